@@ -165,7 +165,7 @@ CGFloat gDashWidth = 8.0f;
     pt2.x = 0.0f;
     while (beginTick < endTick) {
         int mediumCount, majorCount;
-        MDEvent *sig1, *sig2;
+        const MDEvent *sig1, *sig2;
         MDTickType sigTick, nextSigTick;
         float interval, startTick;
         [dataSource verticalLinesFromTick: beginTick timeSignature: &sig1 nextTimeSignature: &sig2 lineInterval: &interval mediumCount: &mediumCount majorCount: &majorCount];
@@ -202,7 +202,7 @@ enum {
 
 - (void)needsReloadClientViews: (NSNotification *)aNotification;
 
-- (void)verticalLinesFromTick: (MDTickType)fromTick timeSignature: (MDEvent **)timeSignature nextTimeSignature: (MDEvent **)nextTimeSignature lineInterval: (float *)lineInterval mediumCount: (int *)mediumCount majorCount: (int *)majorCount;
+- (void)verticalLinesFromTick: (MDTickType)fromTick timeSignature: (const MDEvent **)timeSignature nextTimeSignature: (const MDEvent **)nextTimeSignature lineInterval: (float *)lineInterval mediumCount: (int *)mediumCount majorCount: (int *)majorCount;
 
 - (MDTickType)sequenceDuration;
 - (float)sequenceDurationInQuarter;
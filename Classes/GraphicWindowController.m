@@ -450,12 +450,12 @@ sTableColumnIDToInt(id identifier)
 //    lineInterval: the interval in ticks with which the vertical lines are to be drawn
 //    mediumCount: every mediumCount lines, a vertical line with "medium thickness" appears
 //    majorCount: every majorCount lines, a vertical line with "large thickness" appears
-- (void)verticalLinesFromTick: (MDTickType)fromTick timeSignature: (MDEvent **)timeSignature nextTimeSignature: (MDEvent **)nextTimeSignature lineInterval: (float *)lineInterval mediumCount: (int *)mediumCount majorCount: (int *)majorCount
+- (void)verticalLinesFromTick: (MDTickType)fromTick timeSignature: (const MDEvent **)timeSignature nextTimeSignature: (const MDEvent **)nextTimeSignature lineInterval: (float *)lineInterval mediumCount: (int *)mediumCount majorCount: (int *)majorCount
 {
     float average_ppb;  //  Average pixels per beat between last and next time signatures
     float interval;
     int mdCount, mjCount;
-    MDEvent *ep1, *ep2;
+    const MDEvent *ep1, *ep2;
     MDTickType etick1, etick2;
     int sig0, sig1;
     if (myClientViewsCount > 0 && calib != NULL) {
@@ -2959,7 +2959,7 @@ row:(int)rowIndex
                 for (i = 0; i < numberOfTracks; i++) {
                     MDTrack *track = MDSequenceGetTrack(seq, i);
                     MDPointer *pt = MDPointerNew(track);
-                    MDEvent *ep;
+                    const MDEvent *ep;
                     while ((ep = MDPointerForward(pt)) != NULL) {
                         if (MDGetKind(ep) == kind && (code == 65535 || MDGetCode(ep) == code))
                             continue;
@@ -31,6 +31,7 @@ typedef struct ListWindowFilterRecord {
 		MDEventKind	kind;
 		short	data;
 	} *table;
+	MDEventFilter prefilter;  // Built from table[]; used to skip MDBlocks without candidate events
 } ListWindowFilterRecord;
 
 @interface ListWindowController : NSWindowController <NSTableViewDataSource>
@@ -99,7 +100,7 @@ typedef struct ListWindowFilterRecord {
 //- (void)setMIDITrack:(MDTrack *)aTrack;
 //- (MDTrack *)MIDITrack;
 
-- (MDEvent *)eventPointerForTableRow:(int)rowIndex;
+- (const MDEvent *)eventPointerForTableRow:(int)rowIndex;
 - (int32_t)eventPositionForTableRow:(int)rowIndex;
 - (MDTickType)eventTickForTableRow: (int)rowIndex;
 - (int)rowForEventPosition: (int32_t)position nearestRow: (int *)nearestRow;
@@ -311,6 +311,49 @@ EventSelector(const MDEvent *ep, int32_t position, void *inUserData)
 	return !retval;		
 }
 
+/*  Set up filter->prefilter so that it passes (at least) every event that EventSelector() selects  */
+static void
+EventSelectorSetupPrefilter(ListWindowFilterRecord *filter)
+{
+	int i;
+	MDEventKind kind;
+	MDEventFilter *pf = &filter->prefilter;
+	if (filter->mode == 1) {
+		MDEventFilterInit(pf, 0);
+		pf->channels = 0xffff;
+		MDEventFilterAddKind(pf, kMDEventNull, -1);
+		for (i = 0; i < filter->count && filter->table[i].kind != kMDEventStop; i++) {
+			kind = filter->table[i].kind;
+			if (kind == kMDEventControl || kind == kMDEventMetaText || kind == kMDEventMetaMessage || kind == kMDEventMeta)
+				MDEventFilterAddKind(pf, kind, filter->table[i].data);
+			else MDEventFilterAddKind(pf, kind, -1);
+		}
+	} else {
+		MDEventFilterInit(pf, 1);
+		if (filter->mode == 2) {
+			/*  Only the kinds excluded regardless of the code can be dropped  */
+			for (i = 0; i < filter->count && filter->table[i].kind != kMDEventStop; i++) {
+				kind = filter->table[i].kind;
+				if (kind == kMDEventNull || kind == kMDEventControl || kind == kMDEventMetaText || kind == kMDEventMetaMessage || kind == kMDEventMeta)
+					continue;
+				pf->kinds &= ~(1U << kind);
+			}
+		}
+	}
+}
+
+static const MDEvent *
+ForwardWithEventSelector(MDPointer *pointer, ListWindowFilterRecord *filter)
+{
+	return MDPointerForwardWithFilter(pointer, (filter != NULL ? &filter->prefilter : NULL), EventSelector, filter);
+}
+
+static const MDEvent *
+BackwardWithEventSelector(MDPointer *pointer, ListWindowFilterRecord *filter)
+{
+	return MDPointerBackwardWithFilter(pointer, (filter != NULL ? &filter->prefilter : NULL), EventSelector, filter);
+}
+
 - (void)reloadSelection
 {
     MDSelectionObject *obj = [[self document] selectionOfTrack: myTrackNumber];
@@ -322,7 +365,7 @@ EventSelector(const MDEvent *ep, int32_t position, void *inUserData)
 	if (myTrack != NULL && myPointer != NULL) {
 		MDPointerSetPosition(myPointer, -1);
 		myRow = 0;
-		while (MDPointerForwardWithSelector(myPointer, EventSelector, myFilter) != NULL) {
+		while (ForwardWithEventSelector(myPointer, myFilter) != NULL) {
 			int32_t pos = MDPointerGetPosition(myPointer);
 			if (pos >= min && IntGroupLookup(pset, pos, NULL))
 				[iset addIndex: myRow];
@@ -347,7 +390,7 @@ EventSelector(const MDEvent *ep, int32_t position, void *inUserData)
 			/*  Count the number of events to display  */
 			MDPointerSetPosition(myPointer, -1);
 			myCount = 0;
-			while (MDPointerForwardWithSelector(myPointer, EventSelector, myFilter) != NULL)
+			while (ForwardWithEventSelector(myPointer, myFilter) != NULL)
 				myCount++;
 			myRow = myCount;
 			[myInfoText setStringValue:[NSString localizedStringWithFormat:@"%5d events, %5d shown",
@@ -357,7 +400,7 @@ EventSelector(const MDEvent *ep, int32_t position, void *inUserData)
 	} else return 0;
 }
 
-- (MDEvent *)eventPointerForTableRow:(int)rowIndex
+- (const MDEvent *)eventPointerForTableRow:(int)rowIndex
 {
 	int32_t pos = [self eventPositionForTableRow: rowIndex];
 	if (pos < 0)
@@ -380,12 +423,12 @@ EventSelector(const MDEvent *ep, int32_t position, void *inUserData)
 		return MDTrackGetNumberOfEvents(myTrack);  /* End-of-track */
 	if (myRow > rowIndex) {
 		while (myRow > rowIndex) {
-			MDPointerBackwardWithSelector(myPointer, EventSelector, myFilter);
+			BackwardWithEventSelector(myPointer, myFilter);
 			myRow--;
 		}
 	} else if (myRow < rowIndex) {
 		while (myRow < rowIndex) {
-			MDPointerForwardWithSelector(myPointer, EventSelector, myFilter);
+			ForwardWithEventSelector(myPointer, myFilter);
 			myRow++;
 		}
 	}
@@ -394,7 +437,7 @@ EventSelector(const MDEvent *ep, int32_t position, void *inUserData)
 
 - (MDTickType)eventTickForTableRow:(int)rowIndex
 {
-	MDEvent *ep = [self eventPointerForTableRow: rowIndex];
+	const MDEvent *ep = [self eventPointerForTableRow: rowIndex];
 	if (ep != NULL)
 		return MDGetTick(ep);
 	if (rowIndex == myCount)
@@ -427,13 +470,13 @@ EventSelector(const MDEvent *ep, int32_t position, void *inUserData)
     } else if (mypos > position) {
         do {
             myRow--;
-        } while (MDPointerBackwardWithSelector(myPointer, EventSelector, myFilter) && (mypos = MDPointerGetPosition(myPointer)) > position);
+        } while (BackwardWithEventSelector(myPointer, myFilter) && (mypos = MDPointerGetPosition(myPointer)) > position);
         if (nearestRow != NULL)
             *nearestRow = myRow;
     } else {
         do {
             myRow++;
-        } while (MDPointerForwardWithSelector(myPointer, EventSelector, myFilter) && (mypos = MDPointerGetPosition(myPointer)) < position);
+        } while (ForwardWithEventSelector(myPointer, myFilter) && (mypos = MDPointerGetPosition(myPointer)) < position);
         if (nearestRow != NULL)
             *nearestRow = (mypos == position ? myRow : myRow - 1);
     }
@@ -474,7 +517,7 @@ objectValueForTableColumn:(NSTableColumn *)aTableColumn
 row:(NSInteger)rowIndex
 {
 	id identifier = [aTableColumn identifier];
-	MDEvent *ep;
+	const MDEvent *ep;
 	MDTickType tick;
 	MDTimeType time;
 	int32_t bar, beat, count;
@@ -537,7 +580,7 @@ row:(NSInteger)rowIndex
 				MDEventToGTString(ep, eventStr, sizeof(eventStr));
 			} else if ([@"data" isEqualToString: identifier]) {
                 if (MDGetKind(ep) == kMDEventProgram) {
-                    MDEvent *ep1;
+                    const MDEvent *ep1;
                     int bank = 0;
                     int n, data1;
                     int32_t dev;
@@ -568,7 +611,7 @@ row:(NSInteger)rowIndex
 - (void)tableView:(NSTableView *)aTableView willDisplayCell:(id)aCell forTableColumn:(NSTableColumn *)aTableColumn row:(int)rowIndex
 {
 	id identifier = [aTableColumn identifier];
-	MDEvent *ep;
+	const MDEvent *ep;
 	NSColor *color;
 
     [(ContextMenuTextFieldCell *)aCell setDrawsUnderline:(rowIndex == myPlayingRow)];
@@ -650,7 +693,7 @@ row:(NSInteger)rowIndex
 {
 	id identifier = [aTableColumn identifier];
 //	const char *descStr = [[anObject description] UTF8String];
-	MDEvent *ep;
+	const MDEvent *ep;
 	MDTickType tick;
 	MDTimeType time;
 	MyDocument *document;
@@ -867,7 +910,7 @@ row:(NSInteger)rowIndex
 - (BOOL)myTableView:(MyTableView *)tableView shouldEditColumn:(int)column row:(int)row
 {
 	if (tableView == myEventTrackView) {
-        MDEvent *ep;
+        const MDEvent *ep;
         NSTableColumn *col = [[tableView tableColumns] objectAtIndex:column];
         if (row == myCount && [self tagForTickIdentifier:[col identifier]] >= 0)
             return YES;
@@ -924,7 +967,7 @@ row:(NSInteger)rowIndex
             return nil;
         else return menu;
     } else if (cell == dataDataCell) {
-        MDEvent *ep;
+        const MDEvent *ep;
         int32_t dev;
         int i, count;
         if (row == myCount)
@@ -1064,7 +1107,7 @@ row:(NSInteger)rowIndex
     BOOL mod;
     MDEventFieldData ed;
     MDEventObject *newEvent;
-    MDEvent *ep;
+    const MDEvent *ep;
     int32_t pos_bank;
     int32_t pos;
     int i;
@@ -1084,7 +1127,7 @@ row:(NSInteger)rowIndex
     for (i = 1; i >= 0; i--) {
         /*  0: MSB, 1: LSB  */
         MDPointer *pt;
-        MDEvent *ep1;
+        const MDEvent *ep1;
         ed.intValue = ((tag >> (16 - i * 8)) & 0x7f);
         MDCalibratorJumpToPositionInTrack(myCalibrator, pos, myTrack);
         ep = MDCalibratorGetEvent(myCalibrator, myTrack, kMDEventControl, i * 32);
@@ -1103,11 +1146,10 @@ row:(NSInteger)rowIndex
         if (ep == NULL) {
             /*  Insert a bank select event at 'pos'  */
             newEvent = [[MDEventObject allocWithZone: [self zone]] init];
-            ep1 = &(newEvent->event);
-            MDSetTick(ep1, tick);
-            MDSetKind(ep1, kMDEventControl);
-            MDSetCode(ep1, i * 32);
-            MDSetData1(ep1, ed.intValue);
+            MDSetTick(&newEvent->event, tick);
+            MDSetKind(&newEvent->event, kMDEventControl);
+            MDSetCode(&newEvent->event, i * 32);
+            MDSetData1(&newEvent->event, ed.intValue);
             newEvent->position = pos;
             [document insertEvent: newEvent toTrack: trackNo];
             [newEvent release];
@@ -1254,7 +1296,7 @@ static NSString *sTickIdentifiers[] = { @"bar", @"sec", @"msec", @"count", @"del
 
 - (void)startEditAtColumn: (int)column creatingEventWithTick: (MDTickType)tick atPosition: (int32_t)position
 {
-	MDEvent *ep;
+	const MDEvent *ep;
 	MDPointer *ptr = MDPointerNew(myTrack);
 	MDEventObject *newEvent;
 //	int32_t num = MDTrackGetNumberOfEvents(myTrack);
@@ -1314,7 +1356,7 @@ static NSString *sTickIdentifiers[] = { @"bar", @"sec", @"msec", @"count", @"del
 {
 	MDTickType tick, endTick;
 	int32_t position;
-	MDEvent *ep;
+	const MDEvent *ep;
 	int row = (int)[myEventTrackView selectedRow];
 	if (row < 0) {
 		position = -1;
@@ -1484,6 +1526,7 @@ static NSString *sTickIdentifiers[] = { @"bar", @"sec", @"msec", @"count", @"del
 	filter->table[n++].kind = kMDEventStop;
 	filter->table = realloc(filter->table, sizeof(filter->table[0]) * n);
 	filter->count = n;
+	EventSelectorSetupPrefilter(filter);
 	
 	[cont close];
 	
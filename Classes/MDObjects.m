@@ -145,7 +145,7 @@
 {
 	if (startTick < 0 || endTick < 0 || track != inTrack) {
 		int idx = -1;
-		MDEvent *ep;
+		const MDEvent *ep;
 		MDPointer *ptr = MDPointerNew(inTrack);
 		if (ptr == NULL)
 			return NO;
@@ -119,6 +119,12 @@ static BOOL sStartupCompleted = NO;  //  If NO, then Ruby interrupt check is dis
 	MyAppCallback_saveGlobalSettings();
 }
 
+- (void)applicationDidUpdate:(NSNotification *)aNotification
+{
+	//  Show the warnings queued by other threads (e.g. while loading a track lazily)
+	MDFlushErrorMessages();
+}
+
 static id
 findMenuItemWithTitle(NSMenu *menu, NSString *title)
 {
@@ -77,6 +77,10 @@ typedef enum MyDocumentModifyMode {
 	//  An array of NSNumbers (representing the track numbers)
 	NSMutableArray *modifiedTracks;
 
+	//  Edit history (the bulk edits are undone by restoring its versions)
+	MDHistory *history;
+	MDSequence *historySequence;  //  The sequence the history was made for (not retained)
+
 	//  Destination List
 	//  The devices that have once been used in this document is remembered
 	//  until this document is closed
@@ -105,6 +109,11 @@ typedef enum MyDocumentModifyMode {
 //- (void)postSelectionDidChangeNotification: (int32_t)trackNo selectionChange: (IntGroupObject *)set sender: (id)sender;
 //- (void)postStopPlayingNotification;
 
+//  Edit history for the bulk edits
+- (int32_t)beginHistoryStep;
+- (void)registerUndoForHistoryStepFrom: (int32_t)versionID;
+- (void)restoreHistoryVersion: (int32_t)versionID otherVersion: (int32_t)otherID;
+
 //  Action methods for undo/redo support
 - (BOOL)insertTrack: (MDTrackObject *)trackObj atIndex: (int32_t)trackNo;
 - (BOOL)deleteTrackAt: (int32_t)trackNo;
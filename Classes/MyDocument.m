@@ -46,6 +46,7 @@ NSString *MySeqCatalogPBoardType = @"Alchemusica MIDI sequence info";
 /*  The following notification is used only within MyDocument  */
 static NSString *sSelectionWillChangeNotification = @"My Selection Will Change Notification";
 static NSString *sPostTrackModifiedNotification = @"TrackModifiedNotification needs posted later";
+static NSString *sPackTracksNotification = @"Tracks should be packed at idle time";
 
 /*  Do runtime sanity check after every edit operations (slow)  */
 #if defined(DEBUG)
@@ -55,6 +56,9 @@ static NSString *sPostTrackModifiedNotification = @"TrackModifiedNotification ne
 #endif
 int gMyDocumentSanityCheck = DEFAULT_SANITY_CHECK;
 
+/*  The memory budget for the edit history (bytes)  */
+#define kMyDocumentHistoryBudget (64 * 1024 * 1024)
+
 @implementation MyDocument
 
 #pragma mark ====== Keeping the document/track correspondence ======
@@ -113,6 +117,11 @@ static int sNumTrackInfo, sMaxTrackInfo;
 			selector: @selector(postTrackModifiedNotification:)
 			name: sPostTrackModifiedNotification
 			object: self];
+		[[NSNotificationCenter defaultCenter]
+			addObserver: self
+			selector: @selector(packTracks:)
+			name: sPackTracksNotification
+			object: self];
 		[[NSNotificationCenter defaultCenter]
 		 addObserver:self
 		 selector:@selector(trackModified:)
@@ -137,6 +146,8 @@ static int sNumTrackInfo, sMaxTrackInfo;
 	MRSequenceUnregister(self);
     [[NSNotificationCenter defaultCenter]
         removeObserver: self];
+    if (history != NULL)
+        MDHistoryRelease(history);
     [[self myMIDISequence] release];
     [selections release];
     [super dealloc];
@@ -741,6 +752,15 @@ static NSString *sStackShouldBeCleared = @"stack_should_be_cleared";
 	}
 	[modifiedTracks release];
 	modifiedTracks = nil;
+
+	/*  The observers have redrawn the modified tracks by the time the run loop gets idle
+		again; then the expanded events can be packed  */
+	[[NSNotificationQueue defaultQueue]
+		enqueueNotification:
+			[NSNotification notificationWithName: sPackTracksNotification object: self]
+		postingStyle: NSPostWhenIdle 
+		coalesceMask: (NSNotificationCoalescingOnName | NSNotificationCoalescingOnSender)
+		forModes: nil];
 	
 	if (notification == nil) {
 		//  Dequeue "sPostTrackModifiedNotification" notifications
@@ -751,6 +771,16 @@ static NSString *sStackShouldBeCleared = @"stack_should_be_cleared";
 	}
 }
 
+/*  Notification handler for (internal) sPackTracksNotification  */
+- (void)packTracks: (NSNotification *)notification
+{
+	int32_t i, n = [myMIDISequence trackCount];
+	[self lockMIDISequence];
+	for (i = 0; i < n; i++)
+		MDTrackPack([myMIDISequence getTrackAtIndex: i]);
+	[self unlockMIDISequence];
+}
+
 - (void)enqueueTrackModifiedNotification: (int32_t)trackNo withEventEdited: (BOOL)eventEdited
 {
 	int i;
@@ -868,6 +898,92 @@ static NSString *sStackShouldBeCleared = @"stack_should_be_cleared";
 }
 */
 
+#pragma mark ====== Edit history ======
+
+/*  The bulk edits (on many events at once) are undone by restoring a version of the
+    MDHistory, so that the undo manager only keeps the version IDs instead of copies of
+    the events. The other edits register their own undo actions as before; when they
+    have changed the sequence, a version is taken before the next bulk edit.  */
+
+- (MDHistory *)history
+{
+	MDSequence *sequence = [myMIDISequence mySequence];
+	if (history != NULL && historySequence != sequence) {
+		/*  The sequence has been replaced; the old versions (and the undo actions
+		    referring to them) are no use  */
+		MDHistoryRelease(history);
+		history = NULL;
+		[[self undoManager] removeAllActions];
+	}
+	if (history == NULL && sequence != NULL) {
+		[self lockMIDISequence];
+		history = MDHistoryNew(sequence, kMyDocumentHistoryBudget);
+		[self unlockMIDISequence];
+		historySequence = sequence;
+	}
+	return history;
+}
+
+/*  Returns the ID of the version to restore on undo (-1 if not available)  */
+- (int32_t)beginHistoryStep
+{
+	MDHistory *hist = [self history];
+	int32_t versionID = -1;
+	if (hist == NULL)
+		return -1;
+	[self lockMIDISequence];
+	if (!MDHistoryHasChanges(hist) || MDHistoryAppend(hist) == kMDNoError)
+		versionID = MDHistoryGetCurrentVersionID(hist);
+	[self unlockMIDISequence];
+	return versionID;
+}
+
+/*  Record the result of the bulk edit started by beginHistoryStep, and register the undo
+    action. The versions are appended without discarding the later ones, because this
+    may be called while undoing or redoing, when the redo actions still refer to them.  */
+- (void)registerUndoForHistoryStepFrom: (int32_t)versionID
+{
+	MDHistory *hist = [self history];
+	int32_t newID = -1;
+	if (hist != NULL && versionID >= 0) {
+		[self lockMIDISequence];
+		if (MDHistoryAppend(hist) == kMDNoError)
+			newID = MDHistoryGetCurrentVersionID(hist);
+		[self unlockMIDISequence];
+	}
+	if (newID < 0) {
+		/*  Cannot be undone; the earlier actions are no longer consistent either. This may
+		    be called from an undo action, so the undo stack is cleared later.  */
+		[[self undoManager] performSelector: @selector(removeAllActions) withObject: nil afterDelay: 0.0];
+		return;
+	}
+	[[[self undoManager] prepareWithInvocationTarget: self]
+		restoreHistoryVersion: versionID otherVersion: newID];
+}
+
+- (void)restoreHistoryVersion: (int32_t)versionID otherVersion: (int32_t)otherID
+{
+	MDHistory *hist = [self history];
+	MDStatus sts = kMDErrorInternalError;
+	int32_t i, n;
+	if (hist != NULL) {
+		[self lockMIDISequence];
+		sts = MDHistoryRestoreVersion(hist, versionID);
+		[self unlockMIDISequence];
+	}
+	if (sts != kMDNoError) {
+		/*  The version has been discarded to keep the memory budget  */
+		NSBeep();
+		[[self undoManager] performSelector: @selector(removeAllActions) withObject: nil afterDelay: 0.0];
+		return;
+	}
+	[[[self undoManager] prepareWithInvocationTarget: self]
+		restoreHistoryVersion: otherID otherVersion: versionID];
+	n = [myMIDISequence trackCount];
+	for (i = 0; i < n; i++)
+		[self enqueueTrackModifiedNotification: i];
+}
+
 #pragma mark ====== Editing track lists ======
 
 - (BOOL)insertTrack: (MDTrackObject *)trackObj atIndex: (int32_t)trackNo
@@ -1513,15 +1629,14 @@ static NSString *sStackShouldBeCleared = @"stack_should_be_cleared";
 - (BOOL)deleteMultipleEventsAt: (IntGroupObject *)pointSet fromTrack: (int32_t)trackNo deletedEvents: (MDTrack **)outPtr
 {
 	MDTrack *track, *newTrack;
-	MDTrackObject *trackObj;
     IntGroup *pset;
 	MDStatus sts;
-	MDTickType oduration;
+	int32_t versionID;
 	track = [[self myMIDISequence] getTrackAtIndex: trackNo];
     pset = [pointSet pointSet];
 	if (track == NULL || pointSet == nil || pset == NULL)
 		return NO;
-	oduration = MDTrackGetDuration(track);
+	versionID = [self beginHistoryStep];
 	[self lockMIDISequence];
 	sts = MDTrackUnmerge(track, &newTrack, pset);
 	[self unlockMIDISequence];
@@ -1542,12 +1657,8 @@ static NSString *sStackShouldBeCleared = @"stack_should_be_cleared";
             [self registerUndoForRestoringCurrentSelectionInTrack: trackNo];
 			[self setSelection: [[[MDSelectionObject allocWithZone: [self zone]] initWithMDPointSet: newSelection] autorelease] inTrack: trackNo sender: self];
         }
-		trackObj = [[[MDTrackObject allocWithZone: [self zone]] initWithMDTrack: newTrack] autorelease];
-		/*  Register undo action for change of track duration (if necessary)  */
-		[self registerUndoChangeTrackDuration: oduration ofTrack: trackNo];
-		/*  Register undo action  */
-		[[[self undoManager] prepareWithInvocationTarget: self]
-		 insertMultipleEvents: trackObj at: pointSet toTrack: trackNo selectInsertedEvents: NO insertedPositions: NULL];
+		/*  Register undo action (the deleted events are kept in the history)  */
+		[self registerUndoForHistoryStepFrom: versionID];
 		/*  Post the notification that any track has been modified  */
 		[self enqueueTrackModifiedNotification: trackNo];
 		
@@ -1569,7 +1680,7 @@ static NSString *sStackShouldBeCleared = @"stack_should_be_cleared";
 	MDTrackObject *newTrackObj;
 	MDPointer *pt;
     IntGroup *pset;
-	MDEvent *ep;
+	const MDEvent *ep;
 //	MDStatus sts;
 	track = [[self myMIDISequence] getTrackAtIndex: trackNo];
     pset = [pointSet pointSet];
@@ -1640,19 +1751,16 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
     const float *floatDataPtr;
     MDStatus status;
     unsigned int dataMode;
-    MyDocumentModifyMode undoMode;
-	NSMutableData *tempData, *undoData, *undoPositions;
-	MDTickType *tempDataPtr, *undoDataPtr;
-	int32_t *undoPositionsPtr;
+	NSMutableData *tempData;
+	MDTickType *tempDataPtr;
 	const int32_t *destPositionsPtr;
-	MDTickType oldDuration;
+	int32_t versionID;
 	MDPointer *tempTrackPtr;
 
 	if (doc != nil)
 		trackNo = [[doc myMIDISequence] lookUpTrack: track];
 	else trackNo = -1;
 
-	oldDuration = MDTrackGetDuration(track);
     pset = [pointSet pointSet];
     if (pset == NULL)
         return NO;
@@ -1684,12 +1792,10 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
 	/*  Allocate temporary arrays  */
 	tempData = [NSMutableData dataWithLength: sizeof(MDTickType) * length];
 	tempDataPtr = (MDTickType *)[tempData mutableBytes];
-    undoData = [NSMutableData dataWithLength: sizeof(MDTickType) * length];
-    undoDataPtr = (MDTickType *)[undoData mutableBytes];
-    undoMode = (mode == MyDocumentModifyAdd ? mode : MyDocumentModifySet);
-	undoPositions = [NSMutableData dataWithLength: sizeof(int32_t) * length];
-	undoPositionsPtr = (int32_t *)[undoPositions mutableBytes];
 	
+	/*  The old events are recorded in the history for undo  */
+	versionID = (doc != nil ? [doc beginHistoryStep] : -1);
+
 	/*  Move the target events to a separate track  */
     status = MDTrackUnmerge(track, &tempTrack, pset);
     if (status != kMDNoError)
@@ -1698,13 +1804,14 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
 	if (tempTrackPtr == NULL)
 		return NO;
 
-	/*  Get new/old tick values to tempDataPtr[] and undoDataPtr[]  */
+	/*  Get new tick values to tempDataPtr[]  */
 	{
 		MDTickType prevValue, newValue, oldValue;
+		const MDEvent *cep;
 		prevValue = 0;
 		index = 0;
-		while ((ep = MDPointerForward(tempTrackPtr)) != NULL) {
-			oldValue = MDGetTick(ep);
+		while ((cep = MDPointerForward(tempTrackPtr)) != NULL) {
+			oldValue = MDGetTick(cep);
 			if (mode == MyDocumentModifySet || mode == MyDocumentModifyAdd) {
 				if (dataMode == 0)
 					newValue = dataValue;
@@ -1720,29 +1827,14 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
 					newValue = oldValue * floatDataPtr[index];
 				else newValue = oldValue * [[theData objectAtIndex: index] floatValue];
 			}
-			if (newValue < prevValue) {
-				undoMode = MyDocumentModifySet;  //  Undo can be no longer accomplished by simply adding negative of theData
+			if (newValue < prevValue)
 				newValue = prevValue;
-			}
 			tempDataPtr[index] = newValue;
-			undoDataPtr[index] = oldValue;
 			index++;
 		}
 	}
 
-	/*  Get old positions (for undo) to undoPositionsPtr[]  */
-	{
-		int32_t i, pt, endPt;
-		index = 0;
-		for (i = 0; (pt = IntGroupGetStartPoint(pset, i)) >= 0; i++) {
-			endPt = IntGroupGetEndPoint(pset, i);
-			while (pt < endPt) {
-				undoPositionsPtr[index++] = pt++;
-			}
-		}
-	}
-	
-	/*  Sort events, tempDataPtr, undoDataPtr, undoPositionsPtr  */
+	/*  Sort events  */
 	{
 		int32_t *new2old;
 		void *tempBuffer;
@@ -1767,28 +1859,20 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
 		/*  Sort events  */
 		MDPointerSetPosition(tempTrackPtr, -1);
 		index = 0;
-		while ((ep = MDPointerForward(tempTrackPtr)) != NULL) {
+		while (MDPointerForward(tempTrackPtr) != NULL) {
+			ep = MDPointerCurrentMutable(tempTrackPtr);
 			MDSetTick(ep, tempDataPtr[index]);
 			MDEventMove((MDEvent *)tempBuffer + index, ep, 1);
 			index++;
 		}
 		MDPointerSetPosition(tempTrackPtr, -1);
 		index = 0;
-		while ((ep = MDPointerForward(tempTrackPtr)) != NULL) {
+		while (MDPointerForward(tempTrackPtr) != NULL) {
+			ep = MDPointerCurrentMutable(tempTrackPtr);
 			MDEventMove(ep, (MDEvent *)tempBuffer + new2old[index], 1);
 			index++;
 		}
 		MDTrackRecache(tempTrack, 0);
-		
-		/*  Sort undoDataPtr  */
-		memmove(tempBuffer, undoDataPtr, sizeof(MDTickType) * length);
-		for (index = 0; index < length; index++)
-			undoDataPtr[index] = *((MDTickType *)tempBuffer + new2old[index]);
-		
-		/*  Sort undoPositionsPtr  */
-		memmove(tempBuffer, undoPositionsPtr, sizeof(int32_t) * length);
-		for (index = 0; index < length; index++)
-			undoPositionsPtr[index] = *((int32_t *)tempBuffer + new2old[index]);
 			
 		free(new2old);
 		free(tempBuffer);
@@ -1825,17 +1909,7 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
         }
 
 		/*  Register undo action  */
-		if (oldDuration != MDTrackGetDuration(track)) {
-			[[[doc undoManager] prepareWithInvocationTarget: doc]
-				changeTrackDuration: oldDuration ofTrack: trackNo];
-		}
-		[[[doc undoManager] prepareWithInvocationTarget: doc]
-			modifyTick: 
-				(undoMode == MyDocumentModifyAdd
-					? (id)[NSNumber numberWithLong: -dataValue]
-					: (id)undoData)
-			ofMultipleEventsAt: newDestPointSet inTrack: trackNo mode: undoMode
-            destinationPositions: undoPositions setSelection: setSelection];
+		[doc registerUndoForHistoryStepFrom: versionID];
 
 		/*  Post the notification that this track has been modified  */
 		[doc enqueueTrackModifiedNotification: trackNo];
@@ -1859,7 +1933,8 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
 {
 	int32_t trackNo;
     MDPointer *ptr;
-    MDEvent *ep;
+    const MDEvent *ep;
+    MDEvent *ep1;
     IntGroup *pset;
     int32_t index, length;
 	int psetIndex;
@@ -1868,9 +1943,7 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
     float floatDataValue;
     float *floatDataPtr;
     unsigned int dataMode;
-    MyDocumentModifyMode undoMode;
-    NSMutableData *undoData;
-    short *undoDataPtr;
+	int32_t versionID;
 	if (doc != nil)
 		trackNo = [[doc myMIDISequence] lookUpTrack: track];
 	else trackNo = -1;
@@ -1898,9 +1971,7 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
     } else {
         dataMode = 2;
     }
-    undoData = [NSMutableData dataWithLength: sizeof(short) * length];
-    undoDataPtr = (short *)[undoData mutableBytes];
-    undoMode = (mode == MyDocumentModifyAdd ? mode : MyDocumentModifySet);
+	versionID = (doc != nil ? [doc beginHistoryStep] : -1);
     index = 0;
     MDPointerSetPositionWithPointSet(ptr, pset, -1, &psetIndex);
 	if (doc != nil)
@@ -1924,29 +1995,20 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
                 newValue = oldValue * floatDataPtr[index];
             else newValue = oldValue * [[theData objectAtIndex: index] floatValue];
         }
-        if (newValue < 0 || newValue > 127) {
-            undoMode = MyDocumentModifySet;  //  Undo can be no longer accomplished by simply adding negative of theData
-            if (newValue < 0)
-                newValue = 0;
-            else newValue = 127;
-        }
-        MDSetCode(ep, newValue);
-        undoDataPtr[index] = oldValue;
+        if (newValue < 0)
+            newValue = 0;
+        else if (newValue > 127)
+            newValue = 127;
+        if ((ep1 = MDPointerCurrentMutable(ptr)) == NULL)
+            break;
+        MDSetCode(ep1, newValue);
         index++;
     }
 	if (doc != nil)
 		[doc unlockMIDISequence];
-//    fprintf(stderr, "modifyCodes: undoMode=%d undoData=(", (int)undoMode);
-//    { int i; for (i = 0; i < [undoData length] / 2; i++) fprintf(stderr, "%s%d", (i!=0?",":""), ((short *)[undoData bytes])[i]); }
-//    fprintf(stderr, ")\n");
 	if (doc != nil) {
 		/*  Register undo action  */
-		[[[doc undoManager] prepareWithInvocationTarget: doc]
-			modifyCodes: 
-				(undoMode == MyDocumentModifyAdd
-					? (id)[NSNumber numberWithInt: -dataValue]
-					: (id)undoData)
-			ofMultipleEventsAt: pointSet inTrack: trackNo mode: undoMode];
+		[doc registerUndoForHistoryStepFrom: versionID];
 		/*  Post the notification that this track has been modified  */
 		[doc enqueueTrackModifiedNotification: trackNo];
 	}
@@ -1966,7 +2028,7 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
 {
 	int32_t trackNo;
     MDPointer *ptr;
-    MDEvent *ep;
+    const MDEvent *ep;
     IntGroup *pset;
     int32_t index, length;
 	int psetIndex;
@@ -1976,15 +2038,11 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
     float floatDataValue;
     float *floatDataPtr;
     unsigned int dataMode;
-    MyDocumentModifyMode undoMode;
-    NSMutableData *undoData;
-    MDTickType *undoDataPtr;
-	MDTickType oldDuration;
+	int32_t versionID;
 	
 	if (doc != nil)
 		trackNo = [[doc myMIDISequence] lookUpTrack: track];
 	else trackNo = -1;
-	oldDuration = MDTrackGetDuration(track);
     ptr = MDPointerNew(track);
     if (ptr == NULL)
         return NO;
@@ -2009,9 +2067,7 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
     } else {
         dataMode = 2;
     }
-    undoData = [NSMutableData dataWithLength: sizeof(MDTickType) * length];
-    undoDataPtr = (MDTickType *)[undoData mutableBytes];
-    undoMode = (mode == MyDocumentModifyAdd ? mode : MyDocumentModifySet);
+	versionID = (doc != nil ? [doc beginHistoryStep] : -1);
     index = 0;
     MDPointerSetPositionWithPointSet(ptr, pset, -1, &psetIndex);
     maxTick = -1;
@@ -2036,16 +2092,13 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
                 newValue = oldValue * floatDataPtr[index];
             else newValue = oldValue * [[theData objectAtIndex: index] floatValue];
         }
-        if (newValue <= 0 || newValue > kMDMaxTick / 2) {
-            undoMode = MyDocumentModifySet;  //  Undo can be no longer accomplished by simply adding negative of theData
-            if (newValue <= 0)
-                newValue = 1;
-            else newValue = kMDMaxTick / 2;
-        }
+        if (newValue <= 0)
+            newValue = 1;
+        else if (newValue > kMDMaxTick / 2)
+            newValue = kMDMaxTick / 2;
 		MDPointerSetDuration(ptr, newValue);
         if (MDGetTick(ep) + newValue > maxTick)
             maxTick = MDGetTick(ep) + newValue;
-        undoDataPtr[index] = oldValue;
         index++;
     }
     if (maxTick >= MDTrackGetDuration(track)) {
@@ -2056,21 +2109,9 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
     }
 	if (doc != nil)
 		[doc unlockMIDISequence];
-//    fprintf(stderr, "modifyCodes: undoMode=%d undoData=(", (int)undoMode);
-//    { int i; for (i = 0; i < [undoData length] / 2; i++) fprintf(stderr, "%s%d", (i!=0?",":""), ((short *)[undoData bytes])[i]); }
-//    fprintf(stderr, ")\n");
     /*  Register undo action  */
 	if (doc != nil) {
-		if (oldDuration != MDTrackGetDuration(track)) {
-			[[[doc undoManager] prepareWithInvocationTarget: doc]
-				changeTrackDuration: oldDuration ofTrack: trackNo];
-		}
-		[[[doc undoManager] prepareWithInvocationTarget: doc]
-			modifyDurations: 
-				(undoMode == MyDocumentModifyAdd
-					? (id)[NSNumber numberWithLong: -dataValue]
-					: (id)undoData)
-			ofMultipleEventsAt: pointSet inTrack: trackNo mode: undoMode];
+		[doc registerUndoForHistoryStepFrom: versionID];
 		/*  Post the notification that this track has been modified  */
 		[doc enqueueTrackModifiedNotification: trackNo];
 	}
@@ -2090,7 +2131,8 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
 {
 	int32_t trackNo;
     MDPointer *ptr;
-    MDEvent *ep;
+    const MDEvent *ep;
+    MDEvent *ep1;
     IntGroup *pset;
     int32_t index, length;
 	int psetIndex;
@@ -2099,10 +2141,7 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
     short *dataPtr;
     float *floatDataPtr;
     unsigned int dataMode;
-    MyDocumentModifyMode undoMode;
-    NSMutableData *undoData;
-    short *undoDataPtr;
-    float *floatUndoDataPtr;
+	int32_t versionID;
 	BOOL floatFlag;
 	if (doc != nil)
 		trackNo = [[doc myMIDISequence] lookUpTrack: track];
@@ -2139,16 +2178,7 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
         dataMax = 127;
         dataMin = 0;
     }
-    if (eventKind == kMDEventTempo) {
-        undoData = [NSMutableData dataWithLength: sizeof(float) * length];
-        floatUndoDataPtr = (float *)[undoData mutableBytes];
-    } else {
-        undoData = [NSMutableData dataWithLength: sizeof(short) * length];
-        undoDataPtr = (short *)[undoData mutableBytes];
-    }
-    if (mode == MyDocumentModifyAdd && eventKind != kMDEventTempo)
-        undoMode = MyDocumentModifyAdd;
-    else undoMode = MyDocumentModifySet;
+	versionID = (doc != nil ? [doc beginHistoryStep] : -1);
     index = 0;
     MDPointerSetPositionWithPointSet(ptr, pset, -1, &psetIndex);
 	if (doc != nil)
@@ -2182,38 +2212,26 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
             else multiple = [[theData objectAtIndex: index] floatValue];
             newValue = oldValue * multiple;
         }
-        if (newValue < dataMin || newValue > dataMax) {
-            undoMode = MyDocumentModifySet;  //  Undo can be no longer accomplished by simply adding negative of theData
-            if (newValue < dataMin)
-                newValue = dataMin;
-            else newValue = dataMax;
-        }
+        if (newValue < dataMin)
+            newValue = dataMin;
+        else if (newValue > dataMax)
+            newValue = dataMax;
+        if ((ep1 = MDPointerCurrentMutable(ptr)) == NULL)
+            break;
         if (eventKind == kMDEventNote)
-            MDSetNoteOnVelocity(ep, newValue);
+            MDSetNoteOnVelocity(ep1, newValue);
         else if (eventKind == kMDEventInternalNoteOff)
-            MDSetNoteOffVelocity(ep, newValue);
+            MDSetNoteOffVelocity(ep1, newValue);
         else if (eventKind == kMDEventTempo)
-            MDSetTempo(ep, newValue);
-        else MDSetData1(ep, newValue);
-        if (eventKind == kMDEventTempo)
-            floatUndoDataPtr[index] = oldValue;
-        else undoDataPtr[index] = oldValue;
+            MDSetTempo(ep1, newValue);
+        else MDSetData1(ep1, newValue);
         index++;
     }
 	if (doc != nil)
 		[doc unlockMIDISequence];
-//    fprintf(stderr, "modifyCodes: undoMode=%d undoData=(", (int)undoMode);
-//    { int i; for (i = 0; i < [undoData length] / 2; i++) fprintf(stderr, "%s%d", (i!=0?",":""), ((short *)[undoData bytes])[i]); }
-//    fprintf(stderr, ")\n");
 	if (doc != nil) {
 		/*  Register undo action  */
-		[[[doc undoManager] prepareWithInvocationTarget: doc]
-			modifyData: 
-				(undoMode == MyDocumentModifyAdd
-					? (id)[NSNumber numberWithFloat: -dataValue]
-					: (id)undoData)
-			forEventKind: eventKind
-			ofMultipleEventsAt: pointSet inTrack: trackNo mode: undoMode];
+		[doc registerUndoForHistoryStepFrom: versionID];
 		/*  Post the notification that this track has been modified  */
 		[doc enqueueTrackModifiedNotification: trackNo];
 	}
@@ -2223,7 +2241,7 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
 - (const MDEvent *)eventAtPosition: (int32_t)position inTrack: (int32_t)trackNo
 {
 	MDTrack *track;
-	MDEvent *ep1;
+	const MDEvent *ep1;
 	MDPointer *pt1;
 	track = MDSequenceGetTrack([[self myMIDISequence] mySequence], trackNo);
 	pt1 = MDPointerNew(track);
@@ -2237,7 +2255,7 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
 - (int32_t)changeTick: (int32_t)tick atPosition: (int32_t)position inTrack: (int32_t)trackNo originalPosition: (int32_t)pos1
 {
 	MDTrack *track;
-	MDEvent *ep1;
+	const MDEvent *ep1;
 	MDPointer *pt1;
 	int32_t opos1, npos;
 	MDTickType otick, oduration, duration;
@@ -2314,7 +2332,7 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
 	MDEvent *ep;
 	int ch;
 	MDPointer *pointer = MDPointerNew(MDSequenceGetTrack([[self myMIDISequence] mySequence], trackNo));
-	if (pointer != NULL && MDPointerSetPosition(pointer, position) && (ep = MDPointerCurrent(pointer)) != NULL) {
+	if (pointer != NULL && MDPointerSetPosition(pointer, position) && (ep = MDPointerCurrentMutable(pointer)) != NULL) {
 		if (MDIsChannelEvent(ep)) {
 			ch = MDGetChannel(ep);
 			MDSetChannel(ep, (channel & 15));
@@ -2337,7 +2355,7 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
 - (BOOL)changeDuration: (int32_t)duration atPosition: (int32_t)position inTrack: (int32_t)trackNo
 {
 	MDTrack *track;
-	MDEvent *ep1;
+	const MDEvent *ep1;
 	MDPointer *pt1;
 	int32_t oduration, oldTrackDuration;
 	BOOL modified = NO;
@@ -2379,7 +2397,7 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
 	value.whole = wholeValue;
 	ed1 = ed2 = value;
 
-	if (pointer != NULL && MDPointerSetPosition(pointer, position) && (ep = MDPointerCurrent(pointer)) != NULL) {
+	if (pointer != NULL && MDPointerSetPosition(pointer, position) && (ep = MDPointerCurrentMutable(pointer)) != NULL) {
 		[self lockMIDISequence];
 		switch (code) {
 			case kMDEventFieldKindAndCode:
@@ -2461,7 +2479,8 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
 
 - (BOOL)changeMessage: (NSData *)data atPosition: (int32_t)position inTrack: (int32_t)trackNo
 {
-	MDEvent *ep;
+	const MDEvent *ep;
+	MDEvent *ep1;
 	MDPointer *pointer = MDPointerNew(MDSequenceGetTrack([[self myMIDISequence] mySequence], trackNo));
 	NSData *data2 = nil;
 	BOOL modify = NO;
@@ -2483,8 +2502,9 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
 			}
 			if (modify) {
 				length = (int)[data length];
-				if (MDSetMessageLength(ep, length) == length)
-					MDSetMessage(ep, [data bytes]);
+				ep1 = MDPointerCurrentMutable(pointer);
+				if (ep1 != NULL && MDSetMessageLength(ep1, length) == length)
+					MDSetMessage(ep1, [data bytes]);
 			}
 			[self unlockMIDISequence];
 		}
@@ -2652,11 +2672,12 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
 
 - (MDSelectionObject *)eventSetInTrack: (int32_t)trackNo eventKind: (int)eventKind eventCode: (int)eventCode fromTick: (MDTickType)fromTick toTick: (MDTickType)toTick fromData: (float)fromData toData: (float)toData inPointSet: (IntGroupObject *)pointSet
 {
-	MDEvent *ep;
+	const MDEvent *ep;
 	MDPointer *pointer = MDPointerNew(MDSequenceGetTrack([[self myMIDISequence] mySequence], trackNo));
 	IntGroup *pset;
 	IntGroup *resultSet;
 	MDSelectionObject *retObj;
+	MDEventFilter filter, *filterp;
 	int psetIndex;
 	int32_t pos;
 	int i;
@@ -2664,6 +2685,16 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
 	if (pointer == NULL)
 		return nil;
 
+	//  The blocks without events of this kind (and code) can be skipped
+	if (eventKind != -1) {
+		MDEventFilterInit(&filter, 0);
+		filter.channels = 0xffff;
+		if ((eventKind == kMDEventControl || eventKind == kMDEventKeyPres) && eventCode != -1)
+			MDEventFilterAddKind(&filter, eventKind, eventCode);
+		else MDEventFilterAddKind(&filter, eventKind, -1);
+		filterp = &filter;
+	} else filterp = NULL;
+
 	//  Jump to the start tick
 	if (fromTick >= 0)
 		MDPointerJumpToTick(pointer, fromTick);
@@ -2726,7 +2757,7 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
 		if (pset != NULL)
 			ep = MDPointerForwardWithPointSet(pointer, pset, &psetIndex);
 		else
-			ep = MDPointerForward(pointer);
+			ep = MDPointerForwardWithFilter(pointer, filterp, NULL, NULL);
 	}
 	
 	retObj = [[[MDSelectionObject allocWithZone: [self zone]] initWithMDPointSet: resultSet] autorelease]; 
@@ -2737,7 +2768,7 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
 
 - (int32_t)countMIDIEventsForTrack: (int32_t)index inSelection: (MDSelectionObject *)sel
 {
-	MDEvent *ep;
+	const MDEvent *ep;
 	MDTrack *track = [[self myMIDISequence] getTrackAtIndex: index];
 	MDPointer *pt = MDPointerNew(track);
 	IntGroup *pset = [sel pointSet];
@@ -2918,7 +2949,7 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
 	MDTickType deltaTick;
 	MDTrack *track;
 	MDPointer *pt;
-	MDEvent *ep;
+	const MDEvent *ep;
     id psobj, dt;
 	NSWindowController *cont = [[NSApp mainWindow] windowController];
 	
@@ -2945,10 +2976,9 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
 		ep = MDCalibratorGetEvent(calib, NULL, kMDEventTempo, -1);
 		if (ep == NULL || MDGetTick(ep) != startTick) {
 			newEvent = [[MDEventObject allocWithZone: [self zone]] init];
-			ep = &(newEvent->event);
-			MDSetTick(ep, startTick);
-			MDSetKind(ep, kMDEventTempo);
-			MDSetTempo(ep, tempo);
+			MDSetTick(&newEvent->event, startTick);
+			MDSetKind(&newEvent->event, kMDEventTempo);
+			MDSetTempo(&newEvent->event, tempo);
 			[self insertEvent: newEvent toTrack: 0];
 			[newEvent release];
 		}
@@ -2957,10 +2987,9 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
 		ep = MDCalibratorGetEvent(calib, NULL, kMDEventTempo, -1);
 		if (ep == NULL || MDGetTick(ep) != endTick) {
 			newEvent = [[MDEventObject allocWithZone: [self zone]] init];
-			ep = &(newEvent->event);
-			MDSetTick(ep, endTick);
-			MDSetKind(ep, kMDEventTempo);
-			MDSetTempo(ep, tempo);
+			MDSetTick(&newEvent->event, endTick);
+			MDSetKind(&newEvent->event, kMDEventTempo);
+			MDSetTempo(&newEvent->event, tempo);
 			[self insertEvent: newEvent toTrack: 0];
 			[newEvent release];
 		}
@@ -3099,7 +3128,7 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
     MDTrack *conductorTrack = [[self myMIDISequence] getTrackAtIndex:0];
     MDCalibrator *calib = [[self myMIDISequence] sharedCalibrator];
     MDPointer *mdptr;
-    MDEvent *ep;
+    const MDEvent *ep;
     int i, n;
 
     if (startTick < 0 || startTick >= endTick)
@@ -3318,7 +3347,7 @@ sInternalComparatorByPosition(void *t, const void *a, const void *b)
 			IntGroupObject *psobj;
 			IntGroup *pset;
 			MDPointer *pt;
-			MDEvent *ep;
+			const MDEvent *ep;
 			if (![mainCont isFocusTrack:trackNo])
 				continue;
 			track = [[self myMIDISequence] getTrackAtIndex:trackNo];
@@ -3727,13 +3756,17 @@ isConductorEvent(const MDEvent *ep, int32_t position, void *inUserData)
     int32_t recIndex;
     MDTickType startTick, endTick, currentTick;
     MDTimeType currentTime;
+    MDCalibratorSnapshot *snap;
     NSDictionary *info;
 	static unsigned char remapTable[] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 	
 	seq = [self myMIDISequence];
     info = [seq recordingInfo];
     currentTime = MDPlayerGetTime([seq myPlayer]);
-    currentTick = MDCalibratorTimeToTick([seq sharedCalibrator], currentTime);
+    if ((snap = [seq copyCalibratorSnapshot]) != NULL) {
+        currentTick = MDCalibratorSnapshotTimeToTick(snap, currentTime);
+        MDCalibratorSnapshotRelease(snap);
+    } else currentTick = 0;
     if ([[info valueForKey: MyRecordingInfoStopFlagKey] boolValue]) {
         endTick = (int)[[info valueForKey: MyRecordingInfoStopTickKey] doubleValue];
         if (currentTick < endTick)
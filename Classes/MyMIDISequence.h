@@ -78,6 +78,7 @@ extern NSString *MyRecordingInfoFileExtensionForFormat(int format);
     MDSequence *	mySequence;
 	MDPlayer *		myPlayer;
     MDTrack *		recordTrack;
+	MDNoteOffMatcher *	recordNoteOffMatcher;
 	NSDictionary *  recordingInfo;
 	MDCalibrator *  calib;
 //    MDTrack *		recordNoteOffTrack;
@@ -99,6 +100,7 @@ extern NSString *MyRecordingInfoFileExtensionForFormat(int format);
 - (void)setTrackAttribute: (MDTrackAttribute)attribute atIndex: (int32_t)index;
 
 - (MDCalibrator *)sharedCalibrator;
+- (MDCalibratorSnapshot *)copyCalibratorSnapshot;
 
 - (NSDictionary *)recordingInfo;
 - (void)setRecordingInfo: (NSDictionary *)anInfo;
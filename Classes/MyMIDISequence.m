@@ -58,7 +58,7 @@ NSString
 		MDTrack *track;
 		int i;
         myDocument = document;
-        mySequence = MDSequenceNew();
+        mySequence = MDSequenceNewWithArena();
 		if (mySequence == NULL)
 			return nil;
 		/*  Create conductor track and one empty track  */
@@ -258,6 +258,13 @@ NSString
 	return calib;
 }
 
+- (MDCalibratorSnapshot *)copyCalibratorSnapshot
+{
+	/*  This runs on the editing thread, so bring the published snapshot up to date  */
+	MDSequenceUpdateCalibratorSnapshot(mySequence);
+	return MDSequenceCopyCalibratorSnapshot(mySequence);
+}
+
 #pragma mark ====== File I/O ======
 
 - (MDStatus)readSMFFromFile:(NSString *)fileName withCallback: (MDSequenceCallback)callback andData: (void *)data
@@ -265,14 +272,14 @@ NSString
 	MDSequence *sequence;
 	MDStatus sts;
 	STREAM stream;
-	sequence = MDSequenceNew();
+	sequence = MDSequenceNewWithArena();
     
     if (sequence == NULL) {
         return kMDErrorOutOfMemory;
     } else {
 		stream = MDStreamOpenFile([fileName fileSystemRepresentation], "rb");
 		if (stream != NULL) {
-			sts = MDSequenceReadSMF(sequence, stream, callback, data);
+			sts = MDSequenceReadSMFLazily(sequence, stream, callback, data);
 			FCLOSE(stream);
 		} else sts = kMDErrorCannotOpenFile;
         if (sts == kMDNoError)
@@ -426,6 +433,12 @@ MyRecordingInfoFileExtensionForFormat(int format)
     recordTrack = MDTrackNew();
 	if (recordTrack == NULL)
 		return kMDErrorOutOfMemory;
+	recordNoteOffMatcher = MDNoteOffMatcherNew(recordTrack);
+	if (recordNoteOffMatcher == NULL) {
+		MDTrackRelease(recordTrack);
+		recordTrack = NULL;
+		return kMDErrorOutOfMemory;
+	}
 	if ((destDevice = [recordingInfo valueForKey: MyRecordingInfoDestinationDeviceKey]) != nil)
 		dev = MDPlayerGetDestinationNumberFromName([destDevice UTF8String]);
 	else dev = -1;
@@ -449,21 +462,19 @@ MyRecordingInfoFileExtensionForFormat(int format)
     MDEvent *eventBuf;
 	int eventBufSize;
     MDStatus result = kMDNoError;
-    MDPointer *lastPendingNoteOn;
 	int count;
     int32_t n = 0;
 //    if (recordTrack == NULL || recordNoteOffTrack == NULL)
 //        return kMDErrorInternalError;
-	if (recordTrack == NULL)
+	if (recordTrack == NULL || recordNoteOffMatcher == NULL)
 		return -2;
 	eventBuf = NULL;
 	eventBufSize = 0;
-    lastPendingNoteOn = MDPointerNew(recordTrack);
     while ((count = MDPlayerGetRecordedEvents(myPlayer, &eventBuf, &eventBufSize)) > 0) {
 		MDEvent *ep;
 		for (ep = eventBuf; ep < eventBuf + count; ep++) {
 			if (MDGetKind(ep) == kMDEventInternalNoteOff) {
-				result = MDTrackMatchNoteOff(recordTrack, ep, lastPendingNoteOn);
+				result = MDNoteOffMatcherMatch(recordNoteOffMatcher, ep);
 			} else {
 				if (MDTrackAppendEvents(recordTrack, ep, 1) < 1)
 					result = kMDErrorOutOfMemory;
@@ -474,7 +485,6 @@ MyRecordingInfoFileExtensionForFormat(int format)
 			n++;
 		}
     }
-    MDPointerRelease(lastPendingNoteOn);
 	if (result != kMDNoError)
 		return -1;  /*  Error  */
 
@@ -494,6 +504,10 @@ MyRecordingInfoFileExtensionForFormat(int format)
     if (mySequence == NULL || myPlayer == NULL)
         return nil;
     MDPlayerStopRecording(myPlayer);
+	if (recordNoteOffMatcher != NULL) {
+		MDNoteOffMatcherRelease(recordNoteOffMatcher);
+		recordNoteOffMatcher = NULL;
+	}
 	if (recordTrack == NULL)
         return nil;
     trackObj = [[[MDTrackObject allocWithZone: [self zone]] initWithMDTrack: recordTrack] autorelease];
@@ -553,10 +567,14 @@ MyRecordingInfoFileExtensionForFormat(int format)
 
     duration = 0;
 	if ([[recordingInfo valueForKey: MyRecordingInfoStopFlagKey] boolValue]) {
-        MDTimeType durationTime;
+        MDTimeType durationTime = 0;
+		MDCalibratorSnapshot *snap;
 		stopTick = (MDTickType)[[recordingInfo valueForKey: MyRecordingInfoStopTickKey] doubleValue];
 		MDPlayerSetRecordingStopTick(myPlayer, stopTick);
-        durationTime = MDCalibratorTickToTime(calib, stopTick) - MDCalibratorTickToTime(calib, tick);
+		if ((snap = [self copyCalibratorSnapshot]) != NULL) {
+			durationTime = MDCalibratorSnapshotTickToTime(snap, stopTick) - MDCalibratorSnapshotTickToTime(snap, tick);
+			MDCalibratorSnapshotRelease(snap);
+		}
         if (durationTime > 0)
             duration = ConvertMDTimeTypeToHostTime(durationTime);
 	}
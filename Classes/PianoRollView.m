@@ -190,7 +190,7 @@ appendNotePath(NSBezierPath *path, float x1, float x2, float y, float ys)
 		MDTrack *track;
 		IntGroup *pset;
 		MDPointer *pt;
-		MDEvent *ep;
+		const MDEvent *ep;
 		NSColor *color;
 		float x1, x2, y;
 		BOOL isFocus;
@@ -209,33 +209,17 @@ appendNotePath(NSBezierPath *path, float x1, float x2, float y, float ys)
 		}
 		if (i >= [cacheArray count])
 			continue;  /*  Nothing to draw  */
-		pset = [[cacheArray objectAtIndex: i] pointSet];
-		pt = MDPointerNew(track);
-		if (pt != NULL)
-			MDPointerSetPositionWithPointSet(pt, pset, -1, &n);
-		while (pt != NULL) {  /*  Infinite loop  */
+		/*  Look for the notes in the visible tick range and key range  */
+		pset = MDTrackSearchNotesInRange(track, (addDuration > 0 ? startTick - addDuration : startTick), endTick, startNote, endNote);
+		pt = (pset != NULL ? MDPointerNew(track) : NULL);
+		n = -1;
+		while (pt != NULL) {  /*  Loop until no more notes are found  */
 			MDTickType tick2;
 			int note;
 			NSBezierPath *path;
 			BOOL selected;
-			/*  Loop the note events; first in pset, then from originTick */
-			if (pset != NULL) {
-				while ((ep = MDPointerForwardWithPointSet(pt, pset, &n)) != NULL && MDGetKind(ep) != kMDEventNote)
-					;
-			//	fprintf(stderr, "%s[%d]: ep=%p pos=%ld n=%ld\n", __FILE__, __LINE__, ep, (int32_t)MDPointerGetPosition(pt), (int32_t)n);
-				if (ep == NULL) {
-					pset = NULL;
-					MDPointerJumpToTick(pt, originTick);
-					MDPointerBackward(pt);
-					continue;
-				}
-			} else {
-				while ((ep = MDPointerForward(pt)) != NULL && MDGetTick(ep) < endTick && MDGetKind(ep) != kMDEventNote)
-					;
-			}
-			if (ep == NULL || MDGetTick(ep) >= endTick) {
+			if ((ep = MDPointerForwardWithPointSet(pt, pset, &n)) == NULL)
 				break;
-			}
 			if (trackNum >= 0)
 				selected = [document isSelectedAtPosition: MDPointerGetPosition(pt) inTrack: trackNum];
 			else selected = NO;
@@ -282,6 +266,10 @@ appendNotePath(NSBezierPath *path, float x1, float x2, float y, float ys)
 				[path closePath];
 			} */
 		}
+		if (pt != NULL)
+			MDPointerRelease(pt);
+		if (pset != NULL)
+			IntGroupRelease(pset);
 		if (pencilOn && isFocus) {
 			/*  Drawing note  */
 			x1 = draggingPoint.x;
@@ -367,7 +355,7 @@ appendNotePath(NSBezierPath *path, float x1, float x2, float y, float ys)
 
 /*  Returns 0-3; 0: no note, 1: left 1/3 of a note, 2: middle 1/3 of a note,
     3: right 1/3 of a note  */
-- (int)findNoteUnderPoint: (NSPoint)aPoint track: (int32_t *)outTrack position: (int32_t *)outPosition mdEvent: (MDEvent **)outEvent
+- (int)findNoteUnderPoint: (NSPoint)aPoint track: (int32_t *)outTrack position: (int32_t *)outPosition mdEvent: (const MDEvent **)outEvent
 {
 	int num, i;
 	NSRect rect = [self visibleRect];
@@ -387,7 +375,7 @@ appendNotePath(NSBezierPath *path, float x1, float x2, float y, float ys)
 		MDTrack *track;
 		IntGroup *pset;
 		MDPointer *pt;
-		MDEvent *ep;
+		const MDEvent *ep;
 		MDTickType duration;
 		trackNum = [self sortedTrackNumberAtIndex: i];
 		if (![self isFocusTrack:trackNum])
@@ -461,7 +449,7 @@ appendNotePath(NSBezierPath *path, float x1, float x2, float y, float ys)
 	for (i = 0; (n = [self sortedTrackNumberAtIndex: i]) >= 0; i++) {
 		int index;
 		MDPointer *pt;
-		MDEvent *ep;
+		const MDEvent *ep;
 		MDTrack *track = [[document myMIDISequence] getTrackAtIndex: n];
 		IntGroup *pset = [[document selectionOfTrack: n] pointSet];
 		if (track == NULL || pset == NULL)
@@ -615,7 +603,7 @@ appendNotePath(NSBezierPath *path, float x1, float x2, float y, float ys)
 {
 	int32_t track;
 	int32_t pos;
-	MDEvent *ep;
+	const MDEvent *ep;
 	int n;
 	NSPoint pt;
 	NSUInteger flags = [theEvent modifierFlags];
@@ -691,7 +679,7 @@ appendNotePath(NSBezierPath *path, float x1, float x2, float y, float ys)
     MDTickType tick = (MDTickType)(floor([dataSource pixelToTick:xpos] + 0.5));
 	IntGroup *pset, *pset2, *pset3;
 	MDPointer *pt;
-	MDEvent *ep;
+	const MDEvent *ep;
 	num = [self visibleTrackCount];
 	if (flag) {
 		if (rubbingArray == nil) {
@@ -772,7 +760,7 @@ appendNotePath(NSBezierPath *path, float x1, float x2, float y, float ys)
 {
 //	int track;
 //	int32_t pos;
-	MDEvent *ep;
+	const MDEvent *ep;
 //	NSSize size;
 //	BOOL shiftDown;
 	
@@ -1070,7 +1058,7 @@ appendNotePath(NSBezierPath *path, float x1, float x2, float y, float ys)
 		for (i = 0; (trackNo = [self sortedTrackNumberAtIndex: i]) >= 0; i++) {
 			MDTrack *track;
 			MDPointer *pt;
-			MDEvent *ep;
+			const MDEvent *ep;
 			IntGroup *pset;
 			MDSelectionObject *obj;
 			if (![self isFocusTrack:trackNo])
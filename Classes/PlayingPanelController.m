@@ -227,7 +227,7 @@ static PlayingPanelController *sharedPlayingPanelController = nil;
     if (pos != NULL) {
         /*  Search all the markers in the conductor track  */
         int n;
-        MDEvent *ep;
+        const MDEvent *ep;
         MDTickType tick;
         NSString *name;
         long length;
@@ -274,7 +274,7 @@
     if (pos != NULL) {
         /*  Search all the markers in the conductor track  */
         int n;
-        MDEvent *ep;
+        const MDEvent *ep;
         MDTickType tick;
         NSString *name;
         int32_t length;
@@ -617,7 +617,7 @@
             int32_t currentBar, currentBeat, currentTickInBeat;
             int countOffDuration;
             float timebase = [myDocument timebase];
-            MDEvent *ep = MDCalibratorGetEvent(calibrator, NULL, kMDEventTimeSignature, -1);
+            const MDEvent *ep = MDCalibratorGetEvent(calibrator, NULL, kMDEventTimeSignature, -1);
             float tempo = MDCalibratorGetTempo(calibrator);
             barBeatFlag = [[info valueForKey: MyRecordingInfoBarBeatFlagKey] intValue];
             MDEventCalculateMetronomeBarAndBeat(ep, (int32_t)timebase, &bar, &beat);
@@ -160,7 +160,7 @@ getYValue(const MDEvent *ep, int eventKind)
 	}
 	for (n = [self visibleTrackCount] - 1; n >= 0; n--) {
 		float x, y, ybase;
-		MDEvent *ep;
+		const MDEvent *ep;
 		MDPointer *pt;
 		NSColor *color;
 		MDTrack *track;
@@ -251,7 +251,7 @@ getYValue(const MDEvent *ep, int eventKind)
 		n = [self visibleTrackCount] - 1;
 	for ( ; n >= 0; n--) {
 		float x, y, xlast, ylast;
-		MDEvent *ep;
+		const MDEvent *ep;
 		MDPointer *pt;
 		NSRect rect;
 		NSColor *color, *shadowColor;
@@ -572,7 +572,7 @@ getYValue(const MDEvent *ep, int eventKind)
 	for (i = 0; (n = [self sortedTrackNumberAtIndex: i]) >= 0; i++) {
 		int index;
 		MDPointer *pt;
-		MDEvent *ep;
+		const MDEvent *ep;
 		float y;
 		MDTrack *track = [[document myMIDISequence] getTrackAtIndex: n];
 		IntGroup *pset = [[document selectionOfTrack: n] pointSet];
@@ -605,12 +605,12 @@ getYValue(const MDEvent *ep, int eventKind)
 }
 
 /*  Returns 0-3; 0: no event, 1: the hot spot, 2: on the vertical line, 3: on the horizontal line (box mode only) */
-- (int)findStripUnderPoint: (NSPoint)aPoint track: (int *)outTrack position: (int32_t *)outPosition mdEvent: (MDEvent **)outEvent
+- (int)findStripUnderPoint: (NSPoint)aPoint track: (int *)outTrack position: (int32_t *)outPosition mdEvent: (const MDEvent **)outEvent
 {
 	int num, i, retval;
 	int trackNum;
 	int32_t poslast;
-	MDEvent *ep;
+	const MDEvent *ep;
 	float x, y, ylast;
 	MyDocument *document = (MyDocument *)[dataSource document];
 	MDTickType theTick;
@@ -1101,7 +1101,7 @@ cubicReverseFunc(float x, const float *points, float tt)
 	} else {
 		//  Modify the data of the existing events
 		for (i = 0; (n = [self sortedTrackNumberAtIndex: i]) >= 0; i++) {
-			MDEvent *ep;
+			const MDEvent *ep;
 			MDTrack *track;
 			MDSelectionObject *psetObj;
 			IntGroup *pset;
@@ -1263,7 +1263,7 @@ cubicReverseFunc(float x, const float *points, float tt)
 {
 	int track;
 	int32_t pos;
-	MDEvent *ep;
+	const MDEvent *ep;
 	int n;
 	NSPoint pt = [[self window] mouseLocationOutsideOfEventStream]; /*  Use mouseLocationOutsideOfEventStream in case this is called from flagsChanged: handler (not implemented yet)  */
 	pt = [self convertPoint: pt fromView: nil];
@@ -1325,7 +1325,7 @@ cubicReverseFunc(float x, const float *points, float tt)
 - (void)doMouseDown: (NSEvent *)theEvent
 {
 	int32_t pos;
-	MDEvent *ep;
+	const MDEvent *ep;
 	int track;
 	NSRect bounds;
 	NSPoint pt;
@@ -1493,7 +1493,7 @@ cubicReverseFunc(float x, const float *points, float tt)
 	for (i = 0; (trackNo = [self sortedTrackNumberAtIndex: i]) >= 0; i++) {
 		MDTrack *track;
 		MDPointer *pt;
-		MDEvent *ep;
+		const MDEvent *ep;
 		IntGroup *pset;
 		MDSelectionObject *obj;
 		if (![self isFocusTrack:trackNo])
@@ -98,7 +98,7 @@ typedef struct TimeScalingRecord {
 	while (beginTick < endTick) {
 		int mediumCount, majorCount, i, numLines;
         int sigNumerator, sigDenominator;
-		MDEvent *sig1, *sig2;
+		const MDEvent *sig1, *sig2;
 		MDTickType sigTick, nextSigTick;
 		float interval, startx;
         float widthPerBeat, widthPerMeasure;
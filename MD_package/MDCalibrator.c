@@ -19,6 +19,7 @@
 
 #include <limits.h>
 #include <stdlib.h>
+#include <math.h>
 
 /*  Internal struct: data for individual meta-event  */
 typedef union MDCalibratorData {
@@ -42,27 +43,69 @@ struct MDCalibrator {
 	MDTickType			tick_after;
 	MDCalibratorData	data_before;
 	MDCalibratorData	data_after;
+	MDTempoMap *		tempoMap;		/*  The tempo map of the track (kMDEventTempo only; built on demand)  */
+	MDMeasureMap *		measureMap;		/*  The measure map of the track (kMDEventTimeSignature only; built on demand)  */
+};
+
+/*  The tempo map: the tempo events of the conductor track, with the absolute time at each
+    event. It is never modified after creation.  */
+struct MDTempoMap {
+	int32_t				refCount;
+	int32_t				count;			/*  The number of tempo events  */
+	int32_t				timebase;
+	uint32_t			epoch;			/*  The edit epoch of the track when the map was made  */
+	int32_t				nevents;		/*  The number of events in the track when the map was made  */
+	MDTickType *		ticks;			/*  The ticks of the tempo events  */
+	MDTimeType *		times;			/*  The times (in microseconds) of the tempo events  */
+	int32_t *			tempos;			/*  The MIDI integer tempos (microseconds per quarter note)  */
+	float *				bpms;			/*  The tempos as recorded in the events (beats per minute)  */
+	int32_t *			positions;		/*  The positions of the tempo events in the track  */
+};
+
+/*  The measure map: the time signature events of the conductor track, with the bar number
+    and the beat length at each event. It is never modified after creation.  */
+struct MDMeasureMap {
+	int32_t				refCount;
+	int32_t				count;			/*  The number of time signature events  */
+	int32_t				timebase;
+	uint32_t			epoch;			/*  The edit epoch of the track when the map was made  */
+	int32_t				nevents;		/*  The number of events in the track when the map was made  */
+	MDTickType *		ticks;			/*  The ticks of the time signature events  */
+	int32_t *			bars;			/*  The bar numbers (1-based) of the time signature events  */
+	int32_t *			tickPerBeat;	/*  The beat length in ticks  */
+	int32_t *			beatPerMeasure;	/*  The number of beats in a bar  */
+	int32_t *			metronomeBar;	/*  The bar length in ticks for the metronome  */
+	int32_t *			metronomeClick;	/*  The metronome click length in ticks (from the MIDI clocks per click)  */
+	int32_t *			positions;		/*  The positions of the time signature events in the track  */
+};
+
+/*  A read-only view of the tempo, time signature and key signature events of the conductor
+    track. It is never modified after creation, so it can be shared among threads.  */
+struct MDCalibratorSnapshot {
+	int32_t				refCount;
+	const MDTrack *		track;			/*  The track (for identification only; not retained)  */
+	int32_t				timebase;
+	uint32_t			epoch;			/*  The edit epoch of the track when the snapshot was made  */
+	int32_t				nevents;		/*  The number of events in the track when the snapshot was made  */
+	MDTempoMap *		tempoMap;
+	MDMeasureMap *		measureMap;
+	int32_t				nkeys;			/*  The number of key signature events  */
+	MDTickType *		keyTicks;		/*  The ticks of the key signature events  */
+	unsigned char *		keys;			/*  The (sf, mi) pairs of the key signature events  */
 };
 
 #pragma mark ====== Private functions ======
 
 /* --------------------------------------
-	･ MDCalibratorTickToMeasureWithoutJump
+	･ MDCalibratorCalculateMeasure
    -------------------------------------- */
+/*  Convert inTick to bar/beat/tick, given the time signature that starts at inTickBefore
+    (bar number inBarBefore)  */
 static void
-MDCalibratorTickToMeasureWithoutJump(MDCalibrator *inCalib, MDTickType inTick,
-int32_t *outMeasure, int32_t *outBeat, int32_t *outTick)
+MDCalibratorCalculateMeasure(MDTickType inTickBefore, int32_t inBarBefore, int32_t tickPerBeat, int32_t beatPerMeasure,
+MDTickType inTick, int32_t *outMeasure, int32_t *outBeat, int32_t *outTick)
 {
-	MDEvent *eptr;
-	int32_t tickPerBeat, beatPerMeasure, beat;
-	MDTickType theTickBefore;
-	int32_t theBarBefore;
-	int32_t timebase;
-
-	eptr = MDPointerCurrent(inCalib->before);
-	timebase = MDSequenceGetTimebase(inCalib->parent);
-	MDEventParseTimeSignature(eptr, timebase, &tickPerBeat, &beatPerMeasure);
-	
+	int32_t beat;
 	if (tickPerBeat == 0 || beatPerMeasure == 0) {
 		if (outMeasure != NULL)
 			*outMeasure = 0;
@@ -71,22 +114,35 @@ int32_t *outMeasure, int32_t *outBeat, int32_t *outTick)
 		if (outTick != NULL)
 			*outTick = 0;
 	} else {
-		if (eptr == NULL) {
-			/*  eptr == NULL の場合、data_before.bar = 1, tick_before = 0 として計算する  */
-			theTickBefore = 0;
-			theBarBefore = 1;
-		} else {
-			theTickBefore = inCalib->tick_before;
-			theBarBefore = inCalib->data_before.bar;
-		}
-		
-		beat = (inTick - theTickBefore) / tickPerBeat;
+		beat = (inTick - inTickBefore) / tickPerBeat;
 		if (outTick != NULL)
-			*outTick = (int32_t)(inTick - theTickBefore) - beat * tickPerBeat;
+			*outTick = (int32_t)(inTick - inTickBefore) - beat * tickPerBeat;
 		if (outBeat != NULL)
 			*outBeat = beat % beatPerMeasure + 1;
 		if (outMeasure != NULL)
-			*outMeasure = theBarBefore + beat / beatPerMeasure;
+			*outMeasure = inBarBefore + beat / beatPerMeasure;
+	}
+}
+
+/* --------------------------------------
+	･ MDCalibratorTickToMeasureWithoutJump
+   -------------------------------------- */
+static void
+MDCalibratorTickToMeasureWithoutJump(MDCalibrator *inCalib, MDTickType inTick,
+int32_t *outMeasure, int32_t *outBeat, int32_t *outTick)
+{
+	const MDEvent *eptr;
+	int32_t tickPerBeat, beatPerMeasure;
+	int32_t timebase;
+
+	eptr = MDPointerCurrent(inCalib->before);
+	timebase = MDSequenceGetTimebase(inCalib->parent);
+	MDEventParseTimeSignature(eptr, timebase, &tickPerBeat, &beatPerMeasure);
+	if (eptr == NULL) {
+		/*  eptr == NULL の場合、data_before.bar = 1, tick_before = 0 として計算する  */
+		MDCalibratorCalculateMeasure(0, 1, tickPerBeat, beatPerMeasure, inTick, outMeasure, outBeat, outTick);
+	} else {
+		MDCalibratorCalculateMeasure(inCalib->tick_before, inCalib->data_before.bar, tickPerBeat, beatPerMeasure, inTick, outMeasure, outBeat, outTick);
 	}
 }
 
@@ -114,6 +170,200 @@ MDCalibratorCalculateTime(MDCalibrator *inCalib, MDTickType inTick)
 	return time_before + (MDTimeType)floor(0.5 + (inTick - tick_before) * floor(60000000.0 / tempo) / timebase);
 }
 
+/* --------------------------------------
+	･ MDTempoMapFindTick
+   -------------------------------------- */
+/*  Returns the index of the last tempo event at or before inTick, or -1 if there is none  */
+static int32_t
+MDTempoMapFindTick(const MDTempoMap *inMap, MDTickType inTick)
+{
+	int32_t lo = 0, hi = inMap->count, mid;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (inMap->ticks[mid] <= inTick)
+			lo = mid + 1;
+		else hi = mid;
+	}
+	return lo - 1;
+}
+
+/* --------------------------------------
+	･ MDTempoMapFindTime
+   -------------------------------------- */
+/*  Returns the index of the last tempo event at or before inTime, or -1 if there is none  */
+static int32_t
+MDTempoMapFindTime(const MDTempoMap *inMap, MDTimeType inTime)
+{
+	int32_t lo = 0, hi = inMap->count, mid;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (inMap->times[mid] <= inTime)
+			lo = mid + 1;
+		else hi = mid;
+	}
+	return lo - 1;
+}
+
+/* --------------------------------------
+	･ MDMeasureMapFindTick
+   -------------------------------------- */
+/*  Returns the index of the last time signature at or before inTick, or -1 if there is none  */
+static int32_t
+MDMeasureMapFindTick(const MDMeasureMap *inMap, MDTickType inTick)
+{
+	int32_t lo = 0, hi = inMap->count, mid;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (inMap->ticks[mid] <= inTick)
+			lo = mid + 1;
+		else hi = mid;
+	}
+	return lo - 1;
+}
+
+/* --------------------------------------
+	･ MDMeasureMapFindBar
+   -------------------------------------- */
+/*  Returns the index of the last time signature at or before bar inMeasure, or -1 if there is none  */
+static int32_t
+MDMeasureMapFindBar(const MDMeasureMap *inMap, int32_t inMeasure)
+{
+	int32_t lo = 0, hi = inMap->count, mid;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (inMap->bars[mid] <= inMeasure)
+			lo = mid + 1;
+		else hi = mid;
+	}
+	return lo - 1;
+}
+
+/* --------------------------------------
+	･ MDMeasureMapGetSpan
+   -------------------------------------- */
+/*  Get the start tick, bar number and beat length of the index-th time signature span
+    (-1: before the first time signature, where 4/4 from tick 0 is assumed)  */
+static void
+MDMeasureMapGetSpan(const MDMeasureMap *inMap, int32_t index, MDTickType *outTick, int32_t *outBar, int32_t *outTickPerBeat, int32_t *outBeatPerMeasure)
+{
+	if (index >= 0) {
+		*outTick = inMap->ticks[index];
+		*outBar = inMap->bars[index];
+		*outTickPerBeat = inMap->tickPerBeat[index];
+		*outBeatPerMeasure = inMap->beatPerMeasure[index];
+	} else {
+		*outTick = 0;
+		*outBar = 1;
+		MDEventParseTimeSignature(NULL, inMap->timebase, outTickPerBeat, outBeatPerMeasure);
+	}
+}
+
+/* --------------------------------------
+	･ MDCalibratorGetTempoMap
+   -------------------------------------- */
+/*  Returns the tempo map of a kMDEventTempo calibrator unit, rebuilding it if the track
+    has been edited. Returns NULL if the map is not usable (empty track or out of memory).  */
+static MDTempoMap *
+MDCalibratorGetTempoMap(MDCalibrator *inCalib)
+{
+	MDTempoMap *map = inCalib->tempoMap;
+	if (inCalib->track == NULL || MDTrackGetNumberOfEvents(inCalib->track) == 0)
+		return NULL;
+	if (map != NULL && (map->epoch != MDTrackGetEditEpoch(inCalib->track)
+		|| map->nevents != MDTrackGetNumberOfEvents(inCalib->track)
+		|| map->timebase != MDSequenceGetTimebase(inCalib->parent))) {
+		MDTempoMapRelease(map);
+		map = inCalib->tempoMap = NULL;
+	}
+	if (map == NULL)
+		map = inCalib->tempoMap = MDTempoMapNew(inCalib->track, MDSequenceGetTimebase(inCalib->parent));
+	return map;
+}
+
+/* --------------------------------------
+	･ MDCalibratorPlaceTempo
+   -------------------------------------- */
+/*  Move a kMDEventTempo calibrator unit so that 'before' is the index-th tempo event
+    (-1: before the first one). The resulting state is the same as reached by
+    MDCalibratorForward()/MDCalibratorBackward().  */
+static void
+MDCalibratorPlaceTempo(MDCalibrator *inCalib, const MDTempoMap *inMap, int32_t index)
+{
+	if (index >= 0) {
+		MDPointerSetPosition(inCalib->before, inMap->positions[index]);
+		inCalib->tick_before = inMap->ticks[index];
+		inCalib->data_before.time = inMap->times[index];
+	} else {
+		MDPointerSetPosition(inCalib->before, -1);
+		inCalib->tick_before = kMDNegativeTick;
+		inCalib->data_before.time = 0;
+	}
+	if (index + 1 < inMap->count) {
+		MDPointerSetPosition(inCalib->after, inMap->positions[index + 1]);
+		inCalib->tick_after = inMap->ticks[index + 1];
+		inCalib->data_after.time = inMap->times[index + 1];
+	} else {
+		MDPointerSetPosition(inCalib->after, MDTrackGetNumberOfEvents(inCalib->track));
+		inCalib->tick_after = kMDMaxTick;
+		inCalib->data_after.time = MDCalibratorCalculateTime(inCalib, kMDMaxTick);
+	}
+}
+
+/* --------------------------------------
+	･ MDCalibratorGetMeasureMap
+   -------------------------------------- */
+/*  Returns the measure map of a kMDEventTimeSignature calibrator unit, rebuilding it if the
+    track has been edited. Returns NULL if the map is not usable (empty track or out of memory).  */
+static MDMeasureMap *
+MDCalibratorGetMeasureMap(MDCalibrator *inCalib)
+{
+	MDMeasureMap *map = inCalib->measureMap;
+	if (inCalib->track == NULL || MDTrackGetNumberOfEvents(inCalib->track) == 0)
+		return NULL;
+	if (map != NULL && (map->epoch != MDTrackGetEditEpoch(inCalib->track)
+		|| map->nevents != MDTrackGetNumberOfEvents(inCalib->track)
+		|| map->timebase != MDSequenceGetTimebase(inCalib->parent))) {
+		MDMeasureMapRelease(map);
+		map = inCalib->measureMap = NULL;
+	}
+	if (map == NULL)
+		map = inCalib->measureMap = MDMeasureMapNew(inCalib->track, MDSequenceGetTimebase(inCalib->parent));
+	return map;
+}
+
+/* --------------------------------------
+	･ MDCalibratorPlaceTimeSignature
+   -------------------------------------- */
+/*  Move a kMDEventTimeSignature calibrator unit so that 'before' is the index-th time
+    signature (-1: before the first one). The resulting state is the same as reached by
+    MDCalibratorForward()/MDCalibratorBackward().  */
+static void
+MDCalibratorPlaceTimeSignature(MDCalibrator *inCalib, const MDMeasureMap *inMap, int32_t index)
+{
+	int32_t measure, beat, tick;
+	if (index >= 0) {
+		MDPointerSetPosition(inCalib->before, inMap->positions[index]);
+		inCalib->tick_before = inMap->ticks[index];
+		inCalib->data_before.bar = inMap->bars[index];
+	} else {
+		MDPointerSetPosition(inCalib->before, -1);
+		inCalib->tick_before = kMDNegativeTick;
+		inCalib->data_before.bar = 1;
+	}
+	if (index + 1 < inMap->count) {
+		MDPointerSetPosition(inCalib->after, inMap->positions[index + 1]);
+		inCalib->tick_after = inMap->ticks[index + 1];
+		inCalib->data_after.bar = inMap->bars[index + 1];
+	} else {
+		MDPointerSetPosition(inCalib->after, MDTrackGetNumberOfEvents(inCalib->track));
+		inCalib->tick_after = kMDMaxTick;
+		MDCalibratorTickToMeasureWithoutJump(inCalib, kMDMaxTick, &measure, &beat, &tick);
+		if (measure != 0 && (beat > 1 || tick > 0))
+			measure++;
+		inCalib->data_after.bar = measure;
+	}
+}
+
 static MDCalibrator *
 MDCalibratorInitialize(MDCalibrator *inCalib, MDSequence *inSequence, MDTrack *inTrack, MDEventKind inKind, short inCode)
 {
@@ -129,6 +379,8 @@ MDCalibratorInitialize(MDCalibrator *inCalib, MDSequence *inSequence, MDTrack *i
 	inCalib->next = NULL;
 	inCalib->chain = NULL;
 	inCalib->kind = inKind;
+	inCalib->tempoMap = NULL;
+	inCalib->measureMap = NULL;
 
 	MDSequenceRetain(inCalib->parent);
 	MDTrackRetain(inCalib->track);
@@ -175,6 +427,8 @@ MDCalibratorDeallocateChain(MDCalibrator *inCalib)
 		MDCalibratorDeallocateChain(inCalib->chain);
 	MDPointerRelease(inCalib->before);
 	MDPointerRelease(inCalib->after);
+	MDTempoMapRelease(inCalib->tempoMap);
+	MDMeasureMapRelease(inCalib->measureMap);
 	free(inCalib);
 }
 
@@ -184,7 +438,7 @@ MDCalibratorDeallocateChain(MDCalibrator *inCalib)
 static int
 MDCalibratorForward(MDCalibrator *inCalib)
 {
-	MDEvent *eref;
+	const MDEvent *eref;
 	int32_t measure, beat, tick;
 
 	if (inCalib->track == NULL || inCalib->after == NULL)
@@ -236,7 +490,7 @@ MDCalibratorForward(MDCalibrator *inCalib)
 static int
 MDCalibratorBackward(MDCalibrator *inCalib)
 {
-	MDEvent *eref;
+	const MDEvent *eref;
 	int32_t measure, beat, tick;
 	MDTimeType time;
 
@@ -415,6 +669,10 @@ MDCalibratorRemoveAtIndex(MDCalibrator *inCalib, int index)
             MDPointerRelease(inCalib->before);
         if (inCalib->after != NULL)
             MDPointerRelease(inCalib->after);
+        MDTempoMapRelease(inCalib->tempoMap);
+        inCalib->tempoMap = NULL;
+        MDMeasureMapRelease(inCalib->measureMap);
+        inCalib->measureMap = NULL;
         if (inCalib->chain != NULL) {
             /*  Copy the next record to this record  */
             calib = inCalib->chain;
@@ -442,6 +700,8 @@ MDCalibratorRemoveAtIndex(MDCalibrator *inCalib, int index)
             MDPointerRelease(inCalib->before);
         if (inCalib->after != NULL)
             MDPointerRelease(inCalib->after);
+        MDTempoMapRelease(inCalib->tempoMap);
+        MDMeasureMapRelease(inCalib->measureMap);
         calib->chain = inCalib->chain;
         free(inCalib);
         return kMDNoError;
@@ -488,9 +748,14 @@ MDCalibratorReset(MDCalibrator *inCalib)
 	switch (inCalib->kind) {
 		case kMDEventTempo:
 			inCalib->data_before.time = inCalib->data_after.time = kMDNegativeTime;
+			/*  The conductor track may have been edited  */
+			MDTempoMapRelease(inCalib->tempoMap);
+			inCalib->tempoMap = NULL;
 			break;
 		case kMDEventTimeSignature:
 			inCalib->data_before.bar = inCalib->data_after.bar = 0;
+			MDMeasureMapRelease(inCalib->measureMap);
+			inCalib->measureMap = NULL;
 			break;
 		case kMDEventKey:
 			inCalib->data_before.key = inCalib->data_after.key = 0;
@@ -504,6 +769,20 @@ MDCalibratorReset(MDCalibrator *inCalib)
 static void
 MDCalibratorJumpToTickSub(MDCalibrator *inCalib, MDTickType inTick)
 {
+	MDTempoMap *map;
+	MDMeasureMap *mmap;
+	if (inCalib->kind == kMDEventTempo && (inTick >= inCalib->tick_after || inTick < inCalib->tick_before)
+		&& (map = MDCalibratorGetTempoMap(inCalib)) != NULL) {
+		/*  Binary search instead of walking through the tempo events  */
+		MDCalibratorPlaceTempo(inCalib, map, MDTempoMapFindTick(map, inTick));
+		return;
+	}
+	if (inCalib->kind == kMDEventTimeSignature && (inTick >= inCalib->tick_after || inTick < inCalib->tick_before)
+		&& (mmap = MDCalibratorGetMeasureMap(inCalib)) != NULL) {
+		/*  Ditto for the time signatures  */
+		MDCalibratorPlaceTimeSignature(inCalib, mmap, MDMeasureMapFindTick(mmap, inTick));
+		return;
+	}
     if (inTick >= inCalib->tick_after) {
         //  末尾に向かって探す
         if (inTick == kMDMaxTick) {
@@ -587,7 +866,7 @@ MDCalibratorJumpToPositionInTrack(MDCalibrator *inCalib, int32_t inPosition, MDT
 {
     MDTickType tick;
     MDPointer *pt;
-    MDEvent *ep;
+    const MDEvent *ep;
     
     if (inCalib == NULL || inCalib->track == NULL || inCalib->before == NULL)
         return;
@@ -614,9 +893,10 @@ MDCalibratorJumpToPositionInTrack(MDCalibrator *inCalib, int32_t inPosition, MDT
 MDTickType
 MDCalibratorMeasureToTick(MDCalibrator *inCalib, int32_t inMeasure, int32_t inBeat, int32_t inTick)
 {
-	MDEvent *eptr;
+	const MDEvent *eptr;
 	int32_t tickPerBeat, beatPerMeasure, timebase, theBarBefore;
 	double theTick, theTickBefore;
+	MDMeasureMap *map;
 	
 	while (inCalib != NULL) {
 		if (inCalib->kind == kMDEventTimeSignature)
@@ -631,15 +911,21 @@ MDCalibratorMeasureToTick(MDCalibrator *inCalib, int32_t inMeasure, int32_t inBe
 		return kMDNegativeTick;
 	if (inMeasure >= INT32_MAX)
 		return kMDMaxTick;
-	if (inMeasure >= inCalib->data_after.bar) {
+	if ((inMeasure >= inCalib->data_after.bar || inMeasure < inCalib->data_before.bar)
+		&& (map = MDCalibratorGetMeasureMap(inCalib)) != NULL) {
+		/*  二分探索で移動する  */
+		MDCalibratorPlaceTimeSignature(inCalib, map, MDMeasureMapFindBar(map, inMeasure));
+	} else if (inMeasure >= inCalib->data_after.bar) {
 		/*  末尾に向かって探す  */
 		do {
-			MDCalibratorForward(inCalib);
+			if (!MDCalibratorForward(inCalib))
+				break;	/*  末尾を越えた  */
 		} while (inMeasure >= inCalib->data_after.bar);
 	} else if (inMeasure < inCalib->data_before.bar) {
 		/*  先頭に向かって探す  */
 		do {
-			MDCalibratorBackward(inCalib);
+			if (!MDCalibratorBackward(inCalib))
+				break;
 		} while (inMeasure < inCalib->data_before.bar);
 	}
 	
@@ -655,7 +941,7 @@ MDCalibratorMeasureToTick(MDCalibrator *inCalib, int32_t inMeasure, int32_t inBe
 		theTickBefore = inCalib->tick_before;
 	}
 	theTick = theTickBefore + inTick +
-		((inBeat - 1) + (inMeasure - theBarBefore) * beatPerMeasure) * tickPerBeat;
+		((inBeat - 1) + (double)(inMeasure - theBarBefore) * beatPerMeasure) * tickPerBeat;
 	if (theTick > kMDMaxTick)
 		return kMDMaxTick;
 	else
@@ -685,7 +971,7 @@ MDCalibratorTickToMeasure(MDCalibrator *inCalib, MDTickType inTick, int32_t *out
 float
 MDCalibratorGetTempo(MDCalibrator *inCalib)
 {
-	MDEvent *ep;
+	const MDEvent *ep;
 	while (inCalib != NULL) {
 		if (inCalib->kind == kMDEventTempo) {
 			ep = MDPointerCurrent(inCalib->before);
@@ -707,6 +993,7 @@ MDCalibratorTimeToTick(MDCalibrator *inCalib, MDTimeType inTime)
 	MDTickType	tick_before;
 	MDTimeType	time_before;
 	int32_t timebase;
+	MDTempoMap *map;
 
 	while (inCalib != NULL) {
 		if (inCalib->kind == kMDEventTempo)
@@ -716,7 +1003,10 @@ MDCalibratorTimeToTick(MDCalibrator *inCalib, MDTimeType inTime)
 	if (inCalib == NULL)
 		return kMDNegativeTick;
 	
-	if (inTime >= inCalib->data_after.time) {
+	if ((inTime >= inCalib->data_after.time || inTime < inCalib->data_before.time)
+		&& (map = MDCalibratorGetTempoMap(inCalib)) != NULL) {
+		MDCalibratorPlaceTempo(inCalib, map, MDTempoMapFindTime(map, inTime));
+	} else if (inTime >= inCalib->data_after.time) {
 		/*  Search forward  */
 		while (MDCalibratorForward(inCalib) && inTime >= inCalib->data_after.time) { }
 	} else if (inTime < inCalib->data_before.time) {
@@ -755,7 +1045,7 @@ MDCalibratorTickToTime(MDCalibrator *inCalib, MDTickType inTick)
 /* --------------------------------------
 	･ MDCalibratorGetEvent
    -------------------------------------- */
-MDEvent *
+const MDEvent *
 MDCalibratorGetEvent(MDCalibrator *inCalib, MDTrack *inTrack, MDEventKind inKind, short inCode)
 {
 	while (inCalib != NULL) {
@@ -789,7 +1079,7 @@ MDCalibratorGetEventPosition(MDCalibrator *inCalib, MDTrack *inTrack, MDEventKin
 /* --------------------------------------
 	･ MDCalibratorGetNextEvent
    -------------------------------------- */
-MDEvent *
+const MDEvent *
 MDCalibratorGetNextEvent(MDCalibrator *inCalib, MDTrack *inTrack, MDEventKind inKind, short inCode)
 {
 	while (inCalib != NULL) {
@@ -826,3 +1116,779 @@ MDCalibratorCopyPointer(MDCalibrator *inCalib, MDTrack *inTrack, MDEventKind inK
 		return pt;
 	}
 }
+
+#pragma mark ====== Tempo map ======
+
+/* --------------------------------------
+	･ MDTempoMapNew
+   -------------------------------------- */
+MDTempoMap *
+MDTempoMapNew(MDTrack *inTrack, int32_t inTimebase)
+{
+	MDTempoMap *map;
+	MDPointer *pt;
+	const MDEvent *ep;
+	int32_t n, usPerBeat;
+	MDTickType tick;
+	MDTimeType time;
+	double tempo;
+
+	if (inTrack == NULL || inTimebase <= 0)
+		return NULL;
+	map = (MDTempoMap *)calloc(sizeof(MDTempoMap), 1);
+	pt = MDPointerNew(inTrack);
+	if (map == NULL || pt == NULL)
+		goto error;
+	map->refCount = 1;
+	map->timebase = inTimebase;
+	map->epoch = MDTrackGetEditEpoch(inTrack);
+	map->nevents = MDTrackGetNumberOfEvents(inTrack);
+
+	/*  Count the tempo events  */
+	n = 0;
+	while ((ep = MDPointerForward(pt)) != NULL) {
+		if (MDGetKind(ep) == kMDEventTempo)
+			n++;
+	}
+	map->ticks = (MDTickType *)malloc(sizeof(MDTickType) * (n + 1));
+	map->times = (MDTimeType *)malloc(sizeof(MDTimeType) * (n + 1));
+	map->tempos = (int32_t *)malloc(sizeof(int32_t) * (n + 1));
+	map->bpms = (float *)malloc(sizeof(float) * (n + 1));
+	map->positions = (int32_t *)malloc(sizeof(int32_t) * (n + 1));
+	if (map->ticks == NULL || map->times == NULL || map->tempos == NULL || map->bpms == NULL
+		|| map->positions == NULL)
+		goto error;
+
+	/*  The times are accumulated in the same way as MDCalibratorCalculateTime(), so that
+	    the results are identical to those obtained by walking through the tempo events.
+	    Before the first tempo event, the tempo is 120.  */
+	tick = 0;
+	time = 0;
+	usPerBeat = 500000;
+	MDPointerSetPosition(pt, -1);
+	while ((ep = MDPointerForward(pt)) != NULL) {
+		if (MDGetKind(ep) != kMDEventTempo)
+			continue;
+		time += (MDTimeType)floor(0.5 + (MDGetTick(ep) - tick) * (double)usPerBeat / inTimebase);
+		tick = MDGetTick(ep);
+		tempo = floor(60000000.0 / MDGetTempo(ep));
+		usPerBeat = (tempo >= 1.0 && tempo <= (double)INT32_MAX ? (int32_t)tempo : 500000);
+		map->ticks[map->count] = tick;
+		map->times[map->count] = time;
+		map->tempos[map->count] = usPerBeat;
+		map->bpms[map->count] = MDGetTempo(ep);
+		map->positions[map->count] = MDPointerGetPosition(pt);
+		map->count++;
+	}
+	MDPointerRelease(pt);
+	return map;
+
+  error:
+	if (pt != NULL)
+		MDPointerRelease(pt);
+	if (map != NULL) {
+		free(map->ticks);
+		free(map->times);
+		free(map->tempos);
+		free(map->bpms);
+		free(map->positions);
+		free(map);
+	}
+	return NULL;
+}
+
+/* --------------------------------------
+	･ MDTempoMapRetain
+   -------------------------------------- */
+void
+MDTempoMapRetain(MDTempoMap *inMap)
+{
+	if (inMap != NULL)
+		__sync_fetch_and_add(&inMap->refCount, 1);
+}
+
+/* --------------------------------------
+	･ MDTempoMapRelease
+   -------------------------------------- */
+void
+MDTempoMapRelease(MDTempoMap *inMap)
+{
+	if (inMap != NULL && __sync_sub_and_fetch(&inMap->refCount, 1) == 0) {
+		free(inMap->ticks);
+		free(inMap->times);
+		free(inMap->tempos);
+		free(inMap->bpms);
+		free(inMap->positions);
+		free(inMap);
+	}
+}
+
+/* --------------------------------------
+	･ MDTempoMapGetCount
+   -------------------------------------- */
+int32_t
+MDTempoMapGetCount(const MDTempoMap *inMap)
+{
+	return inMap->count;
+}
+
+/* --------------------------------------
+	･ MDTempoMapGetTempo
+   -------------------------------------- */
+float
+MDTempoMapGetTempo(const MDTempoMap *inMap, MDTickType inTick)
+{
+	int32_t index = MDTempoMapFindTick(inMap, inTick);
+	if (index < 0)
+		return 120.0f;
+	return inMap->bpms[index];
+}
+
+/* --------------------------------------
+	･ MDTempoMapTickToTime
+   -------------------------------------- */
+MDTimeType
+MDTempoMapTickToTime(const MDTempoMap *inMap, MDTickType inTick)
+{
+	int32_t index = MDTempoMapFindTick(inMap, inTick);
+	MDTickType tick = (index >= 0 ? inMap->ticks[index] : 0);
+	MDTimeType time = (index >= 0 ? inMap->times[index] : 0);
+	int32_t usPerBeat = (index >= 0 ? inMap->tempos[index] : 500000);
+	return time + (MDTimeType)floor(0.5 + (inTick - tick) * (double)usPerBeat / inMap->timebase);
+}
+
+/* --------------------------------------
+	･ MDTempoMapTimeToTick
+   -------------------------------------- */
+MDTickType
+MDTempoMapTimeToTick(const MDTempoMap *inMap, MDTimeType inTime)
+{
+	int32_t index = MDTempoMapFindTime(inMap, inTime);
+	MDTickType tick = (index >= 0 ? inMap->ticks[index] : 0);
+	MDTimeType time = (index >= 0 ? inMap->times[index] : 0);
+	int32_t usPerBeat = (index >= 0 ? inMap->tempos[index] : 500000);
+	return tick + (MDTickType)floor(0.5 + (double)(inTime - time) * ((double)inMap->timebase / usPerBeat));
+}
+
+/* --------------------------------------
+	･ MDTempoMapTicksToTimes
+   -------------------------------------- */
+void
+MDTempoMapTicksToTimes(const MDTempoMap *inMap, const MDTickType *inTicks, MDTimeType *outTimes, int32_t inCount)
+{
+	int32_t i, j, index;
+	MDTickType tick;
+	MDTimeType time;
+	int32_t usPerBeat, timebase;
+
+	timebase = inMap->timebase;
+	index = -1;
+	i = 0;
+	while (i < inCount) {
+		/*  Locate the tempo segment for inTicks[i]. Sorted input only steps forward
+		    to the next segment; anything else falls back to a binary search.  */
+		tick = inTicks[i];
+		if (index >= 0 && tick < inMap->ticks[index])
+			index = MDTempoMapFindTick(inMap, tick);
+		else if (index + 1 < inMap->count && inMap->ticks[index + 1] <= tick) {
+			if (index + 2 < inMap->count && inMap->ticks[index + 2] <= tick)
+				index = MDTempoMapFindTick(inMap, tick);
+			else index++;
+		}
+		if (index >= 0) {
+			tick = inMap->ticks[index];
+			time = inMap->times[index];
+			usPerBeat = inMap->tempos[index];
+		} else {
+			tick = 0;
+			time = 0;
+			usPerBeat = 500000;
+		}
+
+		/*  Collect the run of inputs within this segment  */
+		for (j = i + 1; j < inCount; j++) {
+			if ((index + 1 < inMap->count && inTicks[j] >= inMap->ticks[index + 1])
+				|| (index >= 0 && inTicks[j] < tick))
+				break;
+		}
+
+		/*  Straight-line conversion of the run; same formula as MDTempoMapTickToTime()  */
+		for ( ; i < j; i++)
+			outTimes[i] = time + (MDTimeType)floor(0.5 + (inTicks[i] - tick) * (double)usPerBeat / timebase);
+	}
+}
+
+/* --------------------------------------
+	･ MDTempoMapTimesToTicks
+   -------------------------------------- */
+void
+MDTempoMapTimesToTicks(const MDTempoMap *inMap, const MDTimeType *inTimes, MDTickType *outTicks, int32_t inCount)
+{
+	int32_t i, j, index;
+	MDTickType tick;
+	MDTimeType time;
+	double factor;
+
+	index = -1;
+	i = 0;
+	while (i < inCount) {
+		time = inTimes[i];
+		if (index >= 0 && time < inMap->times[index])
+			index = MDTempoMapFindTime(inMap, time);
+		else if (index + 1 < inMap->count && inMap->times[index + 1] <= time) {
+			if (index + 2 < inMap->count && inMap->times[index + 2] <= time)
+				index = MDTempoMapFindTime(inMap, time);
+			else index++;
+		}
+		if (index >= 0) {
+			tick = inMap->ticks[index];
+			time = inMap->times[index];
+			factor = (double)inMap->timebase / inMap->tempos[index];
+		} else {
+			tick = 0;
+			time = 0;
+			factor = (double)inMap->timebase / 500000;
+		}
+		for (j = i + 1; j < inCount; j++) {
+			if ((index + 1 < inMap->count && inTimes[j] >= inMap->times[index + 1])
+				|| (index >= 0 && inTimes[j] < time))
+				break;
+		}
+		for ( ; i < j; i++)
+			outTicks[i] = tick + (MDTickType)floor(0.5 + (double)(inTimes[i] - time) * factor);
+	}
+}
+
+/* --------------------------------------
+	･ MDCalibratorCopyTempoMap
+   -------------------------------------- */
+MDTempoMap *
+MDCalibratorCopyTempoMap(MDCalibrator *inCalib)
+{
+	MDTempoMap *map;
+	while (inCalib != NULL) {
+		if (inCalib->kind == kMDEventTempo)
+			break;
+		inCalib = inCalib->chain;
+	}
+	if (inCalib == NULL || inCalib->track == NULL)
+		return NULL;
+	if (MDTrackGetNumberOfEvents(inCalib->track) == 0)
+		return MDTempoMapNew(inCalib->track, MDSequenceGetTimebase(inCalib->parent));
+	map = MDCalibratorGetTempoMap(inCalib);
+	MDTempoMapRetain(map);
+	return map;
+}
+
+/* --------------------------------------
+	･ MDCalibratorTicksToTimes
+   -------------------------------------- */
+MDStatus
+MDCalibratorTicksToTimes(MDCalibrator *inCalib, const MDTickType *inTicks, MDTimeType *outTimes, int32_t inCount)
+{
+	MDTempoMap *map;
+	int32_t i;
+	if (inCount <= 0)
+		return kMDNoError;
+	if (inTicks == NULL || outTimes == NULL)
+		return kMDErrorBadParameter;
+	while (inCalib != NULL) {
+		if (inCalib->kind == kMDEventTempo)
+			break;
+		inCalib = inCalib->chain;
+	}
+	if (inCalib == NULL) {
+		/*  Same as the single-value version  */
+		for (i = 0; i < inCount; i++)
+			outTimes[i] = 0;
+		return kMDNoError;
+	}
+	map = MDCalibratorCopyTempoMap(inCalib);
+	if (map == NULL)
+		return kMDErrorOutOfMemory;
+	MDTempoMapTicksToTimes(map, inTicks, outTimes, inCount);
+	MDTempoMapRelease(map);
+	return kMDNoError;
+}
+
+/* --------------------------------------
+	･ MDCalibratorTimesToTicks
+   -------------------------------------- */
+MDStatus
+MDCalibratorTimesToTicks(MDCalibrator *inCalib, const MDTimeType *inTimes, MDTickType *outTicks, int32_t inCount)
+{
+	MDTempoMap *map;
+	int32_t i;
+	if (inCount <= 0)
+		return kMDNoError;
+	if (inTimes == NULL || outTicks == NULL)
+		return kMDErrorBadParameter;
+	while (inCalib != NULL) {
+		if (inCalib->kind == kMDEventTempo)
+			break;
+		inCalib = inCalib->chain;
+	}
+	if (inCalib == NULL) {
+		/*  Same as the single-value version  */
+		for (i = 0; i < inCount; i++)
+			outTicks[i] = kMDNegativeTick;
+		return kMDNoError;
+	}
+	map = MDCalibratorCopyTempoMap(inCalib);
+	if (map == NULL)
+		return kMDErrorOutOfMemory;
+	MDTempoMapTimesToTicks(map, inTimes, outTicks, inCount);
+	MDTempoMapRelease(map);
+	return kMDNoError;
+}
+
+#pragma mark ====== Measure map ======
+
+/* --------------------------------------
+	･ MDMeasureMapNew
+   -------------------------------------- */
+MDMeasureMap *
+MDMeasureMapNew(MDTrack *inTrack, int32_t inTimebase)
+{
+	MDMeasureMap *map;
+	MDPointer *pt;
+	const MDEvent *ep;
+	int32_t n, bar, tickPerBeat, beatPerMeasure, measure, beat, subtick;
+	MDTickType tick;
+
+	if (inTrack == NULL || inTimebase <= 0)
+		return NULL;
+	map = (MDMeasureMap *)calloc(sizeof(MDMeasureMap), 1);
+	pt = MDPointerNew(inTrack);
+	if (map == NULL || pt == NULL)
+		goto error;
+	map->refCount = 1;
+	map->timebase = inTimebase;
+	map->epoch = MDTrackGetEditEpoch(inTrack);
+	map->nevents = MDTrackGetNumberOfEvents(inTrack);
+
+	/*  Count the time signature events  */
+	n = 0;
+	while ((ep = MDPointerForward(pt)) != NULL) {
+		if (MDGetKind(ep) == kMDEventTimeSignature)
+			n++;
+	}
+	map->ticks = (MDTickType *)malloc(sizeof(MDTickType) * (n + 1));
+	map->bars = (int32_t *)malloc(sizeof(int32_t) * (n + 1));
+	map->tickPerBeat = (int32_t *)malloc(sizeof(int32_t) * (n + 1));
+	map->beatPerMeasure = (int32_t *)malloc(sizeof(int32_t) * (n + 1));
+	map->metronomeBar = (int32_t *)malloc(sizeof(int32_t) * (n + 1));
+	map->metronomeClick = (int32_t *)malloc(sizeof(int32_t) * (n + 1));
+	map->positions = (int32_t *)malloc(sizeof(int32_t) * (n + 1));
+	if (map->ticks == NULL || map->bars == NULL || map->tickPerBeat == NULL
+		|| map->beatPerMeasure == NULL || map->metronomeBar == NULL || map->metronomeClick == NULL
+		|| map->positions == NULL)
+		goto error;
+
+	/*  The bar numbers are calculated in the same way as MDCalibratorForward(): a time
+	    signature in the middle of a bar starts the next bar. Before the first time signature,
+	    4/4 from tick 0 is assumed.  */
+	tick = 0;
+	bar = 1;
+	MDEventParseTimeSignature(NULL, inTimebase, &tickPerBeat, &beatPerMeasure);
+	MDPointerSetPosition(pt, -1);
+	while ((ep = MDPointerForward(pt)) != NULL) {
+		if (MDGetKind(ep) != kMDEventTimeSignature)
+			continue;
+		MDCalibratorCalculateMeasure(tick, bar, tickPerBeat, beatPerMeasure, MDGetTick(ep), &measure, &beat, &subtick);
+		if (measure != 0 && (beat > 1 || subtick > 0))
+			measure++;
+		tick = MDGetTick(ep);
+		bar = measure;
+		MDEventParseTimeSignature(ep, inTimebase, &tickPerBeat, &beatPerMeasure);
+		map->ticks[map->count] = tick;
+		map->bars[map->count] = bar;
+		map->tickPerBeat[map->count] = tickPerBeat;
+		map->beatPerMeasure[map->count] = beatPerMeasure;
+		MDEventCalculateMetronomeBarAndBeat(ep, inTimebase, &map->metronomeBar[map->count], &map->metronomeClick[map->count]);
+		map->positions[map->count] = MDPointerGetPosition(pt);
+		map->count++;
+	}
+	MDPointerRelease(pt);
+	return map;
+
+  error:
+	if (pt != NULL)
+		MDPointerRelease(pt);
+	if (map != NULL) {
+		free(map->ticks);
+		free(map->bars);
+		free(map->tickPerBeat);
+		free(map->beatPerMeasure);
+		free(map->metronomeBar);
+		free(map->metronomeClick);
+		free(map->positions);
+		free(map);
+	}
+	return NULL;
+}
+
+/* --------------------------------------
+	･ MDMeasureMapRetain
+   -------------------------------------- */
+void
+MDMeasureMapRetain(MDMeasureMap *inMap)
+{
+	if (inMap != NULL)
+		__sync_fetch_and_add(&inMap->refCount, 1);
+}
+
+/* --------------------------------------
+	･ MDMeasureMapRelease
+   -------------------------------------- */
+void
+MDMeasureMapRelease(MDMeasureMap *inMap)
+{
+	if (inMap != NULL && __sync_sub_and_fetch(&inMap->refCount, 1) == 0) {
+		free(inMap->ticks);
+		free(inMap->bars);
+		free(inMap->tickPerBeat);
+		free(inMap->beatPerMeasure);
+		free(inMap->metronomeBar);
+		free(inMap->metronomeClick);
+		free(inMap->positions);
+		free(inMap);
+	}
+}
+
+/* --------------------------------------
+	･ MDMeasureMapGetCount
+   -------------------------------------- */
+int32_t
+MDMeasureMapGetCount(const MDMeasureMap *inMap)
+{
+	return inMap->count;
+}
+
+/* --------------------------------------
+	･ MDMeasureMapGetSignature
+   -------------------------------------- */
+void
+MDMeasureMapGetSignature(const MDMeasureMap *inMap, MDTickType inTick, MDTickType *outStartTick, int32_t *outStartBar, int32_t *outTickPerBeat, int32_t *outBeatPerMeasure)
+{
+	MDTickType tick;
+	int32_t bar, tickPerBeat, beatPerMeasure;
+	MDMeasureMapGetSpan(inMap, MDMeasureMapFindTick(inMap, inTick), &tick, &bar, &tickPerBeat, &beatPerMeasure);
+	if (outStartTick != NULL)
+		*outStartTick = tick;
+	if (outStartBar != NULL)
+		*outStartBar = bar;
+	if (outTickPerBeat != NULL)
+		*outTickPerBeat = tickPerBeat;
+	if (outBeatPerMeasure != NULL)
+		*outBeatPerMeasure = beatPerMeasure;
+}
+
+/* --------------------------------------
+	･ MDMeasureMapGetMetronome
+   -------------------------------------- */
+void
+MDMeasureMapGetMetronome(const MDMeasureMap *inMap, MDTickType inTick, MDTickType *outStartTick, int32_t *outTickPerMeasure, int32_t *outTickPerClick, MDTickType *outNextTick)
+{
+	int32_t index = MDMeasureMapFindTick(inMap, inTick);
+	int32_t bar, click;
+	if (index >= 0) {
+		bar = inMap->metronomeBar[index];
+		click = inMap->metronomeClick[index];
+	} else MDEventCalculateMetronomeBarAndBeat(NULL, inMap->timebase, &bar, &click);
+	if (outStartTick != NULL)
+		*outStartTick = (index >= 0 ? inMap->ticks[index] : 0);
+	if (outTickPerMeasure != NULL)
+		*outTickPerMeasure = bar;
+	if (outTickPerClick != NULL)
+		*outTickPerClick = click;
+	if (outNextTick != NULL)
+		*outNextTick = (index + 1 < inMap->count ? inMap->ticks[index + 1] : kMDMaxTick);
+}
+
+/* --------------------------------------
+	･ MDMeasureMapTickToMeasure
+   -------------------------------------- */
+void
+MDMeasureMapTickToMeasure(const MDMeasureMap *inMap, MDTickType inTick, int32_t *outMeasure, int32_t *outBeat, int32_t *outTick)
+{
+	MDTickType tick;
+	int32_t bar, tickPerBeat, beatPerMeasure;
+	MDMeasureMapGetSpan(inMap, MDMeasureMapFindTick(inMap, inTick), &tick, &bar, &tickPerBeat, &beatPerMeasure);
+	MDCalibratorCalculateMeasure(tick, bar, tickPerBeat, beatPerMeasure, inTick, outMeasure, outBeat, outTick);
+}
+
+/* --------------------------------------
+	･ MDMeasureMapMeasureToTick
+   -------------------------------------- */
+MDTickType
+MDMeasureMapMeasureToTick(const MDMeasureMap *inMap, int32_t inMeasure, int32_t inBeat, int32_t inTick)
+{
+	MDTickType tick;
+	int32_t bar, tickPerBeat, beatPerMeasure;
+	double theTick;
+	if (inMeasure < 1)
+		return kMDNegativeTick;
+	if (inMeasure >= INT32_MAX)
+		return kMDMaxTick;
+	MDMeasureMapGetSpan(inMap, MDMeasureMapFindBar(inMap, inMeasure), &tick, &bar, &tickPerBeat, &beatPerMeasure);
+	theTick = (double)tick + inTick +
+		((inBeat - 1) + (double)(inMeasure - bar) * beatPerMeasure) * tickPerBeat;
+	if (theTick > kMDMaxTick)
+		return kMDMaxTick;
+	else
+		return (MDTickType)theTick;
+}
+
+/* --------------------------------------
+	･ MDMeasureMapGetGridLines
+   -------------------------------------- */
+int32_t
+MDMeasureMapGetGridLines(const MDMeasureMap *inMap, MDTickType inStartTick, MDTickType inEndTick, MDMeasureGridLine *outLines, int32_t inMaxCount)
+{
+	int32_t index, count, bar, tickPerBeat, beatPerMeasure, beat;
+	MDTickType tick, spanTick, spanEnd;
+
+	if (inStartTick < 0)
+		inStartTick = 0;
+	count = 0;
+	index = MDMeasureMapFindTick(inMap, inStartTick);
+	while (count < inMaxCount && inStartTick < inEndTick) {
+		MDMeasureMapGetSpan(inMap, index, &spanTick, &bar, &tickPerBeat, &beatPerMeasure);
+		spanEnd = (index + 1 < inMap->count ? inMap->ticks[index + 1] : kMDMaxTick);
+		if (spanEnd > inEndTick)
+			spanEnd = inEndTick;
+		if (tickPerBeat > 0 && beatPerMeasure > 0) {
+			/*  The first beat at or after inStartTick in this span  */
+			beat = (int32_t)(((int64_t)inStartTick - spanTick + tickPerBeat - 1) / tickPerBeat);
+			tick = spanTick + (MDTickType)beat * tickPerBeat;
+			while (tick < spanEnd && count < inMaxCount) {
+				outLines[count].tick = tick;
+				outLines[count].measure = bar + beat / beatPerMeasure;
+				outLines[count].beat = beat % beatPerMeasure + 1;
+				count++;
+				if (spanEnd - tick <= tickPerBeat)
+					break;
+				tick += tickPerBeat;
+				beat++;
+			}
+		}
+		if (index + 1 >= inMap->count)
+			break;
+		inStartTick = spanEnd;
+		index++;
+	}
+	return count;
+}
+
+/* --------------------------------------
+	･ MDCalibratorCopyMeasureMap
+   -------------------------------------- */
+MDMeasureMap *
+MDCalibratorCopyMeasureMap(MDCalibrator *inCalib)
+{
+	MDMeasureMap *map;
+	while (inCalib != NULL) {
+		if (inCalib->kind == kMDEventTimeSignature)
+			break;
+		inCalib = inCalib->chain;
+	}
+	if (inCalib == NULL || inCalib->track == NULL)
+		return NULL;
+	if (MDTrackGetNumberOfEvents(inCalib->track) == 0)
+		return MDMeasureMapNew(inCalib->track, MDSequenceGetTimebase(inCalib->parent));
+	map = MDCalibratorGetMeasureMap(inCalib);
+	MDMeasureMapRetain(map);
+	return map;
+}
+
+#pragma mark ====== Snapshot ======
+
+/* --------------------------------------
+	･ MDCalibratorSnapshotNew
+   -------------------------------------- */
+MDCalibratorSnapshot *
+MDCalibratorSnapshotNew(MDTrack *inTrack, int32_t inTimebase)
+{
+	MDCalibratorSnapshot *snap;
+	MDPointer *pt;
+	const MDEvent *ep;
+	const unsigned char *p;
+	int32_t n;
+
+	if (inTrack == NULL || inTimebase <= 0)
+		return NULL;
+	snap = (MDCalibratorSnapshot *)calloc(sizeof(MDCalibratorSnapshot), 1);
+	pt = MDPointerNew(inTrack);
+	if (snap == NULL || pt == NULL)
+		goto error;
+	snap->refCount = 1;
+	snap->track = inTrack;
+	snap->timebase = inTimebase;
+	snap->epoch = MDTrackGetEditEpoch(inTrack);
+	snap->nevents = MDTrackGetNumberOfEvents(inTrack);
+	snap->tempoMap = MDTempoMapNew(inTrack, inTimebase);
+	snap->measureMap = MDMeasureMapNew(inTrack, inTimebase);
+	if (snap->tempoMap == NULL || snap->measureMap == NULL)
+		goto error;
+
+	/*  The key signatures  */
+	n = 0;
+	while ((ep = MDPointerForward(pt)) != NULL) {
+		if (MDGetKind(ep) == kMDEventKey)
+			n++;
+	}
+	snap->keyTicks = (MDTickType *)malloc(sizeof(MDTickType) * (n + 1));
+	snap->keys = (unsigned char *)malloc(2 * (n + 1));
+	if (snap->keyTicks == NULL || snap->keys == NULL)
+		goto error;
+	MDPointerSetPosition(pt, -1);
+	while ((ep = MDPointerForward(pt)) != NULL) {
+		if (MDGetKind(ep) != kMDEventKey)
+			continue;
+		p = MDGetMetaDataPtr(ep);
+		snap->keyTicks[snap->nkeys] = MDGetTick(ep);
+		snap->keys[snap->nkeys * 2] = p[0];
+		snap->keys[snap->nkeys * 2 + 1] = p[1];
+		snap->nkeys++;
+	}
+	MDPointerRelease(pt);
+	return snap;
+
+  error:
+	if (pt != NULL)
+		MDPointerRelease(pt);
+	if (snap != NULL) {
+		snap->refCount = 1;
+		MDCalibratorSnapshotRelease(snap);
+	}
+	return NULL;
+}
+
+/* --------------------------------------
+	･ MDCalibratorSnapshotRetain
+   -------------------------------------- */
+void
+MDCalibratorSnapshotRetain(MDCalibratorSnapshot *inSnapshot)
+{
+	if (inSnapshot != NULL)
+		__sync_fetch_and_add(&inSnapshot->refCount, 1);
+}
+
+/* --------------------------------------
+	･ MDCalibratorSnapshotRelease
+   -------------------------------------- */
+void
+MDCalibratorSnapshotRelease(MDCalibratorSnapshot *inSnapshot)
+{
+	if (inSnapshot != NULL && __sync_sub_and_fetch(&inSnapshot->refCount, 1) == 0) {
+		MDTempoMapRelease(inSnapshot->tempoMap);
+		MDMeasureMapRelease(inSnapshot->measureMap);
+		free(inSnapshot->keyTicks);
+		free(inSnapshot->keys);
+		free(inSnapshot);
+	}
+}
+
+/* --------------------------------------
+	･ MDCalibratorSnapshotIsCurrent
+   -------------------------------------- */
+int
+MDCalibratorSnapshotIsCurrent(const MDCalibratorSnapshot *inSnapshot, MDTrack *inTrack, int32_t inTimebase)
+{
+	return (inSnapshot != NULL && inSnapshot->track == inTrack && inTrack != NULL
+		&& inSnapshot->timebase == inTimebase
+		&& inSnapshot->epoch == MDTrackGetEditEpoch(inTrack)
+		&& inSnapshot->nevents == MDTrackGetNumberOfEvents(inTrack));
+}
+
+/* --------------------------------------
+	･ MDCalibratorSnapshotGetTempoMap
+   -------------------------------------- */
+MDTempoMap *
+MDCalibratorSnapshotGetTempoMap(const MDCalibratorSnapshot *inSnapshot)
+{
+	return inSnapshot->tempoMap;
+}
+
+/* --------------------------------------
+	･ MDCalibratorSnapshotGetMeasureMap
+   -------------------------------------- */
+MDMeasureMap *
+MDCalibratorSnapshotGetMeasureMap(const MDCalibratorSnapshot *inSnapshot)
+{
+	return inSnapshot->measureMap;
+}
+
+/* --------------------------------------
+	･ MDCalibratorSnapshotTickToTime
+   -------------------------------------- */
+MDTimeType
+MDCalibratorSnapshotTickToTime(const MDCalibratorSnapshot *inSnapshot, MDTickType inTick)
+{
+	return MDTempoMapTickToTime(inSnapshot->tempoMap, inTick);
+}
+
+/* --------------------------------------
+	･ MDCalibratorSnapshotTimeToTick
+   -------------------------------------- */
+MDTickType
+MDCalibratorSnapshotTimeToTick(const MDCalibratorSnapshot *inSnapshot, MDTimeType inTime)
+{
+	return MDTempoMapTimeToTick(inSnapshot->tempoMap, inTime);
+}
+
+/* --------------------------------------
+	･ MDCalibratorSnapshotGetTempo
+   -------------------------------------- */
+float
+MDCalibratorSnapshotGetTempo(const MDCalibratorSnapshot *inSnapshot, MDTickType inTick)
+{
+	return MDTempoMapGetTempo(inSnapshot->tempoMap, inTick);
+}
+
+/* --------------------------------------
+	･ MDCalibratorSnapshotTickToMeasure
+   -------------------------------------- */
+void
+MDCalibratorSnapshotTickToMeasure(const MDCalibratorSnapshot *inSnapshot, MDTickType inTick, int32_t *outMeasure, int32_t *outBeat, int32_t *outTick)
+{
+	MDMeasureMapTickToMeasure(inSnapshot->measureMap, inTick, outMeasure, outBeat, outTick);
+}
+
+/* --------------------------------------
+	･ MDCalibratorSnapshotMeasureToTick
+   -------------------------------------- */
+MDTickType
+MDCalibratorSnapshotMeasureToTick(const MDCalibratorSnapshot *inSnapshot, int32_t inMeasure, int32_t inBeat, int32_t inTick)
+{
+	return MDMeasureMapMeasureToTick(inSnapshot->measureMap, inMeasure, inBeat, inTick);
+}
+
+/* --------------------------------------
+	･ MDCalibratorSnapshotGetKey
+   -------------------------------------- */
+int
+MDCalibratorSnapshotGetKey(const MDCalibratorSnapshot *inSnapshot, MDTickType inTick, int *outSharps, int *outMinor)
+{
+	int32_t lo = 0, hi = inSnapshot->nkeys, mid;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (inSnapshot->keyTicks[mid] <= inTick)
+			lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo == 0) {
+		/*  No key signature: C major  */
+		if (outSharps != NULL)
+			*outSharps = 0;
+		if (outMinor != NULL)
+			*outMinor = 0;
+		return 0;
+	}
+	if (outSharps != NULL)
+		*outSharps = (signed char)inSnapshot->keys[(lo - 1) * 2];
+	if (outMinor != NULL)
+		*outMinor = (inSnapshot->keys[(lo - 1) * 2 + 1] & 1);
+	return 1;
+}
@@ -27,6 +27,22 @@
 
 typedef struct MDCalibrator MDCalibrator;
 
+/*  MDTempoMap は、コンダクタートラックのテンポイベントの tick、その位置での絶対時間（マイクロ秒）、
+    MIDI の整数テンポ（４分音符あたりのマイクロ秒）を配列にしたもの。作成後は変更されないので、
+    retain しておけばどのスレッドからでも tick <-> 時間の変換に使える（二分探索なので O(log n)）。 */
+typedef struct MDTempoMap MDTempoMap;
+
+/*  MDMeasureMap は、コンダクタートラックの拍子記号イベントの tick、その位置の小節番号、１拍の tick 数、
+    １小節の拍数を配列にしたもの。MDTempoMap と同様に作成後は変更されない。小節・拍 <-> tick の
+    変換は二分探索で行う。 */
+typedef struct MDMeasureMap MDMeasureMap;
+
+/*  MDCalibratorSnapshot は、コンダクタートラックのテンポ・拍子・調号を読み出し専用にまとめたもの。
+    MDCalibrator と違って「現在位置」を持たないので、retain しておけば複数のスレッドから同時に、
+    ロックなしで tick・時間・小節の変換に使える。通常は MDSequenceCopyCalibratorSnapshot() で
+    シーケンスが公開している最新のものを得る。 */
+typedef struct MDCalibratorSnapshot MDCalibratorSnapshot;
+
 #ifndef __MDCommon__
 #include "MDCommon.h"
 #endif
@@ -35,6 +51,13 @@ typedef struct MDCalibrator MDCalibrator;
 #include "MDSequence.h"
 #endif
 
+/*  MDMeasureMapGetGridLines() が返す拍の位置。beat == 1 が小節線。 */
+typedef struct MDMeasureGridLine {
+	MDTickType	tick;
+	int32_t		measure;
+	int32_t		beat;
+} MDMeasureGridLine;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -87,11 +110,113 @@ float			MDCalibratorGetTempo(MDCalibrator *inCalib);
 MDTickType		MDCalibratorTimeToTick(MDCalibrator *inCalib, MDTimeType inTime);
 MDTimeType		MDCalibratorTickToTime(MDCalibrator *inCalib, MDTickType inTick);
 
-MDEvent *		MDCalibratorGetEvent(MDCalibrator *inCalib, MDTrack *inTrack, MDEventKind inKind, short inCode);
-MDEvent *		MDCalibratorGetNextEvent(MDCalibrator *inCalib, MDTrack *inTrack, MDEventKind inKind, short inCode);
+/*  kMDEventTempo のレコードは内部に MDTempoMap を持ち、JumpToTick/TickToTime/TimeToTick では
+    テンポイベントを１つずつたどる代わりに二分探索で移動する。MDTempoMap はコンダクタートラックの
+    編集（編集エポックで判定する）と MDCalibratorReset() で作り直される。 */
+
+const MDEvent *	MDCalibratorGetEvent(MDCalibrator *inCalib, MDTrack *inTrack, MDEventKind inKind, short inCode);
+const MDEvent *	MDCalibratorGetNextEvent(MDCalibrator *inCalib, MDTrack *inTrack, MDEventKind inKind, short inCode);
 int32_t			MDCalibratorGetEventPosition(MDCalibrator *inCalib, MDTrack *inTrack, MDEventKind inKind, short inCode);
 MDPointer *		MDCalibratorCopyPointer(MDCalibrator *inCalib, MDTrack *inTrack, MDEventKind inKind, short inCode);
 
+/*  inCalib が管理している MDTempoMap を retain して返す。kMDEventTempo のレコードが無い場合は
+    NULL を返す。使い終わったら MDTempoMapRelease() すること。 */
+MDTempoMap *	MDCalibratorCopyTempoMap(MDCalibrator *inCalib);
+
+/*  kMDEventTimeSignature のレコードも同様に MDMeasureMap を持ち、JumpToTick/TickToMeasure/
+    MeasureToTick では二分探索で移動する。inCalib が管理している MDMeasureMap を retain して返す。
+    kMDEventTimeSignature のレコードが無い場合は NULL を返す。 */
+MDMeasureMap *	MDCalibratorCopyMeasureMap(MDCalibrator *inCalib);
+
+/*  inCount 個の tick（時間）をまとめて時間（tick）に変換する。結果は MDCalibratorTickToTime()/
+    MDCalibratorTimeToTick() を１つずつ呼んだ場合と同じ。入力が昇順に並んでいればテンポマップを
+    前から１回たどるだけで済む（昇順でなくても正しい結果を返す）。 */
+MDStatus		MDCalibratorTicksToTimes(MDCalibrator *inCalib, const MDTickType *inTicks, MDTimeType *outTimes, int32_t inCount);
+MDStatus		MDCalibratorTimesToTicks(MDCalibrator *inCalib, const MDTimeType *inTimes, MDTickType *outTicks, int32_t inCount);
+
+/* -------------------------------------------------------------------
+    MDTempoMap functions
+   -------------------------------------------------------------------  */
+
+/*  inTrack のテンポイベントから MDTempoMap を作成する。inTimebase はシーケンスのタイムベース。
+    メモリ不足の場合は NULL を返す。 */
+MDTempoMap *	MDTempoMapNew(MDTrack *inTrack, int32_t inTimebase);
+void			MDTempoMapRetain(MDTempoMap *inMap);
+void			MDTempoMapRelease(MDTempoMap *inMap);
+
+/*  テンポイベントの数を返す。 */
+int32_t			MDTempoMapGetCount(const MDTempoMap *inMap);
+
+/*  inTick の位置でのテンポ（テンポイベントの値。MDCalibratorGetTempo() と同じ）を返す。 */
+float			MDTempoMapGetTempo(const MDTempoMap *inMap, MDTickType inTick);
+
+/*  tick <-> 時間（マイクロ秒）の変換。MDCalibratorTickToTime()/MDCalibratorTimeToTick() と
+    同じ結果を返す。 */
+MDTimeType		MDTempoMapTickToTime(const MDTempoMap *inMap, MDTickType inTick);
+MDTickType		MDTempoMapTimeToTick(const MDTempoMap *inMap, MDTimeType inTime);
+
+/*  MDCalibratorTicksToTimes()/MDCalibratorTimesToTicks() の MDTempoMap 版。 */
+void			MDTempoMapTicksToTimes(const MDTempoMap *inMap, const MDTickType *inTicks, MDTimeType *outTimes, int32_t inCount);
+void			MDTempoMapTimesToTicks(const MDTempoMap *inMap, const MDTimeType *inTimes, MDTickType *outTicks, int32_t inCount);
+
+/* -------------------------------------------------------------------
+    MDMeasureMap functions
+   -------------------------------------------------------------------  */
+
+/*  inTrack の拍子記号イベントから MDMeasureMap を作成する。メモリ不足の場合は NULL を返す。 */
+MDMeasureMap *	MDMeasureMapNew(MDTrack *inTrack, int32_t inTimebase);
+void			MDMeasureMapRetain(MDMeasureMap *inMap);
+void			MDMeasureMapRelease(MDMeasureMap *inMap);
+
+/*  拍子記号イベントの数を返す。 */
+int32_t			MDMeasureMapGetCount(const MDMeasureMap *inMap);
+
+/*  inTick の位置で有効な拍子の開始 tick、開始小節、１拍の tick 数、１小節の拍数を返す。
+    最初の拍子記号より前では tick 0 から 4/4 とみなす。不要な出力は NULL でよい。 */
+void			MDMeasureMapGetSignature(const MDMeasureMap *inMap, MDTickType inTick, MDTickType *outStartTick, int32_t *outStartBar, int32_t *outTickPerBeat, int32_t *outBeatPerMeasure);
+
+/*  メトロノーム用に、inTick の位置で有効な拍子の開始 tick、１小節の tick 数、クリックの間隔（拍子記号の
+    MIDI クロック数による。MDEventCalculateMetronomeBarAndBeat() を参照）と、次の拍子記号の tick
+   （なければ kMDMaxTick）を返す。不要な出力は NULL でよい。 */
+void			MDMeasureMapGetMetronome(const MDMeasureMap *inMap, MDTickType inTick, MDTickType *outStartTick, int32_t *outTickPerMeasure, int32_t *outTickPerClick, MDTickType *outNextTick);
+
+/*  小節・拍 <-> tick の変換。MDCalibratorTickToMeasure()/MDCalibratorMeasureToTick() と同じ結果を返す。 */
+void			MDMeasureMapTickToMeasure(const MDMeasureMap *inMap, MDTickType inTick, int32_t *outMeasure, int32_t *outBeat, int32_t *outTick);
+MDTickType		MDMeasureMapMeasureToTick(const MDMeasureMap *inMap, int32_t inMeasure, int32_t inBeat, int32_t inTick);
+
+/*  inStartTick <= tick < inEndTick の範囲にある拍の位置を、tick の順に outLines に最大 inMaxCount 個
+    書き込み、書き込んだ数を返す。戻り値が inMaxCount に等しい場合は、最後の tick + 1 から再度
+    呼び出せば続きが得られる。 */
+int32_t			MDMeasureMapGetGridLines(const MDMeasureMap *inMap, MDTickType inStartTick, MDTickType inEndTick, MDMeasureGridLine *outLines, int32_t inMaxCount);
+
+/* -------------------------------------------------------------------
+    MDCalibratorSnapshot functions
+   -------------------------------------------------------------------  */
+
+/*  inTrack（コンダクタートラック）から MDCalibratorSnapshot を作成する。メモリ不足の場合は NULL を返す。 */
+MDCalibratorSnapshot *	MDCalibratorSnapshotNew(MDTrack *inTrack, int32_t inTimebase);
+void			MDCalibratorSnapshotRetain(MDCalibratorSnapshot *inSnapshot);
+void			MDCalibratorSnapshotRelease(MDCalibratorSnapshot *inSnapshot);
+
+/*  inSnapshot が inTrack の現在の内容（編集エポックで判定する）とタイムベースから作られたもの
+    であれば 1 を返す。inTrack を編集するスレッドから呼ぶこと。 */
+int				MDCalibratorSnapshotIsCurrent(const MDCalibratorSnapshot *inSnapshot, MDTrack *inTrack, int32_t inTimebase);
+
+/*  内部の MDTempoMap/MDMeasureMap を返す（retain はしない）。 */
+MDTempoMap *	MDCalibratorSnapshotGetTempoMap(const MDCalibratorSnapshot *inSnapshot);
+MDMeasureMap *	MDCalibratorSnapshotGetMeasureMap(const MDCalibratorSnapshot *inSnapshot);
+
+/*  変換。結果は MDCalibrator の対応する関数と同じ。 */
+MDTimeType		MDCalibratorSnapshotTickToTime(const MDCalibratorSnapshot *inSnapshot, MDTickType inTick);
+MDTickType		MDCalibratorSnapshotTimeToTick(const MDCalibratorSnapshot *inSnapshot, MDTimeType inTime);
+float			MDCalibratorSnapshotGetTempo(const MDCalibratorSnapshot *inSnapshot, MDTickType inTick);
+void			MDCalibratorSnapshotTickToMeasure(const MDCalibratorSnapshot *inSnapshot, MDTickType inTick, int32_t *outMeasure, int32_t *outBeat, int32_t *outTick);
+MDTickType		MDCalibratorSnapshotMeasureToTick(const MDCalibratorSnapshot *inSnapshot, int32_t inMeasure, int32_t inBeat, int32_t inTick);
+
+/*  inTick の位置での調号を返す。*outSharps はシャープの数（フラットは負）、*outMinor は
+    短調なら 1。inTick 以前に調号がなければハ長調とみなして 0 を返す（あれば 1）。 */
+int				MDCalibratorSnapshotGetKey(const MDCalibratorSnapshot *inSnapshot, MDTickType inTick, int *outSharps, int *outMinor);
+
 #ifdef __cplusplus
 }
 #endif
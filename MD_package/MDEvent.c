@@ -20,17 +20,40 @@
 #include <stdlib.h>		/*  for malloc(), realloc(), free()  */
 #include <stdio.h>		/*  for sprintf()  */
 #include <ctype.h>		/*  for isspace(), tolower()  */
+#include <pthread.h>	/*  for the message pool and the intern table  */
 
 #ifdef __MWERKS__
 #pragma mark ====== Private definitions ======
 #endif
 
+/*  The message buffer. A message may be shared by several events (refCount > 1); it is
+    copied before modification. An interned message is registered in the intern table, so
+    that identical messages share one buffer; it is also copied (or removed from the table)
+    before modification.  */
 struct MDMessage {
 	int32_t	refCount;
 	int32_t	length;
+	int32_t	capacity;		/*  the allocated size of msg[] (including the terminating null)  */
+	uint32_t hash;			/*  the hash value of msg[] (valid only if interned)  */
+	MDMessage *hashNext;	/*  the next message in the same bucket of the intern table, or the
+								next free message in the pool  */
+	char	interned;		/*  non-zero if registered in the intern table  */
 	unsigned char msg[4];	/*  variable length  */
 };
 
+#define kMDMessageNumberOfClasses	6	/*  size classes: 16, 32, ..., 512 bytes  */
+#define kMDMessageSmallestClass		16
+#define kMDMessagePoolMax			1024	/*  max number of free messages kept per class  */
+#define kMDMessageTableInitialSize	256
+
+/*  The free lists of the size classes and the intern table; protected by sMDMessageMutex  */
+static pthread_mutex_t	sMDMessageMutex = PTHREAD_MUTEX_INITIALIZER;
+static MDMessage *		sMDMessagePool[kMDMessageNumberOfClasses];
+static int32_t			sMDMessagePoolCount[kMDMessageNumberOfClasses];
+static MDMessage **		sMDMessageTable;
+static uint32_t			sMDMessageTableSize;	/*  the number of buckets (power of 2)  */
+static uint32_t			sMDMessageTableCount;	/*  the number of interned messages  */
+
 /* -------------------------------------------------------------------
     MDEvent macros --- for private use only
    -------------------------------------------------------------------  */
@@ -45,13 +68,106 @@ struct MDMessage {
 
 static unsigned char	sIsNote60C4		= 0;
 
+/* --------------------------------------
+	･ MDMessageSizeClass
+   -------------------------------------- */
+/*  Returns the size class for the capacity, or -1 if it is too large to be pooled  */
+static int
+MDMessageSizeClass(int32_t capacity)
+{
+	int n;
+	int32_t size = kMDMessageSmallestClass;
+	for (n = 0; n < kMDMessageNumberOfClasses; n++, size *= 2) {
+		if (capacity <= size)
+			return n;
+	}
+	return -1;
+}
+
+/* --------------------------------------
+	･ MDMessageAllocate
+   -------------------------------------- */
+static MDMessage *
+MDMessageAllocate(int32_t length)
+{
+	MDMessage *newMsg = NULL;
+	int32_t capacity;
+	int n;
+
+	capacity = length + 1;	/* One extra byte for terminating null */
+	n = MDMessageSizeClass(capacity);
+	if (n >= 0) {
+		capacity = kMDMessageSmallestClass << n;
+		pthread_mutex_lock(&sMDMessageMutex);
+		if ((newMsg = sMDMessagePool[n]) != NULL) {
+			sMDMessagePool[n] = newMsg->hashNext;
+			sMDMessagePoolCount[n]--;
+		}
+		pthread_mutex_unlock(&sMDMessageMutex);
+	} else if (capacity < 4)
+		capacity = 4;
+	if (newMsg == NULL) {
+		newMsg = (MDMessage *)malloc(sizeof(*newMsg) - 4 + capacity);
+		if (newMsg == NULL)
+			return NULL;
+	}
+	newMsg->refCount = 1;
+	newMsg->length = length;
+	newMsg->capacity = capacity;
+	newMsg->hash = 0;
+	newMsg->hashNext = NULL;
+	newMsg->interned = 0;
+	newMsg->msg[length] = 0;	/*  Null-terminate transparently  */
+	return newMsg;
+}
+
+/* --------------------------------------
+	･ MDMessageDeallocate
+   -------------------------------------- */
+static void
+MDMessageDeallocate(MDMessage *msgRef)
+{
+	int n = MDMessageSizeClass(msgRef->capacity);
+	if (n >= 0) {
+		pthread_mutex_lock(&sMDMessageMutex);
+		if (sMDMessagePoolCount[n] < kMDMessagePoolMax) {
+			msgRef->hashNext = sMDMessagePool[n];
+			sMDMessagePool[n] = msgRef;
+			sMDMessagePoolCount[n]++;
+			msgRef = NULL;
+		}
+		pthread_mutex_unlock(&sMDMessageMutex);
+	}
+	if (msgRef != NULL)
+		free(msgRef);
+}
+
+/* --------------------------------------
+	･ MDMessageUnlink
+   -------------------------------------- */
+/*  Remove an interned message from the intern table. Should be called with sMDMessageMutex locked.  */
+static void
+MDMessageUnlink(MDMessage *msgRef)
+{
+	MDMessage **mpp;
+	for (mpp = &sMDMessageTable[msgRef->hash & (sMDMessageTableSize - 1)]; *mpp != NULL; mpp = &((*mpp)->hashNext)) {
+		if (*mpp == msgRef) {
+			*mpp = msgRef->hashNext;
+			break;
+		}
+	}
+	msgRef->hashNext = NULL;
+	msgRef->interned = 0;
+	sMDMessageTableCount--;
+}
+
 /* --------------------------------------
 	･ MDMessageRetain
    -------------------------------------- */
 static void
 MDMessageRetain(MDMessage *msgRef)
 {
-	msgRef->refCount++;
+	__sync_add_and_fetch(&msgRef->refCount, 1);
 }
 
 /* --------------------------------------
@@ -60,43 +176,110 @@ MDMessageRetain(MDMessage *msgRef)
 static void
 MDMessageRelease(MDMessage *msgRef)
 {
-	msgRef->refCount--;
-	if (msgRef->refCount <= 0)
-		free(msgRef);
+	if (__sync_sub_and_fetch(&msgRef->refCount, 1) > 0)
+		return;
+	if (msgRef->interned) {
+		pthread_mutex_lock(&sMDMessageMutex);
+		/*  The message may have been looked up again in the meantime  */
+		if (msgRef->refCount > 0) {
+			pthread_mutex_unlock(&sMDMessageMutex);
+			return;
+		}
+		MDMessageUnlink(msgRef);
+		pthread_mutex_unlock(&sMDMessageMutex);
+	}
+	MDMessageDeallocate(msgRef);
 }
 
 /* --------------------------------------
 	･ MDMessageReallocate
    -------------------------------------- */
+/*  Change the length of the message. The returned message is owned only by the caller
+    and is not interned, so that it can be modified.  */
 static MDMessage *
 MDMessageReallocate(MDMessage *msgRef, int32_t length)
 {
 	MDMessage *newMsg;
-	int32_t newLength;
-
-	if (length < 4)
-		newLength = sizeof(*newMsg);
-	else
-		newLength = sizeof(*newMsg) - 4 + 1 + length; /* One extra byte for terminating null */
-
-	if (msgRef == NULL)
-		newMsg = (MDMessage *)malloc(newLength);
-	else if (msgRef->refCount == 1)
-		newMsg = (MDMessage *)realloc(msgRef, newLength);
-	else {
-		newMsg = (MDMessage *)malloc(newLength);
-		if (newMsg != NULL) {
-			int32_t minLength = (msgRef->length > length ? length : msgRef->length);
-			msgRef->refCount--;
-			memmove(newMsg->msg, msgRef->msg, minLength + 1);
+	int32_t minLength;
+
+	if (msgRef != NULL && msgRef->interned && msgRef->refCount == 1) {
+		/*  Remove from the intern table instead of copying  */
+		pthread_mutex_lock(&sMDMessageMutex);
+		if (msgRef->refCount == 1)
+			MDMessageUnlink(msgRef);
+		pthread_mutex_unlock(&sMDMessageMutex);
+	}
+	if (msgRef != NULL && msgRef->refCount == 1 && !msgRef->interned) {
+		if (length + 1 <= msgRef->capacity) {
+			/*  Fits in the current buffer  */
+			msgRef->length = length;
+			msgRef->msg[length] = 0;
+			return msgRef;
 		}
 	}
-	if (newMsg != NULL) {
-		newMsg->length = length;
-		newMsg->msg[length] = 0;	/*  Null-terminate transparently  */
-		newMsg->refCount = 1;
-		return newMsg;
-	} else return NULL;
+	newMsg = MDMessageAllocate(length);
+	if (newMsg != NULL && msgRef != NULL) {
+		minLength = (msgRef->length > length ? length : msgRef->length);
+		memmove(newMsg->msg, msgRef->msg, minLength);
+		MDMessageRelease(msgRef);
+	}
+	return newMsg;
+}
+
+/* --------------------------------------
+	･ MDMessageMakeMutable
+   -------------------------------------- */
+/*  Make sure the message of the event is not shared before it is modified  */
+static MDMessage *
+MDMessageMakeMutable(MDEvent *eventRef)
+{
+	MDMessage *message = MDPrivateGetMessage(eventRef);
+	if (message != NULL && (message->refCount > 1 || message->interned)) {
+		message = MDMessageReallocate(message, message->length);
+		if (message == NULL)
+			return NULL;	/*  out of memory  */
+		MDPrivateSetMessage(eventRef, message);
+	}
+	return message;
+}
+
+/* --------------------------------------
+	･ MDMessageHash
+   -------------------------------------- */
+static uint32_t
+MDMessageHash(const unsigned char *p, int32_t length)
+{
+	uint32_t h = 2166136261U;	/*  FNV-1a  */
+	while (--length >= 0) {
+		h ^= *p++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/* --------------------------------------
+	･ MDMessageGrowTable
+   -------------------------------------- */
+/*  Should be called with sMDMessageMutex locked  */
+static void
+MDMessageGrowTable(void)
+{
+	MDMessage **newTable, *mp, *mp2;
+	uint32_t newSize, i;
+	newSize = (sMDMessageTableSize == 0 ? kMDMessageTableInitialSize : sMDMessageTableSize * 2);
+	newTable = (MDMessage **)calloc(newSize, sizeof(MDMessage *));
+	if (newTable == NULL)
+		return;  /*  Keep the current table  */
+	for (i = 0; i < sMDMessageTableSize; i++) {
+		for (mp = sMDMessageTable[i]; mp != NULL; mp = mp2) {
+			mp2 = mp->hashNext;
+			mp->hashNext = newTable[mp->hash & (newSize - 1)];
+			newTable[mp->hash & (newSize - 1)] = mp;
+		}
+	}
+	free(sMDMessageTable);
+	sMDMessageTable = newTable;
+	sMDMessageTableSize = newSize;
 }
 
 #ifdef __MWERKS__
@@ -304,13 +487,10 @@ MDGetMessagePtr(MDEvent *eventRef, int32_t *outLength)
 		MDMessage *message = MDPrivateGetMessage(eventRef);
 		if (outLength != NULL)
 			*outLength = message->length;
-		if (message->refCount > 1) {
-			/*  This is a copy message, so we need to allocate new memory  */
-			message = MDMessageReallocate(message, message->length);
-			if (message == NULL)
-				return NULL;	/*  out of memory  */
-			MDPrivateSetMessage(eventRef, message);
-		}
+		/*  If this is a shared message, we need to allocate new memory  */
+		message = MDMessageMakeMutable(eventRef);
+		if (message == NULL)
+			return NULL;	/*  out of memory  */
 		return message->msg;
 	} else return NULL;
 }
@@ -336,7 +516,7 @@ MDSetMessageLength(MDEvent *eventRef, int32_t inLength)
 	･ MDCopyMessage
    -------------------------------------- */
 void
-MDCopyMessage(MDEvent *destRef, MDEvent *srcRef)
+MDCopyMessage(MDEvent *destRef, const MDEvent *srcRef)
 {
 	if (MDHasEventMessage(destRef) && MDHasEventMessage(srcRef)) {
 		MDMessage *message = MDPrivateGetMessage(srcRef);
@@ -355,14 +535,13 @@ MDSetMessage(MDEvent *eventRef, const unsigned char *inBuffer)
 	if (MDHasEventMessage(eventRef)) {
 		MDMessage *message = MDPrivateGetMessage(eventRef);
 		if (message != NULL) {
-			if (message->refCount > 1) {
-				/*  This is a copy message, so we need to allocate new memory  */
-				message = MDMessageReallocate(message, message->length);
-				if (message == NULL)
-					return -1;	/*  out of memory  */
-				MDPrivateSetMessage(eventRef, message);
-			}
+			/*  If this is a shared message, we need to allocate new memory  */
+			message = MDMessageMakeMutable(eventRef);
+			if (message == NULL)
+				return -1;	/*  out of memory  */
 			memmove(message->msg, inBuffer, message->length);
+			/*  The whole message is given, so share it with the identical ones  */
+			MDInternMessage(eventRef);
 			return message->length;
 		}
 	}
@@ -383,19 +562,64 @@ MDSetMessagePartial(MDEvent *eventRef, const unsigned char *inBuffer, int32_t in
 			inOffset = 0;
 		if (inOffset + inLength > message->length)
 			inLength = message->length - inOffset;
-		if (message->refCount > 1) {
-			/*  This is a copy message, so we need to allocate new memory  */
-			message = MDMessageReallocate(message, message->length);
-			if (message == NULL)
-				return -1;	/*  out of memory  */
-			MDPrivateSetMessage(eventRef, message);
-		}
+		/*  If this is a shared message, we need to allocate new memory  */
+		message = MDMessageMakeMutable(eventRef);
+		if (message == NULL)
+			return -1;	/*  out of memory  */
 		memmove(message->msg + inOffset, inBuffer, inLength);
 		return message->length;
 	}
 	return 0;
 }
 
+/* --------------------------------------
+	･ MDInternMessage
+   -------------------------------------- */
+void
+MDInternMessage(MDEvent *eventRef)
+{
+	MDMessage *message, *mp;
+	uint32_t hash, n;
+
+	if (!MDHasEventMessage(eventRef) || (message = MDPrivateGetMessage(eventRef)) == NULL || message->interned)
+		return;
+	hash = MDMessageHash(message->msg, message->length);
+	pthread_mutex_lock(&sMDMessageMutex);
+	if (sMDMessageTableSize == 0) {
+		MDMessageGrowTable();
+		if (sMDMessageTableSize == 0) {
+			pthread_mutex_unlock(&sMDMessageMutex);
+			return;  /*  Out of memory; leave the message as it is  */
+		}
+	}
+	for (mp = sMDMessageTable[hash & (sMDMessageTableSize - 1)]; mp != NULL; mp = mp->hashNext) {
+		if (mp->hash == hash && mp->length == message->length && memcmp(mp->msg, message->msg, mp->length) == 0) {
+			/*  Retain unless it is being released  */
+			while ((n = mp->refCount) > 0) {
+				if (__sync_bool_compare_and_swap(&mp->refCount, n, n + 1))
+					break;
+			}
+			if (n > 0)
+				break;
+		}
+	}
+	if (mp == NULL) {
+		/*  Register this message  */
+		message->hash = hash;
+		message->interned = 1;
+		message->hashNext = sMDMessageTable[hash & (sMDMessageTableSize - 1)];
+		sMDMessageTable[hash & (sMDMessageTableSize - 1)] = message;
+		if (++sMDMessageTableCount > sMDMessageTableSize * 2)
+			MDMessageGrowTable();
+	}
+	pthread_mutex_unlock(&sMDMessageMutex);
+	if (mp != NULL) {
+		/*  Use the identical message  */
+		MDPrivateSetMessage(eventRef, mp);
+		MDMessageRelease(message);
+	}
+}
+
 #ifdef __MWERKS__
 #pragma mark ====== Display data ======
 #endif
@@ -274,7 +274,7 @@ void	MDEventMove(MDEvent *destRef, MDEvent *sourceRef, int32_t count);
 int32_t	MDGetMessageLength(const MDEvent *eventRef);
 
 /*  srcRef から destRef にメッセージデータだけをコピーする。  */
-void	MDCopyMessage(MDEvent *destRef, MDEvent *srcRef);
+void	MDCopyMessage(MDEvent *destRef, const MDEvent *srcRef);
 
 /*　渡されたバッファアドレスにメッセージデータをコピーする。outBuffer はメッセージを
     格納するのに十分な大きさがなければならない。
@@ -294,7 +294,8 @@ const unsigned char *
 /*  注意：MDGetMessagePtr, MDSetMessageLength, MDSetMessage, MDSetMessagePartial を
     呼び出した時、一見必要がないように見えても内部的にメモリ確保が行われることがある。
     これらの関数はメッセージの内容を書き換えるため、refCount を使ってコピーを保持している
-    メッセージの場合は新しいコピーがその時点で作成されるからである。 */
+    メッセージや、MDInternMessage で共有されているメッセージの場合は、新しいコピーがその
+    時点で作成されるからである。 */
 
 /*	メッセージデータの長さとデータへのポインタを返す。データに書き込んでも構わないが、
 	決められた長さの外側に書き込まないよう注意すること。 */
@@ -317,6 +318,12 @@ int32_t	MDSetMessage(MDEvent *eventRef, const unsigned char *inBuffer);
     メッセージイベントでない場合は何もしない。 */
 int32_t	MDSetMessagePartial(MDEvent *eventRef, const unsigned char *inBuffer, int32_t inOffset, int32_t inLength);
 
+/*　同じ内容のメッセージを持つイベントがあれば、そのメッセージを共有する（なければ
+    このメッセージが以後共有の対象として登録される）。共有されたメッセージは書き換える時に
+    コピーされる。MDSetMessage() の中では自動的に呼ばれる。メッセージイベントでない場合は
+    何もしない。 */
+void	MDInternMessage(MDEvent *eventRef);
+
 /*  イベントデータと表示データの相互変換。  */
 
 /*  ノートナンバーをノート名に変換する。 */
@@ -99,10 +99,13 @@ typedef struct MDDestinationInfo {
 	MIDISysexSendRequest	sysexRequest;
 	unsigned char	sysexTransmitting;		/* non-zero if sysexRequest is being processed */
 
-    MDTrackMerger * merger;
-    MDEvent *       currentEp;
+    int32_t         index;          /*  The position in the timeline where the next event was found  */
+    MDTimelineEntry next;           /*  The first timeline entry not yet processed; the position is
+                                        found again from this when the timeline has changed  */
+    const MDEvent * currentEp;      /*  The next event; NULL if none before the limit tick  */
     MDTrack *       currentTrack;
-    MDTickType      currentTick;
+    MDTickType      currentTick;    /*  The tick of currentEp; if currentEp is NULL, no event comes
+                                        before this tick (kMDMaxTick if no more events)  */
     MDTrack *		noteOff;		/*  Keep the 'internal' note off  */
     MDPointer *		noteOffPtr;
     MDTickType		noteOffTick;
@@ -136,7 +139,8 @@ typedef struct MDRecordingEventHeader {
 struct MDPlayer {
 	int32_t			refCount;
     MDSequence *    sequence;
-	MDCalibrator *	calib;		/*  for tick <-> time conversion  */
+	MDCalibratorSnapshot *snapshot;	/*  for tick <-> time conversion; swapped only by the playing
+									thread (under the player lock) or while not playing  */
 	MDTimeType		time;		/*  the last time when interrupt fired  */
 	MDTimeType		startTime;	/*  In microseconds  */
 	MDTickType		lastTick;	/*  tick of the last event already sent  */
@@ -147,6 +151,11 @@ struct MDPlayer {
 	int32_t			destNum;		/*  The number of destinations used in this player  */
 	MDDestinationInfo	**destInfo;	/*  Information for MIDI output  */
 
+    /*  Track list (the events are taken from the timeline of the sequence)  */
+    int32_t         trackNum;       /*  The number of tracks when the list was made  */
+    int32_t *       destIndex;      /*  Index to destInfo[] for each track; -1 if not sent out  */
+    MDPointer **    trackPointers;  /*  MDPointer for each track, to get the events  */
+
     /*  Metronome status  */
     MDTickType		nextMetronomeBar;  /*  Tick to ring the metronome bell (top of bar)  */
 	MDTickType		nextMetronomeBeat; /*  Tick to ring the metronome click (each beat)  */
@@ -725,8 +734,6 @@ MDPlayerReleaseDestinationInfo(MDDestinationInfo *info)
 	if (info != NULL) {
 		info->refCount--;
 		if (info->refCount == 0) {
-            if (info->merger != NULL)
-                MDTrackMergerRelease(info->merger);
             if (info->noteOffPtr != NULL)
                 MDPointerRelease(info->noteOffPtr);
             if (info->noteOff != NULL)
@@ -1042,13 +1049,13 @@ ScheduleMIDIEventToDevice(int32_t dev, UInt64 timeStamp, int length, unsigned ch
 }
 
 static int
-ScheduleMDEventToDevice(int32_t dev, UInt64 timeStamp, MDEvent *ep, int channel)
+ScheduleMDEventToDevice(int32_t dev, UInt64 timeStamp, const MDEvent *ep, int channel)
 {
     unsigned char buf[4];
     unsigned char *p;
     int32_t len;
     if (MDIsSysexEvent(ep)) {
-        p = MDGetMessagePtr(ep, &len);
+        p = (unsigned char *)MDGetMessageConstPtr(ep, &len);  /*  Read only; do not unshare the message  */
     } else if (MDIsChannelEvent(ep)) {
         memset(buf, 0, 4);
         len = MDEventToMIDIMessage(ep, buf);
@@ -1131,7 +1138,7 @@ MyMIDIReadProc(const MIDIPacketList *pktlist, void *refCon, void *connRefCon)
 static void
 RegisterEventInNoteOffTrack(MDDestinationInfo *info, const MDEvent *ep)
 {
-	MDEvent *ep0;
+	const MDEvent *ep0;
 	MDPointerJumpToTick(info->noteOffPtr, MDGetTick(ep) + 1);
 	MDPointerInsertAnEvent(info->noteOffPtr, ep);
 	MDPointerSetPosition(info->noteOffPtr, 0);
@@ -1140,19 +1147,63 @@ RegisterEventInNoteOffTrack(MDDestinationInfo *info, const MDEvent *ep)
 	else info->noteOffTick = kMDMaxTick;
 }
 
+/*  Take the calibrator snapshot currently published by the sequence. This neither locks
+    nor waits, so it is safe on the playing thread.  */
+static void
+MDPlayerUpdateSnapshot(MDPlayer *inPlayer)
+{
+	MDCalibratorSnapshot *snap = MDSequenceCopyCalibratorSnapshot(inPlayer->sequence);
+	if (snap != NULL) {
+		MDCalibratorSnapshotRelease(inPlayer->snapshot);
+		inPlayer->snapshot = snap;
+	}
+}
+
+static MDTimeType
+MDPlayerTickToTime(MDPlayer *inPlayer, MDTickType inTick)
+{
+	if (inPlayer->snapshot == NULL)
+		return 0;
+	return MDCalibratorSnapshotTickToTime(inPlayer->snapshot, inTick);
+}
+
+static MDTickType
+MDPlayerTimeToTick(MDPlayer *inPlayer, MDTimeType inTime)
+{
+	if (inPlayer->snapshot == NULL)
+		return 0;
+	return MDCalibratorSnapshotTimeToTick(inPlayer->snapshot, inTime);
+}
+
+/*  Same as MDPlayerTimeToTick(), but for the other threads: inPlayer->snapshot may be
+    swapped by the playing thread at any time  */
+static MDTickType
+MDPlayerTimeToTickOnAnyThread(MDPlayer *inPlayer, MDTimeType inTime)
+{
+	MDCalibratorSnapshot *snap = MDSequenceCopyCalibratorSnapshot(inPlayer->sequence);
+	MDTickType tick = 0;
+	if (snap != NULL) {
+		tick = MDCalibratorSnapshotTimeToTick(snap, inTime);
+		MDCalibratorSnapshotRelease(snap);
+	}
+	return tick;
+}
+
 static void
 PrepareMetronomeForTick(MDPlayer *inPlayer, MDTickType inTick)
 {
-	MDEvent *ep;
 	int32_t timebase = MDSequenceGetTimebase(inPlayer->sequence);
-	MDTickType t, t0;
+	MDTickType t, t0, next;
     int32_t beat, bar;
-	MDCalibratorJumpToTick(inPlayer->calib, inTick);
-	ep = MDCalibratorGetEvent(inPlayer->calib, NULL, kMDEventTimeSignature, -1);
-    MDEventCalculateMetronomeBarAndBeat(ep, timebase, &bar, &beat);
+	if (inPlayer->snapshot != NULL)
+		MDMeasureMapGetMetronome(MDCalibratorSnapshotGetMeasureMap(inPlayer->snapshot), inTick, &t, &bar, &beat, &next);
+	else {
+		MDEventCalculateMetronomeBarAndBeat(NULL, timebase, &bar, &beat);
+		t = 0;
+		next = kMDMaxTick;
+	}
     inPlayer->metronomeBeat = beat;
     inPlayer->metronomeBar = bar;
-    t = (ep == NULL ? 0 : MDGetTick(ep));
 /*	if (ep == NULL) {
 		t = 0;
 		inPlayer->metronomeBeat = timebase;
@@ -1174,10 +1225,158 @@ PrepareMetronomeForTick(MDPlayer *inPlayer, MDTickType inTick)
 	inPlayer->nextMetronomeBeat = t0 + (inTick - t0 + inPlayer->metronomeBeat - 1) / inPlayer->metronomeBeat * inPlayer->metronomeBeat;
 	if (inPlayer->nextMetronomeBeat > inPlayer->nextMetronomeBar)
 		inPlayer->nextMetronomeBeat = inPlayer->nextMetronomeBar;
-	ep = MDCalibratorGetNextEvent(inPlayer->calib, NULL, kMDEventTimeSignature, -1);
-	if (ep == NULL)
-		inPlayer->nextTimeSignature = kMDMaxTick;
-	else inPlayer->nextTimeSignature = MDGetTick(ep);
+	inPlayer->nextTimeSignature = next;
+}
+
+/*  Dispose the track list  */
+static void
+MDPlayerDisposeTrackList(MDPlayer *inPlayer)
+{
+    int32_t n;
+    if (inPlayer->trackPointers != NULL) {
+        for (n = 0; n < inPlayer->trackNum; n++) {
+            if (inPlayer->trackPointers[n] != NULL)
+                MDPointerRelease(inPlayer->trackPointers[n]);
+        }
+        free(inPlayer->trackPointers);
+        inPlayer->trackPointers = NULL;
+    }
+    if (inPlayer->destIndex != NULL) {
+        free(inPlayer->destIndex);
+        inPlayer->destIndex = NULL;
+    }
+    inPlayer->trackNum = 0;
+}
+
+/*  Make the list of the tracks and their destinations (index to destInfo[])  */
+static MDStatus
+MDPlayerUpdateTrackList(MDPlayer *inPlayer)
+{
+    int32_t num, n, i, dev;
+    MDTrack *track;
+    char name[256];
+
+    MDPlayerDisposeTrackList(inPlayer);
+    if (inPlayer->sequence == NULL)
+        return kMDNoError;
+    num = MDSequenceGetNumberOfTracks(inPlayer->sequence);
+    inPlayer->destIndex = (int32_t *)malloc(sizeof(int32_t) * (num + 1));
+    inPlayer->trackPointers = (MDPointer **)calloc(sizeof(MDPointer *), num + 1);
+    if (inPlayer->destIndex == NULL || inPlayer->trackPointers == NULL) {
+        MDPlayerDisposeTrackList(inPlayer);
+        return kMDErrorOutOfMemory;
+    }
+    inPlayer->trackNum = num;
+    for (n = 0; n < num; n++) {
+        inPlayer->destIndex[n] = -1;
+        track = MDSequenceGetTrack(inPlayer->sequence, n);
+        inPlayer->trackPointers[n] = MDPointerNew(track);
+        if (inPlayer->trackPointers[n] == NULL) {
+            MDPlayerDisposeTrackList(inPlayer);
+            return kMDErrorOutOfMemory;
+        }
+        MDTrackGetDeviceName(track, name, sizeof name);
+        dev = MDPlayerGetDestinationNumberFromName(name);
+        if (dev < 0)
+            continue;
+        for (i = 0; i < inPlayer->destNum; i++) {
+            if (inPlayer->destInfo[i]->dev == dev) {
+                inPlayer->destIndex[n] = i;
+                break;
+            }
+        }
+    }
+    return kMDNoError;
+}
+
+/*  Remake the track list if tracks have been inserted, deleted or replaced  */
+static MDStatus
+MDPlayerCheckTrackList(MDPlayer *inPlayer)
+{
+    int32_t n, num;
+    num = MDSequenceGetNumberOfTracks(inPlayer->sequence);
+    if (num == inPlayer->trackNum && inPlayer->trackPointers != NULL) {
+        for (n = 0; n < num; n++) {
+            if (MDPointerGetTrack(inPlayer->trackPointers[n]) != MDSequenceGetTrack(inPlayer->sequence, n))
+                break;
+        }
+        if (n >= num)
+            return kMDNoError;
+    }
+    return MDPlayerUpdateTrackList(inPlayer);
+}
+
+static int
+MDPlayerTimelineEntryLess(const MDTimelineEntry *e1, const MDTimelineEntry *e2)
+{
+    if (e1->tick != e2->tick)
+        return e1->tick < e2->tick;
+    if (e1->track != e2->track)
+        return e1->track < e2->track;
+    return e1->position < e2->position;
+}
+
+/*  Find the first event for the destination inPlayer->destInfo[destIndex] at or after
+    info->next and before limitTick. If found, info->currentEp, currentTrack, currentTick
+    are updated. Otherwise, info->currentEp is set to NULL and info->currentTick is
+    set to the tick of the first timeline entry that is not examined.  */
+static void
+MDPlayerSeekEvent(MDPlayer *inPlayer, int32_t destIndex, const MDTimelineEntry *entries, int32_t count, MDTickType limitTick)
+{
+    MDDestinationInfo *info = inPlayer->destInfo[destIndex];
+    const MDTimelineEntry *e;
+    MDPointer *pt;
+    int32_t i = info->index;
+
+    /*  Is the cached index still valid?  */
+    if (i < 0 || i > count
+        || (i < count && MDPlayerTimelineEntryLess(&entries[i], &info->next))
+        || (i > 0 && !MDPlayerTimelineEntryLess(&entries[i - 1], &info->next))) {
+        /*  Search again (the timeline may have been rebuilt)  */
+        i = MDSequenceGetTimelineIndexForTick(inPlayer->sequence, info->next.tick);
+        if (i < 0)
+            i = count;
+        while (i < count && MDPlayerTimelineEntryLess(&entries[i], &info->next))
+            i++;
+    }
+    for ( ; i < count; i++) {
+        e = &entries[i];
+        if (e->tick >= limitTick)
+            break;
+        if (e->track >= inPlayer->trackNum || inPlayer->destIndex[e->track] != destIndex)
+            continue;
+        pt = inPlayer->trackPointers[e->track];
+        if (MDPointerGetPosition(pt) == e->position - 1)
+            MDPointerForward(pt);
+        else MDPointerSetPosition(pt, e->position);
+        info->currentEp = MDPointerCurrent(pt);
+        if (info->currentEp == NULL)
+            continue;
+        info->currentTrack = MDPointerGetTrack(pt);
+        info->currentTick = e->tick;
+        info->index = i;
+        info->next = *e;
+        return;
+    }
+    info->currentEp = NULL;
+    info->currentTrack = NULL;
+    info->currentTick = (i < count ? entries[i].tick : kMDMaxTick);
+    info->index = i;
+    info->next.tick = (i < count ? entries[i].tick : kMDMaxTick);
+    info->next.track = -1;
+    info->next.position = -1;
+}
+
+/*  Proceed to the next event for the destination  */
+static void
+MDPlayerNextEvent(MDPlayer *inPlayer, int32_t destIndex, const MDTimelineEntry *entries, int32_t count, MDTickType limitTick)
+{
+    MDDestinationInfo *info = inPlayer->destInfo[destIndex];
+    if (info->currentEp != NULL) {
+        info->next.position++;
+        info->index++;
+    }
+    MDPlayerSeekEvent(inPlayer, destIndex, entries, count, limitTick);
 }
 
 /*  Send MIDI events before prefetch_tick to their destinations  */
@@ -1214,20 +1413,32 @@ SendMIDIEventsBeforeTick(MDPlayer *inPlayer, MDTickType now_tick, MDTickType pre
     int n, bytesToSend = 0;
     MDTickType sequenceDuration = MDSequenceGetDuration(inPlayer->sequence);
     MDTickType nextTick = kMDMaxTick;
+    const MDTimelineEntry *entries;
+    int32_t count;
+
+    /*  The timeline is updated here if the sequence has been edited  */
+    if (MDPlayerCheckTrackList(inPlayer) != kMDNoError
+        || MDSequenceGetTimeline(inPlayer->sequence, &entries, &count) != kMDNoError) {
+        /*  Out of memory: try again later  */
+        *outNextTick = prefetch_tick;
+        return 0;
+    }
 
     for (n = 0; n < inPlayer->destNum; n++) {
         MDDestinationInfo *info;
         MDTickType currentTick;
         info = inPlayer->destInfo[n];
+        MDPlayerSeekEvent(inPlayer, n, entries, count, prefetch_tick);
         while (1) {
             unsigned char scheduleType = kTrackScheduleType;
-            MDEvent *ep, metEvent, offEvent;
+            const MDEvent *ep;
+            MDEvent metEvent, offEvent;
             unsigned char channel, isBell;
             
             currentTick = info->currentTick;
             if (info->currentEp == NULL) {
-                /*  No event  */
-                currentTick = kMDMaxTick;
+                /*  No event before prefetch_tick (currentTick is the earliest possible tick
+                    of the next event)  */
                 scheduleType = kNoScheduleType;
             } else {
                 MDTrackAttribute attr;
@@ -1278,7 +1489,7 @@ SendMIDIEventsBeforeTick(MDPlayer *inPlayer, MDTickType now_tick, MDTickType pre
                 MDSetNoteOffVelocity(&metEvent, 0);
                 MDSetTick(&metEvent, currentTick);
                 MDSetChannel(&metEvent, gMetronomeInfo.channel & 15);
-                metDuration = MDCalibratorTimeToTick(inPlayer->calib, MDCalibratorTickToTime(inPlayer->calib, currentTick) + gMetronomeInfo.duration) - currentTick;
+                metDuration = MDPlayerTimeToTick(inPlayer, MDPlayerTickToTime(inPlayer, currentTick) + gMetronomeInfo.duration) - currentTick;
                 MDSetDuration(&metEvent, metDuration);
                 ep = &metEvent;
                 channel = gMetronomeInfo.channel & 15;
@@ -1296,7 +1507,7 @@ SendMIDIEventsBeforeTick(MDPlayer *inPlayer, MDTickType now_tick, MDTickType pre
             
             if (ep != NULL) {
                 int len;
-                MDTimeType scheduleTime = MDCalibratorTickToTime(inPlayer->calib, currentTick);
+                MDTimeType scheduleTime = MDPlayerTickToTime(inPlayer, currentTick);
                 UInt64 timeStamp = ConvertMDTimeTypeToHostTime(scheduleTime + inPlayer->startTime);
                 /*  Schedule the MIDI event to the device  */
                 len = ScheduleMDEventToDevice(info->dev, timeStamp, ep, channel);
@@ -1334,10 +1545,7 @@ SendMIDIEventsBeforeTick(MDPlayer *inPlayer, MDTickType now_tick, MDTickType pre
             }
             if (scheduleType == kTrackScheduleType || scheduleType == kMutedScheduleType) {
                 /*  Proceed to next event  */
-                info->currentEp = MDTrackMergerForward(info->merger, &(info->currentTrack));
-                if (info->currentEp != NULL)
-                    info->currentTick = MDGetTick(info->currentEp);
-                else info->currentTick = kMDMaxTick;
+                MDPlayerNextEvent(inPlayer, n, entries, count, prefetch_tick);
             }
         }
         /*  At this point, currentTick is 'the tick of the next event'
@@ -1410,14 +1618,15 @@ MyTimerFunc(MDPlayer *player)
     
     if (MDPlayerTryLock(player) == 0) {
         player->time = now_time;
-        now_tick = MDCalibratorTimeToTick(player->calib, now_time);
-        prefetch_tick = MDCalibratorTimeToTick(player->calib, now_time + kMDPlayerPrefetchInterval);
+        MDPlayerUpdateSnapshot(player);  /*  Pick up the tempo changes  */
+        now_tick = MDPlayerTimeToTick(player, now_time);
+        prefetch_tick = MDPlayerTimeToTick(player, now_time + kMDPlayerPrefetchInterval);
         SendMIDIEventsBeforeTick(player, now_tick, prefetch_tick, &tick);
         if (tick >= kMDMaxTick) {
             player->status = kMDPlayer_exhausted;
             time_to_wait = -1;
         } else {
-            time_to_wait = now_time - MDCalibratorTickToTime(player->calib, tick);
+            time_to_wait = now_time - MDPlayerTickToTime(player, tick);
             if (time_to_wait > kMDPlayerPrefetchInterval)
                 time_to_wait = kMDPlayerPrefetchInterval;
             else if (time_to_wait < kMDPlayerMinimumInterval)
@@ -1516,8 +1725,12 @@ StopSoundInAllTracks(MDPlayer *inPlayer)
         
         /*  Send AllNoteOff (Bn 7B 00), AllSoundOff (Bn 78 00), ResetAllControllers
             (Bn 79 00) to all tracks  */
-        for (num = 0; (track = MDTrackMergerGetTrack(info->merger, num)) != NULL; num++) {
-            int channel = MDTrackGetTrackChannel(track);
+        for (num = 0; num < inPlayer->trackNum; num++) {
+            int channel;
+            if (inPlayer->destIndex[num] != n)
+                continue;
+            track = MDPointerGetTrack(inPlayer->trackPointers[num]);
+            channel = MDTrackGetTrackChannel(track);
             buf[0] = 0xB0 + channel;
             buf[1] = 0x7B;
             buf[2] = 0;
@@ -1582,10 +1795,7 @@ MDPlayerNew(MDSequence *inSequence)
 		player->refCount = 1;
         player->sequence = inSequence;
         MDSequenceRetain(inSequence);
-		player->calib = MDCalibratorNew(inSequence, NULL, kMDEventTempo, -1);
-		if (player->calib == NULL)
-            goto error;
-		MDCalibratorAppend(player->calib, NULL, kMDEventTimeSignature, -1);
+		MDPlayerUpdateSnapshot(player);
 
 		player->status = kMDPlayer_idle;
 		player->time = 0;
@@ -1594,8 +1804,10 @@ MDPlayerNew(MDSequence *inSequence)
 
 		player->destInfo = NULL;
 		player->destNum = 0;
-	/*	player->destIndex = NULL;
-        player->destChannel = NULL;
+		player->trackNum = 0;
+		player->destIndex = NULL;
+		player->trackPointers = NULL;
+	/*	player->destChannel = NULL;
         player->trackAttr = NULL; */
 
         if (MDPlayerAllocateRecordingBuffer(player) == NULL)
@@ -1613,8 +1825,7 @@ MDPlayerNew(MDSequence *inSequence)
     MDPlayerReleaseRecordingBuffer(player);
     if (player->tempStorage != NULL)
         free(player->tempStorage);
-    if (player->calib != NULL)
-        MDCalibratorRelease(player->calib);
+    MDCalibratorSnapshotRelease(player->snapshot);
     if (player->sequence != NULL)
         MDSequenceRelease(player->sequence);
     free(player);
@@ -1647,16 +1858,14 @@ MDPlayerRelease(MDPlayer *inPlayer)
 					MDPlayerReleaseDestinationInfo(inPlayer->destInfo[num]);
 				free(inPlayer->destInfo);
 			}
+			MDPlayerDisposeTrackList(inPlayer);
             if (inPlayer->tempStorage != NULL)
                 free(inPlayer->tempStorage);
        /*     if (inPlayer->trackAttr != NULL)
                 free(inPlayer->trackAttr);
             if (inPlayer->destChannel != NULL)
-                free(inPlayer->destChannel);
-			if (inPlayer->destIndex != NULL)
-				free(inPlayer->destIndex); */
-			if (inPlayer->calib != NULL)
-				MDCalibratorRelease(inPlayer->calib);
+                free(inPlayer->destChannel); */
+			MDCalibratorSnapshotRelease(inPlayer->snapshot);
             if (inPlayer->sequence != NULL)
                 MDSequenceRelease(inPlayer->sequence);
             MDPlayerReleaseRecordingBuffer(inPlayer);
@@ -1672,17 +1881,15 @@ MDStatus
 MDPlayerSetSequence(MDPlayer *inPlayer, MDSequence *inSequence)
 {
     if (inPlayer != NULL) {
-		MDCalibrator *calib;
 		if (inPlayer->status == kMDPlayer_playing || inPlayer->status == kMDPlayer_exhausted)
 			MDPlayerStop(inPlayer);
-		calib = MDCalibratorNew(inSequence, NULL, kMDEventTempo, -1);
-		if (calib == NULL)
-			return kMDErrorOutOfMemory;
-		MDCalibratorRelease(inPlayer->calib);
-		inPlayer->calib = calib;
+        MDSequenceRetain(inSequence);
+        MDPlayerDisposeTrackList(inPlayer);
         MDSequenceRelease(inPlayer->sequence);
         inPlayer->sequence = inSequence;
-        MDSequenceRetain(inSequence);
+		MDCalibratorSnapshotRelease(inPlayer->snapshot);
+		inPlayer->snapshot = NULL;
+		MDPlayerUpdateSnapshot(inPlayer);
         inPlayer->time = 0;
         inPlayer->startTime = 0;
 	}
@@ -1707,18 +1914,16 @@ MDStatus
 MDPlayerRefreshTrackDestinations(MDPlayer *inPlayer)
 {
     MDSequence *sequence;
-    int32_t n, num, i, dev;
+    int32_t n, num, i, dev, count;
     int32_t *temp;
+    const MDTimelineEntry *entries;
+    MDStatus sts;
 
     /*  TODO: we need to rewrite all here!  */
     if (inPlayer == NULL || (sequence = inPlayer->sequence) == NULL)
         return kMDNoError;
 	
     num = MDSequenceGetNumberOfTracks(sequence);
-//	inPlayer->trackNum = num;
-//    inPlayer->destIndex = (int32_t *)re_malloc(inPlayer->destIndex, num * sizeof(int32_t));
-//    if (inPlayer->destIndex == NULL)
-//        return kMDErrorOutOfMemory;
 //    inPlayer->destChannel = (unsigned char *)re_malloc(inPlayer->destChannel, num * sizeof(unsigned char));
 //    if (inPlayer->destChannel == NULL)
 //        return kMDErrorOutOfMemory;
@@ -1746,10 +1951,13 @@ MDPlayerRefreshTrackDestinations(MDPlayer *inPlayer)
     /*  Allocate destInfo  */
     inPlayer->destInfo = (MDDestinationInfo **)malloc((num + 1) * sizeof(MDDestinationInfo *));
     if (inPlayer->destInfo == NULL) {
+        inPlayer->destNum = 0;
+        MDPlayerDisposeTrackList(inPlayer);
         MDPlayerUnlock(inPlayer);
+        free(temp);
         return kMDErrorOutOfMemory;
     }
-    memset(inPlayer->destInfo, 0, num * sizeof(MDDestinationInfo *));
+    memset(inPlayer->destInfo, 0, (num + 1) * sizeof(MDDestinationInfo *));
     inPlayer->destNum = 0;
 
     /*  Initialize MDDestinationInfo for necessary destinations  */
@@ -1774,28 +1982,35 @@ MDPlayerRefreshTrackDestinations(MDPlayer *inPlayer)
             }
             if (i == inPlayer->destNum) {
                 /*  New device  */
-                inPlayer->destInfo[i] = MDPlayerNewDestinationInfo(dev);
+                info = MDPlayerNewDestinationInfo(dev);
+                if (info != NULL) {
+                    info->noteOff = MDTrackNew();
+                    info->noteOffPtr = MDPointerNew(info->noteOff);
+                    info->noteOffTick = kMDMaxTick;
+                    if (info->noteOff == NULL || info->noteOffPtr == NULL) {
+                        MDPlayerReleaseDestinationInfo(info);
+                        info = NULL;
+                    }
+                }
+                if (info == NULL)
+                    break;
+                inPlayer->destInfo[i] = info;
                 inPlayer->destNum++;
             }
-            /*  Add this track to the destination info  */
-            info = inPlayer->destInfo[i];
-            if (info->merger == NULL) {
-                info->merger = MDTrackMergerNew();
-                if (info->merger == NULL)
-                    return kMDErrorOutOfMemory;
-            }
-            if (n < num && MDTrackMergerAddTrack(info->merger, track) < 0)
-                return kMDErrorOutOfMemory;
-            info->noteOff = MDTrackNew();
-            info->noteOffPtr = MDPointerNew(info->noteOff);
-            info->noteOffTick = kMDMaxTick;
         }
     }
+    free(temp);
+
+    /*  The events are sent out in the order of the timeline of the sequence  */
+    if (n <= num)
+        sts = kMDErrorOutOfMemory;
+    else if ((sts = MDPlayerUpdateTrackList(inPlayer)) == kMDNoError)
+        sts = MDSequenceGetTimeline(sequence, &entries, &count);
     MDPlayerJumpToTick(inPlayer, 0);
 
     MDPlayerUnlock(inPlayer);
     
-    return kMDNoError;
+    return sts;
 
 #if 0
     /*  Update destIndex[] and destChannel[] */
@@ -1848,19 +2063,23 @@ MDStatus
 MDPlayerJumpToTick(MDPlayer *inPlayer, MDTickType inTick)
 {
     int i;
-    MDCalibratorJumpToTick(inPlayer->calib, inTick);
+    MDPlayerUpdateSnapshot(inPlayer);
     for (i = 0; i < inPlayer->destNum; i++) {
         MDDestinationInfo *info = inPlayer->destInfo[i];
-        info->currentEp = MDTrackMergerJumpToTick(info->merger, inTick, &info->currentTrack);
-        if (info->currentEp != NULL)
-            info->currentTick = MDGetTick(info->currentEp);
-        else info->currentTick = kMDMaxTick;
+        /*  The event is looked up in the timeline when it is needed  */
+        info->index = -1;
+        info->next.tick = inTick;
+        info->next.track = -1;
+        info->next.position = -1;
+        info->currentEp = NULL;
+        info->currentTrack = NULL;
+        info->currentTick = inTick;
         MDTrackClear(info->noteOff);
         MDPointerSetPosition(info->noteOffPtr, 0);
         info->noteOffTick = kMDMaxTick;
     }
     inPlayer->lastTick = inTick;
-	inPlayer->time = MDCalibratorTickToTime(inPlayer->calib, inTick);
+	inPlayer->time = MDPlayerTickToTime(inPlayer, inTick);
 	inPlayer->status = kMDPlayer_ready;
 	return kMDNoError;
 }
@@ -1919,7 +2138,7 @@ MDPlayerStart(MDPlayer *inPlayer)
 		return kMDNoError;
 
 	if (inPlayer->status != kMDPlayer_suspended)
-		MDPlayerPreroll(inPlayer, MDCalibratorTimeToTick(inPlayer->calib, inPlayer->time), 0);
+		MDPlayerPreroll(inPlayer, MDPlayerTimeToTick(inPlayer, inPlayer->time), 0);
 	
 	if (MDSequenceCreateMutex(inPlayer->sequence))
 		return kMDErrorOnSequenceMutex;
@@ -2001,7 +2220,7 @@ MDPlayerStop(MDPlayer *inPlayer)
     /*  Send AllNoteOff (Bn 7B 00) and AllSoundOff (Bn 78 00)  */
     /*	{
      static unsigned char sAllNoteAndSoundOff[] = {0xB0, 0x7B, 0x00, 0xB0, 0x78, 0x00};
-     MDTimeType lastTime = MDCalibratorTickToTime(inPlayer->calib, inPlayer->lastTick);
+     MDTimeType lastTime = MDPlayerTickToTime(inPlayer, inPlayer->lastTick);
      SendMIDIEventsToAllTracks(inPlayer, lastTime, 6, sAllNoteAndSoundOff);
      } */
     StopSoundInAllTracks(inPlayer);
@@ -2153,9 +2372,9 @@ MDPlayerGetTick(MDPlayer *inPlayer)
 {
 	if (inPlayer != NULL) {
 		if ((inPlayer->status == kMDPlayer_playing || inPlayer->isRecording) && gWaitingForTrigger == kMDPlayerTriggerNone) {
-			return MDCalibratorTimeToTick(inPlayer->calib, GetHostTimeInMDTimeType() - inPlayer->startTime);
+			return MDPlayerTimeToTickOnAnyThread(inPlayer, GetHostTimeInMDTimeType() - inPlayer->startTime);
 		} else {
-			return MDCalibratorTimeToTick(inPlayer->calib, inPlayer->time);
+			return MDPlayerTimeToTickOnAnyThread(inPlayer, inPlayer->time);
 		}
 	}
 	return 0;
@@ -2277,7 +2496,7 @@ sMDPlayerBuildKeyswitchRecord(MDPlayer *inPlayer)
     for (i = 1; i < num; i++) {
         MDTrack *track = MDSequenceGetTrack(seq, i);
         MDPointer *pt = MDPointerNew(track);
-        MDEvent *ep;
+        const MDEvent *ep;
         while ((ep = MDPointerForward(pt)) != NULL) {
             if (MDGetTick(ep) > 0)
                 break;
@@ -2310,12 +2529,14 @@ MDPlayerBacktrackEvents(MDPlayer *inPlayer, MDTickType inTick, const int32_t *in
 		lower 16 bits = MDEventKind, upper 16 bits = the 'code' field in MDEvent record.
 		The value -1 is used for termination.  */
 	
-    MDEvent *ep;
+    const MDEvent *ep;
 /*    MDEvent **lastOnlyEvents; */
 	MDDestinationInfo *info;
     int i, channel, num, lastOnlyCount, processedDest;
     static const int32_t sDefaultEventType = { -1 };
     char *ks_record;
+    const MDTimelineEntry *entries;
+    int32_t count;
 
 	if (inEventType == NULL)
 		inEventType = &sDefaultEventType;
@@ -2331,6 +2552,11 @@ MDPlayerBacktrackEvents(MDPlayer *inPlayer, MDTickType inTick, const int32_t *in
     
     /*  Rewind to the top of the sequence  */
     MDPlayerJumpToTick(inPlayer, 0);
+    if (MDPlayerCheckTrackList(inPlayer) != kMDNoError
+        || MDSequenceGetTimeline(inPlayer->sequence, &entries, &count) != kMDNoError)
+        return kMDErrorOutOfMemory;
+    for (num = 0; num < inPlayer->destNum; num++)
+        MDPlayerSeekEvent(inPlayer, num, entries, count, inTick);
     
     /*  Use note-off track for keeping 'last only' events  */
     for (num = 0; num < inPlayer->destNum; num++) {
@@ -2348,7 +2574,7 @@ MDPlayerBacktrackEvents(MDPlayer *inPlayer, MDTickType inTick, const int32_t *in
             int kind, code;
             int32_t n;
             info = inPlayer->destInfo[num];
-            if (info->currentTick < inTick) {
+            if (info->currentEp != NULL) {
                 processedDest++;
                 ep = info->currentEp;
                 /*  Is this event to be sent?  */
@@ -2366,7 +2592,7 @@ MDPlayerBacktrackEvents(MDPlayer *inPlayer, MDTickType inTick, const int32_t *in
                 } else {
                     if (MDGetKind(ep) == kMDEventNote) {
                         /*  Is this a keyswitch?  */
-                        n = MDSequenceFindTrack(inPlayer->sequence, info->currentTrack);
+                        n = entries[info->index].track;
                         if (n >= 1 && ks_record[n * 128 + MDGetCode(ep)] == 1)
                             i = 0;
                         else i = lastOnlyCount;
@@ -2383,7 +2609,8 @@ MDPlayerBacktrackEvents(MDPlayer *inPlayer, MDTickType inTick, const int32_t *in
                     if (i < lastOnlyCount) {
                         /*  Store this event; if the same type of event is already
                             present, then overwrite it  */
-                        MDEvent ev, *ep1;
+                        MDEvent ev;
+                        const MDEvent *ep1;
                         MDEventClear(&ev);
                         MDEventCopy(&ev, ep, 1);
                         channel = (MDTrackGetTrackChannel(info->currentTrack) & 15);
@@ -2407,30 +2634,34 @@ MDPlayerBacktrackEvents(MDPlayer *inPlayer, MDTickType inTick, const int32_t *in
                         }
                     }
                 }
-                info->currentEp = MDTrackMergerForward(info->merger, &(info->currentTrack));
-                info->currentTick = (info->currentEp != NULL ? MDGetTick(info->currentEp) : kMDMaxTick);
+                MDPlayerNextEvent(inPlayer, num, entries, count, inTick);
             }
         }
     } while (processedDest > 0);
     /*  Send the 'last only' events  */
     for (num = 0; num < inPlayer->destNum; num++) {
-        MDEvent *ep2;
+        const MDEvent *ep2;
+        MDEvent offEvent;
         info = inPlayer->destInfo[num];
         MDPointerSetPosition(info->noteOffPtr, -1);
         while ((ep2 = MDPointerForward(info->noteOffPtr)) != NULL) {
             ScheduleMDEventToDevice(info->dev, 0, ep2, 0);
             if (MDGetKind(ep2) == kMDEventNote) {
-                MDSetKind(ep2, kMDEventInternalNoteOff);
-                ScheduleMDEventToDevice(info->dev, 0, ep2, 0);
-                MDSetKind(ep2, kMDEventNote);
+                /*  The note-off is sent from a copy, so that the track is left untouched  */
+                MDEventInit(&offEvent);
+                MDEventCopy(&offEvent, ep2, 1);
+                MDSetKind(&offEvent, kMDEventInternalNoteOff);
+                ScheduleMDEventToDevice(info->dev, 0, &offEvent, 0);
+                MDEventClear(&offEvent);
             }
         }
         MDPointerSetPosition(info->noteOffPtr, 0);
         MDTrackClear(info->noteOff);
         info->noteOffTick = kMDMaxTick;
     }
+    free(ks_record);
     inPlayer->lastTick = inTick;
-    inPlayer->time = MDCalibratorTickToTime(inPlayer->calib, inTick);
+    inPlayer->time = MDPlayerTickToTime(inPlayer, inTick);
     return 0;
 #if 0
 	/*  eventWithDestList[]: record the event to be sent  */
@@ -2600,7 +2831,7 @@ MDPlayerGetRecordedEvents(MDPlayer *inPlayer, MDEvent **outEvent, int *outEventB
 			/*	MDEventInit(outEvent);
 				return kMDErrorNoEvents; */
 			}
-            tick = MDCalibratorTimeToTick(inPlayer->calib, timeStamp);
+            tick = MDPlayerTimeToTickOnAnyThread(inPlayer, timeStamp);
             if (tick < inPlayer->recordingStopTick) {
                 MDSetTick(&tempEvent, tick);
                 if (*outEvent == NULL || eventCount >= *outEventBufSiz) {
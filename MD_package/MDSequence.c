@@ -21,6 +21,8 @@
 #include <string.h>		/*  for memset()  */
 #include <limits.h>		/*  for LONG_MAX  */
 #include <pthread.h>    /*  for mutex  */
+#include <sched.h>		/*  for sched_yield()  */
+#include <unistd.h>		/*  for sysconf()  */
 
 /*  For output warning messages */
 extern int MyAppCallback_showErrorMessage(const char *fmt, ...);
@@ -29,6 +31,32 @@ extern int MyAppCallback_showErrorMessage(const char *fmt, ...);
 #pragma mark ====== Private definitions ======
 #endif
 
+#define kMDTimelineParallelThreshold	65536	/*  The timeline is built in parallel above this number of events  */
+#define kMDTimelineMaxThreads			8
+
+/*  The flattened timeline: the events of all tracks in the order of MDTrackMergerForward(),
+    i.e. sorted by (tick, track, position). It is brought up to date lazily by
+    MDSequenceGetTimeline(), by comparing the edit epochs of the tracks.  */
+typedef struct MDTimeline {
+	MDTimelineEntry *	entries;
+	int32_t			count;		/*  the number of entries  */
+	int32_t			ntracks;	/*  the number of tracks when the timeline was made; -1 if not valid  */
+	MDTrack **		tracks;		/*  the tracks (not retained; only compared with the current ones)  */
+	uint32_t *		epochs;		/*  the edit epochs of the tracks  */
+	int32_t *		nevents;	/*  the number of events of the tracks  */
+} MDTimeline;
+
+/*  A work unit for building the timeline in multiple threads  */
+typedef struct MDTimelineWork {
+	MDTrack **		tracks;		/*  the tracks to extract  */
+	const int32_t *	trackNos;	/*  the track numbers to record in the entries  */
+	MDTimelineEntry *src, *dst;	/*  the entries (extract: dst only; merge: src -> dst)  */
+	const int32_t *	bounds;		/*  the start of each run in src/dst  */
+	int32_t			first, last;	/*  the range of tracks (extract) or pairs of runs (merge)  */
+	int32_t			nruns;		/*  the number of runs (merge)  */
+	MDStatus		status;
+} MDTimelineWork;
+
 struct MDSequence {
 	int32_t			refCount;	/*  the reference count  */
 	int32_t			timebase;	/*  the timebase  */
@@ -38,6 +66,33 @@ struct MDSequence {
 	MDCalibrator *	calib;		/*  the first MDCalibrator related to this sequence  */
 /*	MDMerger *		merger;		*//*  the first MDMerger related to this sequence  */
 	pthread_mutex_t *mutex;		/*  the mutex for lock/unlock  */
+	MDArena *		arena;		/*  the arena for the blocks of the tracks (may be NULL)  */
+	MDTimeline *	timeline;	/*  the flattened timeline (NULL until requested)  */
+	MDCalibratorSnapshot * volatile snapshot;	/*  the published calibrator snapshot (NULL until requested)  */
+	volatile int32_t snapshotReaders;	/*  the number of threads between reading 'snapshot' and retaining it  */
+};
+
+/*  A version in MDHistory: the snapshots of all tracks. The snapshots share the
+    unchanged blocks with each other and with the sequence (see MDTrackNewFromTrack).
+    A track that is not changed from the previous version shares the snapshot object
+    itself with it, so such sharing happens only between adjacent versions.  */
+typedef struct MDHistoryVersion {
+	int32_t			id;			/*  the version ID (increases with each new version)  */
+	int32_t			num;		/*  the number of tracks  */
+	MDTrack **		tracks;		/*  the track snapshots (malloc'ed)  */
+} MDHistoryVersion;
+
+struct MDHistory {
+	int32_t			refCount;	/*  the reference count  */
+	MDSequence *	sequence;	/*  the sequence (retained)  */
+	MDArray *		versions;	/*  the array of MDHistoryVersion (the oldest first)  */
+	int32_t			current;	/*  the index of the version the sequence is currently at  */
+	size_t			budget;		/*  the memory budget in bytes (0: unlimited)  */
+	int32_t			nextID;		/*  the ID of the next version  */
+	int32_t			numBases;	/*  the number of bases  */
+	MDTrack **		bases;		/*  the tracks of the sequence when it last matched the current
+									version (retained)  */
+	uint32_t *		epochs;		/*  the edit epochs of the bases at that time  */
 };
 
 #if 0
@@ -92,6 +147,23 @@ MDSequenceNew(void)
 	return newSequence;
 }
 
+/* --------------------------------------
+	･ MDSequenceNewWithArena
+   -------------------------------------- */
+MDSequence *
+MDSequenceNewWithArena(void)
+{
+	MDSequence *newSequence = MDSequenceNew();
+	if (newSequence == NULL)
+		return NULL;
+	newSequence->arena = MDArenaNew(0);
+	if (newSequence->arena == NULL) {
+		MDSequenceRelease(newSequence);
+		return NULL;
+	}
+	return newSequence;
+}
+
 /* --------------------------------------
 	･ MDSequenceRetain
    -------------------------------------- */
@@ -109,8 +181,21 @@ MDSequenceRelease(MDSequence *inSequence)
 {
 	if (--inSequence->refCount == 0) {
 
+		/*  The tracks need not return their blocks to the arena one by one  */
+		if (inSequence->arena != NULL)
+			MDArenaClose(inSequence->arena);
 		MDSequenceClear(inSequence);
 		MDArrayRelease(inSequence->tracks);
+		if (inSequence->arena != NULL)
+			MDArenaRelease(inSequence->arena);
+		if (inSequence->timeline != NULL) {
+			free(inSequence->timeline->entries);
+			free(inSequence->timeline->tracks);
+			free(inSequence->timeline->epochs);
+			free(inSequence->timeline->nevents);
+			free(inSequence->timeline);
+		}
+		MDCalibratorSnapshotRelease(inSequence->snapshot);
 		
 		/*  Remove the MDCache's from the linked list  */
 	/*  while (inSequence->calib != NULL)
@@ -138,9 +223,19 @@ MDSequenceClear(MDSequence *inSequence)
 		}
 		MDArrayEmpty(inSequence->tracks);
 		inSequence->num = 0;
+		MDSequenceInvalidateTimeline(inSequence);
 	}
 }
 
+/* --------------------------------------
+	･ MDSequenceGetArena
+   -------------------------------------- */
+MDArena *
+MDSequenceGetArena(const MDSequence *inSequence)
+{
+	return inSequence->arena;
+}
+
 #ifdef __MWERKS__
 #pragma mark ====== MDCalibrator manipulations ======
 #endif
@@ -421,6 +516,12 @@ MDSequenceInsertTrack(MDSequence *inSequence, int32_t index, MDTrack *inTrack)
 		inSequence->num++;
 		MDTrackRetain(inTrack);
 
+		/*  An empty track joins the arena of the sequence (the blocks of a non-empty track
+		    cannot be moved)  */
+		if (inSequence->arena != NULL && MDTrackGetArena(inTrack) == NULL)
+			MDTrackSetArena(inTrack, inSequence->arena);
+		MDSequenceInvalidateTimeline(inSequence);
+
         /*  Check track attributes  */
         if (MDTrackGetAttribute(inTrack) & kMDTrackAttributeRecord)
             MDSequenceSetRecordFlagOnTrack(inSequence, index, 1);
@@ -445,6 +546,7 @@ MDSequenceDeleteTrack(MDSequence *inSequence, int32_t index)
 		inSequence->num--;
 		if (track != NULL)
 			MDTrackRelease(track);
+		MDSequenceInvalidateTimeline(inSequence);
         MDSequenceUpdateMuteBySoloFlag(inSequence);
 		return index;
 	} else return -1;
@@ -465,6 +567,38 @@ MDSequenceReplaceTrack(MDSequence *inSequence, int32_t index, MDTrack *inTrack)
     else return n;
 }
 
+/*  Build a new MDCalibratorSnapshot and publish it. If inForce is zero, nothing is done
+    when the published one is still current.  */
+static MDStatus
+MDSequencePublishCalibratorSnapshot(MDSequence *inSequence, int inForce)
+{
+	MDCalibratorSnapshot *snap, *oldSnap;
+	MDTrack *track;
+	if (inSequence == NULL)
+		return kMDErrorBadParameter;
+	track = MDSequenceGetTrack(inSequence, 0);
+	if (track == NULL)
+		return kMDErrorBadParameter;
+	if (!inForce && MDCalibratorSnapshotIsCurrent(inSequence->snapshot, track, inSequence->timebase))
+		return kMDNoError;
+	snap = MDCalibratorSnapshotNew(track, inSequence->timebase);
+	if (snap == NULL)
+		return kMDErrorOutOfMemory;
+
+	/*  Swap the pointer atomically. A reader may have read the old pointer and not retained
+	    it yet; wait for such readers before releasing it. Only this (non-realtime) side
+	    waits, and the readers never block.  */
+	do {
+		oldSnap = inSequence->snapshot;
+	} while (!__sync_bool_compare_and_swap(&inSequence->snapshot, oldSnap, snap));
+	while (__sync_fetch_and_add(&inSequence->snapshotReaders, 0) != 0)
+		sched_yield();
+
+	/*  The readers that retained the old snapshot keep using it until they release it  */
+	MDCalibratorSnapshotRelease(oldSnap);
+	return kMDNoError;
+}
+
 /* --------------------------------------
 	･ MDSequenceResetCalibrators
    -------------------------------------- */
@@ -475,6 +609,42 @@ MDSequenceResetCalibrators(MDSequence *inSequence)
 	for (calib = inSequence->calib; calib != NULL; calib = MDCalibratorNextInList(calib)) {
 		MDCalibratorReset(calib);
 	}
+	/*  Republish the snapshot if somebody is using it. Like the maps of the calibrators,
+	    it is rebuilt unconditionally: the caller may have edited the conductor track
+	    without going through MDPointerCurrentMutable(), which the edit epoch misses.  */
+	if (inSequence->snapshot != NULL)
+		MDSequencePublishCalibratorSnapshot(inSequence, 1);
+}
+
+/* --------------------------------------
+	･ MDSequenceUpdateCalibratorSnapshot
+   -------------------------------------- */
+MDStatus
+MDSequenceUpdateCalibratorSnapshot(MDSequence *inSequence)
+{
+	return MDSequencePublishCalibratorSnapshot(inSequence, 0);
+}
+
+/* --------------------------------------
+	･ MDSequenceCopyCalibratorSnapshot
+   -------------------------------------- */
+MDCalibratorSnapshot *
+MDSequenceCopyCalibratorSnapshot(MDSequence *inSequence)
+{
+	MDCalibratorSnapshot *snap;
+	if (inSequence == NULL)
+		return NULL;
+	__sync_fetch_and_add(&inSequence->snapshotReaders, 1);
+	snap = __atomic_load_n(&inSequence->snapshot, __ATOMIC_ACQUIRE);
+	MDCalibratorSnapshotRetain(snap);
+	__sync_fetch_and_sub(&inSequence->snapshotReaders, 1);
+	if (snap == NULL) {
+		/*  The first request  */
+		if (MDSequenceUpdateCalibratorSnapshot(inSequence) != kMDNoError)
+			return NULL;
+		return MDSequenceCopyCalibratorSnapshot(inSequence);
+	}
+	return snap;
 }
 
 #ifdef __MWERKS__
@@ -511,6 +681,8 @@ MDSequenceSingleChannelMode(MDSequence *inSequence, int separate)
 			if (nnch <= 1)
 				continue;
 			memset(ntrack, 0, sizeof(ntrack));
+			if ((sts = MDTrackLoad(track)) != kMDNoError)
+				return sts;
 			ntrack[0] = MDTrackNewFromTrack(track);  /*  Duplicate  */
 			if (ntrack[0] == NULL)
 				return kMDErrorOutOfMemory;
@@ -519,7 +691,7 @@ MDSequenceSingleChannelMode(MDSequence *inSequence, int separate)
 			if (pt == NULL || pset == NULL)
 				return kMDErrorOutOfMemory;
 			for (i = 15; i >= 1; i--) {
-				MDEvent *ep;
+				const MDEvent *ep;
 				if (nch[i] == 0)
 					continue;
 				MDPointerSetPosition(pt, -1);
@@ -694,6 +866,856 @@ MDSequenceTryLock(MDSequence *inSequence)
 	else return -1;
 }
 
+#ifdef __MWERKS__
+#pragma mark ====== Flattened timeline ======
+#endif
+
+/*  Returns non-zero if a comes before b in the timeline  */
+static inline int
+sMDTimelineLess(const MDTimelineEntry *a, const MDTimelineEntry *b)
+{
+	if (a->tick != b->tick)
+		return a->tick < b->tick;
+	if (a->track != b->track)
+		return a->track < b->track;
+	return a->position < b->position;
+}
+
+/*  Merge the sorted runs src[0..n1-1] and src[n1..n1+n2-1] into dst  */
+static void
+sMDTimelineMergeRuns(const MDTimelineEntry *src, MDTimelineEntry *dst, int32_t n1, int32_t n2)
+{
+	const MDTimelineEntry *p1 = src, *e1 = src + n1, *p2 = src + n1, *e2 = src + n1 + n2;
+	while (p1 < e1 && p2 < e2) {
+		if (sMDTimelineLess(p2, p1))
+			*dst++ = *p2++;
+		else *dst++ = *p1++;
+	}
+	while (p1 < e1)
+		*dst++ = *p1++;
+	while (p2 < e2)
+		*dst++ = *p2++;
+}
+
+/*  Extract the entries of the tracks work->first..work->last-1  */
+static void *
+sMDTimelineExtractEntry(void *arg)
+{
+	MDTimelineWork *work = (MDTimelineWork *)arg;
+	MDTickType *ticks;
+	int32_t i, j, n, maxn;
+	maxn = 0;
+	for (i = work->first; i < work->last; i++) {
+		n = work->bounds[i + 1] - work->bounds[i];
+		if (n > maxn)
+			maxn = n;
+	}
+	ticks = (MDTickType *)malloc(sizeof(MDTickType) * (maxn > 0 ? maxn : 1));
+	if (ticks == NULL) {
+		work->status = kMDErrorOutOfMemory;
+		return NULL;
+	}
+	work->status = kMDNoError;
+	for (i = work->first; i < work->last; i++) {
+		MDTimelineEntry *ep = work->dst + work->bounds[i];
+		n = work->bounds[i + 1] - work->bounds[i];
+		if (MDTrackCopyTicks(work->tracks[i], ticks, n) != n) {
+			/*  The track could not be loaded, or has changed under us  */
+			work->status = kMDErrorInternalError;
+			break;
+		}
+		for (j = 0; j < n; j++, ep++) {
+			ep->tick = ticks[j];
+			ep->track = work->trackNos[i];
+			ep->position = j;
+		}
+	}
+	free(ticks);
+	return NULL;
+}
+
+/*  Merge the pairs of runs work->first..work->last-1  */
+static void *
+sMDTimelineMergeEntry(void *arg)
+{
+	MDTimelineWork *work = (MDTimelineWork *)arg;
+	int32_t i, n1, n2;
+	for (i = work->first; i < work->last; i++) {
+		n1 = work->bounds[i * 2 + 1] - work->bounds[i * 2];
+		n2 = (i * 2 + 1 < work->nruns ? work->bounds[i * 2 + 2] - work->bounds[i * 2 + 1] : 0);
+		sMDTimelineMergeRuns(work->src + work->bounds[i * 2], work->dst + work->bounds[i * 2], n1, n2);
+	}
+	work->status = kMDNoError;
+	return NULL;
+}
+
+/*  Run the work units; the current thread takes the first one  */
+static MDStatus
+sMDTimelineRun(void *(*inEntry)(void *), MDTimelineWork *works, int32_t nworks)
+{
+	pthread_t threads[kMDTimelineMaxThreads];
+	char started[kMDTimelineMaxThreads];
+	int32_t i;
+	MDStatus sts = kMDNoError;
+	for (i = 0; i < nworks; i++)
+		started[i] = (i > 0 && pthread_create(&threads[i], NULL, inEntry, &works[i]) == 0);
+	for (i = 0; i < nworks; i++) {
+		if (!started[i])
+			(*inEntry)(&works[i]);
+	}
+	for (i = 0; i < nworks; i++) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		if (works[i].status != kMDNoError)
+			sts = works[i].status;
+	}
+	return sts;
+}
+
+/*  Build the sorted entries of the given tracks. The events of each track are extracted
+    and the per-track runs are merged pairwise, both in multiple threads for a large
+    number of events. *outEntries is malloc'ed (NULL if there are no events).  */
+static MDStatus
+sMDTimelineBuild(MDTrack **inTracks, const int32_t *inTrackNos, int32_t ntracks, MDTimelineEntry **outEntries, int32_t *outCount)
+{
+	MDTimelineWork works[kMDTimelineMaxThreads];
+	int32_t *bounds;
+	MDTimelineEntry *entries, *buf, *tmp;
+	int32_t i, j, k, total, nruns, npairs, nworks;
+	long ncpu;
+	MDStatus sts;
+
+	*outEntries = NULL;
+	*outCount = 0;
+	bounds = (int32_t *)malloc(sizeof(int32_t) * (ntracks + 1));
+	if (bounds == NULL)
+		return kMDErrorOutOfMemory;
+	total = 0;
+	for (i = 0; i < ntracks; i++) {
+		bounds[i] = total;
+		total += MDTrackGetNumberOfEvents(inTracks[i]);
+	}
+	bounds[ntracks] = total;
+	if (total == 0) {
+		free(bounds);
+		return kMDNoError;
+	}
+	entries = (MDTimelineEntry *)malloc(sizeof(MDTimelineEntry) * total);
+	buf = (ntracks > 1 ? (MDTimelineEntry *)malloc(sizeof(MDTimelineEntry) * total) : NULL);
+	if (entries == NULL || (ntracks > 1 && buf == NULL)) {
+		free(entries);
+		free(buf);
+		free(bounds);
+		return kMDErrorOutOfMemory;
+	}
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	nworks = (ncpu > kMDTimelineMaxThreads ? kMDTimelineMaxThreads : (ncpu < 1 ? 1 : (int32_t)ncpu));
+	if (total < kMDTimelineParallelThreshold)
+		nworks = 1;
+
+	/*  Extract the tracks, dividing them so that each thread gets about the same number of events  */
+	for (i = j = 0; i < nworks && j < ntracks; i++) {
+		works[i].tracks = inTracks;
+		works[i].trackNos = inTrackNos;
+		works[i].dst = entries;
+		works[i].bounds = bounds;
+		works[i].first = j;
+		while (j < ntracks && (j == works[i].first || bounds[j] < (int64_t)total * (i + 1) / nworks))
+			j++;
+		if (i == nworks - 1)
+			j = ntracks;
+		works[i].last = j;
+	}
+	sts = sMDTimelineRun(sMDTimelineExtractEntry, works, i);
+
+	/*  Merge the runs pairwise, distributing the pairs to the threads  */
+	nruns = ntracks;
+	while (sts == kMDNoError && nruns > 1) {
+		npairs = (nruns + 1) / 2;
+		k = (npairs < nworks ? npairs : nworks);
+		for (i = 0; i < k; i++) {
+			works[i].src = entries;
+			works[i].dst = buf;
+			works[i].bounds = bounds;
+			works[i].nruns = nruns;
+			works[i].first = (int32_t)((int64_t)npairs * i / k);
+			works[i].last = (int32_t)((int64_t)npairs * (i + 1) / k);
+		}
+		sts = sMDTimelineRun(sMDTimelineMergeEntry, works, k);
+		for (i = 0; i < npairs; i++)
+			bounds[i] = bounds[i * 2];
+		bounds[npairs] = total;
+		nruns = npairs;
+		tmp = entries;
+		entries = buf;
+		buf = tmp;
+	}
+	free(buf);
+	free(bounds);
+	if (sts != kMDNoError) {
+		free(entries);
+		return sts;
+	}
+	*outEntries = entries;
+	*outCount = total;
+	return kMDNoError;
+}
+
+/*  Replace the entries of the changed tracks. inChanged[i] is non-zero if track i has changed.  */
+static MDStatus
+sMDTimelinePatch(MDTimeline *inTimeline, MDTrack **inTracks, const char *inChanged, int32_t ntracks)
+{
+	MDTrack **tracks;
+	int32_t *trackNos;
+	MDTimelineEntry *entries, *newEntries;
+	int32_t i, j, n, count;
+	MDStatus sts;
+
+	tracks = (MDTrack **)malloc(sizeof(MDTrack *) * ntracks);
+	trackNos = (int32_t *)malloc(sizeof(int32_t) * ntracks);
+	if (tracks == NULL || trackNos == NULL) {
+		free(tracks);
+		free(trackNos);
+		return kMDErrorOutOfMemory;
+	}
+	for (i = n = 0; i < ntracks; i++) {
+		if (inChanged[i]) {
+			tracks[n] = inTracks[i];
+			trackNos[n++] = i;
+		}
+	}
+	sts = sMDTimelineBuild(tracks, trackNos, n, &newEntries, &count);
+	free(tracks);
+	free(trackNos);
+	if (sts != kMDNoError)
+		return sts;
+
+	/*  Remove the old entries of the changed tracks  */
+	entries = inTimeline->entries;
+	for (i = j = 0; i < inTimeline->count; i++) {
+		if (!inChanged[entries[i].track])
+			entries[j++] = entries[i];
+	}
+	if (j + count > inTimeline->count) {
+		entries = (MDTimelineEntry *)realloc(entries, sizeof(MDTimelineEntry) * (j + count));
+		if (entries == NULL) {
+			free(newEntries);
+			return kMDErrorOutOfMemory;
+		}
+		inTimeline->entries = entries;
+	}
+
+	/*  Merge the new entries from the end, so that no extra buffer is needed  */
+	n = j + count;
+	inTimeline->count = n;
+	i = j - 1;
+	j = count - 1;
+	while (j >= 0) {
+		if (i >= 0 && sMDTimelineLess(&newEntries[j], &entries[i]))
+			entries[--n] = entries[i--];
+		else entries[--n] = newEntries[j--];
+	}
+	free(newEntries);
+	return kMDNoError;
+}
+
+/* --------------------------------------
+	･ MDSequenceInvalidateTimeline
+   -------------------------------------- */
+void
+MDSequenceInvalidateTimeline(MDSequence *inSequence)
+{
+	if (inSequence->timeline != NULL)
+		inSequence->timeline->ntracks = -1;
+}
+
+/* --------------------------------------
+	･ MDSequenceGetTimeline
+   -------------------------------------- */
+MDStatus
+MDSequenceGetTimeline(MDSequence *inSequence, const MDTimelineEntry **outEntries, int32_t *outCount)
+{
+	MDTimeline *tl = inSequence->timeline;
+	MDTrack **tracks;
+	char *changed;
+	int32_t i, n, nchanged, nedited;
+	MDStatus sts;
+
+	if (tl == NULL) {
+		tl = (MDTimeline *)calloc(sizeof(MDTimeline), 1);
+		if (tl == NULL)
+			return kMDErrorOutOfMemory;
+		tl->ntracks = -1;
+		inSequence->timeline = tl;
+	}
+	n = inSequence->num;
+	tracks = (MDTrack **)malloc(sizeof(MDTrack *) * (n + 1));
+	changed = (char *)malloc(n + 1);
+	if (tracks == NULL || changed == NULL) {
+		free(tracks);
+		free(changed);
+		return kMDErrorOutOfMemory;
+	}
+	nchanged = nedited = 0;
+	for (i = 0; i < n; i++) {
+		tracks[i] = MDSequenceGetTrack(inSequence, i);
+		if (tl->ntracks == n && tracks[i] != tl->tracks[i])
+			tl->ntracks = -1;	/*  The track has been replaced  */
+		changed[i] = (tl->ntracks != n
+			|| MDTrackGetEditEpoch(tracks[i]) != tl->epochs[i]
+			|| MDTrackGetNumberOfEvents(tracks[i]) != tl->nevents[i]);
+		if (changed[i]) {
+			nchanged++;
+			if (tl->ntracks == n)
+				nedited += tl->nevents[i] + MDTrackGetNumberOfEvents(tracks[i]);
+		}
+	}
+
+	sts = kMDNoError;
+	if (tl->ntracks == n && nchanged == 0) {
+		/*  Up to date  */
+	} else if (tl->ntracks == n && nedited <= tl->count / 2) {
+		/*  Only a small part has changed  */
+		sts = sMDTimelinePatch(tl, tracks, changed, n);
+	} else {
+		/*  Rebuild from scratch  */
+		MDTimelineEntry *entries;
+		int32_t count, *trackNos;
+		trackNos = (int32_t *)malloc(sizeof(int32_t) * (n + 1));
+		if (trackNos == NULL)
+			sts = kMDErrorOutOfMemory;
+		else {
+			for (i = 0; i < n; i++)
+				trackNos[i] = i;
+			sts = sMDTimelineBuild(tracks, trackNos, n, &entries, &count);
+			free(trackNos);
+		}
+		if (sts == kMDNoError) {
+			free(tl->entries);
+			tl->entries = entries;
+			tl->count = count;
+		}
+	}
+	if (sts == kMDNoError && (tl->ntracks != n || nchanged > 0)) {
+		/*  Record the state of the tracks  */
+		if (tl->ntracks != n) {
+			void *p1 = realloc(tl->tracks, sizeof(MDTrack *) * (n + 1));
+			void *p2 = realloc(tl->epochs, sizeof(uint32_t) * (n + 1));
+			void *p3 = realloc(tl->nevents, sizeof(int32_t) * (n + 1));
+			if (p1 != NULL)
+				tl->tracks = (MDTrack **)p1;
+			if (p2 != NULL)
+				tl->epochs = (uint32_t *)p2;
+			if (p3 != NULL)
+				tl->nevents = (int32_t *)p3;
+			if (p1 == NULL || p2 == NULL || p3 == NULL)
+				sts = kMDErrorOutOfMemory;
+		}
+		if (sts == kMDNoError) {
+			for (i = 0; i < n; i++) {
+				tl->tracks[i] = tracks[i];
+				tl->epochs[i] = MDTrackGetEditEpoch(tracks[i]);
+				tl->nevents[i] = MDTrackGetNumberOfEvents(tracks[i]);
+			}
+			tl->ntracks = n;
+		}
+	}
+	free(tracks);
+	free(changed);
+	if (sts != kMDNoError) {
+		tl->ntracks = -1;
+		return sts;
+	}
+	if (outEntries != NULL)
+		*outEntries = tl->entries;
+	if (outCount != NULL)
+		*outCount = tl->count;
+	return kMDNoError;
+}
+
+/* --------------------------------------
+	･ MDSequenceGetTimelineIndexForTick
+   -------------------------------------- */
+int32_t
+MDSequenceGetTimelineIndexForTick(MDSequence *inSequence, MDTickType inTick)
+{
+	const MDTimelineEntry *entries;
+	int32_t lo, hi, mid, count;
+	if (MDSequenceGetTimeline(inSequence, &entries, &count) != kMDNoError)
+		return -1;
+	lo = 0;
+	hi = count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (entries[mid].tick < inTick)
+			lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+#ifdef __MWERKS__
+#pragma mark -
+#pragma mark ======   MDHistory functions   ======
+#endif
+
+/* --------------------------------------
+	･ MDHistoryVersionDispose
+   -------------------------------------- */
+static void
+MDHistoryVersionDispose(MDHistoryVersion *inVersion)
+{
+	int32_t i;
+	for (i = 0; i < inVersion->num; i++) {
+		if (inVersion->tracks[i] != NULL)
+			MDTrackRelease(inVersion->tracks[i]);
+	}
+	free(inVersion->tracks);
+	inVersion->tracks = NULL;
+	inVersion->num = 0;
+}
+
+/* --------------------------------------
+	･ MDHistoryDisposeBases
+   -------------------------------------- */
+static void
+MDHistoryDisposeBases(MDHistory *inHistory)
+{
+	int32_t i;
+	for (i = 0; i < inHistory->numBases; i++)
+		MDTrackRelease(inHistory->bases[i]);
+	free(inHistory->bases);
+	free(inHistory->epochs);
+	inHistory->bases = NULL;
+	inHistory->epochs = NULL;
+	inHistory->numBases = 0;
+}
+
+/* --------------------------------------
+	･ MDHistorySyncBases
+   -------------------------------------- */
+/*  Record the tracks of the sequence and their edit epochs; the sequence now matches the
+    current version  */
+static MDStatus
+MDHistorySyncBases(MDHistory *inHistory)
+{
+	MDSequence *sequence = inHistory->sequence;
+	int32_t i, n = sequence->num;
+	MDHistoryDisposeBases(inHistory);
+	inHistory->bases = (MDTrack **)malloc(sizeof(MDTrack *) * (n > 0 ? n : 1));
+	inHistory->epochs = (uint32_t *)malloc(sizeof(uint32_t) * (n > 0 ? n : 1));
+	if (inHistory->bases == NULL || inHistory->epochs == NULL) {
+		MDHistoryDisposeBases(inHistory);  /*  Every track will look changed  */
+		return kMDErrorOutOfMemory;
+	}
+	for (i = 0; i < n; i++) {
+		inHistory->bases[i] = MDSequenceGetTrack(sequence, i);
+		MDTrackRetain(inHistory->bases[i]);
+		inHistory->epochs[i] = MDTrackGetEditEpoch(inHistory->bases[i]);
+	}
+	inHistory->numBases = n;
+	return kMDNoError;
+}
+
+/* --------------------------------------
+	･ MDHistoryTrackIsUnchanged
+   -------------------------------------- */
+/*  Returns non-zero if inTrack (the index-th track of the sequence) still has the contents
+    of inSnapshot, the index-th track of the current version  */
+static int
+MDHistoryTrackIsUnchanged(const MDHistory *inHistory, int32_t index, MDTrack *inTrack, const MDTrack *inSnapshot)
+{
+	return (inSnapshot != NULL && index < inHistory->numBases && inHistory->bases[index] == inTrack
+		&& inHistory->epochs[index] == MDTrackGetEditEpoch(inTrack)
+		&& MDTrackHasSameProperties(inTrack, inSnapshot));
+}
+
+/* --------------------------------------
+	･ MDHistoryVersionMake
+   -------------------------------------- */
+/*  inCurrent is the current version (NULL if none), and inLast is the version the new one
+    will follow. Only the tracks changed since inCurrent are copied; the others share the
+    snapshots with inCurrent, as long as inLast has them too (so that the sharing stays
+    between adjacent versions).  */
+static MDStatus
+MDHistoryVersionMake(MDHistoryVersion *outVersion, const MDHistory *inHistory, const MDHistoryVersion *inCurrent, const MDHistoryVersion *inLast)
+{
+	int32_t i;
+	MDTrack *track, *snapshot;
+	MDSequence *sequence = inHistory->sequence;
+	outVersion->num = 0;
+	outVersion->tracks = (MDTrack **)calloc(sizeof(MDTrack *), (sequence->num > 0 ? sequence->num : 1));
+	if (outVersion->tracks == NULL)
+		return kMDErrorOutOfMemory;
+	outVersion->id = inHistory->nextID;
+	outVersion->num = sequence->num;
+	for (i = 0; i < sequence->num; i++) {
+		track = MDSequenceGetTrack(sequence, i);
+		snapshot = (inCurrent != NULL && i < inCurrent->num ? inCurrent->tracks[i] : NULL);
+		if (MDHistoryTrackIsUnchanged(inHistory, i, track, snapshot)
+		&& (inLast == inCurrent || (i < inLast->num && inLast->tracks[i] == snapshot))) {
+			MDTrackRetain(snapshot);
+			outVersion->tracks[i] = snapshot;
+			continue;
+		}
+		/*  Only the block headers are allocated; the events are shared with the sequence.
+		    A track not loaded yet stays so, sharing the source of the events.  */
+		outVersion->tracks[i] = MDTrackNewFromTrack(track);
+		if (outVersion->tracks[i] == NULL) {
+			MDHistoryVersionDispose(outVersion);
+			return kMDErrorOutOfMemory;
+		}
+		MDTrackSetAttribute(outVersion->tracks[i], MDTrackGetAttribute(track));
+	}
+	return kMDNoError;
+}
+
+/* --------------------------------------
+	･ MDHistoryVersionRestore
+   -------------------------------------- */
+/*  Bring the sequence from inCurrent (the current version) to inVersion. Only the tracks
+    that differ are touched.  */
+static MDStatus
+MDHistoryVersionRestore(MDHistory *inHistory, const MDHistoryVersion *inVersion, const MDHistoryVersion *inCurrent)
+{
+	int32_t i;
+	MDTrack *track;
+	MDSequence *sequence = inHistory->sequence;
+	MDStatus sts;
+
+	/*  Remove the extra tracks  */
+	while (sequence->num > inVersion->num)
+		MDSequenceDeleteTrack(sequence, sequence->num - 1);
+
+	/*  Restore the existing tracks in place, so that the MDTrack's referred from
+	    elsewhere (and their MDPointer's) remain valid  */
+	for (i = 0; i < sequence->num; i++) {
+		track = MDSequenceGetTrack(sequence, i);
+		if (i < inCurrent->num && inCurrent->tracks[i] == inVersion->tracks[i]
+		&& MDHistoryTrackIsUnchanged(inHistory, i, track, inCurrent->tracks[i]))
+			continue;
+		sts = MDTrackRestoreFromTrack(track, inVersion->tracks[i]);
+		if (sts != kMDNoError)
+			return sts;
+	}
+
+	/*  Add the missing tracks  */
+	for ( ; i < inVersion->num; i++) {
+		track = MDTrackNewFromTrack(inVersion->tracks[i]);
+		if (track == NULL)
+			return kMDErrorOutOfMemory;
+		MDTrackSetAttribute(track, MDTrackGetAttribute(inVersion->tracks[i]));
+		MDSequenceInsertTrack(sequence, i, track);
+		MDTrackRelease(track);
+	}
+
+	MDSequenceResetCalibrators(sequence);
+	return kMDNoError;
+}
+
+/* --------------------------------------
+	･ MDHistoryVersionGetMemoryUsage
+   -------------------------------------- */
+/*  inNext is the next version (NULL if none). The snapshots shared with it are counted
+    there, so that the sum over all versions counts each snapshot once, and the size of
+    the oldest version is what is freed when it is dropped.  */
+static size_t
+MDHistoryVersionGetMemoryUsage(const MDHistoryVersion *inVersion, const MDHistoryVersion *inNext)
+{
+	int32_t i;
+	size_t size = sizeof(MDHistoryVersion) + inVersion->num * sizeof(MDTrack *);
+	for (i = 0; i < inVersion->num; i++) {
+		if (inNext == NULL || i >= inNext->num || inNext->tracks[i] != inVersion->tracks[i])
+			size += MDTrackGetMemoryUsage(inVersion->tracks[i]);
+	}
+	return size;
+}
+
+/* --------------------------------------
+	･ MDHistoryTrim
+   -------------------------------------- */
+static void
+MDHistoryTrim(MDHistory *inHistory)
+{
+	MDHistoryVersion *vp;
+	size_t total, size;
+	if (inHistory->budget == 0)
+		return;
+	/*  Drop the oldest versions first; the current version is always kept. The total is
+	    computed once, and the size of each dropped version is subtracted from it. The
+	    remaining versions then own larger shares of the events that were shared with the
+	    dropped one, so the total is computed again when the estimate fits in the budget.  */
+	while (inHistory->current > 0 && (total = MDHistoryGetMemoryUsage(inHistory)) > inHistory->budget) {
+		do {
+			vp = (MDHistoryVersion *)MDArrayFetchPtr(inHistory->versions, 0);
+			size = MDHistoryVersionGetMemoryUsage(vp, (MDHistoryVersion *)MDArrayFetchPtr(inHistory->versions, 1));
+			total = (total > size ? total - size : 0);
+			MDHistoryVersionDispose(vp);
+			MDArrayDelete(inHistory->versions, 0, 1);
+			inHistory->current--;
+		} while (inHistory->current > 0 && total > inHistory->budget);
+	}
+}
+
+/* --------------------------------------
+	･ MDHistoryNew
+   -------------------------------------- */
+MDHistory *
+MDHistoryNew(MDSequence *inSequence, size_t inBudget)
+{
+	MDHistory *newHistory;
+	MDHistoryVersion version;
+	if (inSequence == NULL)
+		return NULL;
+	newHistory = (MDHistory *)malloc(sizeof(*newHistory));
+	if (newHistory == NULL)
+		return NULL;	/* out of memory */
+	memset(newHistory, 0, sizeof(MDHistory));
+	newHistory->refCount = 1;
+	newHistory->versions = MDArrayNew(sizeof(MDHistoryVersion));
+	if (newHistory->versions == NULL) {
+		free(newHistory);
+		return NULL;
+	}
+	newHistory->sequence = inSequence;
+	MDSequenceRetain(inSequence);
+	newHistory->budget = inBudget;
+
+	/*  Record the initial state  */
+	if (MDHistoryVersionMake(&version, newHistory, NULL, NULL) != kMDNoError
+	|| MDArrayInsert(newHistory->versions, 0, 1, &version) != kMDNoError) {
+		MDHistoryVersionDispose(&version);
+		MDHistoryRelease(newHistory);
+		return NULL;
+	}
+	newHistory->current = 0;
+	newHistory->nextID++;
+	MDHistorySyncBases(newHistory);
+	return newHistory;
+}
+
+/* --------------------------------------
+	･ MDHistoryRetain
+   -------------------------------------- */
+void
+MDHistoryRetain(MDHistory *inHistory)
+{
+	inHistory->refCount++;
+}
+
+/* --------------------------------------
+	･ MDHistoryRelease
+   -------------------------------------- */
+void
+MDHistoryRelease(MDHistory *inHistory)
+{
+	int32_t i, n;
+	if (--inHistory->refCount == 0) {
+		n = MDArrayCount(inHistory->versions);
+		for (i = 0; i < n; i++)
+			MDHistoryVersionDispose((MDHistoryVersion *)MDArrayFetchPtr(inHistory->versions, i));
+		MDArrayRelease(inHistory->versions);
+		MDHistoryDisposeBases(inHistory);
+		MDSequenceRelease(inHistory->sequence);
+		free(inHistory);
+	}
+}
+
+/* --------------------------------------
+	･ MDHistoryCommit
+   -------------------------------------- */
+MDStatus
+MDHistoryCommit(MDHistory *inHistory)
+{
+	MDHistoryVersion *vp;
+	int32_t i, n;
+
+	/*  Discard the redo versions  */
+	n = MDArrayCount(inHistory->versions);
+	for (i = inHistory->current + 1; i < n; i++) {
+		vp = (MDHistoryVersion *)MDArrayFetchPtr(inHistory->versions, i);
+		MDHistoryVersionDispose(vp);
+	}
+	if (n > inHistory->current + 1)
+		MDArrayDelete(inHistory->versions, inHistory->current + 1, n - inHistory->current - 1);
+
+	return MDHistoryAppend(inHistory);
+}
+
+/* --------------------------------------
+	･ MDHistoryAppend
+   -------------------------------------- */
+MDStatus
+MDHistoryAppend(MDHistory *inHistory)
+{
+	MDHistoryVersion version, *vp, *lastp;
+	MDStatus sts;
+	int32_t n;
+
+	/*  Take a new version after the last one; the unchanged tracks share the snapshots
+	    with the current one  */
+	n = MDArrayCount(inHistory->versions);
+	vp = (MDHistoryVersion *)MDArrayFetchPtr(inHistory->versions, inHistory->current);
+	lastp = (MDHistoryVersion *)MDArrayFetchPtr(inHistory->versions, n - 1);
+	sts = MDHistoryVersionMake(&version, inHistory, vp, lastp);
+	if (sts != kMDNoError)
+		return sts;
+	sts = MDArrayInsert(inHistory->versions, n, 1, &version);
+	if (sts != kMDNoError) {
+		MDHistoryVersionDispose(&version);
+		return sts;
+	}
+	inHistory->current = n;
+	inHistory->nextID++;
+	MDHistorySyncBases(inHistory);
+	MDHistoryTrim(inHistory);
+	return kMDNoError;
+}
+
+/* --------------------------------------
+	･ MDHistoryUndo
+   -------------------------------------- */
+MDStatus
+MDHistoryUndo(MDHistory *inHistory)
+{
+	MDHistoryVersion *vp;
+	MDStatus sts;
+	if (!MDHistoryCanUndo(inHistory))
+		return kMDErrorInternalError;
+	vp = (MDHistoryVersion *)MDArrayFetchPtr(inHistory->versions, inHistory->current - 1);
+	sts = MDHistoryVersionRestore(inHistory, vp, (MDHistoryVersion *)MDArrayFetchPtr(inHistory->versions, inHistory->current));
+	if (sts == kMDNoError) {
+		inHistory->current--;
+		MDHistorySyncBases(inHistory);
+	}
+	return sts;
+}
+
+/* --------------------------------------
+	･ MDHistoryRedo
+   -------------------------------------- */
+MDStatus
+MDHistoryRedo(MDHistory *inHistory)
+{
+	MDHistoryVersion *vp;
+	MDStatus sts;
+	if (!MDHistoryCanRedo(inHistory))
+		return kMDErrorInternalError;
+	vp = (MDHistoryVersion *)MDArrayFetchPtr(inHistory->versions, inHistory->current + 1);
+	sts = MDHistoryVersionRestore(inHistory, vp, (MDHistoryVersion *)MDArrayFetchPtr(inHistory->versions, inHistory->current));
+	if (sts == kMDNoError) {
+		inHistory->current++;
+		MDHistorySyncBases(inHistory);
+	}
+	return sts;
+}
+
+/* --------------------------------------
+	･ MDHistoryRestoreVersion
+   -------------------------------------- */
+MDStatus
+MDHistoryRestoreVersion(MDHistory *inHistory, int32_t inVersionID)
+{
+	MDHistoryVersion *vp;
+	MDStatus sts;
+	int32_t i, n;
+	n = MDArrayCount(inHistory->versions);
+	for (i = 0; i < n; i++) {
+		vp = (MDHistoryVersion *)MDArrayFetchPtr(inHistory->versions, i);
+		if (vp->id == inVersionID)
+			break;
+	}
+	if (i >= n)
+		return kMDErrorInternalError;  /*  Discarded or never existed  */
+	sts = MDHistoryVersionRestore(inHistory, vp, (MDHistoryVersion *)MDArrayFetchPtr(inHistory->versions, inHistory->current));
+	if (sts == kMDNoError) {
+		inHistory->current = i;
+		MDHistorySyncBases(inHistory);
+	}
+	return sts;
+}
+
+/* --------------------------------------
+	･ MDHistoryGetCurrentVersionID
+   -------------------------------------- */
+int32_t
+MDHistoryGetCurrentVersionID(const MDHistory *inHistory)
+{
+	return ((MDHistoryVersion *)MDArrayFetchPtr(inHistory->versions, inHistory->current))->id;
+}
+
+/* --------------------------------------
+	･ MDHistoryHasChanges
+   -------------------------------------- */
+int
+MDHistoryHasChanges(const MDHistory *inHistory)
+{
+	MDHistoryVersion *vp;
+	MDSequence *sequence = inHistory->sequence;
+	int32_t i;
+	vp = (MDHistoryVersion *)MDArrayFetchPtr(inHistory->versions, inHistory->current);
+	if (vp->num != sequence->num)
+		return 1;
+	for (i = 0; i < sequence->num; i++) {
+		if (!MDHistoryTrackIsUnchanged(inHistory, i, MDSequenceGetTrack(sequence, i), vp->tracks[i]))
+			return 1;
+	}
+	return 0;
+}
+
+/* --------------------------------------
+	･ MDHistoryCanUndo
+   -------------------------------------- */
+int
+MDHistoryCanUndo(const MDHistory *inHistory)
+{
+	return (inHistory->current > 0);
+}
+
+/* --------------------------------------
+	･ MDHistoryCanRedo
+   -------------------------------------- */
+int
+MDHistoryCanRedo(const MDHistory *inHistory)
+{
+	return (inHistory->current < MDArrayCount(inHistory->versions) - 1);
+}
+
+/* --------------------------------------
+	･ MDHistoryGetNumberOfVersions
+   -------------------------------------- */
+int32_t
+MDHistoryGetNumberOfVersions(const MDHistory *inHistory)
+{
+	return MDArrayCount(inHistory->versions);
+}
+
+/* --------------------------------------
+	･ MDHistorySetBudget
+   -------------------------------------- */
+void
+MDHistorySetBudget(MDHistory *inHistory, size_t inBudget)
+{
+	inHistory->budget = inBudget;
+	MDHistoryTrim(inHistory);
+}
+
+/* --------------------------------------
+	･ MDHistoryGetMemoryUsage
+   -------------------------------------- */
+size_t
+MDHistoryGetMemoryUsage(const MDHistory *inHistory)
+{
+	int32_t i, n;
+	size_t size = 0;
+	n = MDArrayCount(inHistory->versions);
+	for (i = 0; i < n; i++)
+		size += MDHistoryVersionGetMemoryUsage((MDHistoryVersion *)MDArrayFetchPtr(inHistory->versions, i),
+			(i + 1 < n ? (MDHistoryVersion *)MDArrayFetchPtr(inHistory->versions, i + 1) : NULL));
+	return size;
+}
+
 #ifdef __MWERKS__
 #pragma mark ====== MDMerger manipulations ======
 #endif
@@ -22,9 +22,20 @@
     （複数可）から成る。 */
 typedef struct MDSequence		MDSequence;
 
+/*  シーケンスの編集履歴（アンドゥ／リドゥ用）。 */
+typedef struct MDHistory		MDHistory;
+
 /*  シーケンス中の全トラック中の全イベントをティック順に取り出すための仕掛け。 */
 /* typedef struct MDMerger			MDMerger; */
 
+/*  全トラックのイベントを１列に並べたタイムラインの要素。tick が同じ場合はトラック番号の
+    小さいもの、さらにトラック内の位置の小さいものが先に来る（MDTrackMergerForward() と同じ順序）。 */
+typedef struct MDTimelineEntry {
+	MDTickType		tick;		/*  イベントの tick  */
+	int32_t			track;		/*  トラック番号  */
+	int32_t			position;	/*  トラック内の位置  */
+} MDTimelineEntry;
+
 /*  コピー／ペースト実装のための内部データ  */
 typedef struct MDCatalogTrack {
 	int originalTrackNo;
@@ -60,6 +71,15 @@ extern "C" {
     を使用すること。 */
 MDSequence *	MDSequenceNew(void);
 
+/*  MDSequenceNew() と同じだが、シーケンス専用の MDArena を持つ。このシーケンスに挿入された空の
+    トラック（と MDSequenceReadSMF() で読み込まれたトラック）のブロックはこの MDArena から確保され、
+    シーケンスが release される時にはブロックを個別に解放せず、MDArena ごとまとめて解放する。
+    メッセージはトラック間・クリップボード間で共有されるので、MDArena には置かれない。 */
+MDSequence *	MDSequenceNewWithArena(void);
+
+/*  シーケンスの MDArena を返す。MDSequenceNew() で作成したシーケンスでは NULL。 */
+MDArena *	MDSequenceGetArena(const MDSequence *inSequence);
+
 /*  MDSequence の retain/release。 */
 void	MDSequenceRetain(MDSequence *inSequence);
 void	MDSequenceRelease(MDSequence *inSequence);
@@ -132,7 +152,23 @@ typedef int	(*MDSequenceCallback)(float, void *);
     この時 MDSequence の内容は空になる。 */
 MDStatus	MDSequenceReadSMF(MDSequence *inSequence, STREAM stream, MDSequenceCallback callback, void *cbdata);
 
-/*  ファイル（ストリーム）に SMF を書き出す。途中で失敗したら中断してエラーコードを返す。 */
+/*  メモリ上の SMF データを読み込む。MDSequenceReadSMF() もデータストリームやファイルストリーム
+    （mmap できる場合）についてはこの方法で、ストリームを経由せずにバッファから直接デコードする。
+    この時、トラックのデータが十分大きければ、各 MTrk チャンクを複数のスレッドで並列にデコードする。
+    コールバックは呼び出したスレッドからのみ呼ばれる。 */
+MDStatus	MDSequenceReadSMFFromBuffer(MDSequence *inSequence, const void *inData, size_t inSize, MDSequenceCallback callback, void *cbdata);
+
+/*  MDSequenceReadSMF() と同じだが、各トラックのイベントは最初にアクセスされた時にデコードする
+    （MDTrackSetLoader() を参照）。読み込み時にはイベントの数を数えるだけなので、大きなファイルを
+    早く開ける。トラック名、デバイス名、長さ、チャンネルごとのイベント数はすぐに確定する。
+    読み込まれていないトラックは自分のチャンクのデータだけをコピーして保持し、読み込まれた時に解放する。
+    読み込み後にストリームを閉じてよい。 */
+MDStatus	MDSequenceReadSMFLazily(MDSequence *inSequence, STREAM stream, MDSequenceCallback callback, void *cbdata);
+
+/*  ファイル（ストリーム）に SMF を書き出す。途中で失敗したら中断してエラーコードを返す。
+    各トラックはメモリ上でチャンク全体を作ってから１回の書き込みで出力するので、ストリームは
+    シークできなくてもよい。イベントが十分多ければ、トラックを複数のスレッドで並列に変換する。
+    この時もコールバックは呼び出したスレッドからのみ呼ばれ、err_stream へのメッセージはトラック順に書かれる。 */
 MDStatus	MDSequenceWriteSMF(MDSequence *inSequence, STREAM stream, MDSequenceCallback callback, void *cbdata, STREAM err_stream);
 
 /*  ファイル（ストリーム）に選択されたイベントを SMF として書き出す。i 番目のトラックの選択は psetArray[i] で指示され、これが NULL ならそのトラックはスキップ、有効な IntGroup ならそれが指定するイベントを書き出し、(IntGroup *)(-1) ならそのトラック中のすべてのイベントを書き出す。IntGroup を指定したときは、end-of-track を選択しているかどうかを eotSelectFlags[i] で指示することができる。 */
@@ -148,9 +184,38 @@ MDCatalog  *MDSequenceReadCatalog(STREAM stream);
 void		MDSequenceAttachCalibrator(MDSequence *inSequence, MDCalibrator *inCalib);
 void		MDSequenceDetachCalibrator(MDSequence *inSequence, MDCalibrator *inCalib);
 
-/*  MDCalibrator をすべてリセットする。 */
+/*  MDCalibrator をすべてリセットする。MDSequenceCopyCalibratorSnapshot() が一度でも呼ばれていれば、
+    MDCalibratorSnapshot も（編集エポックにかかわらず）作り直して公開する。 */
 void		MDSequenceResetCalibrators(MDSequence *inSequence);
 
+/*  コンダクタートラックが前回から編集されていれば MDCalibratorSnapshot を作り直して公開する。
+    編集の判定は編集エポックで行うので、MDPointerCurrentMutable() を通さずにイベントを直接書き換えた
+    場合は MDSequenceResetCalibrators() を呼ぶこと。
+    公開は不可分に行われ、古いスナップショットを retain しているスレッドはそのまま使い続けられる。
+    シーケンスを編集するスレッドから呼ぶこと。 */
+MDStatus	MDSequenceUpdateCalibratorSnapshot(MDSequence *inSequence);
+
+/*  公開中の MDCalibratorSnapshot を retain して返す（まだなければ作成する）。どのスレッドからでも
+    呼べるが、最初の呼び出しはシーケンスを編集するスレッドから行うこと。公開済みであれば、ロックを
+    取らず待つこともないので、リアルタイムのスレッドから呼んでもよい。使い終わったら
+    MDCalibratorSnapshotRelease() すること。コンダクタートラックが無い場合は NULL を返す。 */
+MDCalibratorSnapshot *	MDSequenceCopyCalibratorSnapshot(MDSequence *inSequence);
+
+/*  全トラックのイベントを (tick, トラック番号, 位置) の順に並べたタイムラインを返す。
+    タイムラインはシーケンスにキャッシュされ、前回から編集されたトラック（編集エポックで
+    判定する）の分だけが差し替えられる。最初の構築や大きな変更の後では、トラックごとの
+    取り出しとマージを複数のスレッドで行う。*outEntries はシーケンスが所有し、次にこの関数を
+    呼ぶか、トラックを挿入・削除するまで有効。再生中に呼ぶ場合は MDSequenceLock() で保護すること。 */
+MDStatus	MDSequenceGetTimeline(MDSequence *inSequence, const MDTimelineEntry **outEntries, int32_t *outCount);
+
+/*  タイムラインの中で tick が inTick 以上の最初の要素のインデックスを返す（二分探索）。
+    すべての要素が inTick より小さければ要素数を、メモリ不足の場合は -1 を返す。 */
+int32_t		MDSequenceGetTimelineIndexForTick(MDSequence *inSequence, MDTickType inTick);
+
+/*  キャッシュされたタイムラインを無効にする。編集エポックを変えずにイベントの tick を
+    直接書き換えた場合に呼ぶこと（トラックの挿入・削除では自動的に呼ばれる）。 */
+void		MDSequenceInvalidateTimeline(MDSequence *inSequence);
+
 /*  Lock/Unlock MDSequence (for multithread application)  */
 MDStatus	MDSequenceCreateMutex(MDSequence *inSequence);
 MDStatus	MDSequenceDisposeMutex(MDSequence *inSequence);
@@ -158,6 +223,65 @@ void		MDSequenceLock(MDSequence *inSequence);
 void		MDSequenceUnlock(MDSequence *inSequence);
 int			MDSequenceTryLock(MDSequence *inSequence);
 
+/* -------------------------------------------------------------------
+    MDHistory functions
+   -------------------------------------------------------------------  */
+
+/*  シーケンスの編集履歴を作成する。各バージョンは全トラックのスナップショットで、
+    変更されていないブロックは他のバージョンおよびシーケンス自身と共有される。まだ読み込まれて
+    いないトラックは、読み込まずに読み込み元を共有する。
+    inBudget は履歴が使うメモリの上限（バイト数、0 なら無制限）。作成時の状態が
+    最初のバージョンとして記録される。メモリ不足の場合は NULL を返す。 */
+MDHistory *	MDHistoryNew(MDSequence *inSequence, size_t inBudget);
+
+/*  MDHistory の retain/release。 */
+void		MDHistoryRetain(MDHistory *inHistory);
+void		MDHistoryRelease(MDHistory *inHistory);
+
+/*  シーケンスの現在の状態を新しいバージョンとして記録する。編集のたびに呼び出すこと。
+    前のバージョンから変更された（編集エポックまたはイベント以外の属性が変わった）トラックだけが
+    新たにスナップショットを取られ、それ以外のトラックは前のバージョンのスナップショットを共有する。
+    イベントを MDPointerCurrentMutable() を通さずに書き換えた場合は変更が検出されない。
+    リドゥ可能なバージョンは捨てられる。メモリ使用量が上限を超えた場合は、古い
+    バージョンから順に捨てられる（現在のバージョンは捨てられない）。 */
+MDStatus	MDHistoryCommit(MDHistory *inHistory);
+
+/*  MDHistoryCommit() と同様だが、リドゥ可能なバージョンを捨てずに、すべてのバージョンの後に
+    新しいバージョンを加える。アンドゥ・リドゥを外部（NSUndoManager など）で管理して、
+    MDHistoryRestoreVersion() でバージョンを指定して戻す場合に使う。 */
+MDStatus	MDHistoryAppend(MDHistory *inHistory);
+
+/*  １つ前（後）のバージョンにシーケンスを戻す。シーケンス内の MDTrack はそのまま
+    使われ、内容が異なるトラックだけが置き換えられる。再生中の場合は MDSequenceLock() で保護すること。 */
+MDStatus	MDHistoryUndo(MDHistory *inHistory);
+MDStatus	MDHistoryRedo(MDHistory *inHistory);
+
+/*  ID が inVersionID のバージョンにシーケンスを戻す。そのバージョンが捨てられていた場合は
+    エラーを返す。アンドゥ・リドゥを外部（NSUndoManager など）で管理する場合に使う。
+    現在のバージョンより後のバージョンは、次の MDHistoryCommit() まで残る（MDHistoryAppend()
+    では捨てられない）。 */
+MDStatus	MDHistoryRestoreVersion(MDHistory *inHistory, int32_t inVersionID);
+
+/*  現在のバージョンの ID を返す。ID はバージョンが作られるたびに増える。 */
+int32_t		MDHistoryGetCurrentVersionID(const MDHistory *inHistory);
+
+/*  シーケンスが現在のバージョンから変更されていれば non-zero を返す。 */
+int			MDHistoryHasChanges(const MDHistory *inHistory);
+
+/*  アンドゥ（リドゥ）が可能なら non-zero を返す。 */
+int			MDHistoryCanUndo(const MDHistory *inHistory);
+int			MDHistoryCanRedo(const MDHistory *inHistory);
+
+/*  記録されているバージョンの数を返す。 */
+int32_t		MDHistoryGetNumberOfVersions(const MDHistory *inHistory);
+
+/*  メモリ使用量の上限を変更する。必要なら古いバージョンが捨てられる。 */
+void		MDHistorySetBudget(MDHistory *inHistory, size_t inBudget);
+
+/*  履歴が使用しているメモリ量の概算（バイト数）を返す。共有されているイベントは
+    共有数で割った量として数える。 */
+size_t		MDHistoryGetMemoryUsage(const MDHistory *inHistory);
+
 #if 0
 /* -------------------------------------------------------------------
     MDMerger functions
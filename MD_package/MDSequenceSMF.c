@@ -20,14 +20,33 @@
 #include <string.h>		/*  for memset()  */
 #include <stdio.h>
 #include <ctype.h>
+#include <pthread.h>	/*  for the parallel track decoding and encoding  */
+#include <unistd.h>		/*  for sysconf()  */
+#include <sys/time.h>	/*  for gettimeofday()  */
 
 #define DEBUG_PRINT	0
 
+#define kMDSMFReadMaxThreads		16		/*  the max number of threads to decode the tracks  */
+#define kMDSMFReadParallelThreshold	65536	/*  the min total size of the tracks to decode in parallel  */
+#define kMDSMFWriteMaxThreads		16		/*  the max number of threads to encode the tracks  */
+#define kMDSMFWriteParallelThreshold	16384	/*  the min total number of events to encode in parallel  */
+#define kMDSMFProgressInterval		50		/*  the interval (msec) of the callback while waiting for the threads  */
+
+typedef struct MDSMFThreadGroup	MDSMFThreadGroup;
+typedef struct MDSMFTrackJob	MDSMFTrackJob;
+typedef struct MDSMFReadPool	MDSMFReadPool;
+typedef struct MDSMFTrackScan	MDSMFTrackScan;
+typedef struct MDSMFWriteJob	MDSMFWriteJob;
+typedef struct MDSMFWritePool	MDSMFWritePool;
+
 /*  An internal struct for converting SMF to MD format  */
 typedef struct MDSMFConvert		MDSMFConvert;
 struct MDSMFConvert {
 	/*  The information for the whole sequence  */
 	STREAM			stream;
+	const unsigned char *buf;		/*  the whole input in memory (NULL: read through stream)  */
+	size_t			bufsize;		/*  the size of buf  */
+	size_t			bufpos;			/*  the current read position in buf  */
 	MDSequence *	sequence;		/*  the resulting sequence  */
 	int32_t			timebase;		/*  the SMF timebase  */
 	int32_t			max_tick;		/*  the maximum tick (the length of the sequence)  */
@@ -40,7 +59,6 @@ struct MDSMFConvert {
 	int32_t			deltatime;		/*  the deltatime of the current event  */
 	unsigned char	status;			/*  running status  */
     unsigned char	track_channel;	/*  track channel (16 if the sequence is multi-track mode)  */
-	int32_t			pos;			/*  the file position where the track size is to be written  */
 
 	MDSequenceCallback callback;	/*  A callback function. Periodically called, and abort if 0 */
 	int32_t			filesize;		/*  total file size  */
@@ -48,6 +66,104 @@ struct MDSMFConvert {
 
     /*  Store error message  */
     STREAM          err_stream;
+
+	/*  The parallel track decoding (NULL if the tracks are read one by one)  */
+	MDSMFReadPool *	pool;			/*  the state shared by the threads  */
+	MDSMFTrackJob *	job;			/*  the track chunk being decoded by this thread  */
+	size_t			reported;		/*  the buffer position already counted in pool->progress  */
+
+	/*  The lazy reading (NULL if the events are decoded at once)  */
+	unsigned char	lazy;			/*  non-zero if the tracks get loaders instead of the events  */
+	MDSMFTrackScan *scan;			/*  the header pass of the current track  */
+	unsigned char	loading;		/*  non-zero while loading a track on first access; the warnings are
+									    then queued by MDQueueErrorMessage(), as any thread may do this  */
+
+	/*  The track being encoded: the whole chunk is built in memory, and written at once  */
+	unsigned char *	out;			/*  the encoded chunk, including the chunk header  */
+	size_t			outsize;		/*  the number of bytes in out  */
+	size_t			outcapacity;	/*  the allocated size of out  */
+	MDSMFWriteJob *	wjob;			/*  the track being encoded  */
+	MDSMFWritePool *wpool;			/*  the state shared by the encoding threads (NULL if not in parallel)  */
+};
+
+/*  The header pass of a lazily loaded track: the events are counted but not kept  */
+struct MDSMFTrackScan {
+	int32_t			nch[18];		/*  the number of events in each channel (as in MDTrack)  */
+	MDTrack *		prelude;		/*  the events up to the first MIDI event, for guessing the names  */
+	unsigned char	midiSeen;		/*  non-zero after the first channel or sysex event  */
+};
+
+/*  The loader of a lazily loaded track (see MDTrackSetLoader). The track data is a private
+    copy, so that the file can be overwritten while the track is not loaded, and the memory
+    goes away track by track as they are loaded.  */
+typedef struct MDSMFLazyTrack {
+	size_t			size;			/*  the size of the track data  */
+	int32_t			track_index;
+	unsigned char	status;			/*  the running status at the beginning of the track  */
+	unsigned char	data[4];		/*  the track data (variable length)  */
+} MDSMFLazyTrack;
+
+/*  The worker threads started for the parallel decoding or encoding. The calling thread
+    waits for them with MDSMFThreadGroupWait(), so that it can keep calling the callback.  */
+struct MDSMFThreadGroup {
+	pthread_mutex_t	mutex;
+	pthread_cond_t	finished;		/*  signaled when a thread finishes  */
+	volatile int32_t running;		/*  the number of threads not finished yet  */
+};
+
+/*  One MTrk chunk, found before the tracks are decoded in parallel  */
+struct MDSMFTrackJob {
+	size_t			header;			/*  the offset of the chunk header  */
+	size_t			start;			/*  the offset of the track data  */
+	size_t			end;			/*  the end of the track data, as declared in the chunk header  */
+	size_t			endpos;			/*  the position where the decoding actually stopped  */
+	MDTrack *		track;			/*  the decoded track  */
+	MDStatus		result;			/*  the result of the decoding  */
+	unsigned char	status;			/*  the running status at the end of the track  */
+	unsigned char	inheritsStatus;	/*  non-zero if the track relies on the running status of the previous track  */
+	int32_t *		orphanTicks;	/*  the ticks of the orphaned note-offs, reported later in order  */
+	int32_t			norphans, maxorphans;
+};
+
+/*  The state shared by the decoding threads  */
+struct MDSMFReadPool {
+	MDSMFTrackJob *	jobs;
+	int32_t *		order;			/*  the job indices in the order of taking (larger chunks first)  */
+	int32_t			njobs;
+	volatile int32_t next;			/*  the next index to order[]  */
+	volatile int32_t stop;			/*  jobs after this index need not be decoded  */
+	volatile int32_t cancel;		/*  set when the callback requested to abort  */
+	volatile int32_t progress;		/*  the number of bytes decoded so far  */
+	size_t			base;			/*  the position of the first chunk  */
+	MDSMFThreadGroup group;			/*  the worker threads  */
+};
+
+/*  One track to be written by MDSequenceWriteSMFWithSelection()  */
+struct MDSMFWriteJob {
+	MDTrack *		track;
+	IntGroup *		pset;			/*  the selection; NULL if the whole track is written  */
+	char			eotSelected;
+	unsigned char	track_channel;	/*  the channel of the track (16 if the sequence is multi-track mode)  */
+	char			devname[256];	/*  looked up beforehand, as MDPlayer is not thread-safe  */
+	int32_t			nevents;		/*  the number of events to be written  */
+	unsigned char *	out;			/*  the encoded chunk (taken over from MDSMFConvert)  */
+	size_t			outsize;
+	STREAM			err_stream;		/*  the error messages of this track, copied to the real one in order  */
+	MDStatus		result;
+	unsigned char	encoded;		/*  non-zero if the track is already encoded  */
+};
+
+/*  The state shared by the encoding threads  */
+struct MDSMFWritePool {
+	MDSMFWriteJob *	jobs;
+	int32_t *		order;			/*  the job indices in the order of taking (larger tracks first)  */
+	int32_t			njobs;
+	volatile int32_t next;			/*  the next index to order[]  */
+	volatile int32_t stop;			/*  jobs after this index need not be encoded  */
+	volatile int32_t cancel;		/*  set when the callback requested to abort  */
+	volatile int32_t progress;		/*  the number of events encoded so far  */
+	int32_t			total;			/*  the total number of events to be encoded  */
+	MDSMFThreadGroup group;			/*  the worker threads  */
 };
 
 /*  SMF コントロールで特別扱いするもの  */
@@ -108,8 +224,160 @@ MDSequenceSMFConvertError(MDSMFConvert *cref, const char *fmt, ...)
     }
 }
 
+#pragma mark ====== Worker threads ======
+
+static MDStatus
+MDSMFThreadGroupInit(MDSMFThreadGroup *inGroup)
+{
+	if (pthread_mutex_init(&inGroup->mutex, NULL) != 0)
+		return kMDErrorOutOfMemory;
+	if (pthread_cond_init(&inGroup->finished, NULL) != 0) {
+		pthread_mutex_destroy(&inGroup->mutex);
+		return kMDErrorOutOfMemory;
+	}
+	inGroup->running = 0;
+	return kMDNoError;
+}
+
+static void
+MDSMFThreadGroupDispose(MDSMFThreadGroup *inGroup)
+{
+	pthread_cond_destroy(&inGroup->finished);
+	pthread_mutex_destroy(&inGroup->mutex);
+}
+
+/*  Start a thread in the group. Returns non-zero if the thread is started.  */
+static int
+MDSMFThreadGroupStart(MDSMFThreadGroup *inGroup, pthread_t *outThread, void *(*inEntry)(void *), void *inArg)
+{
+	__sync_add_and_fetch(&inGroup->running, 1);
+	if (pthread_create(outThread, NULL, inEntry, inArg) == 0)
+		return 1;
+	__sync_sub_and_fetch(&inGroup->running, 1);
+	return 0;
+}
+
+/*  Called by a thread of the group when it has nothing more to do  */
+static void
+MDSMFThreadGroupLeave(MDSMFThreadGroup *inGroup)
+{
+	pthread_mutex_lock(&inGroup->mutex);
+	__sync_sub_and_fetch(&inGroup->running, 1);
+	pthread_cond_broadcast(&inGroup->finished);
+	pthread_mutex_unlock(&inGroup->mutex);
+}
+
+/*  Wait at most inMsec milliseconds for the threads of the group to finish. Returns non-zero
+    if all of them have finished.  */
+static int
+MDSMFThreadGroupWait(MDSMFThreadGroup *inGroup, int32_t inMsec)
+{
+	struct timeval tv;
+	struct timespec ts;
+	int n;
+	gettimeofday(&tv, NULL);
+	ts.tv_sec = tv.tv_sec + inMsec / 1000;
+	ts.tv_nsec = tv.tv_usec * 1000 + (long)(inMsec % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	pthread_mutex_lock(&inGroup->mutex);
+	while (inGroup->running > 0) {
+		if (pthread_cond_timedwait(&inGroup->finished, &inGroup->mutex, &ts) != 0)
+			break;
+	}
+	n = inGroup->running;
+	pthread_mutex_unlock(&inGroup->mutex);
+	return (n == 0);
+}
+
 #pragma mark ====== Reading SMF ======
 
+/*  Input functions. When the whole input is in memory (a data stream or a memory-mapped
+    file), the bytes are taken directly from the buffer with bounds checks; otherwise
+    they are read through the stream.  */
+
+static inline int
+MDSequenceReadSMFGetc(MDSMFConvert *cref)
+{
+	if (cref->buf != NULL)
+		return (cref->bufpos < cref->bufsize ? cref->buf[cref->bufpos++] : EOF);
+	return GETC(cref->stream);
+}
+
+/*  Read a variable length number. Returns 0 if EOF is reached.  */
+static inline int
+MDSequenceReadSMFVarLength(MDSMFConvert *cref, int32_t *outValue)
+{
+	int32_t val = 0;
+	int n;
+	if (cref->buf != NULL) {
+		while (cref->bufpos < cref->bufsize) {
+			n = cref->buf[cref->bufpos++];
+			val = (val << 7) + (n & 0x7f);
+			if ((n & 0x80) == 0) {
+				*outValue = val;
+				return 1;
+			}
+		}
+		*outValue = val;
+		return 0;
+	}
+	while ((n = GETC(cref->stream)) != EOF) {
+		val = (val << 7) + (n & 0x7f);
+		if ((n & 0x80) == 0)
+			break;
+	}
+	*outValue = val;
+	return (n != EOF);
+}
+
+/*  Read length bytes. Returns the number of bytes actually read.  */
+static size_t
+MDSequenceReadSMFBytes(MDSMFConvert *cref, void *ptr, size_t length)
+{
+	if (cref->buf != NULL) {
+		if (length > cref->bufsize - cref->bufpos)
+			length = cref->bufsize - cref->bufpos;
+		memcpy(ptr, cref->buf + cref->bufpos, length);
+		cref->bufpos += length;
+		return length;
+	}
+	return FREAD_(ptr, length, cref->stream);
+}
+
+/*  Read a 4-byte tag and a 4-byte big-endian chunk size. Returns 0 if EOF is reached.  */
+static int
+MDSequenceReadSMFChunkHeader(MDSMFConvert *cref, char *outTag, int32_t *outSize)
+{
+	unsigned char s[8];
+	if (MDSequenceReadSMFBytes(cref, s, 8) < 8)
+		return 0;
+	memcpy(outTag, s, 4);
+	outTag[4] = 0;
+	*outSize = ((int32_t)s[4] << 24) + ((int32_t)s[5] << 16) + ((int32_t)s[6] << 8) + s[7];
+	return 1;
+}
+
+static int32_t
+MDSequenceReadSMFTell(MDSMFConvert *cref)
+{
+	if (cref->buf != NULL)
+		return (int32_t)cref->bufpos;
+	return (int32_t)FTELL(cref->stream);
+}
+
+static void
+MDSequenceReadSMFSkip(MDSMFConvert *cref, int32_t size)
+{
+	if (cref->buf != NULL) {
+		if (size < 0 || (size_t)size > cref->bufsize - cref->bufpos)
+			cref->bufpos = cref->bufsize;
+		else cref->bufpos += size;
+	} else FSEEK(cref->stream, size, SEEK_CUR);
+}
+
 static MDStatus	
 MDSequenceReadSMFReadMessage(MDSMFConvert *cref, MDEvent *eref)
 {
@@ -117,7 +385,11 @@ MDSequenceReadSMFReadMessage(MDSMFConvert *cref, MDEvent *eref)
 	unsigned char *msg;
 
 	/*  Read the message length  */
-	if (MDReadStreamFormat(cref->stream, "w", &length) != 1)
+	if (!MDSequenceReadSMFVarLength(cref, &length))
+		return kMDErrorUnexpectedEOF;
+
+	/*  A truncated message: fail before allocating the memory  */
+	if (cref->buf != NULL && (size_t)length > cref->bufsize - cref->bufpos)
 		return kMDErrorUnexpectedEOF;
 
 	/*  Allocate the memory  */
@@ -127,17 +399,76 @@ MDSequenceReadSMFReadMessage(MDSMFConvert *cref, MDEvent *eref)
 	if (MDSetMessageLength(eref, length) < 0)
 		return kMDErrorOutOfMemory;
 	
+	/*  The payload goes directly into the message storage  */
 	msg = MDGetMessagePtr(eref, NULL);
 	if (MDGetKind(eref) == kMDEventSysex) {
 		msg[0] = 0xf0;
-		if (FREAD_(msg + 1, length - 1, cref->stream) < length - 1)
+		if (MDSequenceReadSMFBytes(cref, msg + 1, length - 1) < length - 1)
 			return kMDErrorUnexpectedEOF;
 	} else {
 		/*  For messages other than Sysex, the data can be always treated as a C string
 			as MDSetMessageLength() automatically appends a terminating null byte  */
-		if (FREAD_(msg, length, cref->stream) < length)
+		if (MDSequenceReadSMFBytes(cref, msg, length) < length)
 			return kMDErrorUnexpectedEOF;
 	}
+
+	/*  Share the buffer with the identical messages (e.g. repeated GS/XG sysex)  */
+	MDInternMessage(eref);
+	return kMDNoError;
+}
+
+/*  Skip a message without reading it (in the header pass of the lazy reading)  */
+static MDStatus
+MDSequenceReadSMFSkipMessage(MDSMFConvert *cref)
+{
+	int32_t length;
+	if (!MDSequenceReadSMFVarLength(cref, &length))
+		return kMDErrorUnexpectedEOF;
+	if ((size_t)length > cref->bufsize - cref->bufpos)
+		return kMDErrorUnexpectedEOF;
+	cref->bufpos += length;
+	return kMDNoError;
+}
+
+/*  Skip a channel event in the header pass of the lazy reading, and count it. The note-offs
+    are not counted, as they are merged into the note-ons when the track is loaded.  */
+static MDStatus
+MDSequenceReadSMFSkipChannelEvent(MDSMFConvert *cref, int n)
+{
+	int status, ndata;
+	const unsigned char *p;
+
+	if (n < 0x80) {
+		/*  running status: n is the first data byte  */
+		status = cref->status;
+		ndata = 0;
+	} else {
+		status = cref->status = (unsigned char)n;
+		ndata = 1;
+	}
+	switch (status & 0xf0) {
+		case kMDEventSMFNoteOff:
+		case kMDEventSMFNoteOn:
+		case kMDEventSMFKeyPressure:
+		case kMDEventSMFControl:
+		case kMDEventSMFPitchBend:
+			ndata++;
+			break;
+		case kMDEventSMFProgram:
+		case kMDEventSMFChannelPressure:
+			break;
+		default:
+			return kMDErrorUnknownChannelEvent;
+	}
+	if ((size_t)ndata > cref->bufsize - cref->bufpos) {
+		cref->bufpos = cref->bufsize;
+		return kMDErrorUnexpectedEOF;
+	}
+	p = cref->buf + cref->bufpos;
+	cref->bufpos += ndata;
+	if ((status & 0xf0) == kMDEventSMFNoteOff || ((status & 0xf0) == kMDEventSMFNoteOn && p[ndata - 1] == 0))
+		return kMDNoError;
+	cref->scan->nch[status & 0x0f]++;
 	return kMDNoError;
 }
 
@@ -150,7 +481,7 @@ MDSequenceReadSMFMetaEvent(MDSMFConvert *cref, MDEvent *eref)
 	int n;
 	unsigned char s[8], *metaDataPtr;
 	
-	n = GETC(cref->stream);
+	n = MDSequenceReadSMFGetc(cref);
 	if (n == EOF)
 		return kMDErrorUnexpectedEOF;
 	MDSetCode(eref, n);
@@ -160,7 +491,7 @@ MDSequenceReadSMFMetaEvent(MDSMFConvert *cref, MDEvent *eref)
 			if (cref->max_tick < cref->tick)
 				cref->max_tick = cref->tick;
 			/*  Read the message length (should be always zero, but not checked)  */
-			if (MDReadStreamFormat(cref->stream, "w", &length) != 1) {
+			if (!MDSequenceReadSMFVarLength(cref, &length)) {
 				result = kMDErrorUnexpectedEOF;
 				break;
 			}
@@ -169,7 +500,7 @@ MDSequenceReadSMFMetaEvent(MDSMFConvert *cref, MDEvent *eref)
 		case kMDMetaDuration: {
 			MDTickType duration;
 			MDSetKind(eref, kMDEventInternalDuration);
-			if (MDReadStreamFormat(cref->stream, "ww", &length, &duration) != 2) {
+			if (!MDSequenceReadSMFVarLength(cref, &length) || !MDSequenceReadSMFVarLength(cref, &duration)) {
 				result = kMDErrorUnexpectedEOF;
 				break;
 			}
@@ -182,7 +513,7 @@ MDSequenceReadSMFMetaEvent(MDSMFConvert *cref, MDEvent *eref)
 		case kMDMetaTimeSignature:
 		case kMDMetaKey:
 			MDSetKind(eref, kMDEventMeta);
-			if (MDReadStreamFormat(cref->stream, "w", &length) != 1) {
+			if (!MDSequenceReadSMFVarLength(cref, &length)) {
 				result = kMDErrorUnexpectedEOF;
 				break;
 			}
@@ -191,7 +522,7 @@ MDSequenceReadSMFMetaEvent(MDSMFConvert *cref, MDEvent *eref)
 				break;
 			}
 			memset(s, 0, sizeof(s));
-			if (FREAD_(s, length, cref->stream) < length) {
+			if (MDSequenceReadSMFBytes(cref, s, length) < length) {
 				result = kMDErrorUnexpectedEOF;
 				break;
 			}
@@ -239,80 +570,89 @@ MDSequenceReadSMFMetaEvent(MDSMFConvert *cref, MDEvent *eref)
 	return result;
 }
 
-static int
-MDSequenceReadOneChar(void *ptr)
-{
-    return GETC((STREAM)ptr);
-}
-
 /*  Read one channel event. n is the first byte (status byte, or the first data
-    byte if running status is used)  */
+    byte if running status is used). The data bytes are decoded inline; when the
+    whole input is in memory, they are taken from the buffer after a single bounds
+    check.  */
 static MDStatus
 MDSequenceReadSMFChannelEvent(MDSMFConvert *cref, MDEvent *eref, int n)
 {
-    return MDEventFromMIDIMessage(eref, n, cref->status, MDSequenceReadOneChar, cref->stream, &(cref->status));
-
-#if 0
-	MDStatus result = kMDNoError;
-	int data1, data2;
-	unsigned char ch;		/*  MIDI channel  */
+	int status, data1, data2, ndata;
+	const unsigned char *p;
 
 	/*  Get the status byte  */
 	if (n < 0x80) {
 		/*  running status  */
+		status = cref->status;
 		data1 = n;
-		n = cref->status;
+		ndata = 0;
+	} else {
+		status = cref->status = (unsigned char)n;
+		data1 = 0;
+		ndata = 1;
+	}
+
+	/*  The number of data bytes to read  */
+	switch (status & 0xf0) {
+		case kMDEventSMFNoteOff:
+		case kMDEventSMFNoteOn:
+		case kMDEventSMFKeyPressure:
+		case kMDEventSMFControl:
+		case kMDEventSMFPitchBend:
+			ndata++;
+			break;
+		case kMDEventSMFProgram:
+		case kMDEventSMFChannelPressure:
+			break;
+		default:
+			return kMDErrorUnknownChannelEvent;
+	}
+
+	/*  Get the data bytes  */
+	data2 = 0;
+	if (cref->buf != NULL) {
+		if ((size_t)ndata > cref->bufsize - cref->bufpos) {
+			cref->bufpos = cref->bufsize;
+			return kMDErrorUnexpectedEOF;
+		}
+		p = cref->buf + cref->bufpos;
+		cref->bufpos += ndata;
+		if (n >= 0x80)
+			data1 = *p++;
+		if (ndata == 2 || (ndata == 1 && n < 0x80))
+			data2 = *p;
 	} else {
-		cref->status = n;
-		data1 = GETC(cref->stream);
-		if (data1 == EOF)
+		if (n >= 0x80 && (data1 = GETC(cref->stream)) == EOF)
+			return kMDErrorUnexpectedEOF;
+		if ((ndata == 2 || (ndata == 1 && n < 0x80)) && (data2 = GETC(cref->stream)) == EOF)
 			return kMDErrorUnexpectedEOF;
 	}
 
-	/*  Get the MD track number  */
-	ch = (n & 0x0f);	/*  MIDI channel  */
-	MDSetChannel(eref, ch);
-	
-	switch (n & 0xf0) {
+	MDSetChannel(eref, status & 0x0f);
+	switch (status & 0xf0) {
 		case kMDEventSMFNoteOff:
 		case kMDEventSMFNoteOn:
-			data2 = GETC(cref->stream);
-			if (data2 == EOF) {
-				result = kMDErrorUnexpectedEOF;
-				break;
-			}
-			data2 &= 0xff;
-			if ((n & 0xf0) == kMDEventSMFNoteOn && data2 != 0) {
+			if ((status & 0xf0) == kMDEventSMFNoteOn && data2 != 0) {
 				/*  Note on  */
-                MDSetKind(eref, kMDEventNote);
-                MDSetCode(eref, data1);
-                MDSetNoteOnVelocity(eref, data2);
-                MDSetNoteOffVelocity(eref, 0);
-                MDSetDuration(eref, 0); /* Set temporary duration: 0 indicates "note-on that is not paired yet" */
+				MDSetKind(eref, kMDEventInternalNoteOn);
+				MDSetCode(eref, data1);
+				MDSetNoteOnVelocity(eref, data2);
+				MDSetNoteOffVelocity(eref, 0);
+				MDSetDuration(eref, 0);
 			} else {
 				/*  Note off  */
-                MDSetKind(eref, kMDEventInternalNoteOff);
-                MDSetCode(eref, data1);
-                MDSetNoteOnVelocity(eref, 0);
-                MDSetNoteOffVelocity(eref, data2);
+				MDSetKind(eref, kMDEventInternalNoteOff);
+				MDSetCode(eref, data1);
+				MDSetNoteOnVelocity(eref, 0);
+				MDSetNoteOffVelocity(eref, data2);
 			}
 			break;
 		case kMDEventSMFKeyPressure:
-			data2 = GETC(cref->stream);
-			if (data2 == EOF) {
-				result = kMDErrorUnexpectedEOF;
-				break;
-			}
 			MDSetKind(eref, kMDEventKeyPres);
 			MDSetCode(eref, data1);
 			MDSetData1(eref, data2);
 			break;
 		case kMDEventSMFControl:
-			data2 = GETC(cref->stream);
-			if (data2 == EOF) {
-				result = kMDErrorUnexpectedEOF;
-				break;
-			}
 			MDSetKind(eref, kMDEventControl);
 			MDSetCode(eref, data1);
 			MDSetData1(eref, data2);
@@ -326,30 +666,53 @@ MDSequenceReadSMFChannelEvent(MDSMFConvert *cref, MDEvent *eref, int n)
 			MDSetData1(eref, data1);
 			break;
 		case kMDEventSMFPitchBend:
-			data2 = GETC(cref->stream);
-			if (data2 == EOF) {
-				result = kMDErrorUnexpectedEOF;
-				break;
-			}
 			MDSetKind(eref, kMDEventPitchBend);
 			MDSetData1(eref, ((data1 & 0x7f) + ((data2 & 0x7f) << 7)) - 8192);
 			break;
-		default:
-			result = kMDErrorUnknownChannelEvent;
-			break;
-	} /* end switch */
+	}
+	return kMDNoError;
+}
 
-	return result;
-#endif
+/*  Report the progress of the parallel decoding. The callback is only called from the
+    thread that called MDSequenceReadSMF(); the other threads have cref->callback == NULL.
+    Returns 0 if the decoding should be aborted.  */
+static int
+MDSequenceReadSMFPoolProgress(MDSMFConvert *cref)
+{
+	MDSMFReadPool *pool = cref->pool;
+	int32_t progress = __sync_add_and_fetch(&pool->progress, (int32_t)(cref->bufpos - cref->reported));
+	cref->reported = cref->bufpos;
+	if (cref->callback != NULL) {
+		if ((*cref->callback)((float)(pool->base + progress) / cref->filesize * 100, cref->cbdata) == 0)
+			__sync_lock_test_and_set(&pool->cancel, 1);
+	}
+	return (__sync_fetch_and_add(&pool->cancel, 0) == 0);
 }
 
-/*  Read one SMF track  */
+/*  Remember an orphaned note-off found by a worker thread  */
+static void
+MDSequenceReadSMFDeferOrphan(MDSMFTrackJob *job, int32_t tick)
+{
+	if (job->norphans >= job->maxorphans) {
+		int32_t n = (job->maxorphans > 0 ? job->maxorphans * 2 : 8);
+		int32_t *p = (int32_t *)realloc(job->orphanTicks, sizeof(int32_t) * n);
+		if (p == NULL)
+			return;
+		job->orphanTicks = p;
+		job->maxorphans = n;
+	}
+	job->orphanTicks[job->norphans++] = tick;
+}
+
+/*  Decode one SMF track into cref->temptrk (a new track is created if it is NULL). In the
+    header pass of the lazy reading (cref->scan != NULL), the events are only counted, and
+    the track gets the name, the device name and the duration.  */
 static MDStatus
-MDSequenceReadSMFTrack(MDSMFConvert *cref)
+MDSequenceReadSMFDecodeTrack(MDSMFConvert *cref)
 {
 	MDEvent event;
 	MDStatus result = kMDNoError;
-    MDPointer *lastPendingNoteOn;
+    MDNoteOffMatcher *matcher;
 	int n, count;
 	unsigned char quitFlag, skipFlag;
 	MDTickType maxTick = 0;
@@ -361,16 +724,19 @@ MDSequenceReadSMFTrack(MDSMFConvert *cref)
 	cref->tick = 0;
 	cref->deltatime = 0;
 
-	cref->temptrk = MDTrackNew();
-	if (cref->temptrk == NULL)
-		return kMDErrorOutOfMemory;
+	if (cref->temptrk == NULL) {
+		cref->temptrk = MDTrackNew();
+		if (cref->temptrk == NULL)
+			return kMDErrorOutOfMemory;
+		MDTrackSetArena(cref->temptrk, MDSequenceGetArena(cref->sequence));
+	}
 
 //	ptr = MDPointerNew(cref->temptrk);
 //	if (ptr == NULL)
 //		return kMDErrorOutOfMemory;
 
-    lastPendingNoteOn = MDPointerNew(cref->temptrk);
-    if (lastPendingNoteOn == NULL)
+    matcher = MDNoteOffMatcherNew(cref->temptrk);
+    if (matcher == NULL)
         return kMDErrorOutOfMemory;
 
 //	noteOffTrack = MDTrackNew();
@@ -387,8 +753,13 @@ MDSequenceReadSMFTrack(MDSMFConvert *cref)
 	while (quitFlag == 0) {
 	
 		if (++count >= 1000) {
-			if (cref->callback != NULL) {
-				n = (*cref->callback)((float)FTELL(cref->stream) / cref->filesize * 100, cref->cbdata);
+			if (cref->pool != NULL) {
+				if (!MDSequenceReadSMFPoolProgress(cref)) {
+					result = kMDErrorUserInterrupt;
+					break;
+				}
+			} else if (cref->callback != NULL) {
+				n = (*cref->callback)((float)MDSequenceReadSMFTell(cref) / cref->filesize * 100, cref->cbdata);
 				if (n == 0) {
 					result = kMDErrorUserInterrupt;
 					break;
@@ -398,7 +769,7 @@ MDSequenceReadSMFTrack(MDSMFConvert *cref)
 		}
 		
 		/*  Read the delta time  */
-		if (MDReadStreamFormat(cref->stream, "w", &cref->deltatime) != 1) {
+		if (!MDSequenceReadSMFVarLength(cref, &cref->deltatime)) {
 			result = kMDErrorUnexpectedEOF;
 			break;
 		}
@@ -409,7 +780,7 @@ MDSequenceReadSMFTrack(MDSMFConvert *cref)
 		skipFlag = 0;
 
 		/*  Read the status byte  */
-		n = GETC(cref->stream);
+		n = MDSequenceReadSMFGetc(cref);
 		if (n == EOF) {
 			result = kMDErrorUnexpectedEOF;
 			break;
@@ -418,11 +789,15 @@ MDSequenceReadSMFTrack(MDSMFConvert *cref)
 		if (n == kMDEventSMFSysex) {				/*  sysex events  */
 			MDSetKind(&event, kMDEventSysex);
 			MDSetChannel(&event, 16);
-			result = MDSequenceReadSMFReadMessage(cref, &event);
+			if (cref->scan != NULL)
+				result = MDSequenceReadSMFSkipMessage(cref);
+			else result = MDSequenceReadSMFReadMessage(cref, &event);
 		} else if (n == kMDEventSMFSysexF7) {		/*  sysex events (continued)  */
 			MDSetKind(&event, kMDEventSysexCont);
 			MDSetChannel(&event, 16);
-			result = MDSequenceReadSMFReadMessage(cref, &event);
+			if (cref->scan != NULL)
+				result = MDSequenceReadSMFSkipMessage(cref);
+			else result = MDSequenceReadSMFReadMessage(cref, &event);
 		} else if (n == kMDEventSMFMeta) {			/*  meta events  */
 			MDSetChannel(&event, 17);				/*  not a MIDI event  */
 			result = MDSequenceReadSMFMetaEvent(cref, &event);
@@ -481,7 +856,19 @@ MDSequenceReadSMFTrack(MDSMFConvert *cref)
 				metaDuration = MDGetDuration(&event);
 				skipFlag = 1;
 			}
+		} else if (cref->scan != NULL && cref->scan->midiSeen) {
+			/*  Header pass after the first MIDI event: the channel events are only counted  */
+			if ((result = MDSequenceReadSMFSkipChannelEvent(cref, n)) != kMDNoError)
+				break;
+			continue;
 		} else {	/*  channel events */
+			if (n < 0x80 && cref->status == 0 && cref->job != NULL) {
+				/*  The running status is taken over from the previous track, which is
+				    not decoded yet; this track will be read again sequentially  */
+				cref->job->inheritsStatus = 1;
+				result = kMDErrorInternalError;
+				break;
+			}
 			result = MDSequenceReadSMFChannelEvent(cref, &event, n);
 		}
 		
@@ -491,10 +878,17 @@ MDSequenceReadSMFTrack(MDSMFConvert *cref)
 		if (MDGetKind(&event) == kMDEventInternalNoteOn) {
 			if (metaDuration > 0)
 				MDSetDuration(&event, metaDuration);
+		} else if (MDGetKind(&event) == kMDEventInternalNoteOff && cref->scan != NULL) {
+			skipFlag = 1;  /*  Note-offs are paired when the track is loaded  */
 		} else if (MDGetKind(&event) == kMDEventInternalNoteOff) {
-			result = MDTrackMatchNoteOff(cref->temptrk, &event, lastPendingNoteOn);
+			result = MDNoteOffMatcherMatch(matcher, &event);
 			if (result != kMDNoError) {
-                MDShowErrorMessage("Corrupsed file? orphaned note off at %d\n", (int32_t)MDGetTick(&event));
+				if (cref->job != NULL)
+					MDSequenceReadSMFDeferOrphan(cref->job, (int32_t)MDGetTick(&event));
+				else if (cref->loading)
+					MDQueueErrorMessage("Corrupsed file? orphaned note off at %d\n", (int32_t)MDGetTick(&event));
+				else
+					MDShowErrorMessage("Corrupsed file? orphaned note off at %d\n", (int32_t)MDGetTick(&event));
 				// break;
 			}
 			skipFlag = 1;
@@ -508,7 +902,23 @@ MDSequenceReadSMFTrack(MDSMFConvert *cref)
 		}
 		metaDuration = 0;
 
-		if (!skipFlag) {
+		if (!skipFlag && cref->scan != NULL) {
+			/*  Header pass: count the event, and keep it only if no MIDI event has been seen,
+			    as the names are guessed from the events before the first MIDI event (the
+			    first channel event is also kept; a sysex is not, as its message is not read)  */
+			MDSMFTrackScan *scan = cref->scan;
+			short ch = MDGetChannel(&event);
+			if (ch >= 0 && ch < 18)
+				scan->nch[ch]++;
+			if (!scan->midiSeen && ch != 16) {
+				if (MDTrackAppendEvents(scan->prelude, &event, 1) < 1) {
+					result = kMDErrorOutOfMemory;
+					break;
+				}
+			}
+			if (ch < 17)
+				scan->midiSeen = 1;
+		} else if (!skipFlag) {
 			if (MDTrackAppendEvents(cref->temptrk, &event, 1) < 1) {
 				result = kMDErrorOutOfMemory;
 				break;
@@ -525,7 +935,7 @@ MDSequenceReadSMFTrack(MDSMFConvert *cref)
 		MDEventClear(&event);
 	} /* end while (quitFlag == 0)  */
 	
-    MDPointerRelease(lastPendingNoteOn);
+    MDNoteOffMatcherRelease(matcher);
 
 	/*  Set the track duration  */
 	if (maxTick < cref->tick)
@@ -540,7 +950,7 @@ MDSequenceReadSMFTrack(MDSMFConvert *cref)
 		/*  Guess track name  */
         MDTrackGetName(cref->temptrk, buf, sizeof buf);
         if (buf[0] == 0) {
-            MDTrackGuessName(cref->temptrk, buf, 256);
+            MDTrackGuessName((cref->scan != NULL ? cref->scan->prelude : cref->temptrk), buf, 256);
             result = MDTrackSetName(cref->temptrk, buf);
         }
     }
@@ -549,90 +959,414 @@ MDSequenceReadSMFTrack(MDSMFConvert *cref)
 		/*  Guess device name  */
         MDTrackGetDeviceName(cref->temptrk, buf, sizeof buf);
         if (buf[0] == 0) {
-            MDTrackGuessDeviceName(cref->temptrk, buf, 256);
+            MDTrackGuessDeviceName((cref->scan != NULL ? cref->scan->prelude : cref->temptrk), buf, 256);
             result = MDTrackSetDeviceName(cref->temptrk, buf);
         }
+    }
+
+//	MDPointerRelease(noteOffPtr);
+//	MDTrackRelease(noteOffTrack);
+
+	return result;
+}
+
+/*  Add the decoded track cref->temptrk to the sequence. result is the result of
+    MDSequenceReadSMFDecodeTrack(). This is always called from the thread that called
+    MDSequenceReadSMF(), because the device lookup and the warnings are not thread-safe.  */
+static MDStatus
+MDSequenceReadSMFAddTrack(MDSMFConvert *cref, MDStatus result)
+{
+	int32_t i;
+	if (cref->job != NULL) {
+		for (i = 0; i < cref->job->norphans; i++)
+			MDShowErrorMessage("Corrupsed file? orphaned note off at %d\n", cref->job->orphanTicks[i]);
+	}
+	if (cref->temptrk == NULL)
+		return result;
+	if (result == kMDNoError) {
+        char buf[256];
 		/*  Guess the device number from the device name  */
+        MDTrackGetDeviceName(cref->temptrk, buf, sizeof buf);
 		MDTrackSetDevice(cref->temptrk, MDPlayerGetDestinationNumberFromName(buf));
     }
-	
-	if (result != kMDErrorOutOfMemory) {
+	if (result != kMDErrorOutOfMemory)
 		MDSequenceInsertTrack(cref->sequence, -1, cref->temptrk);
-		MDTrackRelease(cref->temptrk);  /* the track will be retained by the sequence */
+	MDTrackRelease(cref->temptrk);  /* the track will be retained by the sequence */
+	cref->temptrk = NULL;
+	return result;
+}
+
+/*  Read one SMF track  */
+static MDStatus
+MDSequenceReadSMFTrack(MDSMFConvert *cref)
+{
+	return MDSequenceReadSMFAddTrack(cref, MDSequenceReadSMFDecodeTrack(cref));
+}
+
+/*  The loader of a lazily loaded track (MDTrackLoaderProc). This may be called from any
+    thread, so the progress callback and the sequence are not used, and the warnings are
+    queued for the main thread.  */
+static MDStatus
+MDSequenceReadSMFLoadTrack(MDTrack *ioTrack, void *inRefCon)
+{
+	MDSMFLazyTrack *lazy = (MDSMFLazyTrack *)inRefCon;
+	MDSMFConvert conv;
+	memset(&conv, 0, sizeof(conv));
+	conv.buf = lazy->data;
+	conv.bufsize = lazy->size;
+	conv.bufpos = 0;
+	conv.filesize = (int32_t)lazy->size;
+	conv.track_index = lazy->track_index;
+	conv.status = lazy->status;
+	conv.temptrk = ioTrack;
+	conv.loading = 1;
+	return MDSequenceReadSMFDecodeTrack(&conv);
+}
+
+/*  Dispose the loader of a lazily loaded track (MDTrackLoaderDisposeProc)  */
+static void
+MDSequenceReadSMFDisposeLazyTrack(void *inRefCon)
+{
+	free(inRefCon);
+}
+
+/*  Read one SMF track lazily: the events are counted, and the track gets a loader that
+    decodes them on the first access. If the track cannot be handled in this way (a broken
+    track, for example), it is read again at once, so that the result is the same as
+    MDSequenceReadSMFTrack().  */
+static MDStatus
+MDSequenceReadSMFLazyTrack(MDSMFConvert *cref)
+{
+	MDSMFTrackScan scan;
+	MDSMFLazyTrack *lazy;
+	size_t start = cref->bufpos, size;
+	unsigned char status = cref->status;
+	MDStatus result;
+
+	memset(&scan, 0, sizeof(scan));
+	scan.prelude = MDTrackNew();
+	result = kMDErrorOutOfMemory;
+	if (scan.prelude != NULL) {
+		cref->scan = &scan;
+		result = MDSequenceReadSMFDecodeTrack(cref);
+		cref->scan = NULL;
+		MDTrackRelease(scan.prelude);
+	}
+	if (result == kMDNoError) {
+		/*  Keep a copy of the bytes of this track only  */
+		size = cref->bufpos - start;
+		lazy = (MDSMFLazyTrack *)malloc(sizeof(MDSMFLazyTrack) + size);
+		if (lazy == NULL)
+			result = kMDErrorOutOfMemory;
+		else {
+			memcpy(lazy->data, cref->buf + start, size);
+			lazy->size = size;
+			lazy->track_index = cref->track_index;
+			lazy->status = status;
+			result = MDTrackSetLoader(cref->temptrk, MDSequenceReadSMFLoadTrack, MDSequenceReadSMFDisposeLazyTrack, lazy, scan.nch);
+			if (result != kMDNoError)
+				MDSequenceReadSMFDisposeLazyTrack(lazy);
+			else return MDSequenceReadSMFAddTrack(cref, kMDNoError);
+		}
+	}
+
+	/*  Read again from the beginning of the track  */
+	if (cref->temptrk != NULL) {
+		MDTrackRelease(cref->temptrk);
 		cref->temptrk = NULL;
 	}
-	
-//	MDPointerRelease(noteOffPtr);
-//	MDTrackRelease(noteOffTrack);
+	cref->bufpos = start;
+	cref->status = status;
+	return MDSequenceReadSMFTrack(cref);
+}
 
+/*  The thread entry for the parallel decoding. Takes the jobs one by one until none is left.  */
+static void *
+MDSequenceReadSMFWorkerEntry(void *arg)
+{
+	MDSMFConvert *cref = (MDSMFConvert *)arg;
+	MDSMFReadPool *pool = cref->pool;
+	MDSMFTrackJob *job;
+	int32_t i, k, n;
+	while ((i = __sync_fetch_and_add(&pool->next, 1)) < pool->njobs) {
+		k = pool->order[i];
+		job = &pool->jobs[k];
+		if (k > __sync_fetch_and_add(&pool->stop, 0))
+			continue;  /*  Will not be used  */
+		if (__sync_fetch_and_add(&pool->cancel, 0)) {
+			job->result = kMDErrorUserInterrupt;
+		} else {
+			cref->job = job;
+			cref->track_index = k;
+			cref->bufpos = cref->reported = job->start;
+			cref->status = 0;
+			job->result = MDSequenceReadSMFDecodeTrack(cref);
+			job->track = cref->temptrk;
+			job->endpos = cref->bufpos;
+			job->status = cref->status;
+			cref->temptrk = NULL;
+			cref->job = NULL;
+			__sync_fetch_and_add(&pool->progress, (int32_t)(cref->bufpos - cref->reported));
+		}
+		if (job->result != kMDNoError || job->endpos != job->end) {
+			/*  The tracks after this one will be discarded (or read again sequentially)  */
+			while ((n = __sync_fetch_and_add(&pool->stop, 0)) > k && !__sync_bool_compare_and_swap(&pool->stop, n, k))
+				;
+		}
+	}
+	return NULL;
+}
+
+/*  The entry of the threads started for the parallel decoding  */
+static void *
+MDSequenceReadSMFThreadEntry(void *arg)
+{
+	MDSMFConvert *cref = (MDSMFConvert *)arg;
+	MDSequenceReadSMFWorkerEntry(cref);
+	MDSMFThreadGroupLeave(&cref->pool->group);
+	return NULL;
+}
+
+/*  Compare the sort keys of the jobs  */
+static int
+MDSequenceReadSMFCompareJobKeys(const void *a, const void *b)
+{
+	uint64_t ka = *(const uint64_t *)a, kb = *(const uint64_t *)b;
+	return (ka < kb ? -1 : (ka > kb ? 1 : 0));
+}
+
+/*  Decode the MTrk chunks in parallel, when the whole input is in memory. The chunk headers
+    are scanned first, and each track is decoded by a pool of threads into its own MDTrack
+    (the blocks come from the per-thread caches of the block pool, or from the sequence
+    arena). The tracks are then added to the sequence in order. If a track turns out to
+    depend on the preceding ones (it does not end at the declared chunk end, or it relies on
+    the running status of the previous track), the reading falls back to the sequential
+    reader from that track: cref->bufpos and *ioTrkno are set so that the caller can continue.
+    *outDone is set to non-zero if no further chunks should be read.  */
+static MDStatus
+MDSequenceReadSMFTracksInParallel(MDSMFConvert *cref, short *ioTrkno, int *outDone)
+{
+	MDSMFConvert convs[kMDSMFReadMaxThreads];
+	pthread_t threads[kMDSMFReadMaxThreads];
+	char started[kMDSMFReadMaxThreads];
+	MDSMFReadPool pool;
+	MDSMFTrackJob *jobs, *job;
+	uint64_t *keys;
+	const unsigned char *s;
+	size_t pos, scanEnd;
+	int32_t i, k, njobs, maxjobs, size, nthreads, exhausted;
+	short trkno;
+	long ncpu;
+	MDStatus result = kMDNoError;
+
+	*outDone = 0;
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu < 2)
+		return kMDNoError;
+
+	/*  Scan the chunk headers, in the same way as the sequential reader  */
+	jobs = NULL;
+	njobs = maxjobs = 0;
+	exhausted = 0;
+	trkno = *ioTrkno;
+	pos = cref->bufpos;
+	while (cref->bufsize - pos >= 8) {
+		s = cref->buf + pos;
+		size = ((int32_t)s[4] << 24) + ((int32_t)s[5] << 16) + ((int32_t)s[6] << 8) + s[7];
+		if (memcmp(s, "MTrk", 4) == 0) {
+			if (njobs >= maxjobs) {
+				maxjobs = (maxjobs > 0 ? maxjobs * 2 : 64);
+				job = (MDSMFTrackJob *)realloc(jobs, sizeof(MDSMFTrackJob) * maxjobs);
+				if (job == NULL) {
+					free(jobs);
+					return kMDNoError;  /*  Leave it to the sequential reader  */
+				}
+				jobs = job;
+			}
+			job = &jobs[njobs++];
+			memset(job, 0, sizeof(*job));
+			job->header = pos;
+			job->start = pos + 8;
+			if (size >= 0 && (size_t)size <= cref->bufsize - job->start)
+				job->end = job->start + size;
+			else job->end = (size_t)-1;  /*  The next chunk cannot be located  */
+			job->result = kMDErrorUserInterrupt;  /*  Not decoded yet  */
+			if (--trkno <= 0) {
+				exhausted = 1;
+				break;
+			}
+			if (job->end == (size_t)-1)
+				break;
+			pos = job->end;
+		} else if (size < 0 || (size_t)size > cref->bufsize - pos - 8) {
+			pos = cref->bufsize;
+		} else pos += 8 + size;
+	}
+	scanEnd = pos;
+	if (njobs < 2 || (jobs[njobs - 1].end == (size_t)-1 ? cref->bufsize : jobs[njobs - 1].end) - jobs[0].start < kMDSMFReadParallelThreshold) {
+		free(jobs);
+		return kMDNoError;  /*  Not worth the threads  */
+	}
+
+	/*  Larger chunks are taken first, so that the threads finish at about the same time  */
+	keys = (uint64_t *)malloc(sizeof(uint64_t) * njobs);
+	pool.order = (int32_t *)malloc(sizeof(int32_t) * njobs);
+	if (keys == NULL || pool.order == NULL || MDSMFThreadGroupInit(&pool.group) != kMDNoError) {
+		free(keys);
+		free(pool.order);
+		free(jobs);
+		return kMDNoError;
+	}
+	for (k = 0; k < njobs; k++) {
+		size_t len = (jobs[k].end == (size_t)-1 ? cref->bufsize : jobs[k].end) - jobs[k].start;
+		if (len > 0xffffffffUL)
+			len = 0xffffffffUL;
+		keys[k] = ((uint64_t)(0xffffffffUL - len) << 32) | (uint32_t)k;
+	}
+	qsort(keys, njobs, sizeof(uint64_t), MDSequenceReadSMFCompareJobKeys);
+	for (k = 0; k < njobs; k++)
+		pool.order[k] = (int32_t)(keys[k] & 0xffffffffUL);
+	free(keys);
+
+	pool.jobs = jobs;
+	pool.njobs = njobs;
+	pool.next = 0;
+	pool.stop = njobs;
+	pool.cancel = 0;
+	pool.progress = 0;
+	pool.base = cref->bufpos;
+
+	/*  Decode; the current thread takes part, and is the only one that calls the callback.
+	    When no job is left for it, it keeps reporting the progress (and checking for
+	    cancellation) until the other threads finish.  */
+	nthreads = (ncpu > kMDSMFReadMaxThreads ? kMDSMFReadMaxThreads : (int32_t)ncpu);
+	if (nthreads > njobs)
+		nthreads = njobs;
+	for (i = 0; i < nthreads; i++) {
+		convs[i] = *cref;
+		convs[i].pool = &pool;
+		convs[i].job = NULL;
+		convs[i].temptrk = NULL;
+		if (i > 0)
+			convs[i].callback = NULL;
+	}
+	for (i = 0; i < nthreads; i++)
+		started[i] = (i > 0 && MDSMFThreadGroupStart(&pool.group, &threads[i], MDSequenceReadSMFThreadEntry, &convs[i]));
+	MDSequenceReadSMFWorkerEntry(&convs[0]);
+	while (!MDSMFThreadGroupWait(&pool.group, kMDSMFProgressInterval)) {
+		if (cref->callback != NULL && (*cref->callback)((float)(pool.base + __sync_fetch_and_add(&pool.progress, 0)) / cref->filesize * 100, cref->cbdata) == 0)
+			__sync_lock_test_and_set(&pool.cancel, 1);
+	}
+	for (i = 1; i < nthreads; i++) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+	}
+	MDSMFThreadGroupDispose(&pool.group);
+	for (i = 0; i < nthreads; i++) {
+		if (cref->max_tick < convs[i].max_tick)
+			cref->max_tick = convs[i].max_tick;
+	}
+
+	/*  Add the tracks in order, as the sequential reader would  */
+	for (k = 0; k < njobs; k++) {
+		job = &jobs[k];
+		if (job->inheritsStatus || (job->result == kMDNoError && job->endpos != job->end)) {
+			/*  Read again sequentially from this chunk  */
+			cref->bufpos = job->header;
+			break;
+		}
+		cref->job = job;
+		cref->temptrk = job->track;
+		job->track = NULL;
+		result = MDSequenceReadSMFAddTrack(cref, job->result);
+		cref->job = NULL;
+		cref->bufpos = job->endpos;
+		if (result == kMDErrorOutOfMemory)
+			break;
+		cref->track_index++;
+		cref->status = job->status;
+		(*ioTrkno)--;
+		if (result != kMDNoError)
+			break;
+	}
+	if (k >= njobs) {
+		if (exhausted)
+			*outDone = 1;
+		else cref->bufpos = scanEnd;
+	}
+
+	for (k = 0; k < njobs; k++) {
+		if (jobs[k].track != NULL)
+			MDTrackRelease(jobs[k].track);
+		free(jobs[k].orphanTicks);
+	}
+	free(jobs);
+	free(pool.order);
 	return result;
 }
 
-MDStatus
-MDSequenceReadSMF(MDSequence *inSequence, STREAM stream, MDSequenceCallback callback, void *cbdata)
+/*  Read the SMF header and the tracks from conv (stream or buffer)  */
+static MDStatus
+MDSequenceReadSMFMain(MDSMFConvert *cref)
 {
 	MDStatus result = kMDNoError;
-	MDSMFConvert conv;
 	short fmt, trkno, timebase;		/*  SMF format, track number, timebase  */
-	int32_t size, pos;
+	int32_t size;
+	unsigned char s[6];
 	char tag[8];
-	
-	if (inSequence == NULL || stream == NULL)
-		return kMDErrorInternalError;
-
-	/*  Initialize the convert record  */
-	memset(&conv, 0, sizeof(conv));
-	conv.stream = stream;
-	conv.sequence = inSequence;
-	conv.callback = callback;
-	pos = (int32_t)FTELL(stream);
-	FSEEK(stream, 0, SEEK_END);
-    conv.track_channel = 0;  /*  Not to be used  */
-	conv.filesize = (int32_t)FTELL(stream) - pos;
-	conv.cbdata = cbdata;
-	FSEEK(stream, pos, SEEK_SET);
+	int done;
 	
 	/*  Read the file header */
-	if (MDReadStreamFormat(conv.stream, "A4Nn3", tag, &size, &fmt, &trkno, &timebase) == 5
+	if (MDSequenceReadSMFChunkHeader(cref, tag, &size) && MDSequenceReadSMFBytes(cref, s, 6) == 6
 	&& size == 6 && strcmp(tag, "MThd") == 0) {
+		fmt = (short)((s[0] << 8) + s[1]);
+		trkno = (short)((s[2] << 8) + s[3]);
+		timebase = (short)((s[4] << 8) + s[5]);
 		if (fmt != 0 && fmt != 1) {
 			result = kMDErrorUnsupportedSMFFormat;
 		} else {
-			conv.timebase = timebase;
-			conv.trkno = trkno;
-			MDSequenceSetTimebase(inSequence, timebase);
+			cref->timebase = timebase;
+			cref->trkno = trkno;
+			MDSequenceSetTimebase(cref->sequence, timebase);
 		}
 	} else {
 		result = kMDErrorHeaderChunkNotFound;
 	}
 	
-	/*  Read each track  */
-	while (result == kMDNoError && MDReadStreamFormat(conv.stream, "A4N", tag, &size) == 2) {
+	/*  Decode the tracks in parallel if the whole input is in memory  */
+	done = 0;
+	if (result == kMDNoError && cref->buf != NULL && !cref->lazy)
+		result = MDSequenceReadSMFTracksInParallel(cref, &trkno, &done);
+
+	/*  Read each track (the rest of the tracks, if some are decoded in parallel)  */
+	while (result == kMDNoError && !done && MDSequenceReadSMFChunkHeader(cref, tag, &size)) {
 		/*  Check the tag  */
 		if (strcmp(tag, "MTrk") == 0) {
-			result = MDSequenceReadSMFTrack(&conv);
+			if (cref->lazy)
+				result = MDSequenceReadSMFLazyTrack(cref);
+			else result = MDSequenceReadSMFTrack(cref);
 			if (result != kMDErrorOutOfMemory)
-				conv.track_index++;
+				cref->track_index++;
 			else break;
 			if (--trkno <= 0)
 				break;
 		} else {
 			/*  Skip this block  */
-			FSEEK(stream, size, SEEK_CUR);
+			MDSequenceReadSMFSkip(cref, size);
 		}
 	}
-	conv.trkno = conv.track_index;
+	cref->trkno = cref->track_index;
 
 #if DEBUG_PRINT
 	{	/*  for debug  */
 		int i;
 		char buf[1024];
 	/*	MDTrackPrintOneEvent(NULL, NULL); */
-		for (i = 0; i < MDSequenceGetNumberOfTracks(inSequence); i++) {
+		for (i = 0; i < MDSequenceGetNumberOfTracks(cref->sequence); i++) {
 			MDPointer *ptr;
 			MDEvent *ev;
 			MDTrack *track;
-			track = MDSequenceGetTrack(inSequence, i);
+			track = MDSequenceGetTrack(cref->sequence, i);
 			ptr = MDPointerNew(track);
 			while ((ev = MDPointerForward(ptr)) != NULL) {
 				printf("%ld: %s\n", (int32_t)MDPointerGetPosition(ptr), MDEventToString(ev, buf, sizeof buf));
@@ -646,16 +1380,196 @@ MDSequenceReadSMF(MDSequence *inSequence, STREAM stream, MDSequenceCallback call
 	return result;
 }
 
+MDStatus
+MDSequenceReadSMF(MDSequence *inSequence, STREAM stream, MDSequenceCallback callback, void *cbdata)
+{
+	MDStatus result;
+	MDSMFConvert conv;
+	const void *mapped;
+	void *data;
+	size_t size;
+	int32_t pos;
+	
+	if (inSequence == NULL || stream == NULL)
+		return kMDErrorInternalError;
+
+	/*  Initialize the convert record  */
+	memset(&conv, 0, sizeof(conv));
+	conv.stream = stream;
+	conv.sequence = inSequence;
+	conv.callback = callback;
+	pos = (int32_t)FTELL(stream);
+	FSEEK(stream, 0, SEEK_END);
+    conv.track_channel = 0;  /*  Not to be used  */
+	conv.filesize = (int32_t)FTELL(stream) - pos;
+	conv.cbdata = cbdata;
+	FSEEK(stream, pos, SEEK_SET);
+
+	/*  If the whole input is accessible in memory, decode directly from there  */
+	mapped = NULL;
+	if (MDStreamGetData(stream, &data, &size) == 0) {
+		conv.buf = (const unsigned char *)data;
+		conv.bufsize = size;
+	} else if ((mapped = MDStreamMapFile(stream, &size)) != NULL) {
+		conv.buf = (const unsigned char *)mapped;
+		conv.bufsize = size;
+	}
+	if (conv.buf != NULL) {
+		if (pos < 0 || (size_t)pos > conv.bufsize)
+			pos = (int32_t)conv.bufsize;
+		conv.bufpos = pos;
+	}
+
+	result = MDSequenceReadSMFMain(&conv);
+
+	if (conv.buf != NULL) {
+		/*  Leave the stream position just after the data read, as the stream reader does  */
+		FSEEK(stream, (off_t)conv.bufpos, SEEK_SET);
+		MDStreamUnmapFile(mapped, size);
+	}
+	return result;
+}
+
+/* --------------------------------------
+	･ MDSequenceReadSMFLazily
+   -------------------------------------- */
+MDStatus
+MDSequenceReadSMFLazily(MDSequence *inSequence, STREAM stream, MDSequenceCallback callback, void *cbdata)
+{
+	MDStatus result;
+	MDSMFConvert conv;
+	const void *mapped;
+	void *data;
+	size_t size;
+	int32_t pos;
+
+	if (inSequence == NULL || stream == NULL)
+		return kMDErrorInternalError;
+
+	/*  The tracks are scanned in memory, and each keeps a copy of its own bytes  */
+	pos = (int32_t)FTELL(stream);
+	mapped = NULL;
+	if (MDStreamGetData(stream, &data, &size) != 0) {
+		mapped = MDStreamMapFile(stream, &size);
+		if (mapped == NULL)
+			return MDSequenceReadSMF(inSequence, stream, callback, cbdata);
+		data = (void *)mapped;
+	}
+	if (pos < 0 || (size_t)pos > size)
+		pos = (int32_t)size;
+
+	memset(&conv, 0, sizeof(conv));
+	conv.sequence = inSequence;
+	conv.callback = callback;
+	conv.cbdata = cbdata;
+	conv.buf = (const unsigned char *)data;
+	conv.bufsize = size;
+	conv.bufpos = pos;
+	conv.filesize = (int32_t)(size - pos);
+	conv.lazy = 1;
+	result = MDSequenceReadSMFMain(&conv);
+
+	/*  Leave the stream position just after the data read, as MDSequenceReadSMF() does  */
+	FSEEK(stream, (off_t)conv.bufpos, SEEK_SET);
+	MDStreamUnmapFile(mapped, size);
+	return result;
+}
+
+/* --------------------------------------
+	･ MDSequenceReadSMFFromBuffer
+   -------------------------------------- */
+MDStatus
+MDSequenceReadSMFFromBuffer(MDSequence *inSequence, const void *inData, size_t inSize, MDSequenceCallback callback, void *cbdata)
+{
+	MDSMFConvert conv;
+	if (inSequence == NULL || inData == NULL)
+		return kMDErrorInternalError;
+	memset(&conv, 0, sizeof(conv));
+	conv.sequence = inSequence;
+	conv.callback = callback;
+	conv.cbdata = cbdata;
+	conv.buf = (const unsigned char *)inData;
+	conv.bufsize = inSize;
+	conv.filesize = (int32_t)inSize;
+	return MDSequenceReadSMFMain(&conv);
+}
+
 #pragma mark ====== Writing SMF ======
 
+/*  Output functions. A track is encoded into cref->out, which grows as needed, and the
+    whole chunk is written to the stream when the track is done; so the chunk size is
+    known before writing, and the stream need not be seekable.  */
+
+/*  Make room for size bytes at the end of the output, and return the pointer to it  */
+static unsigned char *
+MDSequenceWriteSMFReserve(MDSMFConvert *cref, size_t size)
+{
+	unsigned char *p;
+	size_t n;
+	if (cref->outsize + size > cref->outcapacity) {
+		n = (cref->outcapacity > 0 ? cref->outcapacity * 2 : 4096);
+		while (n < cref->outsize + size)
+			n *= 2;
+		p = (unsigned char *)realloc(cref->out, n);
+		if (p == NULL)
+			return NULL;
+		cref->out = p;
+		cref->outcapacity = n;
+	}
+	p = cref->out + cref->outsize;
+	cref->outsize += size;
+	return p;
+}
+
+static inline MDStatus
+MDSequenceWriteSMFPutc(MDSMFConvert *cref, int c)
+{
+	unsigned char *p;
+	if (cref->outsize < cref->outcapacity)
+		p = cref->out + cref->outsize++;
+	else if ((p = MDSequenceWriteSMFReserve(cref, 1)) == NULL)
+		return kMDErrorOutOfMemory;
+	*p = c;
+	return kMDNoError;
+}
+
+static inline MDStatus
+MDSequenceWriteSMFBytes(MDSMFConvert *cref, const void *ptr, size_t size)
+{
+	unsigned char *p = MDSequenceWriteSMFReserve(cref, size);
+	if (p == NULL)
+		return kMDErrorOutOfMemory;
+	memcpy(p, ptr, size);
+	return kMDNoError;
+}
+
+/*  Write a variable length number (in the same way as MDWriteStreamFormat() with "w")  */
+static MDStatus
+MDSequenceWriteSMFVarLength(MDSMFConvert *cref, int32_t value)
+{
+	unsigned char s[4];
+	uint32_t un = (uint32_t)value;
+	int i = 3;
+	s[3] = (un & 0x7f);
+	while (i > 0) {
+		un >>= 7;
+		if (un == 0)
+			break;
+		s[--i] = ((un & 0x7f) | 0x80);
+	}
+	return MDSequenceWriteSMFBytes(cref, s + i, 4 - i);
+}
+
 static MDStatus
 MDSequenceWriteSMFDeltaTime(MDSMFConvert *cref, MDTickType tick)
 {
+	MDStatus result;
 	cref->deltatime = tick - cref->tick;
     if (cref->deltatime < 0)
         MDSequenceSMFConvertError(cref, "tick disorder");
-	if (MDWriteStreamFormat(cref->stream, "w", cref->deltatime) != 1)
-		return kMDErrorCannotWriteToStream;
+	result = MDSequenceWriteSMFVarLength(cref, cref->deltatime);
+	if (result != kMDNoError)
+		return result;
 	cref->tick += cref->deltatime;
 	return kMDNoError;
 }
@@ -663,19 +1577,20 @@ MDSequenceWriteSMFDeltaTime(MDSMFConvert *cref, MDTickType tick)
 static MDStatus	
 MDSequenceWriteSMFWriteMessage(MDSMFConvert *cref, const unsigned char *p, int32_t length)
 {
+	MDStatus result;
+
 	/*  Write the message length  */
-	if (MDWriteStreamFormat(cref->stream, "w", length) != 1)
-		return kMDErrorCannotWriteToStream;
+	result = MDSequenceWriteSMFVarLength(cref, length);
+	if (result != kMDNoError)
+		return result;
 
 	/*  Write the message body  */
-	if (FWRITE_(p, length, cref->stream) < length)
-		return kMDErrorCannotWriteToStream;
-	return kMDNoError;
+	return MDSequenceWriteSMFBytes(cref, p, length);
 }
 
 /*  Write a special "duration" event  */
 static MDStatus
-MDSequenceWriteSMFSpecialDurationEvent(MDSMFConvert *cref, MDEvent *eref)
+MDSequenceWriteSMFSpecialDurationEvent(MDSMFConvert *cref, const MDEvent *eref)
 {
 	MDTickType d;
 	int i;
@@ -702,32 +1617,30 @@ MDSequenceWriteSMFSpecialDurationEvent(MDSMFConvert *cref, MDEvent *eref)
 	s[--i] = kMDEventSMFMeta;
 /*	s[--i] = 0;  *//*  delta time  */
 
-	if (FWRITE_(s + i, sizeof(s) - i, cref->stream) < sizeof(s) - i)
-		return kMDErrorCannotWriteToStream;
-
-	return kMDNoError;
+	return MDSequenceWriteSMFBytes(cref, s + i, sizeof(s) - i);
 }
 
 /*  Write one meta event  */
 static MDStatus
-MDSequenceWriteSMFMetaEvent(MDSMFConvert *cref, MDEvent *eref)
+MDSequenceWriteSMFMetaEvent(MDSMFConvert *cref, const MDEvent *eref)
 {
 	int32_t length;
 	int n;
-	unsigned char s[8], *metaDataPtr;
-	const unsigned char *p;
+	unsigned char s[8];
+	const unsigned char *p, *metaDataPtr;
 	MDEventKind kind = MDGetKind(eref);
+	MDStatus result;
 
-	n = PUTC(kMDEventSMFMeta, cref->stream);
-	if (n == EOF)
-		return kMDErrorCannotWriteToStream;
+	result = MDSequenceWriteSMFPutc(cref, kMDEventSMFMeta);
+	if (result != kMDNoError)
+		return result;
 	
 	switch (kind) {
 		case kMDEventMetaText:
 		case kMDEventMetaMessage:
-			n = PUTC(MDGetCode(eref), cref->stream);
-			if (n == EOF)
-				return kMDErrorCannotWriteToStream;
+			result = MDSequenceWriteSMFPutc(cref, MDGetCode(eref));
+			if (result != kMDNoError)
+				return result;
 			else {
 				p = MDGetMessageConstPtr(eref, &length);
 				return MDSequenceWriteSMFWriteMessage(cref, p, length);
@@ -759,7 +1672,7 @@ MDSequenceWriteSMFMetaEvent(MDSMFConvert *cref, MDEvent *eref)
 			length = 2;
 			break;
 		case kMDEventSMPTE: {
-			MDSMPTERecord *smp = MDGetSMPTERecordPtr(eref);
+			const MDSMPTERecord *smp = MDGetSMPTERecordPtr(eref);
 			n = kMDMetaSMPTE;
 			s[0] = smp->hour;
 			s[1] = smp->min;
@@ -782,15 +1695,16 @@ MDSequenceWriteSMFMetaEvent(MDSMFConvert *cref, MDEvent *eref)
             break;
 	}
 	
-	if (PUTC(n, cref->stream) == EOF)
-		return kMDErrorCannotWriteToStream;
+	result = MDSequenceWriteSMFPutc(cref, n);
+	if (result != kMDNoError)
+		return result;
 
 	return MDSequenceWriteSMFWriteMessage(cref, s, length);
 }
 
 /*  Write one channel event  */
 static MDStatus
-MDSequenceWriteSMFChannelEvent(MDSMFConvert *cref, MDEvent *eref)
+MDSequenceWriteSMFChannelEvent(MDSMFConvert *cref, const MDEvent *eref)
 {
 	unsigned char s[4];
 	int n;
@@ -837,9 +1751,7 @@ MDSequenceWriteSMFChannelEvent(MDSMFConvert *cref, MDEvent *eref)
             s[0] = kMDEventSMFMeta;
             s[1] = kMDMetaText;
             s[2] = 0;
-            if (FWRITE_(s, n, cref->stream) < n)
-                return kMDErrorCannotWriteToStream;
-            return kMDNoError;
+            return MDSequenceWriteSMFBytes(cref, s, n);
 	}
 	
     if (cref->track_channel < 16)
@@ -847,9 +1759,22 @@ MDSequenceWriteSMFChannelEvent(MDSMFConvert *cref, MDEvent *eref)
     else
         s[0] |= (MDGetChannel(eref) & 0x0f);
 
-	if (FWRITE_(s, n, cref->stream) < n)
-		return kMDErrorCannotWriteToStream;
-	return kMDNoError;
+	return MDSequenceWriteSMFBytes(cref, s, n);
+}
+
+/*  Write a text meta event at tick 0  */
+static MDStatus
+MDSequenceWriteSMFTopText(MDSMFConvert *cref, int code, const char *text)
+{
+    MDStatus result;
+    result = MDSequenceWriteSMFDeltaTime(cref, 0);
+    if (result == kMDNoError)
+        result = MDSequenceWriteSMFPutc(cref, kMDEventSMFMeta);
+    if (result == kMDNoError)
+        result = MDSequenceWriteSMFPutc(cref, code);
+    if (result == kMDNoError)
+        result = MDSequenceWriteSMFWriteMessage(cref, (const unsigned char *)text, (int32_t)strlen(text));
+    return result;
 }
 
 /*  Write sequence name and device information as meta events  */
@@ -858,7 +1783,7 @@ MDSequenceWriteSMFTrackNameAndDevice(MDSMFConvert *cref)
 {
     MDStatus result;
     char buf[256];
-    int32_t dev, i;
+    int32_t i;
     const char *key, *value;
 
     /*  Sequence name  */
@@ -869,60 +1794,59 @@ MDSequenceWriteSMFTrackNameAndDevice(MDSMFConvert *cref)
             which causes problem when extra info is stored as a TEXT metaevent  */
         strcpy(buf, " ");
     }
-    result = MDSequenceWriteSMFDeltaTime(cref, 0);
-    if (result != kMDNoError)
-        return result;
-    if (PUTC(kMDEventSMFMeta, cref->stream) == EOF)
-        return kMDErrorCannotWriteToStream;
-    if (PUTC(kMDMetaSequenceName, cref->stream) == EOF)
-        return kMDErrorCannotWriteToStream;
-    result = MDSequenceWriteSMFWriteMessage(cref, (unsigned char *)buf, (int)strlen(buf));
+    result = MDSequenceWriteSMFTopText(cref, kMDMetaSequenceName, buf);
     if (result != kMDNoError)
         return result;
     
-    /*  Device name  */
-	dev = MDTrackGetDevice(cref->temptrk);
-	if (dev < 0 || MDPlayerGetDestinationName(dev, buf, sizeof buf) != kMDNoError)
-		MDTrackGetDeviceName(cref->temptrk, buf, sizeof buf);
-    result = MDSequenceWriteSMFDeltaTime(cref, 0);
-    if (result != kMDNoError)
-        return result;
-    if (PUTC(kMDEventSMFMeta, cref->stream) == EOF)
-        return kMDErrorCannotWriteToStream;
-    if (PUTC(kMDMetaDeviceName, cref->stream) == EOF)
-        return kMDErrorCannotWriteToStream;
-    result = MDSequenceWriteSMFWriteMessage(cref, (unsigned char *)buf, (int)strlen(buf));
+    /*  Device name (looked up before encoding; see MDSequenceWriteSMFWithSelection)  */
+    result = MDSequenceWriteSMFTopText(cref, kMDMetaDeviceName, cref->wjob->devname);
     if (result != kMDNoError)
         return result;
     
     /*  Other extra info  */
     for (i = 0; (value = MDTrackGetExtraInfoAtIndex(cref->temptrk, i, &key)) != NULL; i++) {
         char *msg;
-        asprintf(&msg, "%%%%%s:%s", key, value);
-        result = MDSequenceWriteSMFDeltaTime(cref, 0);
-        if (result != kMDNoError)
-            return result;
-        if (PUTC(kMDEventSMFMeta, cref->stream) == EOF)
-            return kMDErrorCannotWriteToStream;
-        if (PUTC(kMDMetaText, cref->stream) == EOF)
-            return kMDErrorCannotWriteToStream;
-        result = MDSequenceWriteSMFWriteMessage(cref, (unsigned char *)msg, (int)strlen(msg));
+        if (asprintf(&msg, "%%%%%s:%s", key, value) < 0)
+            return kMDErrorOutOfMemory;
+        result = MDSequenceWriteSMFTopText(cref, kMDMetaText, msg);
+        free(msg);
         if (result != kMDNoError)
             return result;
     }
     return result;
 }
 
+/*  Report the progress of the encoding. Returns 0 if the user requested to abort.  */
+static int
+MDSequenceWriteSMFProgress(MDSMFConvert *cref, MDPointer *ptr, int32_t nevents)
+{
+	MDSMFWritePool *pool = cref->wpool;
+	int32_t progress;
+	if (pool != NULL) {
+		progress = __sync_add_and_fetch(&pool->progress, 1000);
+		if (progress > pool->total)
+			progress = pool->total;
+		if (cref->callback != NULL) {
+			if ((*cref->callback)(100.0f * progress / pool->total, cref->cbdata) == 0)
+				__sync_lock_test_and_set(&pool->cancel, 1);
+		}
+		return (__sync_fetch_and_add(&pool->cancel, 0) == 0);
+	}
+	if (cref->callback != NULL)
+		return (*cref->callback)(100.0f * (cref->track_index + ((float)MDPointerGetPosition(ptr) / nevents)) / cref->trkno, cref->cbdata) != 0;
+	return 1;
+}
+
 /*  Write one SMF track  */
 static MDStatus
 MDSequenceWriteSMFTrackWithSelection(MDSMFConvert *cref, IntGroup *pset, char eotSelected)
 {
 	MDPointer *ptr;
-	MDEvent *eref;
+	const MDEvent *eref;
 	MDStatus result = kMDNoError;
 	MDTrack *noteOffTrack;
 	MDPointer *noteOffPtr;
-	MDEvent *noteOffRef;
+	const MDEvent *noteOffRef;
 	MDTickType noteOffTick;
 	int n, count;
 	int32_t nevents;
@@ -933,6 +1857,9 @@ MDSequenceWriteSMFTrackWithSelection(MDSMFConvert *cref, IntGroup *pset, char eo
 	cref->tick = 0;
 	cref->deltatime = 0;
 
+	/*  A track that cannot be loaded must not be written as an empty one  */
+	if ((result = MDTrackLoad(cref->temptrk)) != kMDNoError)
+		return result;
 	ptr = MDPointerNew(cref->temptrk);
 	if (ptr == NULL)
 		return kMDErrorOutOfMemory;
@@ -970,12 +1897,9 @@ MDSequenceWriteSMFTrackWithSelection(MDSMFConvert *cref, IntGroup *pset, char eo
 		}
 			
 		if (++count >= 1000) {
-			if (cref->callback != NULL) {
-				n = (*cref->callback)(100.0f * (cref->track_index + ((float)MDPointerGetPosition(ptr) / nevents)) / cref->trkno, cref->cbdata);
-				if (n == 0) {
-					result = kMDErrorUserInterrupt;
-					break;
-				}
+			if (!MDSequenceWriteSMFProgress(cref, ptr, nevents)) {
+				result = kMDErrorUserInterrupt;
+				break;
 			}
 			count = 0;
 		}
@@ -1023,10 +1947,9 @@ MDSequenceWriteSMFTrackWithSelection(MDSMFConvert *cref, IntGroup *pset, char eo
 					length--;
 				}
 			}
-			if (PUTC(n, cref->stream) == EOF) {
-				result = kMDErrorCannotWriteToStream;
+			result = MDSequenceWriteSMFPutc(cref, n);
+			if (result != kMDNoError)
 				break;
-			}
 			result = MDSequenceWriteSMFWriteMessage(cref, p, length);
 		} else if (MDIsMetaEvent(eref)) {			/*  meta events  */
 			result = MDSequenceWriteSMFMetaEvent(cref, eref);
@@ -1034,7 +1957,8 @@ MDSequenceWriteSMFTrackWithSelection(MDSMFConvert *cref, IntGroup *pset, char eo
 			int overlap = 0;
 			if (MDGetKind(eref) == kMDEventNote) {
 				/*  Register the note-off for later output  */
-				MDEvent noteOffEvent, *ep;
+				MDEvent noteOffEvent;
+				const MDEvent *ep;
 				MDEventInit(&noteOffEvent);
 				MDSetKind(&noteOffEvent, kMDEventInternalNoteOff);
 				MDSetCode(&noteOffEvent, MDGetCode(eref));
@@ -1064,14 +1988,13 @@ MDSequenceWriteSMFTrackWithSelection(MDSMFConvert *cref, IntGroup *pset, char eo
 			if (overlap) {
 				/*  Write a special 'duration' meta-event  */
 				result = MDSequenceWriteSMFSpecialDurationEvent(cref, eref);
-                if (result == kMDErrorCannotWriteToStream)
+                if (result == kMDErrorOutOfMemory)
                     break;  /*  Stop writing  */
                 else if (result == kMDNoError) {
                     /*  Write deltatime 0 (for next event)  */
-                    if (PUTC(0, cref->stream) == EOF) {
-                        result = kMDErrorCannotWriteToStream;
+                    result = MDSequenceWriteSMFPutc(cref, 0);
+                    if (result != kMDNoError)
                         break;
-                    }
                 }
 			}
 			result = MDSequenceWriteSMFChannelEvent(cref, eref);
@@ -1100,8 +2023,9 @@ MDSequenceWriteSMFTrackWithSelection(MDSMFConvert *cref, IntGroup *pset, char eo
 			cref->deltatime = MDTrackGetDuration(cref->temptrk) - cref->tick;
 		else
 			cref->deltatime = 1;
-		if (MDWriteStreamFormat(cref->stream, "w", cref->deltatime) != 1 || FWRITE_(sEndOfTrack, sizeof sEndOfTrack, cref->stream) < sizeof sEndOfTrack)
-			result = kMDErrorCannotWriteToStream;
+		result = MDSequenceWriteSMFVarLength(cref, cref->deltatime);
+		if (result == kMDNoError)
+			result = MDSequenceWriteSMFBytes(cref, sEndOfTrack, sizeof sEndOfTrack);
 	}
 	
 	last:
@@ -1111,13 +2035,171 @@ MDSequenceWriteSMFTrackWithSelection(MDSMFConvert *cref, IntGroup *pset, char eo
 	return result;
 }
 
+/*  Encode one track into a chunk in memory; the chunk is taken over by the job  */
+static void
+MDSequenceWriteSMFEncodeJob(MDSMFConvert *cref, MDSMFWriteJob *job)
+{
+	unsigned char *p;
+	size_t size;
+	cref->wjob = job;
+	cref->temptrk = job->track;
+	cref->track_channel = job->track_channel;
+	cref->out = NULL;
+	cref->outsize = cref->outcapacity = 0;
+	p = MDSequenceWriteSMFReserve(cref, 8);
+	if (p == NULL)
+		job->result = kMDErrorOutOfMemory;
+	else {
+		memcpy(p, "MTrk", 4);
+		job->result = MDSequenceWriteSMFTrackWithSelection(cref, job->pset, job->eotSelected);
+		/*  The chunk size is set even if an error occurred, as the data so far is written  */
+		size = cref->outsize - 8;
+		p = cref->out;
+		p[4] = (unsigned char)(size >> 24);
+		p[5] = (unsigned char)(size >> 16);
+		p[6] = (unsigned char)(size >> 8);
+		p[7] = (unsigned char)size;
+	}
+	job->out = cref->out;
+	job->outsize = cref->outsize;
+	job->encoded = 1;
+	cref->out = NULL;
+	cref->outsize = cref->outcapacity = 0;
+	cref->wjob = NULL;
+	cref->temptrk = NULL;
+}
+
+/*  The thread entry for the parallel encoding. Takes the jobs one by one until none is left.  */
+static void *
+MDSequenceWriteSMFWorkerEntry(void *arg)
+{
+	MDSMFConvert *cref = (MDSMFConvert *)arg;
+	MDSMFWritePool *pool = cref->wpool;
+	MDSMFWriteJob *job;
+	int32_t i, k, n;
+	while ((i = __sync_fetch_and_add(&pool->next, 1)) < pool->njobs) {
+		k = pool->order[i];
+		job = &pool->jobs[k];
+		if (k > __sync_fetch_and_add(&pool->stop, 0))
+			continue;  /*  Will not be written  */
+		if (__sync_fetch_and_add(&pool->cancel, 0)) {
+			job->result = kMDErrorUserInterrupt;
+			job->encoded = 1;
+		} else {
+			cref->track_index = k;
+			cref->err_stream = job->err_stream;
+			MDSequenceWriteSMFEncodeJob(cref, job);
+		}
+		if (job->result != kMDNoError) {
+			/*  The tracks after this one will not be written  */
+			while ((n = __sync_fetch_and_add(&pool->stop, 0)) > k && !__sync_bool_compare_and_swap(&pool->stop, n, k))
+				;
+		}
+	}
+	return NULL;
+}
+
+/*  The entry of the threads started for the parallel encoding  */
+static void *
+MDSequenceWriteSMFThreadEntry(void *arg)
+{
+	MDSMFConvert *cref = (MDSMFConvert *)arg;
+	MDSequenceWriteSMFWorkerEntry(cref);
+	MDSMFThreadGroupLeave(&cref->wpool->group);
+	return NULL;
+}
+
+/*  Encode the tracks in parallel, if there are enough events to be worth the threads.
+    The current thread takes part, and is the only one that calls the callback; when no
+    track is left for it, it keeps reporting the progress (and checking for cancellation)
+    until the other threads finish. The error messages are kept for each track, so that
+    they are reported in order by the caller.  */
+static void
+MDSequenceWriteSMFTracksInParallel(MDSMFConvert *cref, MDSMFWriteJob *jobs, int32_t njobs)
+{
+	MDSMFConvert convs[kMDSMFWriteMaxThreads];
+	pthread_t threads[kMDSMFWriteMaxThreads];
+	char started[kMDSMFWriteMaxThreads];
+	MDSMFWritePool pool;
+	uint64_t *keys;
+	int32_t i, k, total, nthreads;
+	long ncpu;
+
+	if (njobs < 2)
+		return;
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu < 2)
+		return;
+	total = 0;
+	for (k = 0; k < njobs; k++)
+		total += jobs[k].nevents;
+	if (total < kMDSMFWriteParallelThreshold)
+		return;
+
+	/*  Larger tracks are taken first, so that the threads finish at about the same time  */
+	keys = (uint64_t *)malloc(sizeof(uint64_t) * njobs);
+	pool.order = (int32_t *)malloc(sizeof(int32_t) * njobs);
+	if (keys == NULL || pool.order == NULL || MDSMFThreadGroupInit(&pool.group) != kMDNoError) {
+		free(keys);
+		free(pool.order);
+		return;  /*  Leave it to the sequential writer  */
+	}
+	for (k = 0; k < njobs; k++) {
+		keys[k] = ((uint64_t)(0x7fffffff - jobs[k].nevents) << 32) | (uint32_t)k;
+		if (cref->err_stream != NULL)
+			jobs[k].err_stream = MDStreamOpenData(NULL, 0);
+	}
+	qsort(keys, njobs, sizeof(uint64_t), MDSequenceReadSMFCompareJobKeys);
+	for (k = 0; k < njobs; k++)
+		pool.order[k] = (int32_t)(keys[k] & 0xffffffffUL);
+	free(keys);
+
+	pool.jobs = jobs;
+	pool.njobs = njobs;
+	pool.next = 0;
+	pool.stop = njobs;
+	pool.cancel = 0;
+	pool.progress = 0;
+	pool.total = total;
+
+	nthreads = (ncpu > kMDSMFWriteMaxThreads ? kMDSMFWriteMaxThreads : (int32_t)ncpu);
+	if (nthreads > njobs)
+		nthreads = njobs;
+	for (i = 0; i < nthreads; i++) {
+		convs[i] = *cref;
+		convs[i].wpool = &pool;
+		if (i > 0)
+			convs[i].callback = NULL;
+	}
+	for (i = 0; i < nthreads; i++)
+		started[i] = (i > 0 && MDSMFThreadGroupStart(&pool.group, &threads[i], MDSequenceWriteSMFThreadEntry, &convs[i]));
+	MDSequenceWriteSMFWorkerEntry(&convs[0]);
+	while (!MDSMFThreadGroupWait(&pool.group, kMDSMFProgressInterval)) {
+		if (cref->callback != NULL) {
+			k = __sync_fetch_and_add(&pool.progress, 0);
+			if ((*cref->callback)(100.0f * (k < total ? k : total) / total, cref->cbdata) == 0)
+				__sync_lock_test_and_set(&pool.cancel, 1);
+		}
+	}
+	for (i = 1; i < nthreads; i++) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+	}
+	MDSMFThreadGroupDispose(&pool.group);
+	free(pool.order);
+}
+
 MDStatus
 MDSequenceWriteSMFWithSelection(MDSequence *inSequence, IntGroup **psetArray, char *eotSelectFlags, STREAM stream, MDSequenceCallback callback, void *cbdata, STREAM err_stream)
 {
 	MDStatus result = kMDNoError;
 	MDSMFConvert conv;
+	MDSMFWriteJob *jobs, *job;
 	short trkno, trkmax;
-	int32_t size, pos;
+	int32_t njobs, k, dev;
+	int missing;
+	void *ptr;
+	size_t size;
 	
 	if (inSequence == NULL || stream == NULL)
 		return kMDErrorInternalError;
@@ -1150,10 +2232,14 @@ MDSequenceWriteSMFWithSelection(MDSequence *inSequence, IntGroup **psetArray, ch
 		(short)(conv.trkno == 1 ? 0 : 1), (short)conv.trkno, (short)conv.timebase) != 5)
 			result = kMDErrorCannotWriteToStream;
 	
-	/*  Write each track  */
+	/*  List the tracks to write  */
+	jobs = (MDSMFWriteJob *)calloc(trkmax > 0 ? trkmax : 1, sizeof(MDSMFWriteJob));
+	if (jobs == NULL)
+		return kMDErrorOutOfMemory;
+	njobs = 0;
+	missing = 0;
 	for (trkno = 0; trkno < trkmax; trkno++) {
 		IntGroup *pset;
-		char eotSelected;
 		if (psetArray != NULL) {
 			pset = psetArray[trkno];
 			if (pset == NULL) {
@@ -1163,45 +2249,69 @@ MDSequenceWriteSMFWithSelection(MDSequence *inSequence, IntGroup **psetArray, ch
 					continue;
 			}
 		} else pset = NULL;
-
-		if (eotSelectFlags != NULL)
-			eotSelected = eotSelectFlags[trkno];
-		else eotSelected = 0;
+		job = &jobs[njobs];
 
 		/*  Get the track  */
-		conv.temptrk = MDSequenceGetTrack(inSequence, trkno);
-		if (conv.temptrk == NULL) {
-			result = kMDErrorInternalError;
+		job->track = MDSequenceGetTrack(inSequence, trkno);
+		if (job->track == NULL) {
+			missing = 1;  /*  The tracks so far are written  */
 			break;
 		}
-	/*	conv.track_index = trkno; */
+		job->pset = pset;
+		if (eotSelectFlags != NULL)
+			job->eotSelected = eotSelectFlags[trkno];
         if (MDSequenceIsSingleChannelMode(inSequence))
-            conv.track_channel = MDTrackGetTrackChannel(conv.temptrk) & 15;
+            job->track_channel = MDTrackGetTrackChannel(job->track) & 15;
         else
-            conv.track_channel = 16;
-		if (MDWriteStreamFormat(conv.stream, "A4N", "MTrk", 0L) == 2) {
-			conv.pos = (int32_t)FTELL(conv.stream) - 4;
-		/*	if (pset == (IntGroup *)(-1))
-				result = kMDNoError;
-			else */
-			result = MDSequenceWriteSMFTrackWithSelection(&conv, pset, eotSelected);
-			if (result != kMDNoError) {
-				dprintf(0, "Error %d occurred during write of SMF track\n", result);
-			}
-			pos = (int32_t)FTELL(conv.stream);
-			size = pos - conv.pos - 4;
-			FSEEK(conv.stream, conv.pos, SEEK_SET);
-			MDWriteStreamFormat(conv.stream, "N", size);
-			FSEEK(conv.stream, pos, SEEK_SET);
-			if (result != kMDNoError)
-				break;
-		} else {
+            job->track_channel = 16;
+		if (pset == NULL || pset == (IntGroup *)(-1)) {
+			job->nevents = MDTrackGetNumberOfEvents(job->track);
+			dev = MDTrackGetDevice(job->track);
+			if (dev < 0 || MDPlayerGetDestinationName(dev, job->devname, sizeof job->devname) != kMDNoError)
+				MDTrackGetDeviceName(job->track, job->devname, sizeof job->devname);
+		} else job->nevents = IntGroupGetCount(pset);
+		njobs++;
+	}
+	
+	/*  Encode the tracks in parallel if there are many events  */
+	MDSequenceWriteSMFTracksInParallel(&conv, jobs, njobs);
+
+	/*  Write each track (the tracks not encoded in parallel are encoded here)  */
+	for (k = 0; k < njobs; k++) {
+		job = &jobs[k];
+		if (!job->encoded) {
+			conv.err_stream = err_stream;
+			MDSequenceWriteSMFEncodeJob(&conv, job);
+		} else if (job->err_stream != NULL && err_stream != NULL) {
+			/*  The error messages during the parallel encoding  */
+			if (MDStreamGetData(job->err_stream, &ptr, &size) == 0 && size > 0)
+				FWRITE_(ptr, size, err_stream);
+		}
+		result = job->result;
+		if (result != kMDNoError) {
+			dprintf(0, "Error %d occurred during write of SMF track\n", result);
+		}
+		if (job->outsize > 0 && FWRITE_(job->out, job->outsize, conv.stream) != job->outsize)
 			result = kMDErrorCannotWriteToStream;
+		free(job->out);
+		job->out = NULL;
+		if (result != kMDNoError)
 			break;
-		}
 		conv.track_index++;
 	}
-	
+	if (result == kMDNoError && missing)
+		result = kMDErrorInternalError;
+
+	for (k = 0; k < njobs; k++) {
+		job = &jobs[k];
+		free(job->out);
+		if (job->err_stream != NULL) {
+			if (MDStreamGetData(job->err_stream, &ptr, NULL) == 0)
+				free(ptr);
+			FCLOSE(job->err_stream);
+		}
+	}
+	free(jobs);
 	return result;
 }
 
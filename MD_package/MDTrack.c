@@ -22,25 +22,111 @@
 #include <string.h>		/*  for memset() and strdup()  */
 #include <limits.h>		/*  for LONG_MAX  */
 #include <ctype.h>		/*  for isalpha() etc. */
+#include <pthread.h>	/*  for the per-thread MDBlock cache and the lazy loading  */
+#include <unistd.h>		/*  for sysconf()  */
 
 #ifdef __MWERKS__
 #pragma mark ====== Private definitions ======
 #endif
 
 #define kMDBlockSize		64	/*  This number of MDEvent's are allocated per MDBlock  */
+#define kMDBlockIndexFanout	32	/*  Max number of children in an MDBlockIndex node  */
+#define kMDTrackCompactMinBlocks	8	/*  Tracks with fewer blocks are not compacted automatically  */
+#define kMDTrackParallelSortThreshold	65536	/*  MDTrackChangeTick sorts in parallel above this number of events  */
+#define kMDTrackParallelSortMaxThreads	8
+#define kMDPointerEditLogSize	32	/*  The autoAdjust pointers are synchronized when the edit log is full  */
 
 typedef struct MDBlock	MDBlock;
-static MDBlock *sFreeBlocks = NULL;		/*  The pool of free MDBlock's  */
+typedef struct MDBlockIndex	MDBlockIndex;
+typedef struct MDPackedEvent	MDPackedEvent;
+typedef struct MDPackedBlock	MDPackedBlock;
+typedef struct MDPointerEdit	MDPointerEdit;
+
+/*  Fill ratio (num / (numBlocks * kMDBlockSize)) below which a track is compacted after deletion  */
+static float sMDTrackCompactThreshold = 0.5f;
+
+/*  A counted B+-tree over the MDBlock list. The leaves are the MDBlock's themselves, and
+    each node keeps the total number of events below it. This allows the pointers to locate
+    a position or a tick in O(log numBlocks) instead of walking the linked list.
+    Each node also keeps the largest end tick (tick + duration) below it, so that the notes
+    sounding in a tick range can be found without scanning the preceding blocks. If a node
+    is invalid, so are all its ancestors.  */
+struct MDBlockIndex {
+	MDBlockIndex *	parent;		/*  the parent node (NULL for the root)  */
+	int32_t			level;		/*  0: the children are MDBlock's, otherwise MDBlockIndex's  */
+	int32_t			nchildren;	/*  the number of children  */
+	int32_t			count;		/*  the total number of events below this node  */
+	char			largestTickValid;	/*  non-zero if largestTick is up to date  */
+	MDTickType		largestTick;	/*  the max of largestTick of the blocks below this node  */
+	void *			children[kMDBlockIndexFanout];
+};
+
+/*  The packed (cold) representation of an MDEvent. The pointer arm of the union is
+    moved to the side table of the MDPackedBlock, and the channel is stored as a slot
+    in the channel table, so that one event fits in 12 bytes.  */
+struct MDPackedEvent {
+	MDTickType		tick;
+	int32_t			u;		/*  the first 4 bytes of MDEvent.u, or the slot in the side table  */
+	short			data1;
+	unsigned char	code;
+	unsigned char	kind;	/*  bit 0-4: the event kind, bit 5-7: the slot in the channel table  */
+};
+
+struct MDPackedBlock {
+	short			channels[8];	/*  the channel table  */
+	void **			side;		/*  the side table for message/data pointers  */
+	MDPackedEvent	events[1];	/*  (variable length)  */
+};
 
 struct MDBlock {
 	MDBlock *		next;		/*  the next MDBlock in the linked list  */
 	MDBlock *		last;		/*  the last MDBlock in the linked list  */
 	int32_t			size;		/*  the number of allocated MDEvent's  */
 	int32_t			num;		/*  the number of actually containing MDEvent's */
-	MDEvent *		events;		/*  the array of MDEvent's  */
+	MDEvent *		events;		/*  the array of MDEvent's; NULL if the block is packed.
+									Use MDBlockEvents() to access the events. */
+	MDPackedBlock *	packed;		/*  the packed events (valid only if events is NULL)  */
+	int32_t *		shared;		/*  the reference count of events, if they are shared with the
+									blocks of other tracks (copy-on-write); NULL otherwise  */
+	MDArena *		arena;		/*  the arena this block was allocated from (NULL: the block pool)  */
+	char			arenaEvents;	/*  non-zero if events was allocated from arena. The shared
+									events are always allocated by malloc().  */
     MDTickType		largestTick;  /* the max value of (MDGetTick(&events[i]) + MDHasDuration(&events[i]) ? MDGetDuration(&event[i]) : 0); may be kMDNegativeTick after modification, in which case it should be recached */
+	MDBlockIndex *	node;		/*  the index node containing this block  */
+	char			summaryValid;	/*  non-zero if the following summary is up to date  */
+	uint32_t		kinds;		/*  the event kinds in this block (bit (1 << kind))  */
+	uint32_t		channels;	/*  the channels of the channel events (bit (1 << channel))  */
+	uint32_t		codes[8];	/*  the event codes in this block (256 bits)  */
+	uint32_t		noteKeys[4];	/*  the keys of the note events in this block (128 bits)  */
+};
+
+/*  An entry in the edit log of MDTrack. The MDPointer's are not updated when the track is
+    edited; instead, each pointer remembers the edit epoch at which its block/index were
+    looked up, and looks them up again on the next use if the epoch has changed. The
+    autoAdjust pointers also replay the insertions/deletions logged after their epoch.  */
+struct MDPointerEdit {
+	uint32_t		epoch;		/*  the edit epoch after this edit  */
+	int32_t			position;	/*  the position of the edit  */
+	int32_t			count;		/*  the number of inserted events (negative for deletion)  */
 };
 
+/*  The source of the events of a lazily loaded track (see MDTrackSetLoader)  */
+typedef struct MDTrackLoader {
+	MDTrackLoaderProc	proc;		/*  the callback to make the events  */
+	MDTrackLoaderDisposeProc	dispose;	/*  the callback to dispose refCon (may be NULL)  */
+	void *			refCon;
+	int32_t *		sources;	/*  the number of loaders sharing refCon, if the track has been
+									copied before loading (see MDTrackCloneLoader); NULL otherwise  */
+	int32_t			num;		/*  the number of events after loading; -1 if not known  */
+	int32_t			nch[18];	/*  the number of events for each channel after loading  */
+	unsigned char	remap[16];	/*  the channel remapping to be applied after loading  */
+	unsigned char	loading;	/*  non-zero while a thread is making the events  */
+	unsigned char	detached;	/*  non-zero after the track has taken over the events  */
+	int32_t			users;		/*  the number of threads in MDTrackLoad(); the last one frees this
+									after the loader is detached  */
+	MDStatus		result;		/*  the result of loading, for the threads that waited for it  */
+} MDTrackLoader;
+
 struct MDTrack {
 	int32_t			refCount;	/*  the reference count  */
 	int32_t			num;		/*  the number of events  */
@@ -52,6 +138,7 @@ struct MDTrack {
     MDTrackAttribute	attribute;  /*  the track attribute (Rec/Solo/Mute)  */
 	MDBlock *		first;		/*  the first MDBlock  */
 	MDBlock *		last;		/*  the last MDBlock  */
+	MDBlockIndex *	index;		/*  the root of the block index  */
 	MDTickType		duration;	/*  the track duration in ticks  */
 	int32_t			nch[18];	/*  the number of channel events (16: sysex, 17: non-MIDI)  */
 	int32_t			dev;		/*  the device number */
@@ -62,8 +149,37 @@ struct MDTrack {
 								/*  This is a 'mutable' member, i.e. it may be modified internally
 									even when a 'const MDTrack *' is passed. This behavior is
 									acceptable, because this member is strictly internal. */
+	uint32_t		epoch;		/*  the edit epoch; incremented whenever the blocks are rearranged
+									or the ticks are changed  */
+	MDPointerEdit	edits[kMDPointerEditLogSize];	/*  the insertions/deletions not yet applied to
+									the autoAdjust pointers  */
+	int32_t			nedits;		/*  the number of entries in edits  */
+	MDArena *		arena;		/*  the arena for the blocks and the index nodes (retained), or
+									NULL if they are allocated from the heap  */
+	MDTrackLoader *	loader;		/*  non-NULL while the events are not loaded yet. The track has
+									no blocks (and no MDPointer's) until then. This is also
+									a 'mutable' member, like 'pointer'.  */
 };
 
+/*  Read the loader without the lock. When this is NULL, the events taken over by
+    MDTrackLoad() in another thread are visible (acquire; see the release in MDTrackLoad).  */
+#define MDTrackPeekLoader(track)	__atomic_load_n(&(track)->loader, __ATOMIC_ACQUIRE)
+
+/*  Load the events of a lazily loaded track before its blocks are accessed  */
+#define MDTrackLoadIfNeeded(track)	(MDTrackPeekLoader(track) != NULL ? MDTrackLoad((MDTrack *)(track)) : kMDNoError)
+
+/*  Protects the 'loader' members of the tracks. It is not held while the events are made,
+    so that different tracks can be loaded at the same time.  */
+static pthread_mutex_t	sMDTrackLoadMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	sMDTrackLoadCond = PTHREAD_COND_INITIALIZER;	/*  signaled when a track is loaded  */
+
+/*  Incremented together with the edit epoch of any track. An MDTrackMerger compares this
+    single value, instead of the epochs of all its tracks, to detect an edit in any of them.  */
+static volatile uint32_t	sMDTrackEditCount = 0;
+
+/*  Every change of track->epoch must go through this macro  */
+#define MDTrackBumpEpoch(track)	((track)->epoch++, __sync_fetch_and_add(&sMDTrackEditCount, 1))
+
 struct MDPointer {
 	int32_t			refCount;	/*  the reference count  */
 	MDTrack *		parent;		/*  The parent sequence. */
@@ -72,16 +188,71 @@ struct MDPointer {
 								    "before the beginning". */
 	int32_t			index;		/*  The current index in the current block. */
 	MDPointer *		next;
+	MDPointer *		prev;		/*  the previous MDPointer in the linked list  */
+	uint32_t		epoch;		/*  the edit epoch of the track when block/index were looked up  */
 	char			removed;	/*  True if the 'current' event has been removed.  */
 	char			allocated;	/*  True if allocated by malloc() */
 	char			autoAdjust;	/*  True if autoadjust is done after insert/delete (default is false)  */
 };
 
+static int MDPointerUpdateBlock(MDPointer *inPointer);
+static void MDPointerSync(const MDPointer *inPointer);
+static void MDTrackSyncPointers(MDTrack *inTrack);
+static void MDTrackDisposeLoader(MDTrack *inTrack);
+static int MDTrackCloneLoader(const MDTrack *inTrack, MDTrack *inNewTrack);
+static MDEvent *MDPointerCurrentPrivate(const MDPointer *inPointer);
+static MDEvent *MDPointerForwardPrivate(MDPointer *inPointer);
+static MDEvent *MDPointerBackwardPrivate(MDPointer *inPointer);
+
+/*  A work unit for the parallel sort in MDTrackChangeTick  */
+typedef struct MDTrackSortChunk {
+	MDEvent *		events;
+	MDEvent *		buf;
+	int32_t			n1, n2;		/*  the number of events (n2: the second run, used only in merging)  */
+	MDStatus		status;
+} MDTrackSortChunk;
+
+/*  An entry of the heap in MDTrackMerger  */
+typedef struct MDTrackMergerEntry {
+	MDTickType		tick;		/*  the tick of the current event of the track  */
+	int32_t			index;		/*  the index in pointers[]  */
+} MDTrackMergerEntry;
+
 struct MDTrackMerger {
     int32_t            refCount;   /*  the reference count  */
     MDPointer **    pointers;   /*  array of MDPointers  */
     int             npointers;  /*  number of MDPointers in pointers[]  */
     int             idx;        /*  the index of the 'current' track  */
+	MDTrackMergerEntry *heap;	/*  binary heap of the tracks that have a current event, keyed by
+									(tick, index); the top is the next event to return  */
+	int32_t *		heapPos;	/*  the position of each track in heap[], or -1  */
+	uint32_t		editCount;	/*  sMDTrackEditCount when the heap was built  */
+	int				nheap;		/*  number of entries in heap[]  */
+	int				direction;	/*  1: min-heap for Forward, -1: max-heap for Backward,
+									0: the heap is not valid  */
+	int				pastEnd;	/*  non-zero if some pointers are still beyond the end after
+									MDTrackMergerBackward(), so that they need to move back again  */
+};
+
+#define kMDNoteOffMatcherNumberOfKeys	(16 * 128)	/*  (channel, key) pairs  */
+
+/*  An entry of the pending note-on lists in MDNoteOffMatcher  */
+typedef struct MDNoteOffMatcherEntry {
+	int32_t			position;	/*  the position of the internal note-on  */
+	int32_t			next;		/*  the next entry of the same (channel, key), or -1  */
+} MDNoteOffMatcherEntry;
+
+struct MDNoteOffMatcher {
+	int32_t			refCount;	/*  the reference count  */
+	MDTrack *		track;		/*  the track (retained)  */
+	int32_t			scanned;	/*  the events before this position have been registered  */
+	int32_t			heads[kMDNoteOffMatcherNumberOfKeys];	/*  the oldest pending note-on of each
+									(channel, key), as an index to entries; -1 if none  */
+	int32_t			tails[kMDNoteOffMatcherNumberOfKeys];	/*  the newest one  */
+	MDNoteOffMatcherEntry *entries;
+	int32_t			nentries;	/*  the number of entries ever used  */
+	int32_t			maxentries;	/*  the number of allocated entries  */
+	int32_t			freeEntry;	/*  the first recycled entry (linked by next), or -1  */
 };
 
 #ifdef __MWERKS__
@@ -90,600 +261,2198 @@ struct MDTrackMerger {
 #endif
 
 #ifdef __MWERKS__
-#pragma mark ====== Block manipulation (private functions) ======
+#pragma mark ====== Packed storage (private functions) ======
 #endif
 
+/*  A block is either 'hot' (events != NULL) or 'packed' (events == NULL, and packed holds
+    the events). A packed block is expanded on the first access by MDBlockEvents(). The
+    expansion may happen in more than one reader thread at once, so the expanded array
+    is installed by compare-and-swap. The packed buffer is kept while the block is only
+    read, so that packing it again merely drops the expanded array; it is freed as soon
+    as the events are about to be modified.  */
+
+#define MDPackedEventHasPointer(kind) \
+	((kind) == kMDEventSysex || (kind) == kMDEventSysexCont || (kind) == kMDEventMetaMessage \
+	|| (kind) == kMDEventMetaText || (kind) == kMDEventData || (kind) == kMDEventObject)
+
+/*  The same set of kinds as a bit mask for MDBlock.kinds  */
+#define kMDBlockPointerKinds \
+	((1U << kMDEventSysex) | (1U << kMDEventSysexCont) | (1U << kMDEventMetaMessage) \
+	| (1U << kMDEventMetaText) | (1U << kMDEventData) | (1U << kMDEventObject))
+
 /* --------------------------------------
-	･ MDTrackAllocateBlock
+	･ MDBlockAllocateEventBuffer
    -------------------------------------- */
-static MDBlock *
-MDTrackAllocateBlock(MDTrack *inTrack, MDBlock *inBlock, int32_t inSize)
+/*  Allocate a cleared event buffer for inBlock, from the arena if the block belongs to one  */
+static MDEvent *
+MDBlockAllocateEventBuffer(MDBlock *inBlock)
 {
-	MDBlock *aBlock;
+	MDEvent *events;
+	if (inBlock->arena == NULL)
+		return (MDEvent *)calloc(sizeof(MDEvent), inBlock->size);
+	events = (MDEvent *)MDArenaAllocate(inBlock->arena, sizeof(MDEvent) * inBlock->size);
+	if (events != NULL)
+		memset(events, 0, sizeof(MDEvent) * inBlock->size);
+	return events;
+}
 
-	if (sFreeBlocks != NULL) {
-		/*  MDBlock pool から持ってくる。size と events は設定済み  */
-		aBlock = sFreeBlocks;
-		sFreeBlocks = sFreeBlocks->next;
-	} else {
-		/*  ちょっとメモリをけちったやり方。 MDBlockRecord と buffer を同時に確保している  */
-		aBlock = (MDBlock *)malloc(sizeof(*aBlock) + inSize * sizeof(aBlock->events[0]));
-		if (aBlock == NULL)
-			/* out of memory */
-			return NULL;
-		aBlock->size = inSize;
-		aBlock->events = (MDEvent *)(aBlock + 1);
-	}
+/* --------------------------------------
+	･ MDBlockFreeEventBuffer
+   -------------------------------------- */
+/*  inArena: non-zero if inEvents was allocated from the arena of inBlock  */
+static void
+MDBlockFreeEventBuffer(MDBlock *inBlock, MDEvent *inEvents, int inArena)
+{
+	if (inArena)
+		MDArenaFree(inBlock->arena, inEvents, sizeof(MDEvent) * inBlock->size);
+	else free(inEvents);
+}
 
-	aBlock->last = inBlock;
-	if (inBlock == NULL) {
-		/* top of list */
-		aBlock->next = inTrack->first;
-		inTrack->first = aBlock;
-	} else {
-		aBlock->next = inBlock->next;
-		inBlock->next = aBlock;
-	}
-	if (aBlock->next == NULL) {
-		/* bottom of list */
-		inTrack->last = aBlock;
-	} else {
-		aBlock->next->last = aBlock;
+/* --------------------------------------
+	･ MDBlockUnpack
+   -------------------------------------- */
+static MDEvent *
+MDBlockUnpack(MDBlock *inBlock)
+{
+	MDPackedBlock *pb = inBlock->packed;
+	MDPackedEvent *pe;
+	MDEvent *events, *ep;
+	int32_t i;
+	events = MDBlockAllocateEventBuffer(inBlock);
+	if (events == NULL)
+		return NULL;
+	for (i = 0, ep = events, pe = pb->events; i < inBlock->num; i++, ep++, pe++) {
+		MDSetKind(ep, pe->kind & 31);
+		MDSetCode(ep, pe->code);
+		MDSetChannel(ep, pb->channels[pe->kind >> 5]);
+		MDSetTick(ep, pe->tick);
+		MDSetData1(ep, pe->data1);
+		if (MDPackedEventHasPointer(MDGetKind(ep)))
+			ep->u.dataptr = pb->side[pe->u];
+		else memcpy(&ep->u, &pe->u, sizeof(pe->u));
 	}
+	inBlock->arenaEvents = (inBlock->arena != NULL);  /*  Same for all expanding threads  */
+	if (!__sync_bool_compare_and_swap(&inBlock->events, NULL, events))
+		MDBlockFreeEventBuffer(inBlock, events, inBlock->arena != NULL);  /*  Another thread did it first  */
+	return inBlock->events;
+}
 
-	aBlock->num = 0;
-	aBlock->largestTick = kMDNegativeTick;
-    
-	memset(aBlock->events, 0, aBlock->size * sizeof(aBlock->events[0]));
-
-	inTrack->numBlocks++;
+/* --------------------------------------
+	･ MDBlockEvents
+   -------------------------------------- */
+static inline MDEvent *
+MDBlockEvents(MDBlock *inBlock)
+{
+	if (inBlock->events != NULL)
+		return inBlock->events;
+	return MDBlockUnpack(inBlock);
+}
 
-	return aBlock;
+/* --------------------------------------
+	･ MDBlockGetTick
+   -------------------------------------- */
+/*  Read the tick without expanding a packed block  */
+static inline MDTickType
+MDBlockGetTick(const MDBlock *inBlock, int32_t idx)
+{
+	if (inBlock->events != NULL)
+		return MDGetTick(inBlock->events + idx);
+	return inBlock->packed->events[idx].tick;
 }
 
 /* --------------------------------------
-	･ MDTrackDeallocateBlock
+	･ MDBlockShareEvents
    -------------------------------------- */
-static void
-MDTrackDeallocateBlock(MDTrack *inTrack, MDBlock *inBlock)
+/*  Let inNewBlock (an empty block just allocated) share the events of inBlock  */
+static MDStatus
+MDBlockShareEvents(MDBlock *inBlock, MDBlock *inNewBlock)
 {
-	if (inBlock->last == NULL) {
-		inTrack->first = inBlock->next;
-	} else {
-		inBlock->last->next = inBlock->next;
+	int32_t *shared;
+	MDEvent *events;
+	if (MDBlockEvents(inBlock) == NULL)
+		return kMDErrorOutOfMemory;
+	if (inBlock->arenaEvents) {
+		/*  The shared events may outlive the arena, so move them to the heap  */
+		events = (MDEvent *)malloc(sizeof(MDEvent) * inBlock->size);
+		if (events == NULL)
+			return kMDErrorOutOfMemory;
+		memcpy(events, inBlock->events, sizeof(MDEvent) * inBlock->size);
+		MDBlockFreeEventBuffer(inBlock, inBlock->events, 1);
+		inBlock->events = events;
+		inBlock->arenaEvents = 0;
 	}
-	if (inBlock->next == NULL) {
-		inTrack->last = inBlock->last;
-	} else {
-		inBlock->next->last = inBlock->last;
+	if (inBlock->shared == NULL) {
+		shared = (int32_t *)malloc(sizeof(int32_t));
+		if (shared == NULL)
+			return kMDErrorOutOfMemory;
+		*shared = 1;
+		if (!__sync_bool_compare_and_swap(&inBlock->shared, NULL, shared))
+			free(shared);
 	}
-	
-	/*  MDBlock pool に戻す  */
-	inBlock->next = sFreeBlocks;
-	sFreeBlocks = inBlock;
+	__sync_add_and_fetch(inBlock->shared, 1);
+	MDBlockFreeEventBuffer(inNewBlock, inNewBlock->events, inNewBlock->arenaEvents);
+	inNewBlock->events = inBlock->events;
+	inNewBlock->arenaEvents = 0;
+	inNewBlock->shared = inBlock->shared;
+	return kMDNoError;
+}
 
-	inTrack->numBlocks--;
+/* --------------------------------------
+	･ MDBlockReleaseSharedEvents
+   -------------------------------------- */
+/*  Give up the reference to the shared events. Returns non-zero if this block was the
+    last owner, in which case the events still belong to this block.  */
+static int
+MDBlockReleaseSharedEvents(MDBlock *inBlock)
+{
+	int32_t *shared = inBlock->shared;
+	inBlock->shared = NULL;
+	if (__sync_sub_and_fetch(shared, 1) == 0) {
+		free(shared);
+		return 1;
+	}
+	inBlock->events = NULL;  /*  A new buffer will be allocated when the block is reused  */
+	return 0;
 }
 
 /* --------------------------------------
-	･ MDTrackClearBlock
+	･ MDBlockDisposePacked
    -------------------------------------- */
+/*  Free the packed buffer that is no longer used (the block has been expanded)  */
 static void
-MDTrackClearBlock(MDTrack *inTrack, MDBlock *inBlock)
+MDBlockDisposePacked(MDBlock *inBlock)
 {
-	int32_t i;
+	if (inBlock->packed != NULL && inBlock->events != NULL) {
+		free(inBlock->packed);
+		inBlock->packed = NULL;
+	}
+}
 
-	for (i = 0; i < inBlock->num; i++) {
-		/*  パートナー、メッセージなどのポインタを処理して、メモリリーク・
-		    ダングリングポインタが出ないようにする */
-		MDEventClear(&(inBlock->events[i]));
+/* --------------------------------------
+	･ MDBlockMutableEvents
+   -------------------------------------- */
+/*  Same as MDBlockEvents(), but the shared events are copied before they are returned.
+    Should be used whenever the events may be modified.  */
+static MDEvent *
+MDBlockMutableEvents(MDBlock *inBlock)
+{
+	int32_t *shared;
+	MDEvent *events, *oldEvents;
+	int32_t i;
+	if ((events = MDBlockEvents(inBlock)) == NULL)
+		return NULL;
+	MDBlockDisposePacked(inBlock);  /*  It will be out of date  */
+	if ((shared = inBlock->shared) == NULL)
+		return events;
+	if (__sync_fetch_and_add(shared, 0) == 1) {
+		/*  Other owners have gone (the count is released by other threads, so read it atomically)  */
+		if (__sync_bool_compare_and_swap(&inBlock->shared, shared, NULL))
+			free(shared);
+		return inBlock->events;
+	}
+	events = MDBlockAllocateEventBuffer(inBlock);
+	if (events == NULL)
+		return NULL;
+	if (!__sync_bool_compare_and_swap(&inBlock->shared, shared, NULL)) {
+		MDBlockFreeEventBuffer(inBlock, events, inBlock->arena != NULL);  /*  Another thread did it first  */
+		return inBlock->events;
 	}
-	inBlock->num = 0;
-	MDTrackDeallocateBlock(inTrack, inBlock);	
+	oldEvents = inBlock->events;
+	MDEventCopy(events, oldEvents, inBlock->num);
+	inBlock->events = events;
+	inBlock->arenaEvents = (inBlock->arena != NULL);
+	if (__sync_sub_and_fetch(shared, 1) == 0) {
+		/*  The other owners have gone in the meantime  */
+		for (i = 0; i < inBlock->num; i++)
+			MDEventClear(oldEvents + i);
+		free(oldEvents);
+		free(shared);
+	}
+	return events;
 }
 
 /* --------------------------------------
-	･ MDTrackUpdateLargestTickForBlock
- -------------------------------------- */
-static void
-MDTrackUpdateLargestTickForBlock(MDTrack *inTrack, MDBlock *inBlock)
+	･ MDBlockPack
+   -------------------------------------- */
+/*  Returns non-zero if the block is packed. A block having more than 8 distinct channel
+    values is left as it is.  */
+static int
+MDBlockPack(MDBlock *inBlock)
 {
-    MDTickType tick, largestTick;
-    int i;
-    MDEvent *ep;
-    if (inBlock->largestTick < 0) {
-        /*  Recalc the largest tick and cache it  */
-        largestTick = kMDNegativeTick;
-        for (i = 0; i < inBlock->num; i++) {
-            ep = &inBlock->events[i];
-            tick = MDGetTick(ep);
-            if (MDHasDuration(ep))
-                tick += MDGetDuration(ep);
-            if (tick > largestTick)
-                largestTick = tick;
-        }
-        inBlock->largestTick = largestTick;
-    }
+	MDPackedBlock *pb;
+	MDPackedEvent *pe;
+	MDEvent *ep;
+	short channels[8];
+	int32_t i, j, nch, nside;
+	size_t evsize;
+
+	if (inBlock->events == NULL)
+		return 1;  /*  Already packed  */
+	if (inBlock->num == 0 || inBlock->shared != NULL)
+		return 0;
+	if (inBlock->packed != NULL) {
+		/*  Expanded only for reading: the packed buffer is still current  */
+		MDBlockFreeEventBuffer(inBlock, inBlock->events, inBlock->arenaEvents);
+		inBlock->events = NULL;
+		inBlock->arenaEvents = 0;
+		return 1;
+	}
+	nch = nside = 0;
+	for (i = 0, ep = inBlock->events; i < inBlock->num; i++, ep++) {
+		for (j = 0; j < nch; j++) {
+			if (channels[j] == MDGetChannel(ep))
+				break;
+		}
+		if (j == nch) {
+			if (nch == 8)
+				return 0;
+			channels[nch++] = MDGetChannel(ep);
+		}
+		if (MDPackedEventHasPointer(MDGetKind(ep)))
+			nside++;
+	}
+	evsize = sizeof(MDPackedBlock) + (inBlock->num - 1) * sizeof(MDPackedEvent);
+	evsize = (evsize + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *);
+	pb = (MDPackedBlock *)malloc(evsize + nside * sizeof(void *));
+	if (pb == NULL)
+		return 0;
+	memcpy(pb->channels, channels, sizeof(channels));
+	pb->side = (void **)((char *)pb + evsize);
+	nside = 0;
+	for (i = 0, ep = inBlock->events, pe = pb->events; i < inBlock->num; i++, ep++, pe++) {
+		for (j = 0; channels[j] != MDGetChannel(ep); j++)
+			;
+		pe->tick = MDGetTick(ep);
+		pe->data1 = MDGetData1(ep);
+		pe->code = MDGetCode(ep);
+		pe->kind = MDGetKind(ep) | (j << 5);
+		if (MDPackedEventHasPointer(MDGetKind(ep))) {
+			pe->u = nside;
+			pb->side[nside++] = ep->u.dataptr;
+		} else memcpy(&pe->u, &ep->u, sizeof(pe->u));
+	}
+	if (inBlock->packed != NULL)
+		free(inBlock->packed);
+	inBlock->packed = pb;
+	MDBlockFreeEventBuffer(inBlock, inBlock->events, inBlock->arenaEvents);
+	inBlock->events = NULL;
+	inBlock->arenaEvents = 0;
+	return 1;
 }
 
-#if 0
-#pragma mark ====== Manipulation of extraInfo ======
+#ifdef __MWERKS__
+#pragma mark ====== Block index (private functions) ======
 #endif
 
 /* --------------------------------------
- ･ MDTrackCountExtraInfo
- -------------------------------------- */
-int32_t
-MDTrackCountExtraInfo(const MDTrack *inTrack)
+	･ MDBlockIndexChildCount
+   -------------------------------------- */
+static int32_t
+MDBlockIndexChildCount(const MDBlockIndex *inNode, int32_t idx)
 {
-    int i;
-    if (inTrack == NULL || inTrack->extraInfo == NULL)
-        return 0;
-    i = 0;
-    while (inTrack->extraInfo[i] != NULL)
-        i += 2;
-    return i / 2;
+	if (inNode->level == 0)
+		return ((MDBlock *)inNode->children[idx])->num;
+	else return ((MDBlockIndex *)inNode->children[idx])->count;
 }
 
-int32_t
-MDTrackGetExtraInfo(const MDTrack *inTrack, const char *key, const char **outValue)
+/* --------------------------------------
+	･ MDBlockIndexSetChild
+   -------------------------------------- */
+static void
+MDBlockIndexSetChild(MDBlockIndex *inNode, int32_t idx, void *inChild)
 {
-    int i, n;
-    if (inTrack == NULL)
-        return -1;
-    n = MDTrackCountExtraInfo(inTrack);
-    for (i = 0; i < n; i++) {
-        if (strcmp(inTrack->extraInfo[i * 2], key) == 0) {
-            if (outValue != NULL)
-                *outValue = inTrack->extraInfo[i * 2 + 1];
-            return i;
-        }
-    }
-    return -1;
+	inNode->children[idx] = inChild;
+	if (inNode->level == 0)
+		((MDBlock *)inChild)->node = inNode;
+	else ((MDBlockIndex *)inChild)->parent = inNode;
 }
 
-int32_t
-MDTrackSetExtraInfo(MDTrack *inTrack, const char *key, const char *value)
+/* --------------------------------------
+	･ MDBlockIndexFindChild
+   -------------------------------------- */
+static int32_t
+MDBlockIndexFindChild(const MDBlockIndex *inNode, const void *inChild)
 {
-    int n;
-    if (inTrack == NULL)
-        return -1;
-    n = MDTrackGetExtraInfo(inTrack, key, NULL);
-    if (n >= 0) {
-        /*  Found  */
-        free(inTrack->extraInfo[n * 2 + 1]);
-        if (value != NULL) {
-            /*  Replace the value  */
-            inTrack->extraInfo[n * 2 + 1] = strdup(value);
-        } else {
-            /*  Remove the key and value  */
-            int m = MDTrackCountExtraInfo(inTrack);
-            memmove(inTrack->extraInfo + (n * 2), inTrack->extraInfo + (n * 2 + 2), sizeof(char *) * (2 * (m - n) + 1));
-        }
-        return n;
-    } else {
-        /*  Create a new entry  */
-        int m = MDTrackCountExtraInfo(inTrack);
-        if (value == NULL)
-            return -1;  /*  Do nothing  */
-        if (m == 0 || m % 8 == 7) {
-            char **p = (char **)realloc(inTrack->extraInfo, ((m + 9) / 8) * sizeof(char *) * 16);
-            if (p == NULL)
-                return -1;  /*  Cannot allocate  */
-            inTrack->extraInfo = p;
-            p[m * 2] = strdup(key);
-            p[m * 2 + 1] = strdup(value);
-            p[m * 2 + 2] = NULL;
-        }
-        return m;
-    }
+	int32_t i;
+	for (i = 0; i < inNode->nchildren; i++) {
+		if (inNode->children[i] == inChild)
+			return i;
+	}
+	return -1;
 }
 
-const char *MDTrackGetExtraInfoAtIndex(const MDTrack *inTrack, int32_t index, const char **outKey)
+/* --------------------------------------
+	･ MDBlockSetNum
+   -------------------------------------- */
+/*  Every change of block->num must go through this function, so that the event counts
+    in the index nodes are kept up to date  */
+static void
+MDBlockSetNum(MDBlock *inBlock, int32_t inNum)
 {
-    int n = MDTrackCountExtraInfo(inTrack);
-    if (index < 0 || index >= n)
-        return NULL;
-    if (outKey != NULL)
-        *outKey = inTrack->extraInfo[index * 2];
-    return inTrack->extraInfo[index * 2 + 1];
+	MDBlockIndex *node;
+	int32_t delta = inNum - inBlock->num;
+	if (delta == 0)
+		return;
+	inBlock->num = inNum;
+	for (node = inBlock->node; node != NULL; node = node->parent)
+		node->count += delta;
 }
 
-#ifdef __MWERKS__
-#pragma mark ====== Basic Insert/Delete (private functions) ======
-#endif
+/* --------------------------------------
+	･ MDBlockIndexInvalidateLargestTick
+   -------------------------------------- */
+static void
+MDBlockIndexInvalidateLargestTick(MDBlockIndex *inNode)
+{
+	while (inNode != NULL && inNode->largestTickValid) {
+		inNode->largestTickValid = 0;
+		inNode = inNode->parent;
+	}
+}
 
 /* --------------------------------------
-	･ MDTrackInsertBlanks
+	･ MDBlockSetLargestTick
    -------------------------------------- */
-static int32_t
-MDTrackInsertBlanks(MDTrack *inTrack, MDPointer *inPointer, int32_t count)
+/*  Every change of block->largestTick, except recalculation of an invalid value, must go
+    through this function  */
+static void
+MDBlockSetLargestTick(MDBlock *inBlock, MDTickType inTick)
 {
-	MDBlock *block1, *block2;
-	int32_t index, room, num2, tail;
-	MDPointer *ptr;
+	inBlock->largestTick = inTick;
+	MDBlockIndexInvalidateLargestTick(inBlock->node);
+}
 
-	if (count <= 0)
-		return count;
+/* --------------------------------------
+	･ MDTrackAllocateIndexNode
+   -------------------------------------- */
+static MDBlockIndex *
+MDTrackAllocateIndexNode(MDTrack *inTrack)
+{
+	if (inTrack->arena != NULL)
+		return (MDBlockIndex *)MDArenaAllocate(inTrack->arena, sizeof(MDBlockIndex));
+	else return (MDBlockIndex *)malloc(sizeof(MDBlockIndex));
+}
 
-	block1 = inPointer->block;
-	index = inPointer->index;
+/* --------------------------------------
+	･ MDTrackFreeIndexNode
+   -------------------------------------- */
+static void
+MDTrackFreeIndexNode(MDTrack *inTrack, MDBlockIndex *inNode)
+{
+	if (inTrack->arena != NULL)
+		MDArenaFree(inTrack->arena, inNode, sizeof(MDBlockIndex));
+	else free(inNode);
+}
 
-	if (inTrack->num == 0 || block1 == NULL) {
-		room = tail = 0;
-	} else {
-		/*  room: the number of available space  */
-		room = block1->size - block1->num;
-		/*  tail: the number of events that needs to be moved (i.e. after index in block1)  */
-		tail = block1->num - index;
-	}
-	if (room >= count) {
-		/*  The current block have enough room for the required blanks  */
-		MDEventMove(block1->events + index + count, block1->events + index, tail);
-		block1->num += count;
-        block1->largestTick = kMDNegativeTick;
-	} else {
-		/*  Allocate new blocks until there are enough room  */
-		block2 = block1;
-		while (room < count) {
-			block2 = MDTrackAllocateBlock(inTrack, block2, kMDBlockSize);
-			if (block2 == NULL) {
-				/*  Out of memory: clean up the allocated blocks  */
-				if (block1 != NULL) {
-					while (block1->next != NULL && block1->next->num == 0)
-						MDTrackDeallocateBlock(inTrack, block1->next);
-				}
-				return 0;
-			}
-			room += block2->size;
+/* --------------------------------------
+	･ MDTrackIndexInsertChild
+   -------------------------------------- */
+/*  Insert inChild at idx in inNode. inChild must not add to the event count, i.e. it is
+    either an empty MDBlock or a node split from a sibling of inNode. Full nodes are split,
+    and the tree may grow by one level.  */
+static MDStatus
+MDTrackIndexInsertChild(MDTrack *inTrack, MDBlockIndex *inNode, int32_t idx, void *inChild)
+{
+	MDBlockIndex *node2;
+	int32_t i, half;
+	MDStatus sts;
+	
+	if (inNode->nchildren == kMDBlockIndexFanout) {
+		/*  Split inNode: the upper half goes to a new sibling  */
+		node2 = MDTrackAllocateIndexNode(inTrack);
+		if (node2 == NULL)
+			return kMDErrorOutOfMemory;
+		half = kMDBlockIndexFanout / 2;
+		node2->level = inNode->level;
+		node2->nchildren = kMDBlockIndexFanout - half;
+		node2->count = 0;
+		node2->largestTickValid = 0;
+		for (i = 0; i < node2->nchildren; i++) {
+			MDBlockIndexSetChild(node2, i, inNode->children[half + i]);
+			node2->count += MDBlockIndexChildCount(node2, i);
 		}
-		/*  block2: the last allocated block  */
-		/*  num2: the number of events (possibly including blanks) in block2  */
-		num2 = block2->size - (room - count);
-		/*  Move the events after index in block1 if necessary  */
-		if (tail > 0) {
-			if (tail <= num2) {
-				MDEventMove(block2->events + num2 - tail, block1->events + index, tail);
-			} else {
-				/*  block1->events[index..num-num2-1] ====> block2->last->events[size-(tail-num2)..size-1]
-				    block1->events[num-num2..num-1]   ====> block2->events[0..num2-1] */
-				MDEventMove(block2->events, block1->events + (block1->num - num2), num2);
-				MDEventMove(block2->last->events + block2->last->size - (tail - num2), block1->events + index, tail - num2);
+		if (inNode->parent == NULL) {
+			/*  inNode was the root: create a new root  */
+			MDBlockIndex *root = MDTrackAllocateIndexNode(inTrack);
+			if (root == NULL) {
+				for (i = 0; i < node2->nchildren; i++)
+					MDBlockIndexSetChild(inNode, half + i, node2->children[i]);
+				MDTrackFreeIndexNode(inTrack, node2);
+				return kMDErrorOutOfMemory;
+			}
+			root->parent = NULL;
+			root->level = inNode->level + 1;
+			root->nchildren = 2;
+			root->count = inNode->count;
+			root->largestTickValid = 0;
+			MDBlockIndexSetChild(root, 0, inNode);
+			MDBlockIndexSetChild(root, 1, node2);
+			inTrack->index = root;
+		} else {
+			sts = MDTrackIndexInsertChild(inTrack, inNode->parent, MDBlockIndexFindChild(inNode->parent, inNode) + 1, node2);
+			if (sts != kMDNoError) {
+				for (i = 0; i < node2->nchildren; i++)
+					MDBlockIndexSetChild(inNode, half + i, node2->children[i]);
+				MDTrackFreeIndexNode(inTrack, node2);
+				return sts;
 			}
 		}
-		/*  Invalidate the largestTick field  */
-		if (block1 != NULL)
-			block1->largestTick = kMDNegativeTick;
-		/*  update the num fields of modified blocks  */
-		block2->num = num2;		/*  the last allocated block  */
-		/*  other blocks  */
-		if (block1 == NULL)
-			block1 = inTrack->first;
-		while (block1 != block2) {
-			block1->num = block1->size;
-			block1 = block1->next;
+		inNode->nchildren = half;
+		inNode->count -= node2->count;
+		if (idx > half) {
+			inNode = node2;
+			idx -= half;
 		}
 	}
-	inTrack->num += count;
-	
-	if (inPointer->block == NULL) {
-		inPointer->block = inTrack->first;
-		inPointer->position = inPointer->index = 0;
-	} else if (inPointer->index == inPointer->block->size) {
-		/*  The pointer was at the end of track, and the last block in the track
-		    had maximum number of events. In this case, a new block must have been
-			allocated, so we move on to the next block and point to the first
-			event in that block.  */
-		inPointer->block = inPointer->block->next;
-		inPointer->index = 0;
+	for (i = inNode->nchildren; i > idx; i--)
+		inNode->children[i] = inNode->children[i - 1];
+	MDBlockIndexSetChild(inNode, idx, inChild);
+	inNode->nchildren++;
+	MDBlockIndexInvalidateLargestTick(inNode);
+	return kMDNoError;
+}
+
+/* --------------------------------------
+	･ MDTrackIndexInsertBlock
+   -------------------------------------- */
+/*  Register an empty block inNewBlock that is going to be linked after inBlock (or at the
+    top of the list if inBlock is NULL)  */
+static MDStatus
+MDTrackIndexInsertBlock(MDTrack *inTrack, MDBlock *inBlock, MDBlock *inNewBlock)
+{
+	MDBlockIndex *node;
+	inNewBlock->num = 0;
+	inNewBlock->node = NULL;
+	if (inTrack->index == NULL) {
+		node = MDTrackAllocateIndexNode(inTrack);
+		if (node == NULL)
+			return kMDErrorOutOfMemory;
+		memset(node, 0, sizeof(MDBlockIndex));
+		inTrack->index = node;
+		return MDTrackIndexInsertChild(inTrack, node, 0, inNewBlock);
+	} else if (inBlock == NULL) {
+		return MDTrackIndexInsertChild(inTrack, inTrack->first->node, 0, inNewBlock);
+	} else {
+		node = inBlock->node;
+		return MDTrackIndexInsertChild(inTrack, node, MDBlockIndexFindChild(node, inBlock) + 1, inNewBlock);
 	}
+}
 
-	/*  Update pointers  */
-	/*  (1) 0..inPointer->position-1 : no change
-		(2) inPointer->position : position not changed, block/index updated as in inPointer
-		(3) inPointer->position+1..inPointer->position+tail : position += count, block/index updated
-		(4) inPointer->position+tail+1.. : position += count, block/index not changed  */
-	num2 = inPointer->position;
-	for (ptr = inTrack->pointer; ptr != NULL; ptr = ptr->next) {
-		if (ptr == inPointer || !ptr->autoAdjust)
-			continue;
-		index = ptr->position;
-		if (index > num2 + tail)
-			ptr->position += count;		/*  case 4  */
-		else if (index > num2) {
-			/*  case 3  */
-			ptr->position = inPointer->position;
-			ptr->block = inPointer->block;
-			ptr->index = inPointer->index;
-			MDPointerSetRelativePosition(ptr, index - num2 + count);
-		} else if (index == num2) {
-			/*  case 2  */
-			ptr->position = inPointer->position;
-			ptr->block = inPointer->block;
-			ptr->index = inPointer->index;
+/* --------------------------------------
+	･ MDTrackIndexRemoveBlock
+   -------------------------------------- */
+static void
+MDTrackIndexRemoveBlock(MDTrack *inTrack, MDBlock *inBlock)
+{
+	MDBlockIndex *node, *parent;
+	void *child;
+	int32_t i;
+
+	MDBlockSetNum(inBlock, 0);
+	child = inBlock;
+	node = inBlock->node;
+	inBlock->node = NULL;
+	while (node != NULL) {
+		i = MDBlockIndexFindChild(node, child);
+		node->nchildren--;
+		for ( ; i < node->nchildren; i++)
+			node->children[i] = node->children[i + 1];
+		if (node->nchildren > 0) {
+			/*  The removed child may have carried the largest tick of the ancestors  */
+			MDBlockIndexInvalidateLargestTick(node);
+			break;
 		}
+		/*  The node became empty: remove it from the parent  */
+		parent = node->parent;
+		if (parent == NULL)
+			inTrack->index = NULL;
+		MDTrackFreeIndexNode(inTrack, node);
+		child = node;
+		node = parent;
 	}
 	
-	/*  For debug  */
-	for (ptr = inTrack->pointer; ptr != NULL; ptr = ptr->next) {
-		if (ptr == inPointer || ptr->autoAdjust)
-			MDPointerCheck(inPointer);
+	/*  Collapse the root while it has only one child  */
+	node = inTrack->index;
+	while (node != NULL && node->level > 0 && node->nchildren == 1) {
+		inTrack->index = (MDBlockIndex *)node->children[0];
+		inTrack->index->parent = NULL;
+		MDTrackFreeIndexNode(inTrack, node);
+		node = inTrack->index;
 	}
-	/*  ---------  */
-
-	return count;
 }
 
 /* --------------------------------------
-	･ MDTrackDeleteEvents
+	･ MDTrackIndexLookupPosition
    -------------------------------------- */
-static int32_t
-MDTrackDeleteEvents(MDTrack *inTrack, MDPointer *inPointer, int32_t count)
+/*  Returns the block containing the position *ioPosition (0 <= *ioPosition < inTrack->num),
+    and the index in the block in *ioPosition  */
+static MDBlock *
+MDTrackIndexLookupPosition(const MDTrack *inTrack, int32_t *ioPosition)
 {
-	MDBlock *block, *block2;
-	int32_t index, remain, i, n, tail;
-	MDPointer *ptr;
-
-	if (inTrack == NULL || inPointer == NULL || inPointer->parent != inTrack)
-		return 0;
-	if (count <= 0)
-		return count;
-	
-	block = inPointer->block;
-	index = inPointer->index;
-	remain = count;
-	tail = 0;
-	while (remain > 0 && block != NULL) {
-        block->largestTick = kMDNegativeTick;
-		if (index + remain > block->num)
-			n = block->num - index;
-		else
-			n = remain;
-		for (i = 0; i < n; i++)
-			MDEventClear(block->events + index + i);
-		if (index + n < block->num) {
-			/*  tail: the number of surviving events in the last modified block
-				(used later to modify pointers)  */
-			tail = block->num - (index + n);
-			MDEventMove(block->events + index, block->events + index + n, tail);
+	MDBlockIndex *node;
+	int32_t i, n, pos;
+	pos = *ioPosition;
+	node = inTrack->index;
+	while (1) {
+		for (i = 0; i < node->nchildren - 1; i++) {
+			n = MDBlockIndexChildCount(node, i);
+			if (pos < n)
+				break;
+			pos -= n;
 		}
-		block->num -= n;
-		remain -= n;
-		index = 0;
-		block = block->next;
+		if (node->level == 0)
+			break;
+		node = (MDBlockIndex *)node->children[i];
 	}
+	*ioPosition = pos;
+	return (MDBlock *)node->children[i];
+}
 
-	/*  Purge the empty blocks  */
-	if (block == NULL)
-		block = inTrack->last;
-	while (block != NULL) {
-		int endFlag = 0;
-		if (block->num != 0) {
-			if (block == inPointer->block)
+/* --------------------------------------
+	･ MDBlockIndexFirstTick
+   -------------------------------------- */
+/*  The tick of the first event under the i-th child of inNode (kMDMaxTick if empty)  */
+static MDTickType
+MDBlockIndexFirstTick(const MDBlockIndex *inNode, int32_t idx)
+{
+	MDBlock *block;
+	int32_t i;
+	while (inNode->level > 0) {
+		inNode = (MDBlockIndex *)inNode->children[idx];
+		for (idx = 0; idx < inNode->nchildren; idx++) {
+			if (MDBlockIndexChildCount(inNode, idx) > 0)
 				break;
-			block = block->last;
-			continue;
 		}
-		if (block == inPointer->block) {
-			/*  inPointer is updated to point the next surviving event  */
-			if (block->next != NULL) {
-				inPointer->block = block->next;
-				inPointer->index = 0;
-			} else {
-				inPointer->block = block->last;
-				if (block->last == NULL)
-					inPointer->index = 0;
-				else inPointer->index = block->last->num;
-			}
-			endFlag = 1;
+		if (idx >= inNode->nchildren)
+			return kMDMaxTick;
+	}
+	block = (MDBlock *)inNode->children[idx];
+	i = block->num;
+	return (i > 0 ? MDBlockGetTick(block, 0) : kMDMaxTick);
+}
+
+/* --------------------------------------
+	･ MDTrackIndexLookupTick
+   -------------------------------------- */
+/*  Returns the position of the first event whose tick is not less than inTick. If there
+    is no such event, inTrack->num is returned. The track should not be empty.  */
+static int32_t
+MDTrackIndexLookupTick(const MDTrack *inTrack, MDTickType inTick)
+{
+	MDBlockIndex *node;
+	MDBlock *block;
+	int32_t i, n, last, lastBase, base, lo, hi;
+	node = inTrack->index;
+	base = 0;
+	while (1) {
+		/*  Look for the last non-empty child whose first tick is less than inTick  */
+		last = -1;
+		lastBase = base;
+		for (i = 0; i < node->nchildren; i++) {
+			n = MDBlockIndexChildCount(node, i);
+			if (n == 0)
+				continue;
+			if (MDBlockIndexFirstTick(node, i) >= inTick)
+				break;
+			last = i;
+			lastBase = base;
+			base += n;
 		}
-		block2 = block->last;
-		MDTrackDeallocateBlock(inTrack, block);
-		block = block2;
-		if (endFlag)
+		if (last < 0)
+			return lastBase;  /*  The first event in this subtree is the goal  */
+		base = lastBase;
+		if (node->level == 0)
 			break;
+		node = (MDBlockIndex *)node->children[last];
 	}
+	/*  Binary search in the block  */
+	block = (MDBlock *)node->children[last];
+	lo = 0;
+	hi = block->num;
+	while (lo < hi) {
+		i = (lo + hi) / 2;
+		if (MDBlockGetTick(block, i) < inTick)
+			lo = i + 1;
+		else hi = i;
+	}
+	return base + lo;
+}
 
-	inPointer->removed = 1;
-	inTrack->num -= count;
+#ifdef __MWERKS__
+#pragma mark ====== MDBlock pool (private functions) ======
+#endif
 
-	/*  An ad-hoc sanity check  */
-	if (inPointer->block != NULL && inPointer->block->num == inPointer->index && inPointer->block->next != NULL) {
-		inPointer->block = inPointer->block->next;
-		inPointer->index = 0;
-	}
-	
-	/*  Update pointers  */
-	/*  (1) 0..inPointer->position-1 : no change
-		(2) inPointer->position : position not changed, block/index updated as in inPointer
-		(3) inPointer->position+1..inPointer->position+count : position/block/index are made same as in inPointer
-		(4) inPointer->position+count+1..inPointer->position+count+tail : position -= count, block/index updated
-		(5) inPointer->position+count+tail+1 : position -= count, block/index not changed  */
-	n = inPointer->position;
-	for (ptr = inTrack->pointer; ptr != NULL; ptr = ptr->next) {
-		if (inPointer == ptr || !ptr->autoAdjust)
-			continue;
-		index = ptr->position;
-		if (index > n + count + tail)	/*  case 5  */
-			ptr->position -= count;
-		else if (index >= n) {
-			ptr->position = inPointer->position;
-			ptr->block = inPointer->block;
-			ptr->index = inPointer->index;
-			if (index > n + count) {
-				/*  case 4  */
-				MDPointerSetRelativePosition(ptr, index - (n + count));
-			} else ptr->removed = 1;	/*  case 3 and 2  */
-		} else { /* case 1 */ }
-	}
+/*  Freed MDBlock's are kept in a per-thread cache. When the cache grows beyond the high
+    watermark, it is trimmed down to the low watermark by moving the surplus to the global
+    pool as one batch. The global pool is a lock-free stack of batches; in a batch the
+    blocks are linked by 'next', and the first block keeps the number of blocks in 'num'
+    and the next batch in 'last'. Batches are only pushed by compare-and-swap or taken all
+    at once by an atomic exchange, so the stack is free from the ABA problem.  */
+typedef struct MDBlockCache {
+	MDBlock *	first;		/*  the cached blocks linked by 'next'  */
+	int32_t		count;		/*  the number of cached blocks  */
+} MDBlockCache;
 
-	/*  Another sanity check  */
-	if (inPointer->parent->num == 0 && inPointer->position >= 0) {
-		inPointer->position = -1;
-		inPointer->index = -1;
-		inPointer->block = NULL;
+static int32_t sBlockPoolThreadHigh = 256;	/*  the high watermark of the per-thread cache  */
+static int32_t sBlockPoolThreadLow = 64;	/*  the low watermark of the per-thread cache  */
+static int32_t sBlockPoolGlobalMax = 16384;	/*  the max number of blocks in the global pool  */
+
+static MDBlock * volatile sBlockPoolGlobal = NULL;	/*  the global pool  */
+static volatile int32_t sBlockPoolGlobalCount = 0;	/*  the number of blocks in the global pool  */
+
+static pthread_key_t sBlockCacheKey;
+static pthread_once_t sBlockCacheKeyOnce = PTHREAD_ONCE_INIT;
+
+/* --------------------------------------
+	･ MDBlockPoolGlobalHead
+   -------------------------------------- */
+/*  Atomic read of the top of the global pool  */
+static MDBlock *
+MDBlockPoolGlobalHead(void)
+{
+	return (MDBlock *)__sync_val_compare_and_swap(&sBlockPoolGlobal, NULL, NULL);
+}
+
+/* --------------------------------------
+	･ MDBlockPoolFreeChain
+   -------------------------------------- */
+static void
+MDBlockPoolFreeChain(MDBlock *inBlock)
+{
+	MDBlock *next;
+	while (inBlock != NULL) {
+		next = inBlock->next;
+		free(inBlock->events);
+		free(inBlock->packed);
+		free(inBlock);
+		inBlock = next;
 	}
+}
 
-	/*  For debug  */
-	for (ptr = inTrack->pointer; ptr != NULL; ptr = ptr->next) {
-		if (ptr == inPointer || ptr->autoAdjust)
-			MDPointerCheck(inPointer);
+/* --------------------------------------
+	･ MDBlockPoolPushBatch
+   -------------------------------------- */
+/*  Push the chain inFirst..inLast (inCount blocks linked by 'next') to the global pool.
+    If the global pool is full, the blocks are returned to the OS.  */
+static void
+MDBlockPoolPushBatch(MDBlock *inFirst, MDBlock *inLast, int32_t inCount)
+{
+	MDBlock *head;
+	int32_t count;
+	if (inFirst == NULL)
+		return;
+	inLast->next = NULL;
+	/*  Reserve room in the global pool; the check and the update must be one atomic
+	    step, otherwise concurrent pushes can overshoot the cap  */
+	do {
+		count = __sync_fetch_and_add(&sBlockPoolGlobalCount, 0);
+		if (count + inCount > sBlockPoolGlobalMax) {
+			MDBlockPoolFreeChain(inFirst);
+			return;
+		}
+	} while (!__sync_bool_compare_and_swap(&sBlockPoolGlobalCount, count, count + inCount));
+	inFirst->num = inCount;
+	do {
+		head = MDBlockPoolGlobalHead();
+		inFirst->last = head;
+	} while (!__sync_bool_compare_and_swap(&sBlockPoolGlobal, head, inFirst));
+}
+
+/* --------------------------------------
+	･ MDBlockPoolPopBatch
+   -------------------------------------- */
+/*  Take one batch from the global pool. Returns the first block of the batch (or NULL),
+    and the number of blocks in *outCount.  */
+static MDBlock *
+MDBlockPoolPopBatch(int32_t *outCount)
+{
+	MDBlock *batch, *rest, *tail, *head;
+	*outCount = 0;
+	if (MDBlockPoolGlobalHead() == NULL)
+		return NULL;
+	batch = (MDBlock *)__sync_lock_test_and_set(&sBlockPoolGlobal, NULL);
+	if (batch == NULL)
+		return NULL;
+	*outCount = batch->num;
+	__sync_fetch_and_sub(&sBlockPoolGlobalCount, batch->num);
+	rest = batch->last;
+	if (rest != NULL) {
+		/*  Push back the remaining batches  */
+		for (tail = rest; tail->last != NULL; tail = tail->last)
+			;
+		do {
+			head = MDBlockPoolGlobalHead();
+			tail->last = head;
+		} while (!__sync_bool_compare_and_swap(&sBlockPoolGlobal, head, rest));
 	}
-	/*  ---------  */
+	return batch;
+}
 
-	return count;
+/* --------------------------------------
+	･ MDBlockCacheDestructor
+   -------------------------------------- */
+static void
+MDBlockCacheDestructor(void *inCache)
+{
+	MDBlockCache *cache = (MDBlockCache *)inCache;
+	MDBlock *last;
+	if (cache->first != NULL) {
+		for (last = cache->first; last->next != NULL; last = last->next)
+			;
+		MDBlockPoolPushBatch(cache->first, last, cache->count);
+	}
+	free(cache);
 }
 
-#ifdef __MWERKS__
-#pragma mark ====== New/Retain/Release ======
-#endif
+/* --------------------------------------
+	･ MDBlockCacheMakeKey
+   -------------------------------------- */
+static void
+MDBlockCacheMakeKey(void)
+{
+	pthread_key_create(&sBlockCacheKey, MDBlockCacheDestructor);
+}
 
 /* --------------------------------------
-	･ MDTrackNew
+	･ MDBlockCacheGet
    -------------------------------------- */
-MDTrack *
-MDTrackNew(void)
+/*  Get the cache for the current thread. May return NULL if out of memory.  */
+static MDBlockCache *
+MDBlockCacheGet(void)
 {
-	MDTrack *newTrack = (MDTrack *)malloc(sizeof(*newTrack));
-	if (newTrack == NULL)
-		return NULL;	/* out of memory */
-	memset(newTrack, 0, sizeof(*newTrack));
-	newTrack->refCount = 1;
-    newTrack->dev = -1;
-	return newTrack;
+	MDBlockCache *cache;
+	pthread_once(&sBlockCacheKeyOnce, MDBlockCacheMakeKey);
+	cache = (MDBlockCache *)pthread_getspecific(sBlockCacheKey);
+	if (cache == NULL) {
+		cache = (MDBlockCache *)calloc(sizeof(MDBlockCache), 1);
+		if (cache == NULL)
+			return NULL;
+		if (pthread_setspecific(sBlockCacheKey, cache) != 0) {
+			free(cache);
+			return NULL;
+		}
+	}
+	return cache;
 }
 
 /* --------------------------------------
-	･ MDTrackRetain
+	･ MDBlockPoolGet
    -------------------------------------- */
-void
-MDTrackRetain(MDTrack *inTrack)
+static MDBlock *
+MDBlockPoolGet(int32_t inSize)
 {
-	inTrack->refCount++;
+	MDBlockCache *cache;
+	MDBlock *aBlock;
+	int32_t n;
+
+	cache = MDBlockCacheGet();
+	if (cache != NULL && cache->first == NULL) {
+		/*  Refill from the global pool  */
+		cache->first = MDBlockPoolPopBatch(&n);
+		cache->count = n;
+	}
+	if (cache != NULL && cache->first != NULL) {
+		/*  MDBlock pool から持ってくる  */
+		aBlock = cache->first;
+		cache->first = aBlock->next;
+		cache->count--;
+		if (aBlock->size < inSize) {
+			/*  Too small for the request: the event buffer is reallocated below  */
+			free(aBlock->events);
+			aBlock->events = NULL;
+			aBlock->size = inSize;
+		}
+	} else {
+		aBlock = (MDBlock *)malloc(sizeof(*aBlock));
+		if (aBlock == NULL)
+			/* out of memory */
+			return NULL;
+		aBlock->size = inSize;
+		aBlock->events = NULL;
+		aBlock->packed = NULL;
+		aBlock->shared = NULL;
+		aBlock->arena = NULL;
+		aBlock->arenaEvents = 0;
+	}
+	if (aBlock->events == NULL) {
+		/*  The event buffer is allocated separately, so that it can be freed when packed  */
+		aBlock->events = (MDEvent *)malloc(aBlock->size * sizeof(aBlock->events[0]));
+		if (aBlock->events == NULL) {
+			free(aBlock);
+			return NULL;
+		}
+	}
+	return aBlock;
+}
+
+/* --------------------------------------
+	･ MDBlockPoolPut
+   -------------------------------------- */
+static void
+MDBlockPoolPut(MDBlock *inBlock)
+{
+	MDBlockCache *cache;
+	MDBlock *first, *last;
+	int32_t i, n;
+
+	cache = MDBlockCacheGet();
+	if (cache == NULL) {
+		MDBlockPoolPushBatch(inBlock, inBlock, 1);
+		return;
+	}
+	inBlock->next = cache->first;
+	cache->first = inBlock;
+	cache->count++;
+	if (cache->count > sBlockPoolThreadHigh) {
+		/*  Move the surplus to the global pool  */
+		n = cache->count - sBlockPoolThreadLow;
+		first = last = cache->first;
+		for (i = 1; i < n; i++)
+			last = last->next;
+		cache->first = last->next;
+		cache->count -= n;
+		MDBlockPoolPushBatch(first, last, n);
+	}
+}
+
+/* --------------------------------------
+	･ MDTrackSetBlockPoolWatermarks
+   -------------------------------------- */
+void
+MDTrackSetBlockPoolWatermarks(int32_t inThreadHigh, int32_t inThreadLow, int32_t inGlobalMax)
+{
+	if (inThreadHigh >= 0)
+		sBlockPoolThreadHigh = inThreadHigh;
+	if (inThreadLow >= 0)
+		sBlockPoolThreadLow = inThreadLow;
+	if (sBlockPoolThreadLow > sBlockPoolThreadHigh)
+		sBlockPoolThreadLow = sBlockPoolThreadHigh;
+	if (inGlobalMax >= 0)
+		sBlockPoolGlobalMax = inGlobalMax;
+}
+
+/* --------------------------------------
+	･ MDTrackPurgeBlockPool
+   -------------------------------------- */
+void
+MDTrackPurgeBlockPool(void)
+{
+	MDBlockCache *cache;
+	MDBlock *batch, *next;
+
+	/*  The cache of the current thread  */
+	cache = MDBlockCacheGet();
+	if (cache != NULL) {
+		MDBlockPoolFreeChain(cache->first);
+		cache->first = NULL;
+		cache->count = 0;
+	}
+
+	/*  The global pool  */
+	batch = (MDBlock *)__sync_lock_test_and_set(&sBlockPoolGlobal, NULL);
+	while (batch != NULL) {
+		next = batch->last;
+		__sync_fetch_and_sub(&sBlockPoolGlobalCount, batch->num);
+		MDBlockPoolFreeChain(batch);
+		batch = next;
+	}
+}
+
+
+/* --------------------------------------
+	･ MDArenaBlockGet
+   -------------------------------------- */
+/*  The blocks of a track in an arena are not kept in the block pool; they are recycled
+    by the arena, and dropped all at once when the arena is released  */
+static MDBlock *
+MDArenaBlockGet(MDArena *inArena, int32_t inSize)
+{
+	MDBlock *aBlock;
+	aBlock = (MDBlock *)MDArenaAllocate(inArena, sizeof(MDBlock));
+	if (aBlock == NULL)
+		return NULL;
+	aBlock->size = inSize;
+	aBlock->packed = NULL;
+	aBlock->shared = NULL;
+	aBlock->arena = inArena;
+	aBlock->events = (MDEvent *)MDArenaAllocate(inArena, sizeof(MDEvent) * inSize);
+	aBlock->arenaEvents = 1;
+	if (aBlock->events == NULL) {
+		MDArenaFree(inArena, aBlock, sizeof(MDBlock));
+		return NULL;
+	}
+	return aBlock;
+}
+
+/* --------------------------------------
+	･ MDTrackFreeBlock
+   -------------------------------------- */
+/*  Return an unlinked block (without the packed buffer and the shared events) to the
+    arena or to the block pool  */
+static void
+MDTrackFreeBlock(MDBlock *inBlock)
+{
+	if (inBlock->arena != NULL) {
+		if (inBlock->events != NULL)
+			MDBlockFreeEventBuffer(inBlock, inBlock->events, inBlock->arenaEvents);
+		MDArenaFree(inBlock->arena, inBlock, sizeof(MDBlock));
+	} else MDBlockPoolPut(inBlock);
+}
+
+#ifdef __MWERKS__
+#pragma mark ====== Block manipulation (private functions) ======
+#endif
+
+/* --------------------------------------
+	･ MDBlockInvalidateCache
+   -------------------------------------- */
+/*  Invalidate the largestTick and the kind/channel/code summary. Should be called
+    whenever events are written into the block.  */
+static void
+MDBlockInvalidateCache(MDBlock *inBlock)
+{
+	MDBlockSetLargestTick(inBlock, kMDNegativeTick);
+	inBlock->summaryValid = 0;
+	MDBlockDisposePacked(inBlock);
+}
+
+/* --------------------------------------
+	･ MDBlockAddToSummary
+   -------------------------------------- */
+static void
+MDBlockAddToSummary(MDBlock *inBlock, const MDEvent *inEvent)
+{
+	unsigned char code = MDGetCode(inEvent);
+	inBlock->kinds |= (1U << MDGetKind(inEvent));
+	if (MDIsChannelEvent(inEvent))
+		inBlock->channels |= (1U << (MDGetChannel(inEvent) & 15));
+	inBlock->codes[code >> 5] |= (1U << (code & 31));
+	if (MDIsNoteEvent(inEvent))
+		inBlock->noteKeys[(code >> 5) & 3] |= (1U << (code & 31));
+}
+
+/* --------------------------------------
+	･ MDBlockResetSummary
+   -------------------------------------- */
+/*  Make the summary empty and valid  */
+static void
+MDBlockResetSummary(MDBlock *inBlock)
+{
+	inBlock->kinds = inBlock->channels = 0;
+	memset(inBlock->codes, 0, sizeof(inBlock->codes));
+	memset(inBlock->noteKeys, 0, sizeof(inBlock->noteKeys));
+	inBlock->summaryValid = 1;
+}
+
+/* --------------------------------------
+	･ MDBlockUpdateSummary
+   -------------------------------------- */
+static void
+MDBlockUpdateSummary(MDBlock *inBlock)
+{
+	MDEvent *events;
+	int32_t i;
+	if (inBlock->summaryValid)
+		return;
+	MDBlockResetSummary(inBlock);
+	inBlock->summaryValid = 0;
+	events = MDBlockEvents(inBlock);
+	for (i = 0; i < inBlock->num; i++)
+		MDBlockAddToSummary(inBlock, events + i);
+	inBlock->summaryValid = 1;
+}
+
+/* --------------------------------------
+	･ MDBlockMayMatchFilter
+   -------------------------------------- */
+/*  Returns zero if no event in the block can pass inFilter. Deletion of events keeps
+    the summary a superset of the block contents, so it is not invalidated.  */
+static int
+MDBlockMayMatchFilter(MDBlock *inBlock, const MDEventFilter *inFilter)
+{
+	uint32_t kinds;
+	int i;
+	MDBlockUpdateSummary(inBlock);
+	kinds = inBlock->kinds & inFilter->kinds;
+	if ((inBlock->channels & inFilter->channels) == 0)
+		kinds &= ~kMDEventFilterChannelKinds;
+	if (kinds & inFilter->codeKinds) {
+		for (i = 0; i < 8; i++) {
+			if (inBlock->codes[i] & inFilter->codes[i])
+				break;
+		}
+		if (i == 8)
+			kinds &= ~inFilter->codeKinds;
+	}
+	return (kinds != 0);
+}
+
+/* --------------------------------------
+	･ MDTrackAllocateBlock
+   -------------------------------------- */
+static MDBlock *
+MDTrackAllocateBlock(MDTrack *inTrack, MDBlock *inBlock, int32_t inSize)
+{
+	MDBlock *aBlock;
+
+	if (inTrack->arena != NULL)
+		aBlock = MDArenaBlockGet(inTrack->arena, inSize);
+	else aBlock = MDBlockPoolGet(inSize);
+	if (aBlock == NULL)
+		return NULL;
+
+	if (MDTrackIndexInsertBlock(inTrack, inBlock, aBlock) != kMDNoError) {
+		MDTrackFreeBlock(aBlock);
+		return NULL;
+	}
+
+	aBlock->last = inBlock;
+	if (inBlock == NULL) {
+		/* top of list */
+		aBlock->next = inTrack->first;
+		inTrack->first = aBlock;
+	} else {
+		aBlock->next = inBlock->next;
+		inBlock->next = aBlock;
+	}
+	if (aBlock->next == NULL) {
+		/* bottom of list */
+		inTrack->last = aBlock;
+	} else {
+		aBlock->next->last = aBlock;
+	}
+
+	MDBlockInvalidateCache(aBlock);
+    
+	memset(aBlock->events, 0, aBlock->size * sizeof(aBlock->events[0]));
+
+	inTrack->numBlocks++;
+	MDTrackBumpEpoch(inTrack);
+
+	return aBlock;
+}
+
+/* --------------------------------------
+	･ MDTrackDeallocateBlock
+   -------------------------------------- */
+static void
+MDTrackDeallocateBlock(MDTrack *inTrack, MDBlock *inBlock)
+{
+	if (inBlock->last == NULL) {
+		inTrack->first = inBlock->next;
+	} else {
+		inBlock->last->next = inBlock->next;
+	}
+	if (inBlock->next == NULL) {
+		inTrack->last = inBlock->last;
+	} else {
+		inBlock->next->last = inBlock->last;
+	}
+	MDTrackIndexRemoveBlock(inTrack, inBlock);
+	if (inBlock->shared != NULL)
+		MDBlockReleaseSharedEvents(inBlock);  /*  Empty, so nothing to clear  */
+	if (inBlock->packed != NULL) {
+		free(inBlock->packed);
+		inBlock->packed = NULL;
+	}
+	
+	/*  MDBlock pool (または arena) に戻す  */
+	MDTrackFreeBlock(inBlock);
+
+	inTrack->numBlocks--;
+	MDTrackBumpEpoch(inTrack);
+}
+
+/* --------------------------------------
+	･ MDBlockReleaseContents
+   -------------------------------------- */
+/*  Release the messages and data referred to by the events, the shared events and the
+    packed buffer. The event buffer and the block itself are left to the caller.  */
+static void
+MDBlockReleaseContents(MDBlock *inBlock)
+{
+	MDPackedBlock *pb;
+	MDEvent *ep, ev;
+	int32_t i;
+
+	if (inBlock->shared == NULL || MDBlockReleaseSharedEvents(inBlock)) {
+		/*  パートナー、メッセージなどのポインタを処理して、メモリリーク・
+		    ダングリングポインタが出ないようにする。Only the events having pointers need
+		    this, and the blocks without such events are skipped by the summary.  */
+		if (inBlock->num > 0 && (!inBlock->summaryValid || (inBlock->kinds & kMDBlockPointerKinds) != 0)) {
+			if ((ep = inBlock->events) != NULL) {
+				for (i = 0; i < inBlock->num; i++, ep++) {
+					if (MDPackedEventHasPointer(MDGetKind(ep)))
+						MDEventClear(ep);
+				}
+			} else if ((pb = inBlock->packed) != NULL) {
+				/*  Release the side table without expanding the block  */
+				for (i = 0; i < inBlock->num; i++) {
+					if (MDPackedEventHasPointer(pb->events[i].kind & 31)) {
+						MDEventInit(&ev);
+						MDSetKind(&ev, pb->events[i].kind & 31);
+						ev.u.dataptr = pb->side[pb->events[i].u];
+						MDEventClear(&ev);
+					}
+				}
+			}
+		}
+	}
+	if (inBlock->packed != NULL) {
+		free(inBlock->packed);
+		inBlock->packed = NULL;
+	}
+}
+
+/* --------------------------------------
+	･ MDTrackFreeIndexTree
+   -------------------------------------- */
+static void
+MDTrackFreeIndexTree(MDTrack *inTrack, MDBlockIndex *inNode)
+{
+	int32_t i;
+	if (inNode == NULL)
+		return;
+	if (inNode->level > 0) {
+		for (i = 0; i < inNode->nchildren; i++)
+			MDTrackFreeIndexTree(inTrack, (MDBlockIndex *)inNode->children[i]);
+	}
+	MDTrackFreeIndexNode(inTrack, inNode);
+}
+
+/* --------------------------------------
+	･ MDTrackUpdateLargestTickForBlock
+ -------------------------------------- */
+static void
+MDTrackUpdateLargestTickForBlock(MDTrack *inTrack, MDBlock *inBlock)
+{
+    MDTickType tick, largestTick;
+    int i;
+    MDEvent *ep;
+    if (inBlock->largestTick < 0) {
+        /*  Recalc the largest tick and cache it  */
+        largestTick = kMDNegativeTick;
+        for (i = 0; i < inBlock->num; i++) {
+            ep = &MDBlockEvents(inBlock)[i];
+            tick = MDGetTick(ep);
+            if (MDHasDuration(ep))
+                tick += MDGetDuration(ep);
+            if (tick > largestTick)
+                largestTick = tick;
+        }
+        inBlock->largestTick = largestTick;
+    }
+}
+
+#if 0
+#pragma mark ====== Manipulation of extraInfo ======
+#endif
+
+/* --------------------------------------
+ ･ MDTrackCountExtraInfo
+ -------------------------------------- */
+int32_t
+MDTrackCountExtraInfo(const MDTrack *inTrack)
+{
+    int i;
+    if (inTrack == NULL || inTrack->extraInfo == NULL)
+        return 0;
+    i = 0;
+    while (inTrack->extraInfo[i] != NULL)
+        i += 2;
+    return i / 2;
+}
+
+int32_t
+MDTrackGetExtraInfo(const MDTrack *inTrack, const char *key, const char **outValue)
+{
+    int i, n;
+    if (inTrack == NULL)
+        return -1;
+    n = MDTrackCountExtraInfo(inTrack);
+    for (i = 0; i < n; i++) {
+        if (strcmp(inTrack->extraInfo[i * 2], key) == 0) {
+            if (outValue != NULL)
+                *outValue = inTrack->extraInfo[i * 2 + 1];
+            return i;
+        }
+    }
+    return -1;
+}
+
+int32_t
+MDTrackSetExtraInfo(MDTrack *inTrack, const char *key, const char *value)
+{
+    int n;
+    if (inTrack == NULL)
+        return -1;
+    n = MDTrackGetExtraInfo(inTrack, key, NULL);
+    if (n >= 0) {
+        /*  Found  */
+        free(inTrack->extraInfo[n * 2 + 1]);
+        if (value != NULL) {
+            /*  Replace the value  */
+            inTrack->extraInfo[n * 2 + 1] = strdup(value);
+        } else {
+            /*  Remove the key and value  */
+            int m = MDTrackCountExtraInfo(inTrack);
+            memmove(inTrack->extraInfo + (n * 2), inTrack->extraInfo + (n * 2 + 2), sizeof(char *) * (2 * (m - n) + 1));
+        }
+        return n;
+    } else {
+        /*  Create a new entry  */
+        int m = MDTrackCountExtraInfo(inTrack);
+        if (value == NULL)
+            return -1;  /*  Do nothing  */
+        if (m == 0 || m % 8 == 7) {
+            char **p = (char **)realloc(inTrack->extraInfo, ((m + 9) / 8) * sizeof(char *) * 16);
+            if (p == NULL)
+                return -1;  /*  Cannot allocate  */
+            inTrack->extraInfo = p;
+            p[m * 2] = strdup(key);
+            p[m * 2 + 1] = strdup(value);
+            p[m * 2 + 2] = NULL;
+        }
+        return m;
+    }
+}
+
+const char *MDTrackGetExtraInfoAtIndex(const MDTrack *inTrack, int32_t index, const char **outKey)
+{
+    int n = MDTrackCountExtraInfo(inTrack);
+    if (index < 0 || index >= n)
+        return NULL;
+    if (outKey != NULL)
+        *outKey = inTrack->extraInfo[index * 2];
+    return inTrack->extraInfo[index * 2 + 1];
+}
+
+#ifdef __MWERKS__
+#pragma mark ====== Basic Insert/Delete (private functions) ======
+#endif
+
+/* --------------------------------------
+	･ MDTrackLogEdit
+   -------------------------------------- */
+/*  Record an insertion (inCount > 0) or deletion (inCount < 0) at inPosition, which is
+    applied to the autoAdjust pointers when they are used next time  */
+static void
+MDTrackLogEdit(MDTrack *inTrack, int32_t inPosition, int32_t inCount)
+{
+	MDPointerEdit *ep;
+	MDTrackBumpEpoch(inTrack);
+	ep = &inTrack->edits[inTrack->nedits++];
+	ep->epoch = inTrack->epoch;
+	ep->position = inPosition;
+	ep->count = inCount;
+	if (inTrack->nedits >= kMDPointerEditLogSize)
+		MDTrackSyncPointers(inTrack);
+}
+
+/* --------------------------------------
+	･ MDTrackInsertBlanks
+   -------------------------------------- */
+static int32_t
+MDTrackInsertBlanks(MDTrack *inTrack, MDPointer *inPointer, int32_t count)
+{
+	MDBlock *block1, *block2;
+	int32_t index, room, num2, tail;
+
+	if (count <= 0)
+		return count;
+
+	MDPointerSync(inPointer);
+	block1 = inPointer->block;
+	index = inPointer->index;
+
+	if (inTrack->num == 0 || block1 == NULL) {
+		room = tail = 0;
+	} else {
+		/*  room: the number of available space  */
+		room = block1->size - block1->num;
+		/*  tail: the number of events that needs to be moved (i.e. after index in block1)  */
+		tail = block1->num - index;
+	}
+	if (room >= count) {
+		/*  The current block have enough room for the required blanks  */
+		MDEventMove(MDBlockMutableEvents(block1) + index + count, MDBlockMutableEvents(block1) + index, tail);
+		MDBlockSetNum(block1, block1->num + count);
+        MDBlockInvalidateCache(block1);
+	} else {
+		/*  Allocate new blocks until there are enough room  */
+		block2 = block1;
+		while (room < count) {
+			block2 = MDTrackAllocateBlock(inTrack, block2, kMDBlockSize);
+			if (block2 == NULL) {
+				/*  Out of memory: clean up the allocated blocks  */
+				if (block1 != NULL) {
+					while (block1->next != NULL && block1->next->num == 0)
+						MDTrackDeallocateBlock(inTrack, block1->next);
+				}
+				return 0;
+			}
+			room += block2->size;
+		}
+		/*  block2: the last allocated block  */
+		/*  num2: the number of events (possibly including blanks) in block2  */
+		num2 = block2->size - (room - count);
+		/*  Move the events after index in block1 if necessary  */
+		if (tail > 0) {
+			if (tail <= num2) {
+				MDEventMove(MDBlockMutableEvents(block2) + num2 - tail, MDBlockMutableEvents(block1) + index, tail);
+			} else {
+				/*  block1->events[index..num-num2-1] ====> block2->last->events[size-(tail-num2)..size-1]
+				    block1->events[num-num2..num-1]   ====> block2->events[0..num2-1] */
+				MDEventMove(MDBlockMutableEvents(block2), MDBlockMutableEvents(block1) + (block1->num - num2), num2);
+				MDEventMove(MDBlockMutableEvents(block2->last) + block2->last->size - (tail - num2), MDBlockMutableEvents(block1) + index, tail - num2);
+			}
+		}
+		/*  Invalidate the largestTick field  */
+		if (block1 != NULL)
+			MDBlockInvalidateCache(block1);
+		/*  update the num fields of modified blocks  */
+		MDBlockSetNum(block2, num2);		/*  the last allocated block  */
+		/*  other blocks  */
+		if (block1 == NULL)
+			block1 = inTrack->first;
+		while (block1 != block2) {
+			MDBlockSetNum(block1, block1->size);
+			block1 = block1->next;
+		}
+	}
+	inTrack->num += count;
+	
+	if (inPointer->block == NULL) {
+		inPointer->block = inTrack->first;
+		inPointer->position = inPointer->index = 0;
+	} else if (inPointer->index == inPointer->block->size) {
+		/*  The pointer was at the end of track, and the last block in the track
+		    had maximum number of events. In this case, a new block must have been
+			allocated, so we move on to the next block and point to the first
+			event in that block.  */
+		inPointer->block = inPointer->block->next;
+		inPointer->index = 0;
+	}
+
+	/*  Update pointers  */
+	/*  The other pointers are updated lazily (see MDPointerSync): the autoAdjust pointers
+	    after inPointer->position are moved by count, and the others keep their positions  */
+	MDTrackLogEdit(inTrack, inPointer->position, count);
+	inPointer->epoch = inTrack->epoch;
+
+	return count;
+}
+
+/* --------------------------------------
+	･ MDTrackDeleteEvents
+   -------------------------------------- */
+static int32_t
+MDTrackDeleteEvents(MDTrack *inTrack, MDPointer *inPointer, int32_t count)
+{
+	MDBlock *block, *block2;
+	int32_t index, remain, i, n, tail;
+
+	if (inTrack == NULL || inPointer == NULL || inPointer->parent != inTrack)
+		return 0;
+	if (count <= 0)
+		return count;
+	
+	MDPointerSync(inPointer);
+	block = inPointer->block;
+	index = inPointer->index;
+	remain = count;
+	tail = 0;
+	while (remain > 0 && block != NULL) {
+        MDBlockSetLargestTick(block, kMDNegativeTick);
+		if (index + remain > block->num)
+			n = block->num - index;
+		else
+			n = remain;
+		for (i = 0; i < n; i++)
+			MDEventClear(MDBlockMutableEvents(block) + index + i);
+		if (index + n < block->num) {
+			/*  tail: the number of surviving events in the last modified block
+				(used later to modify pointers)  */
+			tail = block->num - (index + n);
+			MDEventMove(MDBlockMutableEvents(block) + index, MDBlockMutableEvents(block) + index + n, tail);
+		}
+		MDBlockSetNum(block, block->num - n);
+		remain -= n;
+		index = 0;
+		block = block->next;
+	}
+
+	/*  Purge the empty blocks  */
+	if (block == NULL)
+		block = inTrack->last;
+	while (block != NULL) {
+		int endFlag = 0;
+		if (block->num != 0) {
+			if (block == inPointer->block)
+				break;
+			block = block->last;
+			continue;
+		}
+		if (block == inPointer->block) {
+			/*  inPointer is updated to point the next surviving event  */
+			if (block->next != NULL) {
+				inPointer->block = block->next;
+				inPointer->index = 0;
+			} else {
+				inPointer->block = block->last;
+				if (block->last == NULL)
+					inPointer->index = 0;
+				else inPointer->index = block->last->num;
+			}
+			endFlag = 1;
+		}
+		block2 = block->last;
+		MDTrackDeallocateBlock(inTrack, block);
+		block = block2;
+		if (endFlag)
+			break;
+	}
+
+	inPointer->removed = 1;
+	inTrack->num -= count;
+
+	/*  An ad-hoc sanity check  */
+	if (inPointer->block != NULL && inPointer->block->num == inPointer->index && inPointer->block->next != NULL) {
+		inPointer->block = inPointer->block->next;
+		inPointer->index = 0;
+	}
+	
+	/*  Update pointers  */
+	/*  The other pointers are updated lazily (see MDPointerSync): the autoAdjust pointers
+	    in inPointer->position..inPointer->position+count are moved to inPointer->position
+	    and marked as removed, those after them are moved by -count, and the others keep
+	    their positions  */
+	MDTrackLogEdit(inTrack, inPointer->position, -count);
+	inPointer->epoch = inTrack->epoch;
+
+	/*  Another sanity check  */
+	if (inPointer->parent->num == 0 && inPointer->position >= 0) {
+		inPointer->position = -1;
+		inPointer->index = -1;
+		inPointer->block = NULL;
+	}
+
+	return count;
+}
+
+#ifdef __MWERKS__
+#pragma mark ====== Compaction ======
+#endif
+
+/* --------------------------------------
+	･ MDTrackSetCompactThreshold
+   -------------------------------------- */
+void
+MDTrackSetCompactThreshold(float inRatio)
+{
+	sMDTrackCompactThreshold = inRatio;
+}
+
+/* --------------------------------------
+	･ MDTrackCompact
+   -------------------------------------- */
+int32_t
+MDTrackCompact(MDTrack *inTrack)
+{
+	MDBlock *sblock, *dblock, *block, *block2;
+	int32_t sindex, dindex, n, count;
+
+	if (inTrack == NULL || inTrack->first == NULL)
+		return 0;
+	if (inTrack->numBlocks <= (inTrack->num + kMDBlockSize - 1) / kMDBlockSize)
+		return 0;	/*  Already compact  */
+
+	/*  Move the events forward in one pass. The destination never goes past the source.  */
+	dblock = inTrack->first;
+	dindex = 0;
+	for (sblock = inTrack->first; sblock != NULL; sblock = sblock->next) {
+		sindex = 0;
+		while (sindex < sblock->num) {
+			if (dindex == dblock->size) {
+				dblock = dblock->next;
+				dindex = 0;
+			}
+			n = sblock->num - sindex;
+			if (n > dblock->size - dindex)
+				n = dblock->size - dindex;
+			MDEventMove(MDBlockMutableEvents(dblock) + dindex, MDBlockMutableEvents(sblock) + sindex, n);
+			sindex += n;
+			dindex += n;
+		}
+	}
+
+	/*  Update the number of events, and purge the blocks after dblock  */
+	count = 0;
+	block = inTrack->first;
+	while (block != NULL) {
+		block2 = block->next;
+		if (dblock == NULL || (block == dblock && dindex == 0)) {
+			MDBlockSetNum(block, 0);
+			MDTrackDeallocateBlock(inTrack, block);
+			dblock = NULL;
+			count++;
+		} else {
+			if (block == dblock) {
+				MDBlockSetNum(block, dindex);
+				dblock = NULL;
+			} else MDBlockSetNum(block, block->size);
+			MDBlockInvalidateCache(block);
+		}
+		block = block2;
+	}
+
+	/*  The positions do not change; the block/index of the pointers are looked up again
+	    when they are used next time  */
+	MDTrackBumpEpoch(inTrack);
+
+	return count;
+}
+
+/* --------------------------------------
+	･ MDTrackCompactIfNeeded
+   -------------------------------------- */
+static void
+MDTrackCompactIfNeeded(MDTrack *inTrack)
+{
+	if (sMDTrackCompactThreshold > 0 && inTrack->numBlocks >= kMDTrackCompactMinBlocks
+	&& inTrack->num < sMDTrackCompactThreshold * inTrack->numBlocks * kMDBlockSize)
+		MDTrackCompact(inTrack);
+}
+
+/* --------------------------------------
+	･ MDTrackPack
+   -------------------------------------- */
+int32_t
+MDTrackPack(MDTrack *inTrack)
+{
+	MDBlock *block;
+	int32_t count = 0;
+	if (inTrack == NULL || MDTrackPeekLoader(inTrack) != NULL)
+		return 0;  /*  Not loaded yet: it will be packed when loaded  */
+	for (block = inTrack->first; block != NULL; block = block->next) {
+		if (block->events == NULL)
+			continue;
+		/*  The caches stay valid while the block is packed  */
+		MDBlockUpdateSummary(block);
+		MDTrackUpdateLargestTickForBlock(inTrack, block);
+		if (MDBlockPack(block))
+			count++;
+	}
+	return count;
+}
+
+/* --------------------------------------
+	･ MDTrackUnpack
+   -------------------------------------- */
+void
+MDTrackUnpack(MDTrack *inTrack)
+{
+	MDBlock *block;
+	if (inTrack == NULL)
+		return;
+	for (block = inTrack->first; block != NULL; block = block->next) {
+		MDBlockEvents(block);
+		MDBlockDisposePacked(block);
+	}
+}
+
+#ifdef __MWERKS__
+#pragma mark ====== New/Retain/Release ======
+#endif
+
+/* --------------------------------------
+	･ MDTrackNew
+   -------------------------------------- */
+MDTrack *
+MDTrackNew(void)
+{
+	MDTrack *newTrack = (MDTrack *)malloc(sizeof(*newTrack));
+	if (newTrack == NULL)
+		return NULL;	/* out of memory */
+	memset(newTrack, 0, sizeof(*newTrack));
+	newTrack->refCount = 1;
+    newTrack->dev = -1;
+	return newTrack;
+}
+
+/* --------------------------------------
+	･ MDTrackRetain
+   -------------------------------------- */
+void
+MDTrackRetain(MDTrack *inTrack)
+{
+	inTrack->refCount++;
+}
+
+/* --------------------------------------
+	･ MDTrackRelease
+   -------------------------------------- */
+void
+MDTrackRelease(MDTrack *inTrack)
+{
+	if (--inTrack->refCount == 0) {
+		if (inTrack->num != 0)
+			MDTrackClear(inTrack);
+		if (inTrack->loader != NULL)
+			MDTrackDisposeLoader(inTrack);
+
+		/*  Remove the MDPointer's from the linked list  */
+		while (inTrack->pointer != NULL)
+			MDPointerSetTrack(inTrack->pointer, NULL);
+
+        /*  Release random fields  */
+        if (inTrack->name != NULL)
+            free(inTrack->name);
+        if (inTrack->devname != NULL)
+            free(inTrack->devname);
+        if (inTrack->extraInfo != NULL) {
+            int i;
+            for (i = 0; inTrack->extraInfo[i] != NULL; i++)
+                free(inTrack->extraInfo[i]);
+            free(inTrack->extraInfo);
+        }
+		if (inTrack->arena != NULL)
+			MDArenaRelease(inTrack->arena);
+		free(inTrack);
+	}
+}
+
+/* --------------------------------------
+	･ MDTrackClear
+   -------------------------------------- */
+void
+MDTrackClear(MDTrack *inTrack)
+{
+	MDPointer *pointer;
+	MDBlock *block, *next;
+	int recycle;
+
+	if (inTrack->loader != NULL)
+		MDTrackDisposeLoader(inTrack);  /*  The events are not needed any more  */
+
+	/*  Dispose all blocks at once, instead of unlinking them one by one. The blocks and
+	    the index nodes in a closed arena are left as they are; they will go away with
+	    the arena.  */
+	recycle = (inTrack->arena == NULL || !MDArenaIsClosed(inTrack->arena));
+	for (block = inTrack->first; block != NULL; block = next) {
+		next = block->next;
+		MDBlockReleaseContents(block);
+		if (recycle)
+			MDTrackFreeBlock(block);
+		else if (block->events != NULL && !block->arenaEvents)
+			free(block->events);
+	}
+	if (recycle)
+		MDTrackFreeIndexTree(inTrack, inTrack->index);
+	inTrack->first = inTrack->last = NULL;
+	inTrack->index = NULL;
+	inTrack->numBlocks = 0;
+	inTrack->num = 0;
+	inTrack->nedits = 0;
+	MDTrackBumpEpoch(inTrack);
+	
+	/*  Reset the MDPointers  */
+	for (pointer = inTrack->pointer; pointer != NULL; pointer = pointer->next) {
+		MDPointerSetPosition(pointer, -1);
+	}
+}
+
+/* --------------------------------------
+	･ MDTrackSetArena
+   -------------------------------------- */
+MDStatus
+MDTrackSetArena(MDTrack *inTrack, MDArena *inArena)
+{
+	if (inTrack->arena == inArena)
+		return kMDNoError;
+	if (inTrack->first != NULL || inTrack->index != NULL)
+		return kMDErrorBadParameter;  /*  The existing blocks cannot be moved  */
+	if (inArena != NULL)
+		MDArenaRetain(inArena);
+	if (inTrack->arena != NULL)
+		MDArenaRelease(inTrack->arena);
+	inTrack->arena = inArena;
+	return kMDNoError;
+}
+
+/* --------------------------------------
+	･ MDTrackGetArena
+   -------------------------------------- */
+MDArena *
+MDTrackGetArena(const MDTrack *inTrack)
+{
+	return inTrack->arena;
+}
+
+/* --------------------------------------
+	･ MDTrackNewFromTrackInArena
+   -------------------------------------- */
+static MDTrack *
+MDTrackNewFromTrackInArena(const MDTrack *inTrack, MDArena *inArena)
+{
+	MDBlock *block, *newBlock;
+	MDTrack *newTrack;
+    const char *key, *value;
+	int i;
+	
+	/*  Allocate a new track  */
+	newTrack = MDTrackNew();
+	if (newTrack == NULL)
+		return NULL;
+	MDTrackSetArena(newTrack, inArena);
+
+	/*  A track that is not loaded yet is copied as another lazily loaded track  */
+	if (MDTrackPeekLoader(inTrack) != NULL && MDTrackCloneLoader(inTrack, newTrack))
+		block = NULL;
+	else if (MDTrackLoadIfNeeded(inTrack) != kMDNoError) {
+		MDTrackRelease(newTrack);
+		return NULL;
+	} else block = inTrack->first;
+	
+	/*  Share the events block by block; they are copied when either track modifies them  */
+	for ( ; block != NULL; block = block->next) {
+		if (block->num == 0)
+			continue;
+		newBlock = MDTrackAllocateBlock(newTrack, newTrack->last, block->size);
+		if (newBlock == NULL || MDBlockShareEvents(block, newBlock) != kMDNoError) {
+			MDTrackRelease(newTrack);
+			return NULL;
+		}
+		MDBlockSetNum(newBlock, block->num);
+		newTrack->num += block->num;
+		MDBlockSetLargestTick(newBlock, block->largestTick);
+		if (block->summaryValid) {
+			newBlock->kinds = block->kinds;
+			newBlock->channels = block->channels;
+			memcpy(newBlock->codes, block->codes, sizeof(block->codes));
+			memcpy(newBlock->noteKeys, block->noteKeys, sizeof(block->noteKeys));
+			newBlock->summaryValid = 1;
+		}
+	}
+		
+	/*  Copy random fields  */
+	for (i = 0; i < 18; i++)
+		newTrack->nch[i] = inTrack->nch[i];
+    newTrack->dev = inTrack->dev;
+    newTrack->channel = inTrack->channel;
+	newTrack->duration = inTrack->duration;
+	if (inTrack->name != NULL)
+		newTrack->name = strdup(inTrack->name);
+	if (inTrack->devname != NULL)
+		newTrack->devname = strdup(inTrack->devname);
+    for (i = 0; (value = MDTrackGetExtraInfoAtIndex(inTrack, i, &key)) != NULL; i++) {
+        MDTrackSetExtraInfo(newTrack, key, value);
+    }
+    
+	return newTrack;
+}
+
+/* --------------------------------------
+	･ MDTrackNewFromTrack
+   -------------------------------------- */
+MDTrack *
+MDTrackNewFromTrack(const MDTrack *inTrack)
+{
+	return MDTrackNewFromTrackInArena(inTrack, NULL);
+}
+
+/*  Exchange the contents of two MDTracks. The tracks should not have any
+    "parents" such as MDSequence. Otherwise, the results are undefined.  */
+void
+MDTrackExchange(MDTrack *inTrack1, MDTrack *inTrack2)
+{
+	MDTrack tempTrack;
+	MDPointer *pointer;
+
+	/*  Exchange the contents of the MDTrack struct  */
+	tempTrack = *inTrack1;
+	*inTrack1 = *inTrack2;
+	*inTrack2 = tempTrack;
+	
+	/*  Update the MDPointers  */
+	for (pointer = inTrack1->pointer; pointer != NULL; pointer = pointer->next)
+		pointer->parent = inTrack2;
+	for (pointer = inTrack2->pointer; pointer != NULL; pointer = pointer->next)
+		pointer->parent = inTrack1;
+}
+
+/* --------------------------------------
+	･ MDTrackRestoreFromTrack
+   -------------------------------------- */
+MDStatus
+MDTrackRestoreFromTrack(MDTrack *inTrack, const MDTrack *inSource)
+{
+	MDTrack *tempTrack;
+	MDTrackLoader *loader;
+	MDStatus sts;
+	int i;
+
+	/*  Make a sharing copy of the source, and take over its contents. The reference count,
+	    the attribute and the MDPointers stay with inTrack. The copy is made in the arena
+	    of inTrack, so that the blocks and the index nodes are exchanged within the arena.  */
+	tempTrack = MDTrackNewFromTrackInArena(inSource, inTrack->arena);
+	if (tempTrack == NULL)
+		return kMDErrorOutOfMemory;
+	if (tempTrack->loader != NULL && inTrack->pointer != NULL) {
+		/*  The source is not loaded yet; inTrack can take over the loader only if no
+		    MDPointer needs the events  */
+		if ((sts = MDTrackLoad(tempTrack)) != kMDNoError) {
+			MDTrackRelease(tempTrack);
+			return sts;
+		}
+	}
+	if (inTrack->loader != NULL)
+		MDTrackDisposeLoader(inTrack);  /*  The events are replaced  */
+	MDTrackSyncPointers(inTrack);
+
+#define SWAP_FIELD(type, field) { type t_ = inTrack->field; inTrack->field = tempTrack->field; tempTrack->field = t_; }
+	SWAP_FIELD(int32_t, num);
+	SWAP_FIELD(int32_t, numBlocks);
+	SWAP_FIELD(char *, name);
+	SWAP_FIELD(char *, devname);
+	SWAP_FIELD(char **, extraInfo);
+	SWAP_FIELD(MDBlock *, first);
+	SWAP_FIELD(MDBlock *, last);
+	SWAP_FIELD(MDBlockIndex *, index);
+	SWAP_FIELD(MDTickType, duration);
+	SWAP_FIELD(int32_t, dev);
+	SWAP_FIELD(short, channel);
+	for (i = 0; i < 18; i++)
+		SWAP_FIELD(int32_t, nch[i]);
+#undef SWAP_FIELD
+	if ((loader = tempTrack->loader) != NULL) {
+		tempTrack->loader = NULL;
+		__atomic_store_n(&inTrack->loader, loader, __ATOMIC_RELEASE);
+	}
+
+	/*  The old contents are released together with tempTrack  */
+	MDTrackRelease(tempTrack);
+
+	/*  The MDPointers keep the same positions (or move to the end of the track) when they
+	    are used next time  */
+	MDTrackBumpEpoch(inTrack);
+	return kMDNoError;
+}
+
+/* --------------------------------------
+	･ MDTrackHasSameProperties
+   -------------------------------------- */
+static int
+MDTrackCompareStrings(const char *s1, const char *s2)
+{
+	if (s1 == NULL || s2 == NULL)
+		return (s1 == s2 ? 0 : 1);
+	return strcmp(s1, s2);
+}
+
+int
+MDTrackHasSameProperties(const MDTrack *inTrack1, const MDTrack *inTrack2)
+{
+	int i, n;
+	if (inTrack1->duration != inTrack2->duration || inTrack1->dev != inTrack2->dev
+	|| inTrack1->channel != inTrack2->channel || inTrack1->attribute != inTrack2->attribute
+	|| MDTrackCompareStrings(inTrack1->name, inTrack2->name) != 0
+	|| MDTrackCompareStrings(inTrack1->devname, inTrack2->devname) != 0)
+		return 0;
+	n = MDTrackCountExtraInfo(inTrack1);
+	if (n != MDTrackCountExtraInfo(inTrack2))
+		return 0;
+	for (i = 0; i < n * 2; i++) {
+		if (MDTrackCompareStrings(inTrack1->extraInfo[i], inTrack2->extraInfo[i]) != 0)
+			return 0;
+	}
+	return 1;
+}
+
+/* --------------------------------------
+	･ MDTrackGetMemoryUsage
+   -------------------------------------- */
+size_t
+MDTrackGetMemoryUsage(const MDTrack *inTrack)
+{
+	MDBlock *block;
+	size_t size;
+	int32_t shared;
+
+	size = sizeof(MDTrack) + inTrack->numBlocks * sizeof(MDBlock);
+	size += (inTrack->numBlocks + kMDBlockIndexFanout - 2) / (kMDBlockIndexFanout - 1) * sizeof(MDBlockIndex);
+	for (block = inTrack->first; block != NULL; block = block->next) {
+		if (block->events != NULL) {
+			/*  Shared events are counted in proportion to the number of owners  */
+			shared = (block->shared != NULL ? *block->shared : 1);
+			size += block->size * sizeof(MDEvent) / (shared > 0 ? shared : 1);
+		} else if (block->packed != NULL) {
+			size += sizeof(MDPackedBlock) + (block->num - 1) * sizeof(MDPackedEvent);
+		}
+	}
+	return size;
+}
+
+#ifdef __MWERKS__
+#pragma mark ====== Lazy loading ======
+#endif
+
+/*  Dispose the source of a loader that has been detached from its track, unless it is
+    still shared with the loaders of other tracks  */
+static void
+MDTrackLoaderReleaseSource(MDTrackLoader *inLoader)
+{
+	if (inLoader->sources != NULL) {
+		if (__sync_sub_and_fetch(inLoader->sources, 1) != 0)
+			return;
+		free(inLoader->sources);
+	}
+	if (inLoader->dispose != NULL)
+		(*inLoader->dispose)(inLoader->refCon);
+}
+
+/*  Dispose the loader without loading the events  */
+static void
+MDTrackDisposeLoader(MDTrack *inTrack)
+{
+	MDTrackLoader *loader;
+	int last;
+	pthread_mutex_lock(&sMDTrackLoadMutex);
+	while ((loader = inTrack->loader) != NULL && loader->loading)
+		pthread_cond_wait(&sMDTrackLoadCond, &sMDTrackLoadMutex);  /*  Let the loading finish  */
+	inTrack->loader = NULL;
+	last = 0;
+	if (loader != NULL) {
+		loader->detached = 1;
+		last = (loader->users == 0);  /*  Otherwise the threads woken after a failed load free it  */
+	}
+	pthread_mutex_unlock(&sMDTrackLoadMutex);
+	if (loader != NULL) {
+		MDTrackLoaderReleaseSource(loader);
+		if (last)
+			free(loader);
+	}
+}
+
+/*  Give inNewTrack (a new empty track) a loader that makes the same events as inTrack will.
+    Returns non-zero if done, or zero if inTrack has been loaded (or memory is short), in
+    which case the events should be copied instead. The source (refCon) is shared, and
+    disposed when the last of the sharing loaders is done with it.  */
+static int
+MDTrackCloneLoader(const MDTrack *inTrack, MDTrack *inNewTrack)
+{
+	MDTrackLoader *loader, *newLoader;
+	int32_t *sources;
+	newLoader = (MDTrackLoader *)malloc(sizeof(MDTrackLoader));
+	if (newLoader == NULL)
+		return 0;
+	pthread_mutex_lock(&sMDTrackLoadMutex);
+	loader = inTrack->loader;
+	if (loader != NULL && loader->sources == NULL) {
+		if ((sources = (int32_t *)malloc(sizeof(int32_t))) == NULL)
+			loader = NULL;
+		else {
+			*sources = 1;
+			loader->sources = sources;
+		}
+	}
+	if (loader != NULL) {
+		memcpy(newLoader, loader, sizeof(MDTrackLoader));
+		newLoader->loading = newLoader->detached = 0;
+		newLoader->users = 0;
+		newLoader->result = kMDNoError;
+		__sync_fetch_and_add(loader->sources, 1);
+		inNewTrack->loader = newLoader;
+	}
+	pthread_mutex_unlock(&sMDTrackLoadMutex);
+	if (loader == NULL) {
+		free(newLoader);
+		return 0;
+	}
+	return 1;
+}
+
+/*  Copy the event counts known without loading (the 18 elements of nch). Returns non-zero
+    if copied; otherwise the track is loaded (or fails to load) and the caller should look
+    at the track itself.  */
+static int
+MDTrackCopyLoaderCounts(const MDTrack *inTrack, int32_t *outCounts)
+{
+	MDTrackLoader *loader;
+	int known = 0;
+	pthread_mutex_lock(&sMDTrackLoadMutex);
+	loader = inTrack->loader;
+	if (loader != NULL && loader->num >= 0) {
+		memcpy(outCounts, loader->nch, sizeof(loader->nch));
+		known = 1;
+	}
+	pthread_mutex_unlock(&sMDTrackLoadMutex);
+	if (!known && loader != NULL)
+		MDTrackLoad((MDTrack *)inTrack);
+	return known;
+}
+
+/*  Remap the channels of the events (and the counts) of a loaded track  */
+static void
+MDTrackRemapChannelOfEvents(MDTrack *inTrack, const unsigned char *newch)
+{
+    int32_t nnch[16];
+    int32_t n;
+    MDBlock *block;
+    for (n = 0; n < 16; n++)
+        nnch[n] = 0;
+    for (block = inTrack->first; block != NULL; block = block->next) {
+        MDEvent *ep = MDBlockMutableEvents(block);
+        for (n = 0; n < block->num; n++, ep++) {
+            if (MDIsChannelEvent(ep)) {
+                unsigned char ch;
+                ch = (newch[MDGetChannel(ep) & 15]) & 15;
+                MDSetChannel(ep, ch);
+                nnch[ch]++;
+            }
+        }
+        MDBlockInvalidateCache(block);
+    }
+    for (n = 0; n < 16; n++)
+        inTrack->nch[n] = nnch[n];
+    MDTrackBumpEpoch(inTrack);
 }
 
 /* --------------------------------------
-	･ MDTrackRelease
+	･ MDTrackSetLoader
    -------------------------------------- */
-void
-MDTrackRelease(MDTrack *inTrack)
+MDStatus
+MDTrackSetLoader(MDTrack *inTrack, MDTrackLoaderProc inProc, MDTrackLoaderDisposeProc inDispose, void *inRefCon, const int32_t *inCounts)
 {
-	if (--inTrack->refCount == 0) {
-		if (inTrack->num != 0)
-			MDTrackClear(inTrack);
-
-		/*  Remove the MDPointer's from the linked list  */
-		while (inTrack->pointer != NULL)
-			MDPointerSetTrack(inTrack->pointer, NULL);
-
-        /*  Release random fields  */
-        if (inTrack->name != NULL)
-            free(inTrack->name);
-        if (inTrack->devname != NULL)
-            free(inTrack->devname);
-        if (inTrack->extraInfo != NULL) {
-            int i;
-            for (i = 0; inTrack->extraInfo[i] != NULL; i++)
-                free(inTrack->extraInfo[i]);
-            free(inTrack->extraInfo);
-        }
-		free(inTrack);
+	MDTrackLoader *loader;
+	int i;
+	if (inTrack == NULL || inProc == NULL)
+		return kMDErrorInternalError;
+	if (inTrack->num != 0 || inTrack->loader != NULL || inTrack->pointer != NULL)
+		return kMDErrorBadParameter;  /*  Only an empty track can be loaded lazily  */
+	loader = (MDTrackLoader *)malloc(sizeof(MDTrackLoader));
+	if (loader == NULL)
+		return kMDErrorOutOfMemory;
+	memset(loader, 0, sizeof(MDTrackLoader));
+	loader->proc = inProc;
+	loader->dispose = inDispose;
+	loader->refCon = inRefCon;
+	loader->num = -1;
+	if (inCounts != NULL) {
+		loader->num = 0;
+		for (i = 0; i < 18; i++) {
+			loader->nch[i] = inCounts[i];
+			loader->num += inCounts[i];
+		}
 	}
+	for (i = 0; i < 16; i++)
+		loader->remap[i] = i;
+	inTrack->loader = loader;
+	return kMDNoError;
 }
 
 /* --------------------------------------
-	･ MDTrackClear
+	･ MDTrackIsLoaded
    -------------------------------------- */
-void
-MDTrackClear(MDTrack *inTrack)
+int
+MDTrackIsLoaded(const MDTrack *inTrack)
 {
-	MDPointer *pointer;
-
-	while (inTrack->first != NULL) {
-		MDTrackClearBlock(inTrack, inTrack->first);
-	}
-	inTrack->num = 0;
-	
-	/*  Reset the MDPointers  */
-	for (pointer = inTrack->pointer; pointer != NULL; pointer = pointer->next) {
-		MDPointerSetPosition(pointer, -1);
-	}
+	return (MDTrackPeekLoader(inTrack) == NULL);
 }
 
 /* --------------------------------------
-	･ MDTrackNewFromTrack
+	･ MDTrackLoad
    -------------------------------------- */
-MDTrack *
-MDTrackNewFromTrack(const MDTrack *inTrack)
+MDStatus
+MDTrackLoad(MDTrack *inTrack)
 {
-	MDPointer *src, *dest;
-	MDEvent *eventSrc, *eventDest;
-	int32_t count;
-	MDTrack *newTrack;
-    const char *key, *value;
-	int i;
-	
-	/*  Allocate a new track  */
-	newTrack = MDTrackNew();
-	if (newTrack == NULL)
-		return NULL;
-	
-	/*  Set up pointers  */
-	dest = MDPointerNew(newTrack);
-	src = MDPointerNew((MDTrack *)inTrack);
-	if (src == NULL || dest == NULL)
-		return NULL;
-	MDPointerSetPosition(dest, 0);
+	MDTrackLoader *loader;
+	MDTrack *tempTrack;
+	MDStatus sts = kMDNoError;
+	int i, last;
 
-	/*  Prepare the blank space  */
-	count = MDTrackGetNumberOfEvents(inTrack);
-	if (MDTrackInsertBlanks(newTrack, dest, count) < count) {
-		MDTrackRelease(newTrack);
-		return NULL;
+	if (inTrack == NULL || MDTrackPeekLoader(inTrack) == NULL)
+		return kMDNoError;
+	pthread_mutex_lock(&sMDTrackLoadMutex);
+	loader = inTrack->loader;
+	if (loader == NULL) {
+		/*  Loaded by another thread  */
+		pthread_mutex_unlock(&sMDTrackLoadMutex);
+		return kMDNoError;
 	}
-	
-	/*  Copy the events  */
-	while ((eventDest = MDPointerForward(dest)) != NULL && (eventSrc = MDPointerForward(src)) != NULL) {
-		MDEventCopy(eventDest, eventSrc, 1);
+	loader->users++;
+	if (loader->loading) {
+		/*  Another thread is making the events; wait for it  */
+		while (loader->loading)
+			pthread_cond_wait(&sMDTrackLoadCond, &sMDTrackLoadMutex);
+		sts = loader->result;
+		last = (--loader->users == 0 && loader->detached);
+		pthread_mutex_unlock(&sMDTrackLoadMutex);
+		if (last)
+			free(loader);
+		return sts;
 	}
-	MDPointerRelease(dest);
-	MDPointerRelease(src);
-		
-	/*  Copy random fields  */
-	for (i = 0; i < 18; i++)
-		newTrack->nch[i] = inTrack->nch[i];
-    newTrack->dev = inTrack->dev;
-    newTrack->channel = inTrack->channel;
-	newTrack->duration = inTrack->duration;
-	if (inTrack->name != NULL)
-		newTrack->name = strdup(inTrack->name);
-	if (inTrack->devname != NULL)
-		newTrack->devname = strdup(inTrack->devname);
-    for (i = 0; (value = MDTrackGetExtraInfoAtIndex(inTrack, i, &key)) != NULL; i++) {
-        MDTrackSetExtraInfo(newTrack, key, value);
-    }
-    
-	return newTrack;
-}
+	loader->loading = 1;
+	pthread_mutex_unlock(&sMDTrackLoadMutex);
 
-/*  Exchange the contents of two MDTracks. The tracks should not have any
-    "parents" such as MDSequence. Otherwise, the results are undefined.  */
-void
-MDTrackExchange(MDTrack *inTrack1, MDTrack *inTrack2)
-{
-	MDTrack tempTrack;
-	MDPointer *pointer;
+	/*  The events are made in a separate track without holding the lock, and then taken over  */
+	tempTrack = MDTrackNew();
+	if (tempTrack == NULL)
+		sts = kMDErrorOutOfMemory;
+	else {
+		MDTrackSetArena(tempTrack, inTrack->arena);
+		sts = (*loader->proc)(tempTrack, loader->refCon);
+		if (sts == kMDNoError) {
+			/*  A freshly loaded track is usually read far more than it is edited, so keep
+			    it in the packed form; the blocks are expanded as they are accessed  */
+			MDTrackCompact(tempTrack);
+			MDTrackPack(tempTrack);
+		}
+	}
+	if (sts != kMDNoError)
+		MDQueueErrorMessage("Cannot load the events of a track (error %d)\n", (int)sts);
 
-	/*  Exchange the contents of the MDTrack struct  */
-	tempTrack = *inTrack1;
-	*inTrack1 = *inTrack2;
-	*inTrack2 = tempTrack;
-	
-	/*  Update the MDPointers  */
-	for (pointer = inTrack1->pointer; pointer != NULL; pointer = pointer->next)
-		pointer->parent = inTrack2;
-	for (pointer = inTrack2->pointer; pointer != NULL; pointer = pointer->next)
-		pointer->parent = inTrack1;
+	pthread_mutex_lock(&sMDTrackLoadMutex);
+	if (sts == kMDNoError) {
+		/*  Apply the channel remapping requested while the events were not loaded. This is
+		    done under the lock, so that no remapping is lost before the swap.  */
+		for (i = 0; i < 16; i++) {
+			if (loader->remap[i] != i)
+				break;
+		}
+		if (i < 16)
+			MDTrackRemapChannelOfEvents(tempTrack, loader->remap);
+#define SWAP_FIELD(type, field) { type t_ = inTrack->field; inTrack->field = tempTrack->field; tempTrack->field = t_; }
+		SWAP_FIELD(int32_t, num);
+		SWAP_FIELD(int32_t, numBlocks);
+		SWAP_FIELD(MDBlock *, first);
+		SWAP_FIELD(MDBlock *, last);
+		SWAP_FIELD(MDBlockIndex *, index);
+		for (i = 0; i < 18; i++)
+			SWAP_FIELD(int32_t, nch[i]);
+#undef SWAP_FIELD
+		MDTrackBumpEpoch(inTrack);
+
+		/*  Now the track is an ordinary one  */
+		__atomic_store_n(&inTrack->loader, NULL, __ATOMIC_RELEASE);
+		loader->detached = 1;
+	}
+	/*  On failure the loader is kept, so that the loading can be retried  */
+	loader->loading = 0;
+	loader->result = sts;
+	pthread_cond_broadcast(&sMDTrackLoadCond);
+	pthread_mutex_unlock(&sMDTrackLoadMutex);
+	if (tempTrack != NULL)
+		MDTrackRelease(tempTrack);
+
+	if (sts == kMDNoError)
+		MDTrackLoaderReleaseSource(loader);
+	pthread_mutex_lock(&sMDTrackLoadMutex);
+	last = (--loader->users == 0 && loader->detached);
+	pthread_mutex_unlock(&sMDTrackLoadMutex);
+	if (last)
+		free(loader);
+	return sts;
 }
 
 #ifdef __MWERKS__
@@ -696,22 +2465,63 @@ MDTrackExchange(MDTrack *inTrack1, MDTrack *inTrack2)
 int32_t
 MDTrackGetNumberOfEvents(const MDTrack *inTrack)
 {
+	int32_t counts[18], n, i;
+	if (MDTrackPeekLoader(inTrack) != NULL && MDTrackCopyLoaderCounts(inTrack, counts)) {
+		/*  Known without loading  */
+		for (i = n = 0; i < 18; i++)
+			n += counts[i];
+		return n;
+	}
 	return inTrack->num;
 }
 
+/* --------------------------------------
+	･ MDTrackGetEditEpoch
+   -------------------------------------- */
+uint32_t
+MDTrackGetEditEpoch(const MDTrack *inTrack)
+{
+	return inTrack->epoch;
+}
+
+/* --------------------------------------
+	･ MDTrackCopyTicks
+   -------------------------------------- */
+/*  Read the ticks of all events without expanding the packed blocks; this does not
+    modify the track, so it can be called for different tracks from multiple threads  */
+int32_t
+MDTrackCopyTicks(const MDTrack *inTrack, MDTickType *outTicks, int32_t inMax)
+{
+	const MDBlock *block;
+	int32_t i, n;
+	if (MDTrackLoadIfNeeded(inTrack) != kMDNoError)
+		return -1;
+	n = 0;
+	for (block = inTrack->first; block != NULL; block = block->next) {
+		for (i = 0; i < block->num; i++, n++) {
+			if (n < inMax)
+				outTicks[n] = MDBlockGetTick(block, i);
+		}
+	}
+	return n;
+}
+
 /* --------------------------------------
 	･ MDTrackGetNumberOfChannelEvents
    -------------------------------------- */
 int32_t
 MDTrackGetNumberOfChannelEvents(const MDTrack *inTrack, short channel)
 {
-	int32_t n;
+	int32_t n, counts[18];
+	const int32_t *nch = inTrack->nch;
+	if (MDTrackPeekLoader(inTrack) != NULL && MDTrackCopyLoaderCounts(inTrack, counts))
+		nch = counts;  /*  Known without loading  */
 	if (channel >= 0 && channel < 16)
-		return inTrack->nch[channel];
+		return nch[channel];
 	else {
 		n = 0;
 		for (channel = 0; channel < 16; channel++)
-			n += inTrack->nch[channel];
+			n += nch[channel];
 		return n;
 	}
 }
@@ -722,6 +2532,9 @@ MDTrackGetNumberOfChannelEvents(const MDTrack *inTrack, short channel)
 int32_t
 MDTrackGetNumberOfSysexEvents(const MDTrack *inTrack)
 {
+	int32_t counts[18];
+	if (MDTrackPeekLoader(inTrack) != NULL && MDTrackCopyLoaderCounts(inTrack, counts))
+		return counts[16];
 	return inTrack->nch[16];
 }
 
@@ -731,6 +2544,9 @@ MDTrackGetNumberOfSysexEvents(const MDTrack *inTrack)
 int32_t
 MDTrackGetNumberOfNonMIDIEvents(const MDTrack *inTrack)
 {
+	int32_t counts[18];
+	if (MDTrackPeekLoader(inTrack) != NULL && MDTrackCopyLoaderCounts(inTrack, counts))
+		return counts[17];
 	return inTrack->nch[17];
 }
 
@@ -764,7 +2580,8 @@ MDTrackAppendEvents(MDTrack *inTrack, const MDEvent *inEvent, int32_t count)
 {
 	MDBlock *block;
 	int32_t index, i, n, nn;
-	if (inTrack == NULL)
+	int valid;
+	if (inTrack == NULL || MDTrackLoadIfNeeded(inTrack) != kMDNoError)
 		return 0;
 
 	/*  Get the position of the last event  */
@@ -787,14 +2604,24 @@ MDTrackAppendEvents(MDTrack *inTrack, const MDEvent *inEvent, int32_t count)
 		if (count > block->size - index)
 			nn = block->size - index;
 		else nn = count;
-		MDEventCopy(block->events + index, inEvent, nn);
+		MDEventCopy(MDBlockMutableEvents(block) + index, inEvent, nn);
 		for (i = 0; i < nn; i++) {
 			short ch = MDGetChannel(inEvent + i);
 			if (ch >= 0 && ch < 18)
 				inTrack->nch[ch]++;
 		}
-		block->num += nn;
-        block->largestTick = kMDNegativeTick;
+		MDBlockSetNum(block, block->num + nn);
+		valid = (index == 0 || block->summaryValid);
+        MDBlockInvalidateCache(block);
+		if (valid) {
+			/*  Keep the summary up to date while the block is filled from the top, so that
+			    MDTrackClear() and the filters need not scan the block later  */
+			if (index == 0)
+				MDBlockResetSummary(block);
+			else block->summaryValid = 1;
+			for (i = 0; i < nn; i++)
+				MDBlockAddToSummary(block, inEvent + i);
+		}
 		index += nn;
 		inEvent += nn;
 		n += nn;
@@ -812,7 +2639,8 @@ MDTrackMerge(MDTrack *inTrack1, const MDTrack *inTrack2, IntGroup **ioSet)
 	MDPointer *src1;	/*  The source position in inTrack1  */
 	MDPointer *src2;	/*  The source position in inTrack2  */
 	MDPointer *dest;	/*  The destination position  */
-	MDEvent *eventSrc1, *eventSrc2, *eventDest;
+	MDEvent *eventSrc1, *eventDest;
+	const MDEvent *eventSrc2;
 	int32_t	destPosition;
 	int32_t	i;
 	MDTickType tick1, duration1, duration2;
@@ -820,8 +2648,10 @@ MDTrackMerge(MDTrack *inTrack1, const MDTrack *inTrack2, IntGroup **ioSet)
 	MDStatus result = kMDNoError;
 	MDBlock *block;
 
-	if (inTrack1 == NULL || inTrack2 == NULL || inTrack2->num == 0)
+	if (inTrack1 == NULL || inTrack2 == NULL || MDTrackGetNumberOfEvents(inTrack2) == 0)
 		return kMDErrorNoEvents;
+	if ((result = MDTrackLoadIfNeeded(inTrack1)) != kMDNoError || (result = MDTrackLoadIfNeeded(inTrack2)) != kMDNoError)
+		return result;
 
 	src1 = MDPointerNew(inTrack1);
 	dest = MDPointerNew(inTrack1);
@@ -858,9 +2688,16 @@ MDTrackMerge(MDTrack *inTrack1, const MDTrack *inTrack2, IntGroup **ioSet)
 		return kMDErrorOutOfMemory;
 	MDPointerSetPosition(dest, inTrack1->num - 1);
 	MDPointerSetPosition(src1, i - 1); */
+
+	/*  The events of inTrack1 are rearranged through dest and src1, so the shared blocks
+	    are made private beforehand  */
+	for (block = inTrack1->first; block != NULL; block = block->next) {
+		if (MDBlockMutableEvents(block) == NULL)
+			return kMDErrorOutOfMemory;
+	}
 	
-	eventDest = MDPointerCurrent(dest);
-	eventSrc1 = MDPointerCurrent(src1);
+	eventDest = MDPointerCurrentPrivate(dest);
+	eventSrc1 = MDPointerCurrentPrivate(src1);
 	destPosition = MDPointerGetPosition(dest);
 
 	while (eventSrc2 != NULL) {
@@ -894,9 +2731,9 @@ MDTrackMerge(MDTrack *inTrack1, const MDTrack *inTrack2, IntGroup **ioSet)
 		} else {
 			MDEventMove(eventDest, eventSrc1, 1);
 		/*	fprintf(stderr, "MDTrackMerge: MDEventMove %ld from %ld (t1=%ld, t2=%ld)\n", MDPointerGetPosition(dest), MDPointerGetPosition(src1), t1, t2); */
-			eventSrc1 = MDPointerBackward(src1);
+			eventSrc1 = MDPointerBackwardPrivate(src1);
 		}
-		eventDest = MDPointerBackward(dest);
+		eventDest = MDPointerBackwardPrivate(dest);
 		destPosition--;
 	}
 
@@ -905,7 +2742,7 @@ MDTrackMerge(MDTrack *inTrack1, const MDTrack *inTrack2, IntGroup **ioSet)
 	}
 	
     for (block = inTrack1->first; block != NULL; block = block->next)
-        block->largestTick = kMDNegativeTick;
+        MDBlockInvalidateCache(block);
 
 	MDPointerRelease(src2);
 	MDPointerRelease(src1);
@@ -927,6 +2764,181 @@ MDTrackMerge(MDTrack *inTrack1, const MDTrack *inTrack2, IntGroup **ioSet)
 	return result;
 }
 
+/* --------------------------------------
+	･ MDTrackInsertSortedBatch
+   -------------------------------------- */
+MDStatus
+MDTrackInsertSortedBatch(MDTrack *inTrack, const MDEvent *inEvents, int32_t count, int32_t *outPositions)
+{
+	MDBlock *block, *oldBlock, *lastOld, *firstNew, *dest, *src;	/*  src: the next source block  */
+	MDEvent stash[kMDBlockSize], *srcEvents, *destEvents;
+	MDPointer *ptr;
+	int32_t i, k, n, lo, hi, mid, startPos, oldIndex, srcIndex, srcNum, destIndex, position, nstash, nblocks;
+	MDTickType tick, maxTick;
+	MDStatus sts;
+
+	if (inTrack == NULL || count <= 0)
+		return kMDNoError;
+	if (inEvents == NULL)
+		return kMDErrorBadParameter;
+	if ((sts = MDTrackLoadIfNeeded(inTrack)) != kMDNoError)
+		return sts;
+	for (i = 1; i < count; i++) {
+		if (MDGetTick(&inEvents[i]) < MDGetTick(&inEvents[i - 1]))
+			return kMDErrorTickDisorder;
+	}
+
+	/*  Locate the first existing event not earlier than the first new event. The new events
+	    go before the existing events on the same tick (as in MDPointerInsertAnEvent).  */
+	startPos = (inTrack->num == 0 ? 0 : MDTrackIndexLookupTick(inTrack, MDGetTick(&inEvents[0])));
+	if (startPos >= inTrack->num) {
+		oldBlock = inTrack->last;
+		oldIndex = (oldBlock == NULL ? 0 : oldBlock->num);
+	} else {
+		oldIndex = startPos;
+		oldBlock = MDTrackIndexLookupPosition(inTrack, &oldIndex);
+	}
+
+	/*  Make the existing events after the insertion point writable, so that nothing can
+	    fail once the merge begins  */
+	for (block = oldBlock; block != NULL; block = block->next) {
+		if (MDBlockMutableEvents(block) == NULL)
+			return kMDErrorOutOfMemory;
+	}
+
+	/*  Allocate the new blocks after the last block; the events in oldBlock after oldIndex
+	    and those in the following blocks are moved there, so that they are all full  */
+	lastOld = inTrack->last;
+	n = inTrack->num - startPos + count;
+	if (oldBlock != NULL)
+		n -= oldBlock->size - oldIndex;
+	nblocks = (n > 0 ? (n + kMDBlockSize - 1) / kMDBlockSize : 0);
+	firstNew = NULL;
+	for (i = 0; i < nblocks; i++) {
+		block = MDTrackAllocateBlock(inTrack, inTrack->last, kMDBlockSize);
+		if (block == NULL) {
+			while (firstNew != NULL && inTrack->last != lastOld)
+				MDTrackDeallocateBlock(inTrack, inTrack->last);
+			return kMDErrorOutOfMemory;
+		}
+		if (firstNew == NULL)
+			firstNew = block;
+	}
+
+	/*  Adjust the positions of the autoAdjust pointers. An existing event is shifted by the
+	    number of new events on or before its tick. The blocks are looked up at the end.  */
+	MDTrackSyncPointers(inTrack);
+	for (ptr = inTrack->pointer; ptr != NULL; ptr = ptr->next) {
+		if (!ptr->autoAdjust || ptr->position < startPos)
+			continue;
+		if (ptr->position >= inTrack->num) {
+			ptr->position += count;
+			continue;
+		}
+		i = ptr->position;
+		block = MDTrackIndexLookupPosition(inTrack, &i);
+		tick = MDBlockGetTick(block, i);
+		lo = 0;
+		hi = count;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (MDGetTick(&inEvents[mid]) <= tick)
+				lo = mid + 1;
+			else hi = mid;
+		}
+		ptr->position += lo;
+	}
+
+	/*  Move the tail of oldBlock aside, so that oldBlock can receive the merged events  */
+	nstash = 0;
+	if (oldBlock != NULL) {
+		nstash = oldBlock->num - oldIndex;
+		MDEventMove(stash, MDBlockMutableEvents(oldBlock) + oldIndex, nstash);
+	}
+
+	/*  The merge pass  */
+	src = (oldBlock == NULL || oldBlock->next == firstNew ? NULL : oldBlock->next);
+	srcEvents = stash;
+	srcIndex = 0;
+	srcNum = nstash;
+	if (oldBlock != NULL && oldIndex < oldBlock->size) {
+		dest = oldBlock;
+		destIndex = oldIndex;
+	} else {
+		dest = firstNew;
+		destIndex = 0;
+	}
+	destEvents = (dest == NULL ? NULL : MDBlockMutableEvents(dest));
+	position = startPos;
+	maxTick = kMDNegativeTick;
+	k = 0;
+	while (1) {
+		/*  Skip to the next source block if necessary  */
+		while (srcIndex >= srcNum && src != NULL) {
+			srcEvents = MDBlockEvents(src);
+			srcIndex = 0;
+			srcNum = src->num;
+			src = (src->next == firstNew ? NULL : src->next);
+		}
+		if (srcIndex >= srcNum && k >= count)
+			break;
+		if (destIndex >= dest->size) {
+			MDBlockSetNum(dest, destIndex);
+			MDBlockInvalidateCache(dest);
+			dest = (dest == oldBlock ? firstNew : dest->next);
+			destEvents = MDBlockMutableEvents(dest);
+			destIndex = 0;
+		}
+		if (k < count && (srcIndex >= srcNum || MDGetTick(&inEvents[k]) <= MDGetTick(&srcEvents[srcIndex]))) {
+			MDEventCopy(&destEvents[destIndex], &inEvents[k], 1);
+			if (MDIsChannelEvent(&inEvents[k]))
+				inTrack->nch[MDGetChannel(&inEvents[k]) & 15]++;
+			else if (MDIsSysexEvent(&inEvents[k]))
+				inTrack->nch[16]++;
+			else inTrack->nch[17]++;
+			tick = MDGetTick(&inEvents[k]);
+			if (MDHasDuration(&inEvents[k]))
+				tick += MDGetDuration(&inEvents[k]);
+			if (tick > maxTick)
+				maxTick = tick;
+			if (outPositions != NULL)
+				outPositions[k] = position;
+			k++;
+		} else {
+			MDEventMove(&destEvents[destIndex], &srcEvents[srcIndex], 1);
+			srcIndex++;
+		}
+		destIndex++;
+		position++;
+	}
+	MDBlockSetNum(dest, destIndex);
+	MDBlockInvalidateCache(dest);
+
+	/*  Dispose the drained blocks (the events have been moved out of them)  */
+	if (oldBlock != NULL) {
+		while (oldBlock->next != firstNew) {
+			MDBlockSetNum(oldBlock->next, 0);
+			MDTrackDeallocateBlock(inTrack, oldBlock->next);
+		}
+		if (oldBlock->num == 0)
+			MDTrackDeallocateBlock(inTrack, oldBlock);
+	}
+	inTrack->num += count;
+
+	/*  Update track duration if necessary  */
+	if (maxTick >= MDTrackGetDuration(inTrack))
+		MDTrackSetDuration(inTrack, maxTick + 1);
+
+	/*  Look up the blocks for the autoAdjust pointers; the others are looked up lazily  */
+	MDTrackBumpEpoch(inTrack);
+	for (ptr = inTrack->pointer; ptr != NULL; ptr = ptr->next) {
+		if (ptr->autoAdjust)
+			MDPointerUpdateBlock(ptr);
+	}
+
+	return kMDNoError;
+}
+
 /* --------------------------------------
 	･ MDTrackUnmerge
    -------------------------------------- */
@@ -935,7 +2947,8 @@ sMDTrackUnmergeSub(MDTrack *inTrack, MDTrack **outTrack, const IntGroup *inSet,
 {
 	MDPointer *src;
 	MDPointer *dest;
-	MDEvent *eventSrc, *eventDest;
+	const MDEvent *eventSrc;
+	MDEvent *eventDest;
 	int32_t	ptCount;	/*  The number of points in inSet  */
 	int32_t	destPosition;
 	int32_t	index, start, length;
@@ -943,14 +2956,20 @@ sMDTrackUnmergeSub(MDTrack *inTrack, MDTrack **outTrack, const IntGroup *inSet,
 	MDTickType duration;
 	MDTrack *newTrack;
 	MDBlock *block;
+	MDStatus sts;
 
 	if (inTrack == NULL || inSet == NULL || (ptCount = IntGroupGetCount(inSet)) == 0)
 		return kMDErrorNoEvents;
+	if ((sts = MDTrackLoadIfNeeded(inTrack)) != kMDNoError)
+		return sts;
 	
-	/*  Allocate a destination track  */
+	/*  Allocate a destination track. The events moved out of inTrack stay in the same
+	    arena; the extracted copy does not.  */
 	newTrack = MDTrackNew();
 	if (newTrack == NULL)
 		return kMDErrorOutOfMemory;
+	if (deleteFlag)
+		MDTrackSetArena(newTrack, inTrack->arena);
 	
 	src  = MDPointerNew(inTrack);
 	dest = MDPointerNew(newTrack);
@@ -963,7 +2982,7 @@ sMDTrackUnmergeSub(MDTrack *inTrack, MDTrack **outTrack, const IntGroup *inSet,
 		return kMDErrorOutOfMemory;
 	MDPointerSetPosition(dest, 0);
 	destPosition = 0;
-	eventDest = MDPointerCurrent(dest);
+	eventDest = MDPointerCurrentPrivate(dest);
 	duration = 0;
 
 	/*  Copy the events  */
@@ -989,7 +3008,7 @@ sMDTrackUnmergeSub(MDTrack *inTrack, MDTrack **outTrack, const IntGroup *inSet,
                 duration = MDGetTick(eventDest) + 1;
 
 			eventSrc = MDPointerForward(src);
-			eventDest = MDPointerForward(dest);
+			eventDest = MDPointerForwardPrivate(dest);
 			destPosition++;
 		}
 		if (eventDest == NULL)
@@ -1020,7 +3039,8 @@ sMDTrackUnmergeSub(MDTrack *inTrack, MDTrack **outTrack, const IntGroup *inSet,
 			inTrack->nch[i] -= newTrack->nch[i];
 		}
 		for (block = inTrack->first; block != NULL; block = block->next)
-			block->largestTick = kMDNegativeTick;
+			MDBlockSetLargestTick(block, kMDNegativeTick);
+		MDTrackCompactIfNeeded(inTrack);
 	}
 	
 	MDPointerRelease(src);
@@ -1060,7 +3080,7 @@ MDTrackSplitByMIDIChannel(MDTrack *inTrack, MDTrack **outTracks)
 	int32_t count[16];
 	int i, n, nn;
 	MDPointer *pt;
-	MDEvent *ep;
+	const MDEvent *ep;
 	IntGroup *pset;
 	pt = MDPointerNew(inTrack);
 	if (pt == NULL)
@@ -1128,7 +3148,8 @@ MDTrackSplitByMIDIChannel(MDTrack *inTrack, MDTrack **outTracks)
 MDStatus
 MDTrackMatchNoteOff(MDTrack *inTrack, const MDEvent *noteOffEvent, MDPointer *lastPendingNoteOn)
 {
-    MDEvent *ep;
+    const MDEvent *ep;
+    MDEvent *ep2;
     MDStatus result = kMDErrorOrphanedNoteOff;
     int32_t lastPendingPos;
 	unsigned char code = MDGetCode(noteOffEvent);
@@ -1147,13 +3168,15 @@ MDTrackMatchNoteOff(MDTrack *inTrack, const MDEvent *noteOffEvent, MDPointer *la
             if (MDGetCode(ep) == code && MDGetChannel(ep) == channel && (MDGetDuration(ep) == 0 || MDGetDuration(ep) == tick - MDGetTick(ep))) {
                 /*  Found  */
                 MDTickType duration = tick - MDGetTick(ep);
-                MDSetKind(ep, kMDEventNote);
+                if ((ep2 = MDPointerCurrentMutable(lastPendingNoteOn)) == NULL) {
+                    result = kMDErrorOutOfMemory;
+                    break;
+                }
+                MDSetKind(ep2, kMDEventNote);
                 if (duration <= 0)
                     duration = 1;  /*  Avoid zero-duration event  */
-                MDSetDuration(ep, duration);
-                MDSetNoteOffVelocity(ep, MDGetNoteOffVelocity(noteOffEvent));
-                /*  Reset the 'largestTick' field directly  */
-                lastPendingNoteOn->block->largestTick = kMDNegativeTick;
+                MDSetDuration(ep2, duration);
+                MDSetNoteOffVelocity(ep2, MDGetNoteOffVelocity(noteOffEvent));
                 result = kMDNoError;
                 if (lastPendingPos == -1)
                     lastPendingPos = MDPointerGetPosition(lastPendingNoteOn) + 1;
@@ -1175,15 +3198,16 @@ MDTrackMatchNoteOff(MDTrack *inTrack, const MDEvent *noteOffEvent, MDPointer *la
 	/*  Do not use MDPointer, but use internal block info directly (for efficiency)  */
 	for (bp = inTrack->last; bp != NULL; bp = bp->last) {
 		MDEvent *ep;
-		for (index = bp->num - 1, ep = &(bp->events[index]); index >= 0; index--, ep--) {
+		for (index = bp->num - 1, ep = &(MDBlockEvents(bp)[index]); index >= 0; index--, ep--) {
 			if (MDGetKind(ep) == kMDEventInternalNoteOn && MDGetCode(ep) == code && MDGetChannel(ep) == channel) {
 				MDTickType duration = MDGetDuration(ep);
 				if (duration == 0 || duration == tick - MDGetTick(ep)) {
 					/*  Found  */
+					ep = MDBlockMutableEvents(bp) + index;
 					MDSetKind(ep, kMDEventNote);
 					MDSetDuration(ep, tick - MDGetTick(ep));
 					MDSetNoteOffVelocity(ep, MDGetNoteOffVelocity(noteOffEvent));
-					bp->largestTick = kMDNegativeTick;
+					MDBlockSetLargestTick(bp, kMDNegativeTick);
                     MDPointerRelease(lastPendingNoteOn);
 					return kMDNoError;
 				}
@@ -1194,63 +3218,283 @@ MDTrackMatchNoteOff(MDTrack *inTrack, const MDEvent *noteOffEvent, MDPointer *la
 #endif
 }
 
-/* --------------------------------------
-	･ MDTrackMatchNoteOffInTrack
-   -------------------------------------- */
-MDStatus
-MDTrackMatchNoteOffInTrack(MDTrack *inTrack, MDTrack *noteOffTrack)
+/* --------------------------------------
+	･ MDTrackMatchNoteOffInTrack
+   -------------------------------------- */
+MDStatus
+MDTrackMatchNoteOffInTrack(MDTrack *inTrack, MDTrack *noteOffTrack)
+{
+    /*  Pair note-on with the corresponding note-off  */
+	/*  The note-offs are grouped by (channel, key) in the order of position. Since the
+	    note-ons are visited in the order of tick, the note-off for a note-on is always the
+	    first one in its group at or after the tick of the note-on, and the ones before that
+	    are never used again; so each group is consumed from the top.  */
+    MDPointer *noteon, *noteoff;
+    const MDEvent *eref1, *eref2;
+    MDEvent *ep;
+    MDBlock *block;
+    MDTickType largestTick = kMDNegativeTick;
+	int32_t *starts, *heads, *offPos;
+	MDTickType *offTick;
+	unsigned char *offVel, *matched;
+	int32_t i, n, key, num;
+	MDStatus sts;
+
+	if ((sts = MDTrackLoadIfNeeded(inTrack)) != kMDNoError || (sts = MDTrackLoadIfNeeded(noteOffTrack)) != kMDNoError)
+		return sts;
+	num = noteOffTrack->num;
+	starts = (int32_t *)calloc(sizeof(int32_t), kMDNoteOffMatcherNumberOfKeys + 1);
+	heads = (int32_t *)malloc(sizeof(int32_t) * kMDNoteOffMatcherNumberOfKeys);
+	offPos = (int32_t *)malloc(sizeof(int32_t) * (num > 0 ? num : 1));
+	offTick = (MDTickType *)malloc(sizeof(MDTickType) * (num > 0 ? num : 1));
+	offVel = (unsigned char *)malloc(num > 0 ? num : 1);
+	matched = (unsigned char *)calloc(1, num > 0 ? num : 1);
+    noteon = MDPointerNew(inTrack);
+    noteoff = MDPointerNew(noteOffTrack);
+    if (starts == NULL || heads == NULL || offPos == NULL || offTick == NULL || offVel == NULL || matched == NULL || noteon == NULL || noteoff == NULL) {
+		free(starts);
+		free(heads);
+		free(offPos);
+		free(offTick);
+		free(offVel);
+		free(matched);
+		MDPointerRelease(noteon);
+		MDPointerRelease(noteoff);
+        return kMDErrorOutOfMemory;
+	}
+
+	/*  Group the note-offs by (channel, key)  */
+	while ((eref2 = MDPointerForward(noteoff)) != NULL) {
+		if (MDGetKind(eref2) == kMDEventInternalNoteOff && MDGetChannel(eref2) < 16 && MDGetCode(eref2) < 128)
+			starts[MDGetChannel(eref2) * 128 + MDGetCode(eref2) + 1]++;
+	}
+	for (key = 0; key < kMDNoteOffMatcherNumberOfKeys; key++) {
+		starts[key + 1] += starts[key];
+		heads[key] = starts[key];
+	}
+	MDPointerSetPosition(noteoff, -1);
+	while ((eref2 = MDPointerForward(noteoff)) != NULL) {
+		if (MDGetKind(eref2) == kMDEventInternalNoteOff && MDGetChannel(eref2) < 16 && MDGetCode(eref2) < 128) {
+			key = MDGetChannel(eref2) * 128 + MDGetCode(eref2);
+			i = heads[key]++;
+			offPos[i] = MDPointerGetPosition(noteoff);
+			offTick[i] = MDGetTick(eref2);
+			offVel[i] = MDGetNoteOffVelocity(eref2);
+		}
+	}
+	for (key = 0; key < kMDNoteOffMatcherNumberOfKeys; key++)
+		heads[key] = starts[key];
+
+    while ((eref1 = MDPointerForward(noteon)) != NULL) {
+        if (MDGetKind(eref1) == kMDEventInternalNoteOn && MDGetChannel(eref1) < 16 && MDGetCode(eref1) < 128) {
+			key = MDGetChannel(eref1) * 128 + MDGetCode(eref1);
+			while (heads[key] < starts[key + 1] && offTick[heads[key]] < MDGetTick(eref1))
+				heads[key]++;
+			if (heads[key] < starts[key + 1]) {
+				MDTickType tick2;
+				i = heads[key]++;
+				tick2 = offTick[i];
+				if ((ep = MDPointerCurrentMutable(noteon)) == NULL) {
+					sts = kMDErrorOutOfMemory;
+					break;
+				}
+				MDSetDuration(ep, tick2 - MDGetTick(ep));
+				MDSetNoteOffVelocity(ep, offVel[i]);
+				MDSetKind(ep, kMDEventNote);
+				matched[offPos[i]] = 1;
+				dprintf(2, "Paired note-event: tick %ld code %d vel %d/%d duration %ld\n", MDGetTick(ep), MDGetCode(ep), MDGetNoteOnVelocity(ep), MDGetNoteOffVelocity(ep), MDGetDuration(ep));
+				if (tick2 > largestTick)
+					largestTick = tick2;
+			}
+        }
+    }
+
+	/*  The paired note-offs are turned into null events (to avoid being read twice)  */
+	MDPointerSetPosition(noteoff, -1);
+	n = 0;
+	while (sts == kMDNoError && MDPointerForward(noteoff) != NULL) {
+		if (matched[n++]) {
+			if ((ep = MDPointerCurrentMutable(noteoff)) == NULL)
+				sts = kMDErrorOutOfMemory;
+			else MDSetKind(ep, kMDEventNull);
+		}
+	}
+
+	free(starts);
+	free(heads);
+	free(offPos);
+	free(offTick);
+	free(offVel);
+	free(matched);
+    MDPointerRelease(noteon);
+    MDPointerRelease(noteoff);
+    for (block = inTrack->first; block != NULL; block = block->next)
+        MDBlockInvalidateCache(block);
+    if (largestTick > MDTrackGetDuration(inTrack))
+        MDTrackSetDuration(inTrack, largestTick);
+    return sts;
+}
+
+/*  Merge the sorted runs src[0..n1-1] and src[n1..n1+n2-1] into dst. Stable: on the
+    same tick, the events from the first run come first.  */
+static void
+sMDEventMergeRuns(const MDEvent *src, MDEvent *dst, int32_t n1, int32_t n2)
+{
+	const MDEvent *p1 = src, *e1 = src + n1, *p2 = src + n1, *e2 = src + n1 + n2;
+	while (p1 < e1 && p2 < e2) {
+		if (MDGetTick(p2) < MDGetTick(p1))
+			*dst++ = *p2++;
+		else *dst++ = *p1++;
+	}
+	while (p1 < e1)
+		*dst++ = *p1++;
+	while (p2 < e2)
+		*dst++ = *p2++;
+}
+
+/*  Stable natural merge sort by tick. The existing ascending runs are merged, so that
+    a mostly sorted array costs O(n log r) for r runs. buf must have room for n events.
+    The contents are moved bitwise; ownership of the messages is unchanged.  */
+static MDStatus
+sMDEventStableSort(MDEvent *events, MDEvent *buf, int32_t n)
+{
+	int32_t *runs, nruns, i, j;
+	MDEvent *src, *dst, *tmp;
+
+	if (n < 2)
+		return kMDNoError;
+
+	/*  Find the runs; runs[i] is the start of the i-th run, runs[nruns] == n  */
+	runs = (int32_t *)malloc(sizeof(int32_t) * (n + 1));
+	if (runs == NULL)
+		return kMDErrorOutOfMemory;
+	nruns = 0;
+	runs[nruns++] = 0;
+	for (i = 1; i < n; i++) {
+		if (MDGetTick(&events[i]) < MDGetTick(&events[i - 1]))
+			runs[nruns++] = i;
+	}
+	runs[nruns] = n;
+
+	/*  Merge adjacent pairs of runs until only one is left  */
+	src = events;
+	dst = buf;
+	while (nruns > 1) {
+		for (i = j = 0; i < nruns; i += 2, j++) {
+			if (i + 1 < nruns)
+				sMDEventMergeRuns(src + runs[i], dst + runs[i], runs[i + 1] - runs[i], runs[i + 2] - runs[i + 1]);
+			else
+				memcpy(dst + runs[i], src + runs[i], sizeof(MDEvent) * (runs[i + 1] - runs[i]));
+			runs[j] = runs[i];
+		}
+		runs[j] = n;
+		nruns = j;
+		tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+	if (src != events)
+		memcpy(events, src, sizeof(MDEvent) * n);
+	free(runs);
+	return kMDNoError;
+}
+
+static void *
+sMDTrackSortChunkEntry(void *arg)
+{
+	MDTrackSortChunk *chunk = (MDTrackSortChunk *)arg;
+	chunk->status = sMDEventStableSort(chunk->events, chunk->buf, chunk->n1);
+	return NULL;
+}
+
+static void *
+sMDTrackMergeChunkEntry(void *arg)
 {
-    /*  Pair note-on with the corresponding note-off  */
-    MDPointer *noteon, *noteoff;
-    MDEvent *eref1, *eref2;
-    MDBlock *block;
-    MDTickType largestTick = kMDNegativeTick;
+	MDTrackSortChunk *chunk = (MDTrackSortChunk *)arg;
+	sMDEventMergeRuns(chunk->events, chunk->buf, chunk->n1, chunk->n2);
+	return NULL;
+}
 
-    noteon = MDPointerNew(inTrack);
-    noteoff = MDPointerNew(noteOffTrack);
-    if (noteon == NULL || noteoff == NULL)
-        return kMDErrorOutOfMemory;
-    while ((eref1 = MDPointerForward(noteon)) != NULL) {
-        if (MDGetKind(eref1) == kMDEventInternalNoteOn) {
-            MDPointerJumpToTick(noteoff, MDGetTick(eref1));
-            MDPointerBackward(noteoff);
-            while ((eref2 = MDPointerForward(noteoff)) != NULL) {
-                if (MDGetKind(eref2) == kMDEventInternalNoteOff
-                && MDGetCode(eref1) == MDGetCode(eref2)
-                && MDGetChannel(eref1) == MDGetChannel(eref2)) {
-                    MDTickType tick2 = MDGetTick(eref2);
-                    MDSetDuration(eref1, tick2 - MDGetTick(eref1));
-                    MDSetNoteOffVelocity(eref1, MDGetNoteOffVelocity(eref2));
-                    MDSetKind(eref2, kMDEventNull);
-					MDSetKind(eref1, kMDEventNote);
-                    dprintf(2, "Paired note-event: tick %ld code %d vel %d/%d duration %ld\n", MDGetTick(eref1), MDGetCode(eref1), MDGetNoteOnVelocity(eref1), MDGetNoteOffVelocity(eref1), MDGetDuration(eref1));
-                    if (tick2 > largestTick)
-                        largestTick = tick2;
-                    break;
-                }
-            }
-        }
-    }
-    MDPointerRelease(noteon);
-    MDPointerRelease(noteoff);
-    for (block = inTrack->first; block != NULL; block = block->next)
-        block->largestTick = kMDNegativeTick;
-    if (largestTick > MDTrackGetDuration(inTrack))
-        MDTrackSetDuration(inTrack, largestTick);
-    return kMDNoError;
+/*  Same as sMDEventStableSort, but splits a large array into chunks that are sorted and
+    merged by multiple threads  */
+static MDStatus
+sMDEventStableSortParallel(MDEvent *events, MDEvent *buf, int32_t n)
+{
+	MDTrackSortChunk chunks[kMDTrackParallelSortMaxThreads];
+	pthread_t threads[kMDTrackParallelSortMaxThreads];
+	char started[kMDTrackParallelSortMaxThreads];
+	int32_t bounds[kMDTrackParallelSortMaxThreads + 1];
+	int32_t nchunks, i, j;
+	long ncpu;
+	MDEvent *src, *dst, *tmp;
+	MDStatus sts = kMDNoError;
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	nchunks = (ncpu > kMDTrackParallelSortMaxThreads ? kMDTrackParallelSortMaxThreads : (int32_t)ncpu);
+	if (n < kMDTrackParallelSortThreshold || nchunks < 2)
+		return sMDEventStableSort(events, buf, n);
+
+	/*  Sort the chunks in parallel (the current thread takes the first one)  */
+	for (i = 0; i <= nchunks; i++)
+		bounds[i] = (int32_t)((int64_t)n * i / nchunks);
+	for (i = 0; i < nchunks; i++) {
+		chunks[i].events = events + bounds[i];
+		chunks[i].buf = buf + bounds[i];
+		chunks[i].n1 = bounds[i + 1] - bounds[i];
+		chunks[i].n2 = 0;
+		chunks[i].status = kMDNoError;
+		started[i] = (i > 0 && pthread_create(&threads[i], NULL, sMDTrackSortChunkEntry, &chunks[i]) == 0);
+	}
+	for (i = 0; i < nchunks; i++) {
+		if (!started[i])
+			sMDTrackSortChunkEntry(&chunks[i]);
+	}
+	for (i = 0; i < nchunks; i++) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		if (chunks[i].status != kMDNoError)
+			sts = chunks[i].status;
+	}
+	if (sts != kMDNoError)
+		return sts;
+
+	/*  Merge the sorted chunks pairwise, each pair in its own thread  */
+	src = events;
+	dst = buf;
+	while (nchunks > 1) {
+		for (i = j = 0; i < nchunks; i += 2, j++) {
+			chunks[j].events = src + bounds[i];
+			chunks[j].buf = dst + bounds[i];
+			chunks[j].n1 = bounds[i + 1] - bounds[i];
+			chunks[j].n2 = (i + 1 < nchunks ? bounds[i + 2] - bounds[i + 1] : 0);
+			started[j] = (j > 0 && pthread_create(&threads[j], NULL, sMDTrackMergeChunkEntry, &chunks[j]) == 0);
+			bounds[j] = bounds[i];
+		}
+		bounds[j] = n;
+		nchunks = j;
+		for (i = 0; i < nchunks; i++) {
+			if (!started[i])
+				sMDTrackMergeChunkEntry(&chunks[i]);
+		}
+		for (i = 0; i < nchunks; i++) {
+			if (started[i])
+				pthread_join(threads[i], NULL);
+		}
+		tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+	if (src != events)
+		memcpy(events, src, sizeof(MDEvent) * n);
+	return kMDNoError;
 }
 
+/*  Compare the (tick << 32 | index) keys of the displaced events in MDTrackChangeTick  */
 static int
-sMDTrackEventComparator(const void *a, const void *b)
+sMDTrackCompareTickKeys(const void *a, const void *b)
 {
-	MDTickType ticka, tickb;
-	ticka = MDGetTick((const MDEvent *)a);
-	tickb = MDGetTick((const MDEvent *)b);
-	if (ticka < tickb)
-		return -1;
-	else if (ticka > tickb)
-		return 1;
-	else return 0;
+	uint64_t ka = *(const uint64_t *)a, kb = *(const uint64_t *)b;
+	return (ka < kb ? -1 : (ka > kb ? 1 : 0));
 }
 
 /* --------------------------------------
@@ -1260,68 +3504,169 @@ MDStatus
 MDTrackChangeTick(MDTrack *inTrack, MDTickType *newTick)
 {
 	MDBlock *block;
-/*	int index, i; */
-	int32_t n, count;
-	MDTickType largestTick;
-/*	MDTickType oldTick, tick; */
-	MDEvent *tempEvents;
+	int32_t i, n, count, first, last, nsort, ndisp, kn, dn;
+	MDTickType tick, maxTick, minTick, largestTick;
+	MDEvent *ep, *tempEvents, *buf;
+	uint64_t *keys, key;
+	unsigned char *displaced;
+	MDStatus sts;
+
+	if ((sts = MDTrackLoadIfNeeded(inTrack)) != kMDNoError)
+		return sts;
+	count = inTrack->num;
+	if (count == 0)
+		return kMDNoError;
 
-#if 1
-	/*  Move all events to a temporary array of MDEvent  */
-	count = MDTrackGetNumberOfEvents(inTrack);
-	tempEvents = (MDEvent *)malloc(sizeof(MDEvent) * count);
-	if (tempEvents == NULL)
-		return kMDErrorOutOfMemory;
+	/*  Nothing is modified until everything that may fail (allocation, un-sharing the
+	    blocks and sorting) has succeeded, so that the track is left intact on error  */
+
+	/*  Pass 1: Find the last event whose new tick is smaller than the new tick of some
+	    preceding event  */
 	n = 0;
+	last = -1;
+	maxTick = kMDNegativeTick;
 	for (block = inTrack->first; block != NULL; block = block->next) {
-		MDEventMove(tempEvents + n, block->events, block->num);
-		n += block->num;
+		for (i = 0; i < block->num; i++, n++) {
+			tick = (newTick[n] >= 0 ? newTick[n] : MDBlockGetTick(block, i));
+			if (tick < maxTick)
+				last = n;
+			else maxTick = tick;
+		}
 	}
-	
-	/*  Modify tick  */
-	for (n = 0; n < count; n++)
-		MDSetTick(&tempEvents[n], newTick[n]);
-	
-	/*  Sort event index by the new tick  */
-	qsort(tempEvents, count, sizeof(MDEvent), sMDTrackEventComparator);
-	
-	/*  Move the events back  */
-	n = 0;
-	for (block = inTrack->first; block != NULL; block = block->next) {
-		MDEventMove(block->events, tempEvents + n, block->num);
-		block->largestTick = kMDNegativeTick;
-		n += block->num;
+
+	first = count;
+	nsort = ndisp = 0;
+	tempEvents = NULL;
+	keys = NULL;
+	displaced = NULL;
+	if (last >= 0) {
+		/*  Pass 2: Find the first event that is larger than some following event. The events
+		    outside first..last are already in place.  */
+		n = count;
+		minTick = kMDMaxTick;
+		for (block = inTrack->last; block != NULL; block = block->last) {
+			for (i = block->num - 1; i >= 0; i--) {
+				n--;
+				tick = (newTick[n] >= 0 ? newTick[n] : MDBlockGetTick(block, i));
+				if (tick > minTick)
+					first = n;
+				else minTick = tick;
+			}
+		}
+		nsort = last - first + 1;
+		tempEvents = (MDEvent *)malloc(sizeof(MDEvent) * nsort);
+		keys = (uint64_t *)malloc(sizeof(uint64_t) * nsort);
+		displaced = (unsigned char *)calloc(nsort, 1);
+		if (tempEvents == NULL || keys == NULL || displaced == NULL) {
+			free(tempEvents);
+			free(keys);
+			free(displaced);
+			return kMDErrorOutOfMemory;
+		}
 	}
-	free(tempEvents);
-	
-#else
-	/*  Pass 1: Check the new tick order first  */
-	oldTick = kMDNegativeTick;
-	index = 0;
-	for (block = inTrack->first; block != NULL; block = block->next) {
+
+	/*  Make the blocks to be modified private  */
+	n = 0;
+	for (block = inTrack->first; block != NULL; n += block->num, block = block->next) {
 		for (i = 0; i < block->num; i++) {
-			if (newTick[index] >= 0)
-				tick = newTick[index];
-			else
-				tick = MDGetTick(&block->events[i]);
-			if (oldTick > tick)
-				return kMDErrorTickDisorder;
-			oldTick = tick;
-			index++;
+			if ((n + i >= first && n + i <= last) || (newTick[n + i] >= 0 && newTick[n + i] != MDBlockGetTick(block, i)))
+				break;
+		}
+		if (i < block->num && MDBlockMutableEvents(block) == NULL) {
+			free(tempEvents);
+			free(keys);
+			free(displaced);
+			return kMDErrorOutOfMemory;
+		}
+	}
+
+	if (nsort > 0) {
+		i = first;
+		block = MDTrackIndexLookupPosition(inTrack, &i);
+		for (n = 0; n < nsort; block = block->next, i = 0) {
+			int32_t nn = block->num - i;
+			if (nn > nsort - n)
+				nn = nsort - n;
+			memcpy(tempEvents + n, block->events + i, sizeof(MDEvent) * nn);
+			n += nn;
+		}
+
+		/*  Only the events whose new tick breaks the order are taken out. The events whose
+		    tick is not changed are in order already, and so is a changed event that still
+		    fits between the preceding kept event and the next unchanged event. Backwards,
+		    keys[n] is set to the tick of the next unchanged event after n.  */
+		key = kMDMaxTick;
+		for (n = nsort - 1; n >= 0; n--) {
+			keys[n] = key;
+			if (newTick[first + n] < 0 || newTick[first + n] == MDGetTick(&tempEvents[n]))
+				key = MDGetTick(&tempEvents[n]);
+		}
+		/*  Forwards, the displaced events are collected as (tick << 32 | n) in keys[0..ndisp-1];
+		    keys[n] has been read when keys[ndisp] (ndisp <= n) is overwritten  */
+		maxTick = kMDNegativeTick;
+		for (n = 0; n < nsort; n++) {
+			key = keys[n];
+			if (newTick[first + n] >= 0)
+				MDSetTick(&tempEvents[n], newTick[first + n]);
+			tick = MDGetTick(&tempEvents[n]);
+			if (tick >= maxTick && (uint64_t)tick <= key)
+				maxTick = tick;
+			else {
+				displaced[n] = 1;
+				keys[ndisp++] = ((uint64_t)tick << 32) | (uint32_t)n;
+			}
+		}
+
+		if (ndisp * 4 > nsort) {
+			/*  Many events are displaced: sort the whole range (stable, so that the events on
+			    the same tick keep their order; multi-threaded when large)  */
+			buf = (MDEvent *)malloc(sizeof(MDEvent) * nsort);
+			sts = (buf == NULL ? kMDErrorOutOfMemory : sMDEventStableSortParallel(tempEvents, buf, nsort));
+			free(buf);
+			if (sts != kMDNoError) {
+				free(tempEvents);
+				free(keys);
+				free(displaced);
+				return sts;
+			}
+			memset(displaced, 0, nsort);
+			ndisp = 0;
+		} else {
+			/*  Sort the displaced events only; with the index in the key, this keeps the
+			    original order on the same tick  */
+			qsort(keys, ndisp, sizeof(uint64_t), sMDTrackCompareTickKeys);
 		}
 	}
 
-	/*  Pass 2: Change the tick  */
-	index = 0;
+	/*  Pass 3: Store the new ticks outside first..last, and merge the kept events in
+	    first..last with the sorted displaced ones  */
+	MDTrackBumpEpoch(inTrack);	/*  the events are moved, and their ticks are changed  */
+	n = 0;
+	kn = dn = 0;
 	for (block = inTrack->first; block != NULL; block = block->next) {
-		for (i = 0; i < block->num; i++) {
-			if (newTick[index] >= 0)
-				MDSetTick(&block->events[i], newTick[index]);
-			index++;
+		ep = NULL;
+		for (i = 0; i < block->num; i++, n++) {
+			if (n >= first && n <= last) {
+				if (ep == NULL)
+					ep = block->events;
+				while (kn < nsort && displaced[kn])
+					kn++;
+				if (dn < ndisp && (kn >= nsort || keys[dn] < (((uint64_t)MDGetTick(&tempEvents[kn]) << 32) | (uint32_t)kn)))
+					MDEventMove(&ep[i], &tempEvents[(int32_t)(keys[dn++] & 0xffffffff)], 1);
+				else
+					MDEventMove(&ep[i], &tempEvents[kn++], 1);
+			} else if (newTick[n] >= 0 && newTick[n] != MDBlockGetTick(block, i)) {
+				if (ep == NULL)
+					ep = block->events;
+				MDSetTick(&ep[i], newTick[n]);
+			}
 		}
-		block->largestTick = kMDNegativeTick;
+		if (ep != NULL)
+			MDBlockInvalidateCache(block);
 	}
-#endif
+	free(tempEvents);
+	free(keys);
+	free(displaced);
 
 	largestTick = MDTrackGetLargestTick(inTrack);
 	if (largestTick >= inTrack->duration)
@@ -1338,16 +3683,20 @@ MDTrackOffsetTick(MDTrack *inTrack, MDTickType offset)
 	MDBlock *block;
 	int i;
 	MDTickType tick;
+	MDStatus sts;
 
+	if ((sts = MDTrackLoadIfNeeded(inTrack)) != kMDNoError)
+		return sts;
+	MDTrackBumpEpoch(inTrack);	/*  the ticks are changed  */
 	for (block = inTrack->first; block != NULL; block = block->next) {
 		if (block->largestTick >= 0)
-			block->largestTick += offset;
+			MDBlockSetLargestTick(block, block->largestTick + offset);
 		for (i = 0; i < block->num; i++) {
-			MDEvent *ep = &block->events[i];
+			MDEvent *ep = &MDBlockMutableEvents(block)[i];
 			tick = MDGetTick(ep) + offset;
 			if (tick < 0) {
 				tick = 0;
-				block->largestTick = kMDNegativeTick;
+				MDBlockSetLargestTick(block, kMDNegativeTick);
 			}
 			MDSetTick(ep, tick);
 		}
@@ -1360,25 +3709,301 @@ MDTrackOffsetTick(MDTrack *inTrack, MDTickType offset)
 	return kMDNoError;
 }
 
+#ifdef __MWERKS__
+#pragma mark ====== MDNoteOffMatcher ======
+#endif
+
+/* --------------------------------------
+	･ MDNoteOffMatcherNew
+   -------------------------------------- */
+MDNoteOffMatcher *
+MDNoteOffMatcherNew(MDTrack *inTrack)
+{
+	MDNoteOffMatcher *matcher;
+	if (inTrack == NULL)
+		return NULL;
+	matcher = (MDNoteOffMatcher *)malloc(sizeof(MDNoteOffMatcher));
+	if (matcher == NULL)
+		return NULL;	/*  out of memory  */
+	memset(matcher, 0, sizeof(MDNoteOffMatcher));
+	matcher->refCount = 1;
+	matcher->track = inTrack;
+	MDTrackRetain(inTrack);
+	MDNoteOffMatcherReset(matcher);
+	return matcher;
+}
+
+/* --------------------------------------
+	･ MDNoteOffMatcherRetain
+   -------------------------------------- */
+void
+MDNoteOffMatcherRetain(MDNoteOffMatcher *inMatcher)
+{
+	if (inMatcher == NULL)
+		return;
+	inMatcher->refCount++;
+}
+
+/* --------------------------------------
+	･ MDNoteOffMatcherRelease
+   -------------------------------------- */
+void
+MDNoteOffMatcherRelease(MDNoteOffMatcher *inMatcher)
+{
+	if (inMatcher == NULL)
+		return;
+	if (--(inMatcher->refCount) == 0) {
+		MDTrackRelease(inMatcher->track);
+		free(inMatcher->entries);
+		free(inMatcher);
+	}
+}
+
+/* --------------------------------------
+	･ MDNoteOffMatcherReset
+   -------------------------------------- */
+void
+MDNoteOffMatcherReset(MDNoteOffMatcher *inMatcher)
+{
+	int32_t i;
+	if (inMatcher == NULL)
+		return;
+	for (i = 0; i < kMDNoteOffMatcherNumberOfKeys; i++)
+		inMatcher->heads[i] = inMatcher->tails[i] = -1;
+	inMatcher->nentries = 0;
+	inMatcher->freeEntry = -1;
+	inMatcher->scanned = 0;
+}
+
+/* --------------------------------------
+	･ MDNoteOffMatcherScan
+   -------------------------------------- */
+/*  Register the internal note-ons appended since the last scan  */
+static MDStatus
+MDNoteOffMatcherScan(MDNoteOffMatcher *inMatcher)
+{
+	MDTrack *track = inMatcher->track;
+	MDBlock *block;
+	MDEvent *ep;
+	MDNoteOffMatcherEntry *entry;
+	int32_t index, pos, key, i;
+	MDStatus sts;
+
+	if ((sts = MDTrackLoadIfNeeded(track)) != kMDNoError)
+		return sts;
+	if (track->num < inMatcher->scanned)
+		MDNoteOffMatcherReset(inMatcher);  /*  Some events have been removed  */
+	if (track->num == inMatcher->scanned)
+		return kMDNoError;
+	pos = index = inMatcher->scanned;
+	block = MDTrackIndexLookupPosition(track, &index);
+	for ( ; block != NULL; block = block->next, index = 0) {
+		ep = MDBlockEvents(block);
+		if (ep == NULL)
+			return kMDErrorOutOfMemory;
+		for ( ; index < block->num; index++, pos++) {
+			if (MDGetKind(ep + index) != kMDEventInternalNoteOn || MDGetChannel(ep + index) >= 16 || MDGetCode(ep + index) >= 128)
+				continue;
+			/*  Append an entry to the list of this (channel, key)  */
+			if (inMatcher->freeEntry >= 0) {
+				i = inMatcher->freeEntry;
+				inMatcher->freeEntry = inMatcher->entries[i].next;
+			} else {
+				if (inMatcher->nentries >= inMatcher->maxentries) {
+					int32_t n = (inMatcher->maxentries > 0 ? inMatcher->maxentries * 2 : 256);
+					entry = (MDNoteOffMatcherEntry *)realloc(inMatcher->entries, sizeof(MDNoteOffMatcherEntry) * n);
+					if (entry == NULL) {
+						inMatcher->scanned = pos;
+						return kMDErrorOutOfMemory;
+					}
+					inMatcher->entries = entry;
+					inMatcher->maxentries = n;
+				}
+				i = inMatcher->nentries++;
+			}
+			key = MDGetChannel(ep + index) * 128 + MDGetCode(ep + index);
+			entry = &inMatcher->entries[i];
+			entry->position = pos;
+			entry->next = -1;
+			if (inMatcher->tails[key] >= 0)
+				inMatcher->entries[inMatcher->tails[key]].next = i;
+			else inMatcher->heads[key] = i;
+			inMatcher->tails[key] = i;
+		}
+	}
+	inMatcher->scanned = pos;
+	return kMDNoError;
+}
+
+/* --------------------------------------
+	･ MDNoteOffMatcherMatch
+   -------------------------------------- */
+MDStatus
+MDNoteOffMatcherMatch(MDNoteOffMatcher *inMatcher, const MDEvent *noteOffEvent)
+{
+	MDTrack *track;
+	MDBlock *block;
+	MDEvent *ep;
+	MDNoteOffMatcherEntry *entry;
+	MDTickType duration;
+	MDStatus result;
+	int32_t i, prev, key, index, retry;
+	unsigned char code = MDGetCode(noteOffEvent);
+	int channel = MDGetChannel(noteOffEvent);
+	MDTickType tick = MDGetTick(noteOffEvent);
+
+	if (inMatcher == NULL)
+		return kMDErrorInternalError;
+	track = inMatcher->track;
+	if (channel < 0 || channel >= 16 || code >= 128)
+		return MDTrackMatchNoteOff(track, noteOffEvent, NULL);  /*  Not a MIDI note; search linearly  */
+
+	for (retry = 0; retry < 2; retry++) {
+		if ((result = MDNoteOffMatcherScan(inMatcher)) != kMDNoError)
+			return result;
+		key = channel * 128 + code;
+		for (i = inMatcher->heads[key], prev = -1; i >= 0; prev = i, i = entry->next) {
+			entry = &inMatcher->entries[i];
+			index = entry->position;
+			if (index >= track->num)
+				break;  /*  The track has been edited  */
+			block = MDTrackIndexLookupPosition(track, &index);
+			ep = MDBlockEvents(block) + index;
+			if (MDGetKind(ep) != kMDEventInternalNoteOn || MDGetCode(ep) != code || MDGetChannel(ep) != channel)
+				break;  /*  The track has been edited  */
+			duration = MDGetDuration(ep);
+			if (duration != 0 && duration != tick - MDGetTick(ep))
+				continue;  /*  The duration hint does not match; try the next one  */
+			/*  Found  */
+			if ((ep = MDBlockMutableEvents(block)) == NULL)
+				return kMDErrorOutOfMemory;
+			ep += index;
+			duration = tick - MDGetTick(ep);
+			MDSetKind(ep, kMDEventNote);
+			if (duration <= 0)
+				duration = 1;  /*  Avoid zero-duration event  */
+			MDSetDuration(ep, duration);
+			MDSetNoteOffVelocity(ep, MDGetNoteOffVelocity(noteOffEvent));
+			MDBlockInvalidateCache(block);
+			/*  Remove the entry from the list  */
+			if (prev >= 0)
+				inMatcher->entries[prev].next = entry->next;
+			else inMatcher->heads[key] = entry->next;
+			if (inMatcher->tails[key] == i)
+				inMatcher->tails[key] = prev;
+			entry->next = inMatcher->freeEntry;
+			inMatcher->freeEntry = i;
+			return kMDNoError;
+		}
+		if (i < 0)
+			return kMDErrorOrphanedNoteOff;
+		/*  The pending note-ons are out of date; register them again from the top  */
+		MDNoteOffMatcherReset(inMatcher);
+	}
+	return kMDErrorOrphanedNoteOff;
+}
+
 #ifdef __MWERKS__
 #pragma mark ====== Duration search ======
 #endif
 
+/* --------------------------------------
+	･ MDBlockIndexGetLargestTick
+   -------------------------------------- */
+static MDTickType
+MDBlockIndexGetLargestTick(MDTrack *inTrack, MDBlockIndex *inNode)
+{
+	MDTickType tick, largestTick;
+	MDBlock *block;
+	int32_t i;
+	if (!inNode->largestTickValid) {
+		largestTick = kMDNegativeTick;
+		for (i = 0; i < inNode->nchildren; i++) {
+			if (inNode->level == 0) {
+				block = (MDBlock *)inNode->children[i];
+				MDTrackUpdateLargestTickForBlock(inTrack, block);
+				tick = block->largestTick;
+			} else tick = MDBlockIndexGetLargestTick(inTrack, (MDBlockIndex *)inNode->children[i]);
+			if (tick > largestTick)
+				largestTick = tick;
+		}
+		inNode->largestTick = largestTick;
+		inNode->largestTickValid = 1;
+	}
+	return inNode->largestTick;
+}
+
+/* --------------------------------------
+	･ MDBlockIndexCollectDurations
+   -------------------------------------- */
+/*  Add to ioSet the events with duration under inNode that satisfy tick < inToTick and
+    tick + duration >= inFromTick. If inKeys is not NULL, only the notes whose key is set
+    in the 128-bit mask inKeys are added. The subtrees that end before inFromTick, and the
+    blocks that have no notes in inKeys, are skipped.
+    Returns non-zero when the search is over (an event at or after inToTick is reached,
+    or out of memory; in the latter case *outStatus is set).  */
+static int
+MDBlockIndexCollectDurations(MDTrack *inTrack, MDBlockIndex *inNode, int32_t inBase, MDTickType inFromTick, MDTickType inToTick, const uint32_t *inKeys, IntGroup *ioSet, MDStatus *outStatus)
+{
+	MDBlock *block;
+	MDEvent *ep;
+	int32_t i, j, n;
+	unsigned char code;
+	for (i = 0; i < inNode->nchildren; i++, inBase += n) {
+		n = MDBlockIndexChildCount(inNode, i);
+		if (n == 0)
+			continue;
+		if (MDBlockIndexFirstTick(inNode, i) >= inToTick)
+			return 1;
+		if (inNode->level > 0) {
+			if (MDBlockIndexGetLargestTick(inTrack, (MDBlockIndex *)inNode->children[i]) < inFromTick)
+				continue;
+			if (MDBlockIndexCollectDurations(inTrack, (MDBlockIndex *)inNode->children[i], inBase, inFromTick, inToTick, inKeys, ioSet, outStatus))
+				return 1;
+			continue;
+		}
+		block = (MDBlock *)inNode->children[i];
+		MDTrackUpdateLargestTickForBlock(inTrack, block);
+		if (block->largestTick < inFromTick)
+			continue;
+		if (inKeys != NULL) {
+			MDBlockUpdateSummary(block);
+			if ((block->noteKeys[0] & inKeys[0]) == 0 && (block->noteKeys[1] & inKeys[1]) == 0
+			&& (block->noteKeys[2] & inKeys[2]) == 0 && (block->noteKeys[3] & inKeys[3]) == 0) {
+				if (MDBlockGetTick(block, n - 1) >= inToTick)
+					return 1;
+				continue;
+			}
+		}
+		for (j = 0, ep = MDBlockEvents(block); j < n; j++, ep++) {
+			if (MDGetTick(ep) >= inToTick)
+				return 1;
+			if (inKeys != NULL) {
+				code = MDGetCode(ep);
+				if (!MDIsNoteEvent(ep) || (inKeys[(code >> 5) & 3] & (1U << (code & 31))) == 0)
+					continue;
+			}
+			if (MDHasDuration(ep) && MDGetTick(ep) + MDGetDuration(ep) >= inFromTick) {
+				if (IntGroupAdd(ioSet, inBase + j, 1) != kMDNoError) {
+					*outStatus = kMDErrorOutOfMemory;
+					return 1;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
 /* --------------------------------------
 	･ MDTrackGetLargestTick
    -------------------------------------- */
 MDTickType
 MDTrackGetLargestTick(MDTrack *inTrack)
 {
-    MDTickType globalLargestTick;
-    MDBlock *block;
-	globalLargestTick = kMDNegativeTick;
-    for (block = inTrack->first; block != NULL; block = block->next) {
-        MDTrackUpdateLargestTickForBlock(inTrack, block);
-        if (block->largestTick > globalLargestTick)
-			globalLargestTick = block->largestTick;
-	}
-	return globalLargestTick;
+	MDTrackLoadIfNeeded(inTrack);
+	if (inTrack->index == NULL)
+		return kMDNegativeTick;
+	return MDBlockIndexGetLargestTick(inTrack, inTrack->index);
 }
 
 /* --------------------------------------
@@ -1387,41 +4012,58 @@ MDTrackGetLargestTick(MDTrack *inTrack)
 IntGroup *
 MDTrackSearchEventsWithDurationCrossingTick(MDTrack *inTrack, MDTickType inTick)
 {
-    IntGroup *pset;
-    int32_t position, i;
-    MDTickType tick, largestTick;
-    MDBlock *block;
-    MDEvent *ep;
-    pset = IntGroupNew();
-    if (pset == NULL)
-        return NULL;
-    position = 0;
-    for (block = inTrack->first; block != NULL; block = block->next) {
-        if (block->largestTick < 0 || block->largestTick >= inTick) {
-            largestTick = kMDNegativeTick;
-            for (i = 0; i < block->num; i++) {
-                ep = &block->events[i];
-                tick = MDGetTick(ep);
-                if (tick >= inTick)
-                    goto exit;
-                if (MDHasDuration(ep)) {
-                    tick += MDGetDuration(ep);
-                    if (tick >= inTick) {
-                        if (IntGroupAdd(pset, position + i, 1) != kMDNoError) {
-                            IntGroupRelease(pset);
-                            return NULL;
-                        }
-                    }
-                }
-                if (tick > largestTick)
-                    largestTick = tick;
-            }
-            block->largestTick = largestTick;
-        }
-        position += block->num;
-    }
-    exit:
-    return pset;
+	return MDTrackSearchEventsWithDurationInRange(inTrack, inTick, inTick);
+}
+
+/* --------------------------------------
+	･ MDTrackSearchEventsWithDurationInRange
+   -------------------------------------- */
+IntGroup *
+MDTrackSearchEventsWithDurationInRange(MDTrack *inTrack, MDTickType inFromTick, MDTickType inToTick)
+{
+	IntGroup *pset;
+	MDStatus sts = kMDNoError;
+	pset = IntGroupNew();
+	if (pset == NULL)
+		return NULL;
+	sts = MDTrackLoadIfNeeded(inTrack);
+	if (sts == kMDNoError && inTrack->index != NULL)
+		MDBlockIndexCollectDurations(inTrack, inTrack->index, 0, inFromTick, inToTick, NULL, pset, &sts);
+	if (sts != kMDNoError) {
+		IntGroupRelease(pset);
+		return NULL;
+	}
+	return pset;
+}
+
+/* --------------------------------------
+	･ MDTrackSearchNotesInRange
+   -------------------------------------- */
+IntGroup *
+MDTrackSearchNotesInRange(MDTrack *inTrack, MDTickType inFromTick, MDTickType inToTick, int inFromKey, int inToKey)
+{
+	IntGroup *pset;
+	MDStatus sts = kMDNoError;
+	uint32_t keys[4];
+	int key;
+	pset = IntGroupNew();
+	if (pset == NULL)
+		return NULL;
+	if (inFromKey < 0)
+		inFromKey = 0;
+	if (inToKey > 127)
+		inToKey = 127;
+	memset(keys, 0, sizeof(keys));
+	for (key = inFromKey; key <= inToKey; key++)
+		keys[key >> 5] |= (1U << (key & 31));
+	sts = MDTrackLoadIfNeeded(inTrack);
+	if (sts == kMDNoError && inTrack->index != NULL && inFromKey <= inToKey)
+		MDBlockIndexCollectDurations(inTrack, inTrack->index, 0, inFromTick, inToTick, keys, pset, &sts);
+	if (sts != kMDNoError) {
+		IntGroupRelease(pset);
+		return NULL;
+	}
+	return pset;
 }
 
 /* --------------------------------------
@@ -1429,15 +4071,24 @@ MDTrackSearchEventsWithDurationCrossingTick(MDTrack *inTrack, MDTickType inTick)
    -------------------------------------- */
 IntGroup *
 MDTrackSearchEventsWithSelector(MDTrack *inTrack, MDEventSelector inSelector, void *inUserData)
+{
+	return MDTrackSearchEventsWithFilter(inTrack, NULL, inSelector, inUserData);
+}
+
+/* --------------------------------------
+	･ MDTrackSearchEventsWithFilter
+   -------------------------------------- */
+IntGroup *
+MDTrackSearchEventsWithFilter(MDTrack *inTrack, const MDEventFilter *inFilter, MDEventSelector inSelector, void *inUserData)
 {
     IntGroup *pset;
 	MDPointer *pt;
-    MDEvent *ep;
+    const MDEvent *ep;
     pset = IntGroupNew();
 	pt = MDPointerNew(inTrack);
     if (pset == NULL || pt == NULL)
         return NULL;
-	while ((ep = MDPointerForwardWithSelector(pt, inSelector, inUserData)) != NULL) {
+	while ((ep = MDPointerForwardWithFilter(pt, inFilter, inSelector, inUserData)) != NULL) {
 		if (IntGroupAdd(pset, MDPointerGetPosition(pt), 1) != kMDNoError) {
 			MDPointerRelease(pt);
 			IntGroupRelease(pset);
@@ -1460,27 +4111,31 @@ MDTrackRemapChannel(MDTrack *inTrack, const unsigned char *newch)
 {
     int32_t nnch[16];
     int32_t n;
-    MDBlock *block;
+	MDTrackLoader *loader;
 	static unsigned char allzero[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
     if (inTrack == NULL)
         return;
 	if (newch == NULL)
 		newch = allzero;
-    for (n = 0; n < 16; n++)
-        nnch[n] = 0;
-    for (block = inTrack->first; block != NULL; block = block->next) {
-        MDEvent *ep = block->events;
-        for (n = 0; n < block->num; n++, ep++) {
-            if (MDIsChannelEvent(ep)) {
-                unsigned char ch;
-                ch = (newch[MDGetChannel(ep) & 15]) & 15;
-                MDSetChannel(ep, ch);
-                nnch[ch]++;
-            }
-        }
-    }
-    for (n = 0; n < 16; n++)
-        inTrack->nch[n] = nnch[n];
+	if (MDTrackPeekLoader(inTrack) != NULL) {
+		pthread_mutex_lock(&sMDTrackLoadMutex);
+		if ((loader = inTrack->loader) != NULL) {
+			/*  Remap the counts now, and the events when they are loaded (MDTrackLoad()
+			    applies loader->remap under the same lock)  */
+			for (n = 0; n < 16; n++)
+				nnch[n] = 0;
+			for (n = 0; n < 16; n++) {
+				nnch[newch[n] & 15] += loader->nch[n];
+				loader->remap[n] = newch[loader->remap[n]] & 15;
+			}
+			for (n = 0; n < 16; n++)
+				loader->nch[n] = nnch[n];
+			pthread_mutex_unlock(&sMDTrackLoadMutex);
+			return;
+		}
+		pthread_mutex_unlock(&sMDTrackLoadMutex);
+	}
+	MDTrackRemapChannelOfEvents(inTrack, newch);
 }
 
 /* --------------------------------------
@@ -1602,7 +4257,7 @@ void
 MDTrackGuessName(MDTrack *inTrack, char *outName, int32_t length)
 {
 	MDPointer *ptr;
-	MDEvent *eref, *stopref;
+	const MDEvent *eref, *stopref;
 	int32_t len;
 
 	ptr = MDPointerNew(inTrack);
@@ -1646,7 +4301,7 @@ void
 MDTrackGuessDeviceName(MDTrack *inTrack, char *outName, int32_t length)
 {
 	MDPointer *ptr;
-	MDEvent *eref, *stopref;
+	const MDEvent *eref, *stopref;
 	char name[256];
 	char c;
 	char *p;
@@ -1760,7 +4415,7 @@ void
 MDTrackDump(const MDTrack *inTrack)
 {
 	MDPointer *pt;
-	MDEvent *ev;
+	const MDEvent *ev;
 	char buf[256];
 	FILE *fp = fopen("Alchemusica.dump", "w");
 	if (fp == NULL)
@@ -1781,7 +4436,7 @@ int
 MDTrackRecache(MDTrack *inTrack, int check)
 {
 	MDPointer *pt1, *pt2;
-	MDEvent *ev1;
+	const MDEvent *ev1;
 	int32_t nch[18];
 	int32_t i, pos;
 	MDTickType tick, lastTick;
@@ -1837,13 +4492,17 @@ MDTrackRecache(MDTrack *inTrack, int check)
 		}
 		inTrack->nch[i] = nch[i];
 	}
+	if (check && (inTrack->index != NULL ? inTrack->index->count : 0) != inTrack->num) {
+		MDShowErrorMessage("The block index count (%d) does not match the number of events (%d)\n", (int)(inTrack->index != NULL ? inTrack->index->count : 0), (int)inTrack->num);
+		errcnt++;
+	}
 	
 	lastTick = kMDNegativeTick;
     for (block = inTrack->first; block != NULL; block = block->next) {
         tick = kMDNegativeTick;
         for (i = 0; i < block->num; i++) {
             MDTickType tick2;
-            ev1 = &block->events[i];
+            ev1 = &MDBlockEvents(block)[i];
             tick2 = MDGetTick(ev1);
             if (MDHasDuration(ev1))
                 tick2 += MDGetDuration(ev1);
@@ -1854,7 +4513,7 @@ MDTrackRecache(MDTrack *inTrack, int check)
             MDShowErrorMessage("The largestTick(%d) does not match the largest tick(%d) in block %p\n", (int)block->largestTick, (int)tick, block);
 			errcnt++;
         }
-		block->largestTick = tick;
+		MDBlockSetLargestTick(block, tick);
 		if (tick > lastTick)
 			lastTick = tick;
     }
@@ -1882,32 +4541,40 @@ MDTrackAttachPointer(const MDTrack *inTrack, MDPointer *inPointer)
 	if (inTrack == NULL || inPointer == NULL)
 		return;
 	inPointer->next = inTrack->pointer;
+	inPointer->prev = NULL;
+	if (inPointer->next != NULL)
+		inPointer->next->prev = inPointer;
 
 	/*  pointer is a 'mutable' member, so this cast is acceptable  */
 	((MDTrack *)inTrack)->pointer = inPointer;
 }
 
 static void
-MDTrackDetachPointer(const MDTrack *inTrack, MDPointer *inPointer)
+MDTrackDetachPointer(const MDTrack *inTrack, MDPointer *inPointer)
+{
+	if (inTrack == NULL || inPointer == NULL)
+		return;
+	if (inPointer->prev == NULL) {
+		/*  pointer is a 'mutable' member, so this cast is acceptable  */
+		((MDTrack *)inTrack)->pointer = inPointer->next;
+	} else {
+		inPointer->prev->next = inPointer->next;
+	}
+	if (inPointer->next != NULL)
+		inPointer->next->prev = inPointer->prev;
+	inPointer->next = inPointer->prev = NULL;
+}
+
+/*  Bring all the autoAdjust pointers up to date, and empty the edit log  */
+static void
+MDTrackSyncPointers(MDTrack *inTrack)
 {
-	MDPointer *currRef, *prevRef;
-	if (inTrack == NULL || inPointer == NULL)
-		return;
-	currRef = inTrack->pointer;
-	prevRef = NULL;
-	while (currRef != NULL) {
-		if (currRef == inPointer) {
-			if (prevRef == NULL) {
-				/*  pointer is a 'mutable' member, so this cast is acceptable  */
-				((MDTrack *)inTrack)->pointer = currRef->next;
-			} else {
-				prevRef->next = currRef->next;
-			}
-			break;
-		}
-		prevRef = currRef;
-		currRef = currRef->next;
+	MDPointer *ptr;
+	for (ptr = inTrack->pointer; ptr != NULL; ptr = ptr->next) {
+		if (ptr->autoAdjust)
+			MDPointerSync(ptr);
 	}
+	inTrack->nedits = 0;
 }
 
 #ifdef __MWERKS__
@@ -1927,15 +4594,21 @@ MDPointerNew(MDTrack *inTrack)
 	
 	theRef->refCount = 1;
 	theRef->parent = NULL;
-	theRef->next = NULL;
+	theRef->next = theRef->prev = NULL;
+	theRef->epoch = 0;
 	theRef->block = NULL;
 	theRef->position = -1;
 	theRef->index = 0;
 	theRef->removed = 0;
 	theRef->autoAdjust = 0;
 /*	theRef->allocated = 1; */
-	if (inTrack != NULL)
+	if (inTrack != NULL) {
 		MDPointerSetTrack(theRef, inTrack);
+		if (theRef->parent == NULL) {
+			free(theRef);  /*  The events cannot be loaded  */
+			return NULL;
+		}
+	}
 	return theRef;
 }
 
@@ -1969,6 +4642,8 @@ void
 MDPointerCopy(MDPointer *inDest, const MDPointer *inSrc)
 {
 	if (inDest->parent == inSrc->parent) {
+		MDPointerSync(inSrc);
+		inDest->epoch = inSrc->epoch;
 		inDest->block = inSrc->block;
 		inDest->position = inSrc->position;
 		inDest->index = inSrc->index;
@@ -1987,6 +4662,8 @@ MDPointerSetTrack(MDPointer *inPointer, MDTrack *inTrack)
 	if (inPointer->parent != inTrack) {
 		if (inPointer->parent != NULL)
 			MDTrackDetachPointer(inPointer->parent, inPointer);
+		if (inTrack != NULL && MDTrackLoadIfNeeded(inTrack) != kMDNoError)
+			inTrack = NULL;  /*  Do not show the track as empty; the loading can be retried  */
 		inPointer->parent = inTrack;
 		if (inTrack != NULL)
 			MDTrackAttachPointer(inTrack, inPointer);
@@ -1996,6 +4673,7 @@ MDPointerSetTrack(MDPointer *inPointer, MDTrack *inTrack)
 		else inPointer->block = NULL;
 		inPointer->index = -1;
 		inPointer->removed = 0;
+		inPointer->epoch = (inTrack != NULL ? inTrack->epoch : 0);
 	}
 }
 
@@ -2019,43 +4697,66 @@ MDPointerUpdateBlock(MDPointer *inPointer)
 
 	num = inPointer->parent->num;
 	position = inPointer->position;
+	inPointer->epoch = inPointer->parent->epoch;
 
 	if (num == 0) {
 		inPointer->block = NULL;
 		inPointer->index = inPointer->position = -1;
 		return 0;
-	} else if (position < num / 2) {
-		/*  Search the position starting from the first block  */
+	} else if (position < 0) {
 		inPointer->block = inPointer->parent->first;
-		inPointer->index = 0;
-		if (position < 0) {
-			inPointer->index = inPointer->position = -1;
-			return 0;
-		} else {
-			while (position >= inPointer->block->num) {
-				position -= inPointer->block->num;
-				inPointer->block = inPointer->block->next;
-			}
-			inPointer->index = position;
-			return 1;
-		}
-	} else {
-		/*  Search the position starting from the last block  */
+		inPointer->index = inPointer->position = -1;
+		return 0;
+	} else if (position >= num) {
 		inPointer->block = inPointer->parent->last;
 		inPointer->index = inPointer->block->num;
-		if (position >= num) {
-			inPointer->position = num;
-			return 0;
-		} else {
-			int32_t offset = num - position;
-			while (offset > inPointer->block->num) {
-				offset -= inPointer->block->num;
-				inPointer->block = inPointer->block->last;
+		inPointer->position = num;
+		return 0;
+	} else {
+		/*  Look up the block index  */
+		inPointer->block = MDTrackIndexLookupPosition(inPointer->parent, &position);
+		inPointer->index = position;
+		return 1;
+	}
+}
+
+/* --------------------------------------
+	･ MDPointerSync
+   -------------------------------------- */
+/*  If the track has been edited since the block/index were looked up, apply the logged
+    insertions/deletions (only for autoAdjust pointers) and look them up again. Should
+    be called before the block/index/position are used.  */
+static void
+MDPointerSync(const MDPointer *inPointer)
+{
+	/*  block, index, position and removed are 'mutable' members, so this cast is acceptable  */
+	MDPointer *ptr = (MDPointer *)inPointer;
+	MDTrack *track = ptr->parent;
+	MDPointerEdit *ep;
+	int32_t i, n;
+
+	if (track == NULL || ptr->epoch == track->epoch)
+		return;
+	if (ptr->autoAdjust) {
+		for (i = 0; i < track->nedits; i++) {
+			ep = &track->edits[i];
+			if ((int32_t)(ep->epoch - ptr->epoch) <= 0)
+				continue;	/*  Already applied  */
+			if (ep->count > 0) {
+				if (ptr->position > ep->position)
+					ptr->position += ep->count;
+			} else {
+				n = -ep->count;
+				if (ptr->position > ep->position + n)
+					ptr->position -= n;
+				else if (ptr->position >= ep->position) {
+					ptr->position = ep->position;
+					ptr->removed = 1;
+				}
 			}
-			inPointer->index = inPointer->block->num - offset;
-			return 1;
 		}
 	}
+	MDPointerUpdateBlock(ptr);
 }
 
 /* --------------------------------------
@@ -2082,6 +4783,7 @@ MDPointerSetRelativePosition(MDPointer *inPointer, int32_t inOffset)
 
 	if (inPointer->parent == NULL)
 		return 0;	/*  always false  */
+	MDPointerSync(inPointer);
 	num = inPointer->parent->num;
 
 	if (inOffset == 0 || num == 0)
@@ -2128,6 +4830,7 @@ MDPointerSetRelativePosition(MDPointer *inPointer, int32_t inOffset)
 int32_t
 MDPointerGetPosition(const MDPointer *inPointer)
 {
+	MDPointerSync(inPointer);
 	return inPointer->position;
 }
 
@@ -2137,6 +4840,7 @@ MDPointerGetPosition(const MDPointer *inPointer)
 void
 MDPointerSetAutoAdjust(MDPointer *inPointer, char flag)
 {
+	MDPointerSync(inPointer);
 	inPointer->autoAdjust = (flag != 0);
 }
 
@@ -2155,6 +4859,7 @@ MDPointerIsAutoAdjust(const MDPointer *inPointer)
 int
 MDPointerIsRemoved(const MDPointer *inPointer)
 {
+	MDPointerSync(inPointer);
 	return inPointer->removed;
 }
 
@@ -2165,7 +4870,6 @@ int
 MDPointerJumpToTick(MDPointer *inPointer, MDTickType inTick)
 {
 	int32_t num;
-	MDEvent event;
 
 	if (inPointer->parent == NULL)
 		return 0;	/*  always false  */
@@ -2175,63 +4879,13 @@ MDPointerJumpToTick(MDPointer *inPointer, MDTickType inTick)
 	if (num == 0)
 		return 0;
 	
+	/*  Look up the block index for the first event >= inTick  */
+	/*  (If there are no such events, then the current position becomes the
+	    "end of sequence")  */
+	inPointer->position = MDTrackIndexLookupTick(inPointer->parent, inTick);
+	MDPointerUpdateBlock(inPointer);
 	inPointer->removed = 0;
 
-	/*  Move to the top of the current block  */
-	inPointer->position -= inPointer->index;
-	if (inPointer->block == NULL)
-		inPointer->block = inPointer->parent->first;
-	inPointer->index = 0;
-
-	/*  dummy event for comparison only  */
-	MDEventInit(&event);
-	MDSetTick(&event, inTick);
-
-	/*  Look for the block whose first event >= inTick  */
-	if (MDIsTickGreaterOrEqual(inPointer->block->events, &event)) {
-		/*  The first event is already >= inTick  */
-		/*  Search backward  */
-		while (inPointer->block->last != NULL) {
-			if (MDIsTickLess(inPointer->block->last->events, &event))
-				break;
-			inPointer->block = inPointer->block->last;
-			inPointer->position -= inPointer->block->num;
-		}
-	} else {
-		/*  Search forward  */
-		do {
-			inPointer->position += inPointer->block->num;
-			inPointer->block = inPointer->block->next;
-		} while (inPointer->block != NULL && MDIsTickLess(inPointer->block->events, &event));
-	}
-
-	if (inPointer->block != NULL &&
-		(inPointer->block->last == NULL ||
-		MDIsTickLess(inPointer->block->last->events + inPointer->block->last->num - 1, &event))) {
-		/*  If this is the first block, or the last event in the previous block is < inEvent,
-		    then the first event in this block is the goal  */
-		inPointer->index = 0;
-	} else {
-		/*  The goal is contained in the last block  */
-		if (inPointer->block == NULL) {
-			inPointer->block = inPointer->parent->last;
-		} else {
-			/*  inPointer->block->last should not be NULL (that case is already processed in the
-			    previous "if" statement)  */
-			inPointer->block = inPointer->block->last;
-		}
-		inPointer->position -= inPointer->block->num;
-
-		/*  Look in this block for the first event which is >= inTick  */
-		/*  (If there are no such events, then the current position becomes the
-		    "end of sequence")  */
-		for (inPointer->index = 0; inPointer->index < inPointer->block->num; inPointer->index++) {
-			if (MDIsTickGreaterOrEqual(inPointer->block->events + inPointer->index, &event))
-				break;
-		}
-		inPointer->position += inPointer->index;
-	}
-
 	return (inPointer->position < num);
 }
 
@@ -2249,6 +4903,7 @@ MDPointerJumpToLast(MDPointer *inPointer)
 	inPointer->block = inPointer->parent->last;
 	inPointer->index = inPointer->parent->last->num - 1;
 	inPointer->removed = 0;
+	inPointer->epoch = inPointer->parent->epoch;
 	return 1;
 }
 
@@ -2264,6 +4919,7 @@ MDPointerLookForEvent(MDPointer *inPointer, const MDEvent *inEvent)
 
 	if (inPointer->parent == NULL || inPointer->parent->num == 0 || inEvent == NULL)
 		return 0;
+	MDPointerSync(inPointer);
 
 	/*  Move to the top event in the current block  */
 	inPointer->position -= inPointer->index;
@@ -2274,10 +4930,10 @@ MDPointerLookForEvent(MDPointer *inPointer, const MDEvent *inEvent)
 	tick = MDGetTick(inEvent);
 
 	/*  Search forward  */
-	while (inPointer->block != NULL && MDGetTick(inPointer->block->events) <= tick) {
+	while (inPointer->block != NULL && MDBlockGetTick(inPointer->block, 0) <= tick) {
 		/*  This if-statement is violating ANSI standard (i.e. it assumes arbitrary two pointers
 		    can be compared).  However, this is allowed in most platforms.  */
-		if (inPointer->block->events <= inEvent
+		if (inPointer->block->events != NULL && inPointer->block->events <= inEvent
 			&& inEvent < inPointer->block->events + inPointer->block->num) {
 				goto found;
 		}
@@ -2289,13 +4945,13 @@ MDPointerLookForEvent(MDPointer *inPointer, const MDEvent *inEvent)
 	inPointer->block = saveBlock;
 
 	/*  Search backward  */
-	while (inPointer->block != NULL && MDGetTick(inPointer->block->events) >= tick) {
+	while (inPointer->block != NULL && MDBlockGetTick(inPointer->block, 0) >= tick) {
 		if (inPointer->block->last != NULL) {
 			inPointer->block = inPointer->block->last;
 			inPointer->position -= inPointer->block->num;
 		} else break;
 		/*  Another illegal if-statement  */
-		if (inPointer->block->events <= inEvent
+		if (inPointer->block->events != NULL && inPointer->block->events <= inEvent
 			&& inEvent < inPointer->block->events + inPointer->block->num) {
 				goto found;
 		}
@@ -2320,6 +4976,7 @@ found:
 static int
 MDPointerNextPos(MDPointer *inPointer)
 {
+	MDPointerSync(inPointer);
 	inPointer->removed = 0;
 	if (inPointer->block == NULL) {
 		if (inPointer->parent == NULL || inPointer->parent->num == 0)
@@ -2349,6 +5006,7 @@ MDPointerNextPos(MDPointer *inPointer)
 static int
 MDPointerPreviousPos(MDPointer *inPointer)
 {
+	MDPointerSync(inPointer);
 	if (inPointer->position <= 0) {
 		if (inPointer->position == 0) {
 			inPointer->block = NULL;
@@ -2374,21 +5032,84 @@ MDPointerPreviousPos(MDPointer *inPointer)
 /* --------------------------------------
 	･ MDPointerCurrent
    -------------------------------------- */
-MDEvent *
+const MDEvent *
 MDPointerCurrent(const MDPointer *inPointer)
 {
+	MDPointerSync(inPointer);
 	if (inPointer->parent == NULL ||
 	(inPointer->position < 0 || inPointer->position >= inPointer->parent->num)) {
 		return NULL;
 	} else {
-		return inPointer->block->events + inPointer->index;
+		return MDBlockEvents(inPointer->block) + inPointer->index;
 	}
 }
 
 /* --------------------------------------
-	･ MDPointerForward
+	･ MDPointerCurrentMutable
    -------------------------------------- */
 MDEvent *
+MDPointerCurrentMutable(MDPointer *inPointer)
+{
+	MDEvent *events;
+	MDTrack *track;
+	MDPointerSync(inPointer);
+	track = inPointer->parent;
+	if (track == NULL || inPointer->position < 0 || inPointer->position >= track->num)
+		return NULL;
+	if ((events = MDBlockMutableEvents(inPointer->block)) == NULL)
+		return NULL;
+	/*  The event is going to be modified: drop the block caches, and let the tempo maps,
+	    the snapshots and the other pointers know that the track has changed  */
+	MDBlockInvalidateCache(inPointer->block);
+	MDTrackBumpEpoch(track);
+	inPointer->epoch = track->epoch;
+	return events + inPointer->index;
+}
+
+/* --------------------------------------
+	･ MDPointerCurrentPrivate
+   -------------------------------------- */
+/*  Same as MDPointerCurrentMutable(), but the block caches and the edit epoch are left
+    alone. For the functions in this file that rewrite many events in a row, and take care
+    of the caches and the epoch once at the end.  */
+static MDEvent *
+MDPointerCurrentPrivate(const MDPointer *inPointer)
+{
+	MDEvent *events;
+	MDPointerSync(inPointer);
+	if (inPointer->parent == NULL || inPointer->position < 0 || inPointer->position >= inPointer->parent->num)
+		return NULL;
+	if ((events = MDBlockMutableEvents(inPointer->block)) == NULL)
+		return NULL;
+	return events + inPointer->index;
+}
+
+/* --------------------------------------
+	･ MDPointerForwardPrivate
+   -------------------------------------- */
+static MDEvent *
+MDPointerForwardPrivate(MDPointer *inPointer)
+{
+	if (MDPointerNextPos(inPointer)) {
+		return MDPointerCurrentPrivate(inPointer);
+	} else return NULL;
+}
+
+/* --------------------------------------
+	･ MDPointerBackwardPrivate
+   -------------------------------------- */
+static MDEvent *
+MDPointerBackwardPrivate(MDPointer *inPointer)
+{
+	if (MDPointerPreviousPos(inPointer)) {
+		return MDPointerCurrentPrivate(inPointer);
+	} else return NULL;
+}
+
+/* --------------------------------------
+	･ MDPointerForward
+   -------------------------------------- */
+const MDEvent *
 MDPointerForward(MDPointer *inPointer)
 {
 	if (MDPointerNextPos(inPointer)) {
@@ -2399,7 +5120,7 @@ MDPointerForward(MDPointer *inPointer)
 /* --------------------------------------
 	･ MDPointerBackward
    -------------------------------------- */
-MDEvent *
+const MDEvent *
 MDPointerBackward(MDPointer *inPointer)
 {
 	if (MDPointerPreviousPos(inPointer)) {
@@ -2410,10 +5131,10 @@ MDPointerBackward(MDPointer *inPointer)
 /* --------------------------------------
 	･ MDPointerForwardWithSelector
    -------------------------------------- */
-MDEvent *
+const MDEvent *
 MDPointerForwardWithSelector(MDPointer *inPointer, MDEventSelector inSelector, void *inUserData)
 {
-	MDEvent *ep;
+	const MDEvent *ep;
 	int32_t position;
 	while ((ep = MDPointerForward(inPointer)) != NULL) {
 		position = MDPointerGetPosition(inPointer);
@@ -2426,10 +5147,10 @@ MDPointerForwardWithSelector(MDPointer *inPointer, MDEventSelector inSelector, v
 /* --------------------------------------
 	･ MDPointerBackwardWithSelector
    -------------------------------------- */
-MDEvent *
+const MDEvent *
 MDPointerBackwardWithSelector(MDPointer *inPointer, MDEventSelector inSelector, void *inUserData)
 {
-	MDEvent *ep;
+	const MDEvent *ep;
 	int32_t position;
 	while ((ep = MDPointerBackward(inPointer)) != NULL) {
 		position = MDPointerGetPosition(inPointer);
@@ -2439,6 +5160,63 @@ MDPointerBackwardWithSelector(MDPointer *inPointer, MDEventSelector inSelector,
 	return NULL;
 }
 
+/* --------------------------------------
+	･ MDPointerForwardWithFilter
+   -------------------------------------- */
+const MDEvent *
+MDPointerForwardWithFilter(MDPointer *inPointer, const MDEventFilter *inFilter, MDEventSelector inSelector, void *inUserData)
+{
+	const MDEvent *ep;
+	MDBlock *block = NULL;
+	while (MDPointerNextPos(inPointer)) {
+		if (inFilter != NULL) {
+			if (inPointer->block != block) {
+				/*  Entered a new block: skip it if no event can pass the filter  */
+				block = inPointer->block;
+				if (!MDBlockMayMatchFilter(block, inFilter)) {
+					inPointer->position += block->num - 1 - inPointer->index;
+					inPointer->index = block->num - 1;
+					continue;
+				}
+			}
+			if (!MDEventFilterMatch(inFilter, MDBlockEvents(inPointer->block) + inPointer->index))
+				continue;
+		}
+		ep = MDPointerCurrent(inPointer);
+		if (inSelector == NULL || (*inSelector)(ep, inPointer->position, inUserData))
+			return ep;
+	}
+	return NULL;
+}
+
+/* --------------------------------------
+	･ MDPointerBackwardWithFilter
+   -------------------------------------- */
+const MDEvent *
+MDPointerBackwardWithFilter(MDPointer *inPointer, const MDEventFilter *inFilter, MDEventSelector inSelector, void *inUserData)
+{
+	const MDEvent *ep;
+	MDBlock *block = NULL;
+	while (MDPointerPreviousPos(inPointer)) {
+		if (inFilter != NULL) {
+			if (inPointer->block != block) {
+				block = inPointer->block;
+				if (!MDBlockMayMatchFilter(block, inFilter)) {
+					inPointer->position -= inPointer->index;
+					inPointer->index = 0;
+					continue;
+				}
+			}
+			if (!MDEventFilterMatch(inFilter, MDBlockEvents(inPointer->block) + inPointer->index))
+				continue;
+		}
+		ep = MDPointerCurrent(inPointer);
+		if (inSelector == NULL || (*inSelector)(ep, inPointer->position, inUserData))
+			return ep;
+	}
+	return NULL;
+}
+
 /* --------------------------------------
 	･ MDPointerSetPositionWithPointSet
    -------------------------------------- */
@@ -2469,7 +5247,7 @@ MDPointerSetPositionWithPointSet(MDPointer *inPointer, IntGroup *inPointSet, int
 /* --------------------------------------
 	･ MDPointerForwardWithPointSet
    -------------------------------------- */
-MDEvent *
+const MDEvent *
 MDPointerForwardWithPointSet(MDPointer *inPointer, IntGroup *inPointSet, int *index)
 {
     int32_t pt;
@@ -2512,7 +5290,7 @@ MDPointerForwardWithPointSet(MDPointer *inPointer, IntGroup *inPointSet, int *in
 /* --------------------------------------
 	･ MDPointerBackwardWithPointSet
    -------------------------------------- */
-MDEvent *
+const MDEvent *
 MDPointerBackwardWithPointSet(MDPointer *inPointer, IntGroup *inPointSet, int *index)
 {
     int32_t pt;
@@ -2557,7 +5335,8 @@ MDPointerBackwardWithPointSet(MDPointer *inPointer, IntGroup *inPointSet, int *i
 MDStatus
 MDPointerInsertAnEvent(MDPointer *inPointer, const MDEvent *inEvent)
 {
-	MDEvent *ep1, *ep2;
+	const MDEvent *ep1, *ep2;
+	MDEvent *ep;
 	MDTickType tick, ptick, tick1, tick2;
 	MDStatus sts = kMDNoError;
 	MDTrack *track;
@@ -2576,16 +5355,15 @@ MDPointerInsertAnEvent(MDPointer *inPointer, const MDEvent *inEvent)
 		MDPointerJumpToTick(inPointer, tick);
 
 	/*  Insert the event  */
-	if (MDTrackInsertBlanks(inPointer->parent, inPointer, 1) == 1) {
-		ep1 = MDPointerCurrent(inPointer);
-		MDEventCopy(ep1, inEvent, 1);
-        if (MDHasDuration(ep1))
-			ptick = MDGetTick(ep1) + MDGetDuration(ep1);
+	if (MDTrackInsertBlanks(inPointer->parent, inPointer, 1) == 1 && (ep = MDPointerCurrentMutable(inPointer)) != NULL) {
+		MDEventCopy(ep, inEvent, 1);
+        if (MDHasDuration(ep))
+			ptick = MDGetTick(ep) + MDGetDuration(ep);
 		else ptick = kMDNegativeTick;
 		/*  Update nch[] fields  */
-		if (MDIsChannelEvent(ep1))
-			track->nch[MDGetChannel(ep1) & 15]++;
-		else if (MDIsSysexEvent(ep1))
+		if (MDIsChannelEvent(ep))
+			track->nch[MDGetChannel(ep) & 15]++;
+		else if (MDIsSysexEvent(ep))
 			track->nch[16]++;
 		else track->nch[17]++;
 	} else sts = kMDErrorOutOfMemory;
@@ -2606,7 +5384,7 @@ MDPointerInsertAnEvent(MDPointer *inPointer, const MDEvent *inEvent)
 MDStatus
 MDPointerDeleteAnEvent(MDPointer *inPointer, MDEvent *outEvent)
 {
-	MDEvent *ep1;
+	const MDEvent *ep1;
 	MDTrack *track;
 	
 	if (inPointer == NULL || (ep1 = MDPointerCurrent(inPointer)) == NULL)
@@ -2621,6 +5399,7 @@ MDPointerDeleteAnEvent(MDPointer *inPointer, MDEvent *outEvent)
         track->nch[16]--;
     else track->nch[17]--;
     MDTrackDeleteEvents(inPointer->parent, inPointer, 1);
+	MDTrackCompactIfNeeded(track);
 	return kMDNoError;
 }
 
@@ -2634,7 +5413,7 @@ MDPointerReplaceAnEvent(MDPointer *inPointer, const MDEvent *inEvent, MDEvent *o
     MDTrack *track;
     MDTickType oldTick;
     int oldHasDuration;
-    if (inPointer == NULL || (ep = MDPointerCurrent(inPointer)) == NULL)
+    if (inPointer == NULL || (ep = MDPointerCurrentMutable(inPointer)) == NULL)
         return kMDNoError;
     track = MDPointerGetTrack(inPointer);
     oldHasDuration = MDHasDuration(ep);
@@ -2661,7 +5440,6 @@ MDPointerReplaceAnEvent(MDPointer *inPointer, const MDEvent *inEvent, MDEvent *o
             if (tick1 >= MDTrackGetDuration(track))
                 MDTrackSetDuration(track, tick1 + 1);
         }
-        inPointer->block->largestTick = kMDNegativeTick;
     }
     return kMDNoError;
 }
@@ -2673,7 +5451,8 @@ MDStatus
 MDPointerChangeTick(MDPointer *inPointer, MDTickType inTick, int32_t inPosition)
 {
 	MDTrack *track;
-	MDEvent *ep, *ep1;
+	const MDEvent *ep, *ep1;
+	MDEvent *ep2, *ep3;
 	MDTickType tick, tick_last, tick_next;
 	MDPointer *newPointer = NULL;
 	MDStatus sts = kMDNoError;
@@ -2695,8 +5474,9 @@ MDPointerChangeTick(MDPointer *inPointer, MDTickType inTick, int32_t inPosition)
 		tick_next = ((ep1 = MDPointerForward(inPointer)) != NULL ? MDGetTick(ep1) : kMDMaxTick);
         MDPointerBackward(inPointer);
 		if (tick_last <= inTick && inTick <= tick_next) {
-			MDSetTick(ep, inTick);
-            inPointer->block->largestTick = kMDNegativeTick;
+			if ((ep2 = MDPointerCurrentMutable(inPointer)) == NULL)
+				return kMDErrorOutOfMemory;
+			MDSetTick(ep2, inTick);
             MDTrackUpdateLargestTickForBlock(track, inPointer->block);
 			goto exit;
 		}
@@ -2717,8 +5497,10 @@ MDPointerChangeTick(MDPointer *inPointer, MDTickType inTick, int32_t inPosition)
 		MDPointerJumpToTick(newPointer, inTick);
 	
 	if (MDPointerGetPosition(newPointer) == MDPointerGetPosition(inPointer)) {
-		MDSetTick(ep, inTick);
 		MDPointerRelease(newPointer);
+		if ((ep2 = MDPointerCurrentMutable(inPointer)) == NULL)
+			return kMDErrorOutOfMemory;
+		MDSetTick(ep2, inTick);
 		goto exit;
 	}
 	
@@ -2728,10 +5510,10 @@ MDPointerChangeTick(MDPointer *inPointer, MDTickType inTick, int32_t inPosition)
 
 	/*  Insert a blank  */
 	if (MDTrackInsertBlanks(track, newPointer, 1) == 1) {
-		ep1 = MDPointerCurrent(newPointer);
-		ep = MDPointerCurrent(inPointer);  /*  May have moved while inserting a blank  */
-		MDEventMove(ep1, ep, 1);
-		MDSetTick(ep1, inTick);
+		ep2 = MDPointerCurrentMutable(newPointer);
+		ep3 = MDPointerCurrentMutable(inPointer);  /*  May have moved while inserting a blank  */
+		MDEventMove(ep2, ep3, 1);
+		MDSetTick(ep2, inTick);
 		/*  Delete the previous position  */
 		MDTrackDeleteEvents(track, inPointer, 1);
         ep = MDPointerCurrent(newPointer);	/*  May have moved while deleting  */
@@ -2749,7 +5531,7 @@ MDPointerChangeTick(MDPointer *inPointer, MDTickType inTick, int32_t inPosition)
         if (inTick >= MDTrackGetDuration(track))
             MDTrackSetDuration(track, inTick + 1);
         if (inPointer->block->largestTick >= 0 && inTick > inPointer->block->largestTick)
-            inPointer->block->largestTick = inTick;
+            MDBlockSetLargestTick(inPointer->block, inTick);
     }
 	return sts;
 }
@@ -2761,15 +5543,13 @@ MDStatus
 MDPointerSetDuration(MDPointer *inPointer, MDTickType inDuration)
 {
 	MDEvent *ep;
-	if (inPointer == NULL || (ep = MDPointerCurrent(inPointer)) == NULL)
+	/*  largestTick is invalidated by MDPointerCurrentMutable(), and recalculated later  */
+	if (inPointer == NULL || (ep = MDPointerCurrentMutable(inPointer)) == NULL)
 		return kMDNoError;
 	
 	/*  We do not check here the validity of the event type  */
 	MDSetDuration(ep, inDuration);
 	
-	/*  Invalidate largestTick and request recalculation later  */
-	inPointer->block->largestTick = kMDNegativeTick;
-	
 	return kMDNoError;
 }
 
@@ -2785,6 +5565,7 @@ MDPointerCheck(const MDPointer *inPointer)
 	int err = 0;
 	if (inPointer == NULL)
 		return kMDNoError;
+	MDPointerSync(inPointer);
 	track = inPointer->parent;
 	if (track == NULL) {
         MDShowErrorMessage("MDPointerCheck: track is NULL\n");
@@ -2827,10 +5608,219 @@ MDPointerCheck(const MDPointer *inPointer)
 	return (err > 0 ? kMDErrorInternalError : kMDNoError);
 }
 
+#if 0
+#pragma mark ====== MDEventFilter functions ======
+#endif
+
+/* --------------------------------------
+	･ MDEventFilterInit
+ -------------------------------------- */
+void
+MDEventFilterInit(MDEventFilter *outFilter, int acceptAll)
+{
+	memset(outFilter, (acceptAll ? 0xff : 0), sizeof(MDEventFilter));
+	outFilter->codeKinds = 0;
+}
+
+/* --------------------------------------
+	･ MDEventFilterAddKind
+ -------------------------------------- */
+void
+MDEventFilterAddKind(MDEventFilter *ioFilter, int kind, int code)
+{
+	if (kind < 0 || kind >= 32)
+		return;
+	ioFilter->kinds |= (1U << kind);
+	if (code >= 0 && code < 256) {
+		ioFilter->codeKinds |= (1U << kind);
+		ioFilter->codes[code >> 5] |= (1U << (code & 31));
+	}
+}
+
+/* --------------------------------------
+	･ MDEventFilterMatch
+ -------------------------------------- */
+int
+MDEventFilterMatch(const MDEventFilter *inFilter, const MDEvent *inEvent)
+{
+	unsigned char code;
+	uint32_t kindBit = (1U << MDGetKind(inEvent));
+	if ((inFilter->kinds & kindBit) == 0)
+		return 0;
+	if ((kindBit & kMDEventFilterChannelKinds) && (inFilter->channels & (1U << (MDGetChannel(inEvent) & 15))) == 0)
+		return 0;
+	if (inFilter->codeKinds & kindBit) {
+		code = MDGetCode(inEvent);
+		if ((inFilter->codes[code >> 5] & (1U << (code & 31))) == 0)
+			return 0;
+	}
+	return 1;
+}
+
 #if 0
 #pragma mark ====== MDTrackMerger functions ======
 #endif
 
+/* --------------------------------------
+	･ MDTrackMergerHeapLess
+ -------------------------------------- */
+/*  Returns non-zero if heap entry a should come out before b. Ties are broken by the track
+    index, in the same order as the linear scans did: the lowest index first when going
+    forward, the highest index first when going backward.  */
+static inline int
+MDTrackMergerHeapLess(const MDTrackMerger *inMerger, const MDTrackMergerEntry *a, const MDTrackMergerEntry *b)
+{
+	if (inMerger->direction > 0)
+		return (a->tick < b->tick || (a->tick == b->tick && a->index < b->index));
+	else
+		return (a->tick > b->tick || (a->tick == b->tick && a->index > b->index));
+}
+
+/* --------------------------------------
+	･ MDTrackMergerHeapSwap
+ -------------------------------------- */
+static inline void
+MDTrackMergerHeapSwap(MDTrackMerger *inMerger, int i, int j)
+{
+	MDTrackMergerEntry e = inMerger->heap[i];
+	inMerger->heap[i] = inMerger->heap[j];
+	inMerger->heap[j] = e;
+	inMerger->heapPos[inMerger->heap[i].index] = i;
+	inMerger->heapPos[inMerger->heap[j].index] = j;
+}
+
+/* --------------------------------------
+	･ MDTrackMergerHeapSiftUp
+ -------------------------------------- */
+static int
+MDTrackMergerHeapSiftUp(MDTrackMerger *inMerger, int i)
+{
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+		if (!MDTrackMergerHeapLess(inMerger, &inMerger->heap[i], &inMerger->heap[parent]))
+			break;
+		MDTrackMergerHeapSwap(inMerger, i, parent);
+		i = parent;
+	}
+	return i;
+}
+
+/* --------------------------------------
+	･ MDTrackMergerHeapSiftDown
+ -------------------------------------- */
+static void
+MDTrackMergerHeapSiftDown(MDTrackMerger *inMerger, int i)
+{
+	int n = inMerger->nheap;
+	while (1) {
+		int child = i * 2 + 1;
+		if (child >= n)
+			break;
+		if (child + 1 < n && MDTrackMergerHeapLess(inMerger, &inMerger->heap[child + 1], &inMerger->heap[child]))
+			child++;
+		if (!MDTrackMergerHeapLess(inMerger, &inMerger->heap[child], &inMerger->heap[i]))
+			break;
+		MDTrackMergerHeapSwap(inMerger, i, child);
+		i = child;
+	}
+}
+
+/* --------------------------------------
+	･ MDTrackMergerHeapBuild
+ -------------------------------------- */
+/*  Rebuild the heap from the current positions of all the pointers, without moving them  */
+static void
+MDTrackMergerHeapBuild(MDTrackMerger *inMerger, int inDirection)
+{
+	int i, n;
+	n = 0;
+	inMerger->direction = inDirection;
+	for (i = 0; i < inMerger->npointers; i++) {
+		MDPointer *pt = inMerger->pointers[i];
+		const MDEvent *ep = MDPointerCurrent(pt);
+		if (ep != NULL) {
+			inMerger->heap[n].tick = MDGetTick(ep);
+			inMerger->heap[n].index = i;
+			inMerger->heapPos[i] = n++;
+		} else inMerger->heapPos[i] = -1;
+	}
+	inMerger->nheap = n;
+	for (i = n / 2 - 1; i >= 0; i--)
+		MDTrackMergerHeapSiftDown(inMerger, i);
+	/*  Read after the pointers are looked up, which may load the tracks  */
+	inMerger->editCount = __sync_fetch_and_add(&sMDTrackEditCount, 0);
+}
+
+/* --------------------------------------
+	･ MDTrackMergerHeapUpdate
+ -------------------------------------- */
+/*  Update the heap entry of track num after its pointer has moved  */
+static void
+MDTrackMergerHeapUpdate(MDTrackMerger *inMerger, int num)
+{
+	MDPointer *pt = inMerger->pointers[num];
+	const MDEvent *ep = MDPointerCurrent(pt);
+	int i = inMerger->heapPos[num];
+	if (ep == NULL) {
+		/*  Remove the entry  */
+		if (i < 0)
+			return;
+		inMerger->heapPos[num] = -1;
+		if (i != --(inMerger->nheap)) {
+			inMerger->heap[i] = inMerger->heap[inMerger->nheap];
+			inMerger->heapPos[inMerger->heap[i].index] = i;
+			if (MDTrackMergerHeapSiftUp(inMerger, i) == i)
+				MDTrackMergerHeapSiftDown(inMerger, i);
+		}
+		return;
+	}
+	if (i < 0) {
+		/*  Add an entry  */
+		i = inMerger->nheap++;
+		inMerger->heap[i].index = num;
+		inMerger->heapPos[num] = i;
+	}
+	inMerger->heap[i].tick = MDGetTick(ep);
+	if (MDTrackMergerHeapSiftUp(inMerger, i) == i)
+		MDTrackMergerHeapSiftDown(inMerger, i);
+}
+
+/* --------------------------------------
+	･ MDTrackMergerHeapIsStale
+ -------------------------------------- */
+/*  Returns non-zero if some track has been edited since the heap was built. An edit in
+    a track other than the current one may move its event (or the position of its pointer)
+    anywhere in the heap. Edits in tracks outside the merger also make the heap stale;
+    this only costs a rebuild.  */
+static int
+MDTrackMergerHeapIsStale(const MDTrackMerger *inMerger)
+{
+	return (inMerger->editCount != __sync_fetch_and_add(&sMDTrackEditCount, 0));
+}
+
+/* --------------------------------------
+	･ MDTrackMergerHeapTop
+ -------------------------------------- */
+/*  Returns the event at the top of the heap, and make it the 'current' one  */
+static const MDEvent *
+MDTrackMergerHeapTop(MDTrackMerger *inMerger, MDTrack **outTrack)
+{
+	const MDEvent *ep;
+	MDTrack *tr;
+	if (inMerger->nheap > 0) {
+		MDPointer *pt = inMerger->pointers[inMerger->heap[0].index];
+		inMerger->idx = inMerger->heap[0].index;
+		ep = MDPointerCurrent(pt);
+		tr = MDPointerGetTrack(pt);
+	} else {
+		ep = NULL;
+		tr = NULL;
+	}
+	if (outTrack != NULL)
+		*outTrack = tr;
+	return ep;
+}
+
 /* --------------------------------------
 	･ MDTrackMergerNew
  -------------------------------------- */
@@ -2873,6 +5863,8 @@ MDTrackMergerRelease(MDTrackMerger *inMerger)
             }
             free(inMerger->pointers);
         }
+		free(inMerger->heap);
+		free(inMerger->heapPos);
         free(inMerger);
     }
 }
@@ -2889,6 +5881,9 @@ MDTrackMergerAddTrack(MDTrackMerger *inMerger, MDTrack *inTrack)
     if (inMerger->npointers % 8 == 0) {
         /*  Expand the storage  */
         MDPointer **pointers;
+		MDTrackMergerEntry *heap;
+		int32_t *heapPos;
+		int n = inMerger->npointers + 8;
         if (inMerger->npointers == 0)
             pointers = (MDPointer **)malloc(sizeof(MDPointer *) * 8);
         else
@@ -2897,12 +5892,21 @@ MDTrackMergerAddTrack(MDTrackMerger *inMerger, MDTrack *inTrack)
             return -1;
         memset(pointers + inMerger->npointers, 0, 8 * sizeof(MDPointer *));
         inMerger->pointers = pointers;
+		heap = (MDTrackMergerEntry *)realloc(inMerger->heap, sizeof(MDTrackMergerEntry) * n);
+		if (heap == NULL)
+			return -1;
+		inMerger->heap = heap;
+		heapPos = (int32_t *)realloc(inMerger->heapPos, sizeof(int32_t) * n);
+		if (heapPos == NULL)
+			return -1;
+		inMerger->heapPos = heapPos;
     }
     pt = MDPointerNew(inTrack);
     if (pt == NULL)
         return -1;
     MDPointerSetPosition(pt, 0);
     inMerger->pointers[inMerger->npointers++] = pt;
+	inMerger->direction = 0;
     return inMerger->npointers;
 }
 
@@ -2923,6 +5927,7 @@ MDTrackMergerRemoveTrack(MDTrackMerger *inMerger, MDTrack *inTrack)
             inMerger->npointers--;
             if (inMerger->npointers > 0 && inMerger->idx >= inMerger->npointers)
                 inMerger->idx--;
+			inMerger->direction = 0;
             return inMerger->npointers;
         }
     }
@@ -2944,11 +5949,11 @@ MDTrackMergerGetTrack(MDTrackMerger *inMerger, int num)
 /* --------------------------------------
 	･ MDTrackMergerJumpToTick
  -------------------------------------- */
-MDEvent *
+const MDEvent *
 MDTrackMergerJumpToTick(MDTrackMerger *inMerger, MDTickType inTick, MDTrack **outTrack)
 {
     int i, n, idx;
-    MDEvent *ep;
+    const MDEvent *ep;
     MDTrack *tr;
     if (inMerger == NULL)
         return NULL;
@@ -2958,7 +5963,7 @@ MDTrackMergerJumpToTick(MDTrackMerger *inMerger, MDTickType inTick, MDTrack **ou
     for (i = 0; i < inMerger->npointers; i++) {
         MDPointer *pt = inMerger->pointers[n];
         if (MDPointerJumpToTick(pt, inTick)) {
-            MDEvent *ep1 = MDPointerCurrent(pt);
+            const MDEvent *ep1 = MDPointerCurrent(pt);
             if (ep1 != NULL) {
                 if (ep == NULL || MDGetTick(ep) > MDGetTick(ep1)) {
                     ep = ep1;
@@ -2971,6 +5976,9 @@ MDTrackMergerJumpToTick(MDTrackMerger *inMerger, MDTickType inTick, MDTrack **ou
             n = 0;
     }
     inMerger->idx = idx;
+	/*  All pointers have moved; the subsequent MDTrackMergerForward() starts from a fresh heap.
+	    Note that idx may not be the top of the heap when some tracks tie at the same tick.  */
+	MDTrackMergerHeapBuild(inMerger, 1);
     if (outTrack != NULL)
         *outTrack = tr;
     return ep;
@@ -2979,43 +5987,33 @@ MDTrackMergerJumpToTick(MDTrackMerger *inMerger, MDTickType inTick, MDTrack **ou
 /* --------------------------------------
 	･ MDTrackMergerCurrent
  -------------------------------------- */
-MDEvent *
+const MDEvent *
 MDTrackMergerCurrent(MDTrackMerger *inMerger, MDTrack **outTrack)
 {
-    int i, idx;
-    MDEvent *ep;
-    MDTrack *tr;
     if (inMerger == NULL)
         return NULL;
-    ep = NULL;
-    tr = NULL;
-    idx = inMerger->idx;
-    for (i = 0; i < inMerger->npointers; i++) {
-        MDPointer *pt = inMerger->pointers[i];
-        MDEvent *ep1 = MDPointerCurrent(pt);
-        if (ep1 != NULL) {
-            if (ep == NULL || MDGetTick(ep) > MDGetTick(ep1)) {
-                ep = ep1;
-                tr = MDPointerGetTrack(pt);
-                idx = i;
-            }
-        }
-    }
-    inMerger->idx = idx;
-    if (outTrack != NULL)
-        *outTrack = tr;
-    return ep;
+	/*  Always rescan all tracks, so that this function can be used to resynchronize
+	    the merger after the tracks are modified  */
+	MDTrackMergerHeapBuild(inMerger, 1);
+	return MDTrackMergerHeapTop(inMerger, outTrack);
 }
 
 /* --------------------------------------
 	･ MDTrackMergerForward
  -------------------------------------- */
-MDEvent *
+const MDEvent *
 MDTrackMergerForward(MDTrackMerger *inMerger, MDTrack **outTrack)
 {
     if (inMerger != NULL && inMerger->npointers > 0 && inMerger->idx < inMerger->npointers) {
-        MDPointerForward(inMerger->pointers[inMerger->idx]);
-        return MDTrackMergerCurrent(inMerger, outTrack);
+		int idx = inMerger->idx;
+		if (inMerger->direction <= 0 || MDTrackMergerHeapIsStale(inMerger)) {
+			/*  Going forward for the first time, or some track has been edited  */
+			MDPointerForward(inMerger->pointers[idx]);
+			return MDTrackMergerCurrent(inMerger, outTrack);
+		}
+        MDPointerForward(inMerger->pointers[idx]);
+		MDTrackMergerHeapUpdate(inMerger, idx);
+		return MDTrackMergerHeapTop(inMerger, outTrack);
     }
     return NULL;
 }
@@ -3023,34 +6021,30 @@ MDTrackMergerForward(MDTrackMerger *inMerger, MDTrack **outTrack)
 /* --------------------------------------
 	･ MDTrackMergerBackward
  -------------------------------------- */
-MDEvent *
+const MDEvent *
 MDTrackMergerBackward(MDTrackMerger *inMerger, MDTrack **outTrack)
 {
     int i, idx;
-    MDEvent *ep;
-    MDTrack *tr;
     if (inMerger == NULL || inMerger->npointers <= 0 || inMerger->idx >= inMerger->npointers)
         return NULL;
-    ep = NULL;
-    tr = NULL;
     idx = inMerger->idx;
+	if (inMerger->direction < 0 && !inMerger->pastEnd && !MDTrackMergerHeapIsStale(inMerger)) {
+		/*  Only the current track needs to move back  */
+		MDPointerBackward(inMerger->pointers[idx]);
+		MDTrackMergerHeapUpdate(inMerger, idx);
+		return MDTrackMergerHeapTop(inMerger, outTrack);
+	}
+	/*  Going backward for the first time: move back the current track and the tracks
+	    that are at the end  */
+	inMerger->pastEnd = 0;
     for (i = inMerger->npointers - 1; i >= 0; i--) {
         MDPointer *pt = inMerger->pointers[i];
-        MDEvent *ep1;
-        if (inMerger->idx == i || MDPointerGetPosition(pt) >= MDTrackGetNumberOfEvents(MDPointerGetTrack(pt))) {
+        if (idx == i || MDPointerGetPosition(pt) >= MDTrackGetNumberOfEvents(MDPointerGetTrack(pt))) {
             MDPointerBackward(pt);
-        }
-        ep1 = MDPointerCurrent(pt);
-        if (ep1 != NULL) {
-            if (ep == NULL || MDGetTick(ep) < MDGetTick(ep1)) {
-                ep = ep1;
-                tr = MDPointerGetTrack(pt);
-                idx = i;
-            }
+			if (MDPointerGetPosition(pt) >= MDTrackGetNumberOfEvents(MDPointerGetTrack(pt)))
+				inMerger->pastEnd = 1;
         }
     }
-    inMerger->idx = idx;
-    if (outTrack != NULL)
-        *outTrack = tr;
-    return ep;
+	MDTrackMergerHeapBuild(inMerger, -1);
+	return MDTrackMergerHeapTop(inMerger, outTrack);
 }
@@ -31,6 +31,10 @@ typedef struct MDPointer			MDPointer;
 /*  MDSequence.h の MDMerger と違って、MDSequence には依存しない。 */
 typedef struct MDTrackMerger		MDTrackMerger;
 
+/*  トラック中の対応のとれていない internal note-on を (チャンネル, キー) ごとに古い順に記録しておき、
+    note-off との対応づけを定数時間で行うための仕掛け。SMF の読み込みと MIDI レコーディングで使う。 */
+typedef struct MDNoteOffMatcher		MDNoteOffMatcher;
+
 typedef unsigned char MDTrackAttribute;
 enum {
     kMDTrackAttributeRecord = 1,
@@ -49,6 +53,10 @@ enum {
 #include "IntGroup.h"
 #endif
 
+#ifndef __MDUtility__
+#include "MDUtility.h"
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -57,6 +65,25 @@ extern "C" {
     コールバック関数 */
 typedef int	(*MDEventSelector)(const MDEvent *ep, int32_t position, void *inUserData);
 
+/*  MDTrackSetLoader() で使うコールバック関数。ioTrack（空のトラック）にイベントを追加する。
+    MDTrackLoaderDisposeProc は refCon が不要になった時に呼ばれる。 */
+typedef MDStatus	(*MDTrackLoaderProc)(MDTrack *ioTrack, void *inRefCon);
+typedef void	(*MDTrackLoaderDisposeProc)(void *inRefCon);
+
+/*  MDPointerForwardWithFilter(), MDTrackSearchEventsWithFilter() などで使う宣言的なフィルタ。
+    MDBlock はそれぞれ含んでいるイベントの種類・チャンネル・コードの要約を持っているので、
+    フィルタを通るイベントを１つも含まないブロックは丸ごと読み飛ばされる。
+    チャンネルはチャンネルイベントにのみ、コードは codeKinds に含まれる種類のイベントにのみ適用される。 */
+typedef struct MDEventFilter {
+	uint32_t	kinds;		/*  通すイベントの種類の集合 (bit (1 << kind))  */
+	uint32_t	channels;	/*  通すチャンネルの集合 (bit (1 << channel))  */
+	uint32_t	codeKinds;	/*  コードをチェックするイベントの種類の集合 (bit (1 << kind))  */
+	uint32_t	codes[8];	/*  通すコードの集合 (256 ビット)  */
+} MDEventFilter;
+
+/*  チャンネルイベントの種類の集合 (MDIsChannelEvent() に対応)  */
+#define kMDEventFilterChannelKinds	(((1U << (kMDEventKeyPres + 1)) - 1) & ~((1U << kMDEventProgram) - 1))
+
 /* -------------------------------------------------------------------
     MDTrack functions
    -------------------------------------------------------------------  */
@@ -66,9 +93,47 @@ typedef int	(*MDEventSelector)(const MDEvent *ep, int32_t position, void *inUser
     を使用すること。 */
 MDTrack *	MDTrackNew(void);
 
-/*  新しい MDTrack を作成し、そこに inTrack の全イベントをコピーする。 */
+/*  新しい MDTrack を作成し、そこに inTrack の全イベントをコピーする。イベントはブロック単位で inTrack と
+    共有され、どちらかのトラックで変更される時に初めて実際にコピーされる (copy-on-write)。
+    MDPointerCurrentMutable() で書き換え可能なイベントへのポインタを得た時にもコピーが行われる。
+    inTrack がまだ読み込まれていない（遅延読み込みの）場合は、読み込みを行わず、同じ読み込み元を
+    共有する遅延読み込みのトラックを作る。 */
 MDTrack *	MDTrackNewFromTrack(const MDTrack *inTrack);
 
+/*  解放された MDBlock はスレッドごとのキャッシュに保持され、キャッシュ内のブロック数が threadHigh を
+    超えると threadLow まで減らされて、余りはロックフリーの共有プールに移される。共有プールのブロック数が
+    globalMax を超える分はメモリを OS に返す。負の値を指定したパラメータは変更されない。 */
+void	MDTrackSetBlockPoolWatermarks(int32_t threadHigh, int32_t threadLow, int32_t globalMax);
+
+/*  共有プールと、呼び出したスレッドのキャッシュに保持されている MDBlock をすべて解放する。 */
+void	MDTrackPurgeBlockPool(void);
+
+/*  トラックの MDBlock とインデックスを確保する MDArena を設定する（retain される）。NULL なら
+    通常のヒープ（ブロックプール）から確保する。すでにブロックを持っているトラックには設定できない
+    (kMDErrorBadParameter を返す)。MDArena が MDArenaClose() されていれば、MDTrackClear() は
+    ブロックを個別に解放しないので、トラックの破棄がほぼブロックの数によらない時間で済む。 */
+MDStatus	MDTrackSetArena(MDTrack *inTrack, MDArena *inArena);
+MDArena *	MDTrackGetArena(const MDTrack *inTrack);
+
+/*  部分的にしか埋まっていない MDBlock のイベントを前に詰めて、空いたブロックを解放する。トラックに
+    結びつけられた MDPointer の位置は変わらない（ブロック内の位置は更新される）。解放したブロックの数を返す。 */
+int32_t	MDTrackCompact(MDTrack *inTrack);
+
+/*  イベントを削除したあと、ブロックの充填率 (イベント数 / (ブロック数 * ブロックサイズ)) が ratio を下回っていれば
+    自動的に MDTrackCompact() を行う。既定値は 0.5。0 を指定すると自動の詰め直しは行わない。 */
+void	MDTrackSetCompactThreshold(float ratio);
+
+/*  トラックのイベントを詰めた形式 (1イベント12バイト) に変換して、メモリを節約する。メッセージなどへの
+    ポインタは別表に移される。詰めた形式のブロックは、MDPointerCurrent() などでアクセスされた時に元の
+    形式に展開される。読み出しのためだけに展開されたブロックは詰めた形式も保持しているので、再び
+    MDTrackPack() すると展開した分を捨てるだけで済む。アイドル時などに呼ぶとよい（遅延読み込みされた
+    トラックは、読み込みの直後に自動的に詰められる）。以前に得た MDEvent へのポインタは無効になるので、
+    他のスレッドがトラックを読んでいる間に呼んではならない。変換したブロックの数を返す。 */
+int32_t	MDTrackPack(MDTrack *inTrack);
+
+/*  MDTrackPack() で詰めた形式にしたブロックをすべて元の形式に戻す。 */
+void	MDTrackUnpack(MDTrack *inTrack);
+
 /*  MDTrack の retain/release。 */
 void	MDTrackRetain(MDTrack *inTrack);
 void	MDTrackRelease(MDTrack *inTrack);
@@ -78,9 +143,53 @@ void	MDTrackClear(MDTrack *inTrack);
 
 void	MDTrackExchange(MDTrack *inTrack1, MDTrack *inTrack2);
 
+/*  inTrack の内容を inSource の内容で置き換える。イベントは MDTrackNewFromTrack() と同様に
+    ブロック単位で共有される。inSource が読み込まれていなければ、inTrack に MDPointer がない限り
+    inTrack も遅延読み込みのトラックになる。inTrack の参照カウント、アトリビュート、MDPointer はそのまま
+    残る（MDPointer の位置は新しいイベント数を超えないように調整される）。 */
+MDStatus	MDTrackRestoreFromTrack(MDTrack *inTrack, const MDTrack *inSource);
+
+/*  イベント以外の属性（duration、デバイス、チャンネル、アトリビュート、トラック名、デバイス名、
+    追加情報）が等しければ非ゼロを返す。 */
+int		MDTrackHasSameProperties(const MDTrack *inTrack1, const MDTrack *inTrack2);
+
+/*  トラックが使用しているメモリ量の概算（バイト数）を返す。他のトラックと共有している
+    イベントは、共有しているトラック数で割った量として数える。 */
+size_t	MDTrackGetMemoryUsage(const MDTrack *inTrack);
+
+/*  空のトラックのイベントを、最初に必要になった時（MDPointer を作る、イベントを追加するなど）に
+    inProc を呼んで作るようにする（遅延読み込み）。トラック名やデバイス名、duration などは通常通り
+    設定しておく。inCounts は読み込み後のチャンネルごとのイベント数（トラックの nch と同じ 18 要素）で、
+    これを与えておけば MDTrackGetNumberOfEvents(), MDTrackGetNumberOfChannelEvents() などや
+    MDTrackRemapChannel() は読み込みを行わずに済む。NULL なら最初に呼ばれた時に読み込む。
+    読み込みに失敗したら、エラーメッセージを MDQueueErrorMessage() でキューに入れ、トラックは読み込み前の
+    状態のまま残る（次にイベントが必要になった時に再び読み込みを試みる）。この時 MDPointerNew() は NULL を
+    返し、エラーを返せる関数はそのエラーを返す。空のトラックとして扱われることはない。
+    inProc はどのスレッドから呼ばれるかわからないので、警告は MDQueueErrorMessage() で出すこと。
+    また、読み込み前にトラックが MDTrackNewFromTrack() でコピーされると、同じ inRefCon で何度でも
+    （異なるスレッドから同時にでも）呼ばれるので、inRefCon の内容を書き換えてはならない。inDispose は
+    inRefCon を共有するトラックがすべて読み込まれるか破棄された後で一度だけ呼ばれる。 */
+MDStatus	MDTrackSetLoader(MDTrack *inTrack, MDTrackLoaderProc inProc, MDTrackLoaderDisposeProc inDispose, void *inRefCon, const int32_t *inCounts);
+
+/*  イベントが読み込み済みなら（遅延読み込みのトラックでなければ）非ゼロを返す。 */
+int		MDTrackIsLoaded(const MDTrack *inTrack);
+
+/*  遅延読み込みのトラックのイベントを今すぐ読み込む。異なるスレッドから呼んでもよい。
+    異なるトラックは同時に読み込まれ、同じトラックを読み込み中のスレッドは、それが終わるのを待つ。 */
+MDStatus	MDTrackLoad(MDTrack *inTrack);
+
 /*  含まれているイベントの数を返す。 */
 int32_t	MDTrackGetNumberOfEvents(const MDTrack *inTrack);
 
+/*  編集エポックを返す。イベントの挿入・削除や tick の変更、MDPointerCurrentMutable() による
+    書き換えのたびに値が変わるので、トラックから作ったデータが古くなったかどうかの判定に使える。 */
+uint32_t	MDTrackGetEditEpoch(const MDTrack *inTrack);
+
+/*  イベントの tick を先頭から最大 inMax 個まで outTicks にコピーし、イベントの総数を返す。
+    まだ読み込まれていなければ読み込み、失敗した場合は -1 を返す。トラックは変更しない
+    （パックされたブロックも展開しない）ので、異なるトラックなら複数のスレッドから同時に呼べる。 */
+int32_t	MDTrackCopyTicks(const MDTrack *inTrack, MDTickType *outTicks, int32_t inMax);
+
 /*  含まれているチャンネルイベントの数を返す。channel が 0-15 の範囲でなければ
     すべてのチャンネルイベントの数の合計を返す。 */
 int32_t	MDTrackGetNumberOfChannelEvents(const MDTrack *inTrack, short channel);
@@ -110,6 +219,14 @@ int32_t	MDTrackAppendEvents(MDTrack *inTrack, const MDEvent *inEvent, int32_t co
 	場合と同じく新しくアロケートされた IntGroup が返される。もとの *ioSet は release されない。 */
 MDStatus	MDTrackMerge(MDTrack *inTrack1, const MDTrack *inTrack2, IntGroup **ioSet);
 
+/*  tick 順に並んだ count 個のイベントを inTrack に挿入する。同じ tick のイベントがある場合は、
+    新しいイベントがその前に入る（MDPointerInsertAnEvent と同じ）。トラックの挿入位置以降は
+    １回のマージで詰め直されるため、多数のイベントを一度に挿入する場合に速い。outPositions が
+    NULL でなければ、挿入された各イベントの位置が入る（count 個分の領域が必要）。
+    autoAdjust が設定された MDPointer は同じイベントを指すように調整される。
+    inEvents が tick 順に並んでいなければ kMDErrorTickDisorder を返す。 */
+MDStatus	MDTrackInsertSortedBatch(MDTrack *inTrack, const MDEvent *inEvents, int32_t count, int32_t *outPositions);
+
 /*  MDTrackMerge の逆操作。inTrack の中から、位置が inSet に含まれるイベントをすべて抜き出して
     新しいトラックに入れ、*outTrack に入れて返す。outTrack が NULL なら抜き出されたイベントは捨てられる。 */
 MDStatus	MDTrackUnmerge(MDTrack *inTrack, MDTrack **outTrack, const IntGroup *inSet);
@@ -126,7 +243,22 @@ MDStatus	MDTrackMatchNoteOff(MDTrack *inTrack, const MDEvent *noteOffEvent, MDPo
 /*  inTrack のノートイベントで、internal note-on に対応する internal note-off イベントを noteOffTrack から探し出して、duration をセットする。対応がとれた internal note-off イベントは null イベントに変換される（二度読みを防ぐため）。SMF の読み込み、および MIDI レコーディングの時に使う。  */
 MDStatus	MDTrackMatchNoteOffInTrack(MDTrack *inTrack, MDTrack *noteOffTrack);
 
-/*  inTrack 中の全イベントの tick を newTick[] 中の値に先頭から順に変更する。newTick[] < 0 なら、そのイベントの tick は変更されない。tick が昇順になっていなければエラーになる。必要に応じて inTrack->duration は変更される。 */
+/*  inTrack の note-off 対応づけ用の MDNoteOffMatcher をアロケートする。inTrack は retain される。 */
+MDNoteOffMatcher *	MDNoteOffMatcherNew(MDTrack *inTrack);
+void		MDNoteOffMatcherRetain(MDNoteOffMatcher *inMatcher);
+void		MDNoteOffMatcherRelease(MDNoteOffMatcher *inMatcher);
+
+/*  記録している internal note-on をすべて忘れ、次の MDNoteOffMatcherMatch() でトラックの先頭から
+    探し直すようにする。トラックの末尾にイベントを追加する以外の編集をした時に呼ぶこと。 */
+void		MDNoteOffMatcherReset(MDNoteOffMatcher *inMatcher);
+
+/*  MDTrackMatchNoteOff() と同じ対応づけを行う。前回の呼び出し以降にトラックの末尾に追加された
+    internal note-on を登録してから、noteOffEvent と同じチャンネル・キーの最も古い internal note-on
+    （duration がゼロでなければ、tick 差が duration に等しいもの）を Note イベントにする。
+    見つからなければ kMDErrorOrphanedNoteOff を返す。 */
+MDStatus	MDNoteOffMatcherMatch(MDNoteOffMatcher *inMatcher, const MDEvent *noteOffEvent);
+
+/*  inTrack 中の全イベントの tick を newTick[] 中の値に先頭から順に変更する。newTick[] < 0 なら、そのイベントの tick は変更されない。イベントは新しい tick の順に並べ替えられる（同じ tick のイベントは元の順序を保つ）。並べ替えは順序が乱れた範囲だけに対して行われ、大きい場合は複数のスレッドで行われる。MDPointer の位置は調整されない。必要に応じて inTrack->duration は変更される。 */
 MDStatus    MDTrackChangeTick(MDTrack *inTrack, MDTickType *newTick);
 
 /*  inTrack 中の全イベントの tick に offset を加える。tick + offset が負の場合は 0 になる。必要に応じて inTrack->duration は変更される。 */
@@ -140,10 +272,24 @@ MDTickType  MDTrackGetLargestTick(MDTrack *inTrack);
     １つもないときは空の IntGroup を返す。 */
 IntGroup *MDTrackSearchEventsWithDurationCrossingTick(MDTrack *inTrack, MDTickType inTick);
 
+/*  duration を持っているイベントで、tick < toTick かつ tick+duration >= fromTick であるもの、すなわち
+    fromTick から toTick までの区間に鳴っているものを探し、その position を IntGroup として返す。
+    各ブロックの最大終了ティックを索引に保持しているので、区間より前のイベントを走査せずに済む。
+    メモリ不足の場合は NULL を返す。 */
+IntGroup *MDTrackSearchEventsWithDurationInRange(MDTrack *inTrack, MDTickType fromTick, MDTickType toTick);
+
+/*  MDTrackSearchEventsWithDurationInRange() と同じ条件を満たすノートイベントのうち、キー番号が fromKey 以上
+    toKey 以下のものを探し、その position を IntGroup として返す。各ブロックが持っているノートのキー番号の
+    ビットマップ (128 ビット) を使って、該当するノートのないブロックは読み飛ばす。メモリ不足の場合は NULL を返す。 */
+IntGroup *MDTrackSearchNotesInRange(MDTrack *inTrack, MDTickType fromTick, MDTickType toTick, int fromKey, int toKey);
+
 /*  inSelector が non-zero を返すイベントを探し、その position を IntGroup として返す。
     メモリ不足の場合は NULL、該当するイベントが１つもないときは空の IntGroup を返す。 */
 IntGroup *MDTrackSearchEventsWithSelector(MDTrack *inTrack, MDEventSelector inSelector, void *inUserData);
 
+/*  inFilter を通り、かつ inSelector が non-zero を返すイベントを探す。inFilter, inSelector はどちらも NULL でもよい。 */
+IntGroup *MDTrackSearchEventsWithFilter(MDTrack *inTrack, const MDEventFilter *inFilter, MDEventSelector inSelector, void *inUserData);
+
 /*  MIDIチャンネルを置き換える。チャンネルchのイベントはチャンネルnewch[ch]に変更される。変更先のチャンネルが重複していてもチェックされず、そのまま置換が行われる。newch[ch]が15より大きい時は16で割った余りが新しいチャンネルになる。この関数は必ず成功するので、エラーを発生しない。 */
 void		MDTrackRemapChannel(MDTrack *inTrack, const unsigned char *newch);
 
@@ -199,7 +345,8 @@ const char *MDTrackGetExtraInfoAtIndex(const MDTrack *inTrack, int32_t index, co
     MDPointer functions
    -------------------------------------------------------------------  */
 
-/*  新しい MDPointer をアロケートする。メモリ不足の場合は NULL を返す。
+/*  新しい MDPointer をアロケートする。メモリ不足の場合や、遅延読み込みのトラックのイベントを
+    読み込めなかった場合は NULL を返す。
     inTrack と関係づけられ、場所は -1 （先頭イベントの前）にセットされる。 */
 MDPointer *	MDPointerNew(MDTrack *inTrack);
 
@@ -214,7 +361,8 @@ void			MDPointerRelease(MDPointer *inPointer);
 /*  MDPointer をコピーする。parent が違う時は意味がないが、一応 SetPosition を行う。 */
 void			MDPointerCopy(MDPointer *inDest, const MDPointer *inSrc);
 
-/*  MDTrack との関係付けを変更する。 */
+/*  MDTrack との関係付けを変更する。inTrack のイベントを読み込めなかった場合は、どのトラックとも
+    関係づけられない。 */
 void			MDPointerSetTrack(MDPointer *inPointer, MDTrack *inTrack);
 
 /*  関係付けられた MDTrack を返す。 */
@@ -228,7 +376,8 @@ int				MDPointerSetRelativePosition(MDPointer *inPointer, int32_t inOffset);
 /*  現在位置を読み出す */
 int32_t			MDPointerGetPosition(const MDPointer *inPointer);
 
-/*  挿入・削除後に位置を自動調整する場合に 1 をセットする。デフォルトは 0  */
+/*  挿入・削除後に位置を自動調整する場合に 1 をセットする。デフォルトは 0
+    （調整は挿入・削除の時点ではなく、次にポインタが使われた時にまとめて行われる）  */
 void			MDPointerSetAutoAdjust(MDPointer *inPointer, char flag);
 
 /*  自動調整フラグが立っていれば 1, 立っていなければ 0 を返す  */
@@ -248,31 +397,45 @@ int				MDPointerJumpToLast(MDPointer *inPointer);
     しなければ指している位置は変化せず、 0 (false) を返す。 */
 int				MDPointerLookForEvent(MDPointer *inPointer, const MDEvent *inEvent);
 
-/*  現在のイベントへのポインタを得る。存在しないイベントを指している場合は NULL を返す。 */
-MDEvent *		MDPointerCurrent(const MDPointer *inPointer);
+/*  現在のイベントへのポインタを得る。存在しないイベントを指している場合は NULL を返す。
+    このポインタは読み出し専用で、他のトラックと共有されているイベントを指していることがある。
+    MDPointerForward() など、イベントへのポインタを返す他の関数も同様。 */
+const MDEvent *	MDPointerCurrent(const MDPointer *inPointer);
+
+/*  MDPointerCurrent() と同じだが、イベントを書き換えるためのポインタを返す。共有されているブロックは
+    この時にコピーされ、MDBlock のキャッシュ (largestTick とイベントの要約) は無効にされ、トラックの
+    編集エポックが進められる。イベントを直接書き換える時は必ずこの関数でポインタを得ること。 */
+MDEvent *		MDPointerCurrentMutable(MDPointer *inPointer);
 
 /*  １つ先の位置に進み、そのイベントへのポインタを得る。最後のイベントを越えた場合は
     NULL を返す。 */
-MDEvent *		MDPointerForward(MDPointer *inPointer);
+const MDEvent *	MDPointerForward(MDPointer *inPointer);
 
 /*  １つ前の位置に戻り、そのイベントへのポインタを得る。先頭のイベントを越えた場合は
     NULL を返す。 */
-MDEvent *		MDPointerBackward(MDPointer *inPointer);
+const MDEvent *	MDPointerBackward(MDPointer *inPointer);
 
 /*  現在位置より先で inSelector が non-zero を返す最初のイベントの位置に移動する  */
-MDEvent *		MDPointerForwardWithSelector(MDPointer *inPointer, MDEventSelector inSelector, void *inUserData);
+const MDEvent *	MDPointerForwardWithSelector(MDPointer *inPointer, MDEventSelector inSelector, void *inUserData);
 
 /*  現在位置より前で inSelector が non-zero を返す最初のイベントの位置に移動する  */
-MDEvent *		MDPointerBackwardWithSelector(MDPointer *inPointer, MDEventSelector inSelector, void *inUserData);
+const MDEvent *	MDPointerBackwardWithSelector(MDPointer *inPointer, MDEventSelector inSelector, void *inUserData);
+
+/*  現在位置より先で inFilter を通り、かつ inSelector が non-zero を返す最初のイベントの位置に移動する。
+    inFilter を通るイベントを含まないブロックは読み飛ばされる。inFilter, inSelector はどちらも NULL でもよい。 */
+const MDEvent *	MDPointerForwardWithFilter(MDPointer *inPointer, const MDEventFilter *inFilter, MDEventSelector inSelector, void *inUserData);
+
+/*  現在位置より前で inFilter を通り、かつ inSelector が non-zero を返す最初のイベントの位置に移動する */
+const MDEvent *	MDPointerBackwardWithFilter(MDPointer *inPointer, const MDEventFilter *inFilter, MDEventSelector inSelector, void *inUserData);
 
 /*  inPointSet 中の offset 番目の点の位置に移動する  */
 int				MDPointerSetPositionWithPointSet(MDPointer *inPointer, IntGroup *inPointSet, int32_t offset, int *outIndex);
 
 /*  現在位置より１つ進み、その点が pointSet の *index 番目の区間の終端より先であれば、次の区間の始点に対応する位置に移動して (*index) を +1 する。index == NULL であるか、または *index < 0 であるなら、pointSet に含まれるところまで現在位置を進め、index != NULL ならば *index にその区間の番号を返す。もし対応する点がなければ、inPointer はトラック末尾+1 の位置になり、*index には -1 が返される。 */
-MDEvent *		MDPointerForwardWithPointSet(MDPointer *inPointer, IntGroup *inPointSet, int *index);
+const MDEvent *	MDPointerForwardWithPointSet(MDPointer *inPointer, IntGroup *inPointSet, int *index);
 
 /*  現在位置から１つ戻り、その点が pointSet の *index 番目の区間の始点より前であれば、前の区間の終点-1に対応する位置に移動して (*index) を -1 する。index == NULL であるか、または *index < 0 であるなら、pointSet に含まれるところまで現在位置を戻し、index != NULL ならば *index にその区間の番号を返す。もし対応する点がなければ、inPointer はトラック先頭-1 の位置になり、*index には -1 が返される。 */
-MDEvent *		MDPointerBackwardWithPointSet(MDPointer *inPointer, IntGroup *inPointSet, int *index);
+const MDEvent *	MDPointerBackwardWithPointSet(MDPointer *inPointer, IntGroup *inPointSet, int *index);
 
 /*  現在位置にイベントを１つ挿入する。tick が現在位置と合わない場合には、合う位置を探す。 */
 MDStatus		MDPointerInsertAnEvent(MDPointer *inPointer, const MDEvent *inEvent);
@@ -293,6 +456,16 @@ MDStatus		MDPointerSetDuration(MDPointer *inPointer, MDTickType inDuration);
 /*  Sanity check  */
 MDStatus		MDPointerCheck(const MDPointer *inPointer);
 
+/*  MDEventFilter を初期化する。acceptAll が non-zero ならすべてのイベントを通し、ゼロならどのイベントも通さない。 */
+void			MDEventFilterInit(MDEventFilter *outFilter, int acceptAll);
+
+/*  種類 kind のイベントを通すようにする。code >= 0 ならば、その種類のイベントはコードもチェックされる
+    （複数の種類にコードを指定すると、コードの集合は共通になる）。 */
+void			MDEventFilterAddKind(MDEventFilter *ioFilter, int kind, int code);
+
+/*  inEvent が inFilter を通れば 1 を返す */
+int				MDEventFilterMatch(const MDEventFilter *inFilter, const MDEvent *inEvent);
+
 /*  新しい MDTrackMerger をアロケートする。メモリ不足の場合は NULL を返す。 */
 MDTrackMerger *	MDTrackMergerNew(void);
 
@@ -312,22 +485,26 @@ MDTrack *       MDTrackMergerGetTrack(MDTrackMerger *inMerger, int num);
 /*  inTick より小さくない tick 値を持つ最初のイベントの位置に移動し、そのイベントへの
  ポインタを返す。そのようなイベントが存在しなければ末尾以降に移動し、NULL を返す。 */
 /*  outTrack が NULL でなければ、現在のイベントが属するトラックを返す。  */
-MDEvent *       MDTrackMergerJumpToTick(MDTrackMerger *inMerger, MDTickType inTick, MDTrack **outTrack);
+const MDEvent * MDTrackMergerJumpToTick(MDTrackMerger *inMerger, MDTickType inTick, MDTrack **outTrack);
 
 /*  現在のイベントへのポインタを得る。存在しないイベントを指している場合は NULL を返す。 */
 /*  outTrack が NULL でなければ、現在のイベントが属するトラックを返す。  */
-/* （呼ばれるたびにすべてのトラックの tick を比較するので注意）  */
-MDEvent *		MDTrackMergerCurrent(MDTrackMerger *inMerger, MDTrack **outTrack);
+/* （呼ばれるたびにすべてのトラックの tick を比較するので注意。トラックを編集した後は
+  この関数を呼ぶと内部状態が再構築される）  */
+const MDEvent *	MDTrackMergerCurrent(MDTrackMerger *inMerger, MDTrack **outTrack);
 
 /*  １つ先の位置に進み、そのイベントへのポインタを得る。最後のイベントを越えた場合は
  NULL を返す。 */
+/*  トラックは (tick, トラック番号) をキーとするヒープで管理されるので、１回の呼び出しは
+ O(log トラック数)。同じ tick のイベントは、トラック番号の小さいものが先に返される。 */
 /*  outTrack が NULL でなければ、現在のイベントが属するトラックを返す。  */
-MDEvent *		MDTrackMergerForward(MDTrackMerger *inMerger, MDTrack **outTrack);
+const MDEvent *	MDTrackMergerForward(MDTrackMerger *inMerger, MDTrack **outTrack);
 
 /*  １つ前の位置に戻り、そのイベントへのポインタを得る。先頭のイベントを越えた場合は
  NULL を返す。 */
+/*  同じ tick のイベントは、トラック番号の大きいものが先に返される。 */
 /*  outTrack が NULL でなければ、現在のイベントが属するトラックを返す。  */
-MDEvent *		MDTrackMergerBackward(MDTrackMerger *inMerger, MDTrack **outTrack);
+const MDEvent *	MDTrackMergerBackward(MDTrackMerger *inMerger, MDTrack **outTrack);
 
 #ifdef __cplusplus
 }
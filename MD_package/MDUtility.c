@@ -21,6 +21,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>	/*  for MDArena and the queued error messages  */
+#include <sys/mman.h>	/*  for mmap()  */
+#include <sys/stat.h>	/*  for fstat()  */
 #include <malloc/malloc.h>  /*  for malloc_size()  */
 
 #ifdef __MWERKS__
@@ -442,6 +445,38 @@ MDStreamGetData(STREAM stream, void **ptr, size_t *size)
 	return 0;
 }
 
+/* --------------------------------------
+	･ MDStreamMapFile
+   -------------------------------------- */
+const void *
+MDStreamMapFile(STREAM stream, size_t *outSize)
+{
+	struct stat st;
+	void *ptr;
+	FILE *fp;
+	if (stream == NULL || stream->getc != MDFileStreamGetc)
+		return NULL;
+	fp = ((file_stream_record *)stream)->file;
+	fflush(fp);	/*  Pending writes must reach the file before it is mapped  */
+	if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0)
+		return NULL;
+	ptr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+	if (ptr == MAP_FAILED)
+		return NULL;
+	*outSize = (size_t)st.st_size;
+	return ptr;
+}
+
+/* --------------------------------------
+	･ MDStreamUnmapFile
+   -------------------------------------- */
+void
+MDStreamUnmapFile(const void *ptr, size_t size)
+{
+	if (ptr != NULL)
+		munmap((void *)ptr, size);
+}
+
 #ifdef __MWERKS__
 #pragma mark ====== Debug print ======
 #endif
@@ -478,6 +513,60 @@ MDShowErrorMessage(const char *fmt, ...)
     return n;
 }
 
+/*  The messages queued by MDQueueErrorMessage(), waiting for MDFlushErrorMessages()  */
+static pthread_mutex_t sMDErrorMessageMutex = PTHREAD_MUTEX_INITIALIZER;
+static char **sMDErrorMessages;
+static volatile int sMDErrorMessageCount;
+static int sMDErrorMessageCapacity;
+
+int
+MDQueueErrorMessage(const char *fmt, ...)
+{
+    char *p, **pp;
+    int n;
+    va_list ap;
+    va_start(ap, fmt);
+    n = vasprintf(&p, fmt, ap);
+    va_end(ap);
+    if (n < 0 || p == NULL)
+        return 0;  /*  Ignore error  */
+    pthread_mutex_lock(&sMDErrorMessageMutex);
+    if (sMDErrorMessageCount >= sMDErrorMessageCapacity) {
+        pp = (char **)realloc(sMDErrorMessages, sizeof(char *) * (sMDErrorMessageCapacity + 16));
+        if (pp == NULL) {
+            pthread_mutex_unlock(&sMDErrorMessageMutex);
+            free(p);
+            return 0;
+        }
+        sMDErrorMessages = pp;
+        sMDErrorMessageCapacity += 16;
+    }
+    sMDErrorMessages[sMDErrorMessageCount++] = p;
+    pthread_mutex_unlock(&sMDErrorMessageMutex);
+    return n;
+}
+
+int
+MDFlushErrorMessages(void)
+{
+    char **pp;
+    int i, n;
+    if (sMDErrorMessageCount == 0)
+        return 0;
+    pthread_mutex_lock(&sMDErrorMessageMutex);
+    pp = sMDErrorMessages;
+    n = sMDErrorMessageCount;
+    sMDErrorMessages = NULL;
+    sMDErrorMessageCount = sMDErrorMessageCapacity = 0;
+    pthread_mutex_unlock(&sMDErrorMessageMutex);
+    for (i = 0; i < n; i++) {
+        MDShowErrorMessage("%s", pp[i]);
+        free(pp[i]);
+    }
+    free(pp);
+    return n;
+}
+
 #ifdef __MWERKS__
 #pragma mark ====== MDArray implementations ======
 #endif
@@ -781,6 +870,183 @@ MDArrayFetchPtr(const MDArray *arrayRef, int32_t inIndex)
 	return (char *)arrayRef->data + inIndex * arrayRef->elemSize;
 }
 
+#ifdef __MWERKS__
+#pragma mark ====== MDArena implementations ======
+#endif
+
+#define kMDArenaDefaultRegionSize	(1024 * 1024)
+#define kMDArenaAlignment	16
+#define kMDArenaNumberOfFreeLists	8	/*  the number of chunk sizes recycled at once  */
+
+#define MDArenaRoundUp(size)	(((size) + kMDArenaAlignment - 1) / kMDArenaAlignment * kMDArenaAlignment)
+
+/*  A region is one malloc'ed memory block, from which the chunks are cut out from the
+    bottom. Freed chunks are kept in the free list for their size, so that a long editing
+    session does not grow the arena without limit. Once the arena is closed, the chunks
+    are no longer recycled, and the regions are freed all at once when the arena is
+    released.  */
+typedef struct MDArenaRegion MDArenaRegion;
+struct MDArenaRegion {
+	MDArenaRegion *	next;		/*  the next (older) region  */
+	size_t			size;		/*  the usable size  */
+	size_t			used;		/*  the used size  */
+};
+
+struct MDArena {
+	int32_t			refCount;	/*  the reference count  */
+	char			closed;		/*  non-zero if the freed chunks are no longer recycled  */
+	size_t			regionSize;	/*  the default size of a region  */
+	size_t			allocated;	/*  the total size of the regions  */
+	MDArenaRegion *	regions;	/*  the current region (the older ones follow)  */
+	struct {
+		size_t		size;		/*  the chunk size (0 if this entry is not used)  */
+		void *		first;		/*  the freed chunks linked by the first word  */
+	} freeLists[kMDArenaNumberOfFreeLists];
+	pthread_mutex_t	mutex;
+};
+
+/* --------------------------------------
+	･ MDArenaNew
+   -------------------------------------- */
+MDArena *
+MDArenaNew(size_t regionSize)
+{
+	MDArena *arenaRef = (MDArena *)calloc(sizeof(MDArena), 1);
+	if (arenaRef == NULL)
+		return NULL;	/* out of memory */
+	arenaRef->refCount = 1;
+	arenaRef->regionSize = (regionSize > 0 ? regionSize : kMDArenaDefaultRegionSize);
+	pthread_mutex_init(&arenaRef->mutex, NULL);
+	return arenaRef;
+}
+
+/* --------------------------------------
+	･ MDArenaRetain
+   -------------------------------------- */
+void
+MDArenaRetain(MDArena *arenaRef)
+{
+	__sync_add_and_fetch(&arenaRef->refCount, 1);
+}
+
+/* --------------------------------------
+	･ MDArenaRelease
+   -------------------------------------- */
+void
+MDArenaRelease(MDArena *arenaRef)
+{
+	MDArenaRegion *region, *next;
+	if (__sync_sub_and_fetch(&arenaRef->refCount, 1) == 0) {
+		for (region = arenaRef->regions; region != NULL; region = next) {
+			next = region->next;
+			free(region);
+		}
+		pthread_mutex_destroy(&arenaRef->mutex);
+		free(arenaRef);
+	}
+}
+
+/* --------------------------------------
+	･ MDArenaAllocate
+   -------------------------------------- */
+void *
+MDArenaAllocate(MDArena *arenaRef, size_t size)
+{
+	MDArenaRegion *region;
+	size_t rsize;
+	void *ptr = NULL;
+	int i;
+
+	size = MDArenaRoundUp(size > 0 ? size : 1);
+	pthread_mutex_lock(&arenaRef->mutex);
+	for (i = 0; i < kMDArenaNumberOfFreeLists; i++) {
+		if (arenaRef->freeLists[i].size == size) {
+			if ((ptr = arenaRef->freeLists[i].first) != NULL)
+				arenaRef->freeLists[i].first = *((void **)ptr);
+			break;
+		}
+	}
+	if (ptr == NULL) {
+		region = arenaRef->regions;
+		if (region == NULL || region->size - region->used < size) {
+			/*  Start a new region  */
+			rsize = (size > arenaRef->regionSize ? size : arenaRef->regionSize);
+			region = (MDArenaRegion *)malloc(MDArenaRoundUp(sizeof(MDArenaRegion)) + rsize);
+			if (region != NULL) {
+				region->size = rsize;
+				region->used = 0;
+				region->next = arenaRef->regions;
+				arenaRef->regions = region;
+				arenaRef->allocated += rsize;
+			}
+		}
+		if (region != NULL) {
+			ptr = (char *)region + MDArenaRoundUp(sizeof(MDArenaRegion)) + region->used;
+			region->used += size;
+		}
+	}
+	pthread_mutex_unlock(&arenaRef->mutex);
+	return ptr;
+}
+
+/* --------------------------------------
+	･ MDArenaFree
+   -------------------------------------- */
+void
+MDArenaFree(MDArena *arenaRef, void *ptr, size_t size)
+{
+	int i;
+	if (ptr == NULL || arenaRef->closed)
+		return;
+	size = MDArenaRoundUp(size > 0 ? size : 1);
+	pthread_mutex_lock(&arenaRef->mutex);
+	for (i = 0; i < kMDArenaNumberOfFreeLists; i++) {
+		if (arenaRef->freeLists[i].size == size || arenaRef->freeLists[i].size == 0) {
+			arenaRef->freeLists[i].size = size;
+			*((void **)ptr) = arenaRef->freeLists[i].first;
+			arenaRef->freeLists[i].first = ptr;
+			break;
+		}
+	}
+	/*  If all free lists are in use for other sizes, the chunk is left until the arena
+	    is released  */
+	pthread_mutex_unlock(&arenaRef->mutex);
+}
+
+/* --------------------------------------
+	･ MDArenaClose
+   -------------------------------------- */
+void
+MDArenaClose(MDArena *arenaRef)
+{
+	int i;
+	pthread_mutex_lock(&arenaRef->mutex);
+	arenaRef->closed = 1;
+	for (i = 0; i < kMDArenaNumberOfFreeLists; i++) {
+		arenaRef->freeLists[i].size = 0;
+		arenaRef->freeLists[i].first = NULL;
+	}
+	pthread_mutex_unlock(&arenaRef->mutex);
+}
+
+/* --------------------------------------
+	･ MDArenaIsClosed
+   -------------------------------------- */
+int
+MDArenaIsClosed(const MDArena *arenaRef)
+{
+	return arenaRef->closed;
+}
+
+/* --------------------------------------
+	･ MDArenaGetMemoryUsage
+   -------------------------------------- */
+size_t
+MDArenaGetMemoryUsage(const MDArena *arenaRef)
+{
+	return arenaRef->allocated;
+}
+
 #pragma mark ====== Simpler Array Implementation ======
 
 /*  Assign a value to an array. An array is represented by two fields; count and base,
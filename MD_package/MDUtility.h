@@ -19,6 +19,7 @@
 #define __MDUtility__
 
 typedef struct MDArray	MDArray;
+typedef struct MDArena	MDArena;
 
 #ifndef __MDCommon__
 #include "MDCommon.h"
@@ -70,6 +71,13 @@ STREAM	MDStreamOpenData(void *ptr, size_t size);
    ない場合は -1 を返す。 */
 int     MDStreamGetData(STREAM stream, void **ptr, size_t *size);
 
+/* ファイルストリームが開いているファイル全体を読み出し専用でメモリにマップし、その先頭ポインタを
+   返す。*outSize にはファイルサイズが入る。ストリームの位置は変わらない。ファイルストリームでない
+   場合や、マップできない場合（通常のファイルでない場合など）は NULL を返す。
+   使い終わったら MDStreamUnmapFile() で解放すること。 */
+const void *MDStreamMapFile(STREAM stream, size_t *outSize);
+void    MDStreamUnmapFile(const void *ptr, size_t size);
+
 /* -------------------------------------------------------------------
     Debug print functions
    -------------------------------------------------------------------  */
@@ -81,6 +89,14 @@ int		_dprintf(const char *fname, int lineno, int level, const char *fmt, ...);
 
 int     MDShowErrorMessage(const char *fmt, ...);
 
+/*  エラーメッセージをキューに入れる。MDShowErrorMessage() と違ってどのスレッドからでも呼べる。
+    キューに入ったメッセージは、メインスレッドから MDFlushErrorMessages() を呼んだ時に表示される。 */
+int     MDQueueErrorMessage(const char *fmt, ...);
+
+/*  MDQueueErrorMessage() でキューに入ったメッセージをすべて MDShowErrorMessage() で表示し、
+    その数を返す。メインスレッドから呼ぶこと。 */
+int     MDFlushErrorMessages(void);
+
 #if DEBUG
 /*  Usage: dprintf(int level, const char *fmt, ...)  */
 #define dprintf(level, fmt...) (gMDVerbose >= (level) ? _dprintf(__FILE__, __LINE__, (level), fmt) : 0)
@@ -133,6 +149,36 @@ int32_t		MDArrayFetch(const MDArray *arrayRef, int32_t inIndex, int32_t inLength
 
 void *		MDArrayFetchPtr(const MDArray *arrayRef, int32_t inIndex);
 
+/* -------------------------------------------------------------------
+    MDArena functions
+   -------------------------------------------------------------------  */
+
+/*  新しい MDArena をアロケートする。MDArena は regionSize バイト（0 ならデフォルトの 1MB）
+    ずつ確保したメモリ領域からメモリを切り出して渡すアロケータで、最後の release の時に
+    すべての領域をまとめて解放する。メモリ不足の場合は NULL を返す。 */
+MDArena *	MDArenaNew(size_t regionSize);
+
+/*  MDArena の retain/release。release で参照カウントが０になると、MDArenaAllocate で
+    渡したメモリはすべて無効になる。 */
+void		MDArenaRetain(MDArena *arenaRef);
+void		MDArenaRelease(MDArena *arenaRef);
+
+/*  size バイトのメモリを切り出す（16 バイト境界。０クリアはされない）。メモリ不足の
+    場合は NULL を返す。 */
+void *		MDArenaAllocate(MDArena *arenaRef, size_t size);
+
+/*  MDArenaAllocate で得たメモリを返却する。size は確保した時と同じ値を渡すこと。
+    返却されたメモリは同じサイズの MDArenaAllocate で再利用される。 */
+void		MDArenaFree(MDArena *arenaRef, void *ptr, size_t size);
+
+/*  以後の MDArenaFree を何もしないようにする。まもなく release される MDArena に
+    ついて、個々のメモリ返却の手間を省くために使う。 */
+void		MDArenaClose(MDArena *arenaRef);
+int			MDArenaIsClosed(const MDArena *arenaRef);
+
+/*  確保しているメモリ領域の合計バイト数を返す。 */
+size_t		MDArenaGetMemoryUsage(const MDArena *arenaRef);
+
 /*  Simpler Array implementation  */
 void *AssignArray(void *base, int *count, int item_size, int idx, const void *value);
 void *NewArray(void *base, int *count, int item_size, int nitems);
@@ -982,7 +982,7 @@ s_MREventSet_ModifyDataSub(int argc, VALUE *argv, VALUE self, int kind)
 	float *floatp;
 	VALUE *nvalp;
 	MDPointer *pt;
-	MDEvent *ep;
+	const MDEvent *ep;
 	int idx;
 
 	tval = rb_ivar_get(self, s_ID_track);
@@ -590,7 +590,7 @@ static void
 s_MRPointer_BadKindError(MDPointer *pt)
 {
 	char buf[64];
-	MDEvent *ep;
+	const MDEvent *ep;
 	if (pt != NULL && (ep = MDPointerCurrent(pt)) != NULL)
 		MDEventToKindString(ep, buf, sizeof buf);
 	else buf[0] = 0;
@@ -612,7 +612,7 @@ s_MRPointer_Kind(VALUE self)
 	int kind;
 /*	int code; */
 	MDPointer *pt = MDPointerFromMRPointerValue(self);
-	MDEvent *ep = MDPointerCurrent(pt);
+	const MDEvent *ep = MDPointerCurrent(pt);
 	if (ep == NULL)
 		s_MRPointer_OutOfBoundsError(pt);
 	kind = MDGetKind(ep);
@@ -633,7 +633,7 @@ s_MRPointer_SetKind(VALUE self, VALUE val)
 	int kind, code;
 	MRPointerInfo *ip = s_MRPointerInfoFromValue(self);
 	MDPointer *pt = ip->pointer;
-	MDEvent *ep = MDPointerCurrent(pt);
+	const MDEvent *ep = MDPointerCurrent(pt);
     MDEvent event;
 	if (ep == NULL)
 		s_MRPointer_OutOfBoundsError(pt);
@@ -658,8 +658,11 @@ s_MRPointer_SetKind(VALUE self, VALUE val)
 		newEvent->position = MDPointerGetPosition(pt);
 		[ip->trackInfo.doc replaceEvent: newEvent inTrack: ip->trackInfo.num];
 	} else {
-        MDEventClear(ep);
-        MDEventMove(ep, &event, 1);
+        MDEvent *ep1 = MDPointerCurrentMutable(pt);
+        if (ep1 != NULL) {
+            MDEventClear(ep1);
+            MDEventMove(ep1, &event, 1);
+        } else MDEventClear(&event);
 	}
 	return val;
 }
@@ -676,7 +679,7 @@ s_MRPointer_Code(VALUE self)
 {
 	int kind, code;
 	MDPointer *pt = MDPointerFromMRPointerValue(self);
-	MDEvent *ep = MDPointerCurrent(pt);
+	const MDEvent *ep = MDPointerCurrent(pt);
 	if (ep == NULL)
 		s_MRPointer_OutOfBoundsError(pt);
 	kind = MDGetKind(ep);
@@ -700,7 +703,7 @@ s_MRPointer_SetCode(VALUE self, VALUE val)
 	int kind, code;
 	MRPointerInfo *ip = s_MRPointerInfoFromValue(self);
 	MDPointer *pt = ip->pointer;
-	MDEvent *ep = MDPointerCurrent(pt);
+	const MDEvent *ep = MDPointerCurrent(pt);
 	if (ep == NULL)
 		s_MRPointer_OutOfBoundsError(pt);
 	kind = MDGetKind(ep);
@@ -719,7 +722,7 @@ s_MRPointer_SetCode(VALUE self, VALUE val)
 		ed.ucValue[1] = code;
 		[ip->trackInfo.doc changeValue: ed.whole ofType: kMDEventFieldKindAndCode atPosition: MDPointerGetPosition(pt) inTrack: ip->trackInfo.num];
 	} else {
-		MDSetCode(ep, code);
+		MDSetCode(MDPointerCurrentMutable(pt), code);
 	}
 	return val;
 }
@@ -737,7 +740,7 @@ s_MRPointer_ControlKind(VALUE self)
     int kind;
     int code;
     MDPointer *pt = MDPointerFromMRPointerValue(self);
-    MDEvent *ep = MDPointerCurrent(pt);
+    const MDEvent *ep = MDPointerCurrent(pt);
     if (ep == NULL)
         s_MRPointer_OutOfBoundsError(pt);
     kind = MDGetKind(ep);
@@ -760,7 +763,7 @@ s_MRPointer_TextKind(VALUE self)
     int kind;
     int code;
     MDPointer *pt = MDPointerFromMRPointerValue(self);
-    MDEvent *ep = MDPointerCurrent(pt);
+    const MDEvent *ep = MDPointerCurrent(pt);
     if (ep == NULL)
         s_MRPointer_OutOfBoundsError(pt);
     kind = MDGetKind(ep);
@@ -858,17 +861,19 @@ static VALUE
 s_MRPointer_Data(VALUE self)
 {
 	MDPointer *pt = MDPointerFromMRPointerValue(self);
-	MDEvent *ep = MDPointerCurrent(pt);
+	const MDEvent *ep = MDPointerCurrent(pt);
 	if (ep == NULL)
 		s_MRPointer_OutOfBoundsError(pt);
 	return MRPointer_GetDataSub(ep);
 }
 
 void
-MRPointer_SetDataSub(VALUE val, MDEvent *ep, MyDocument *doc, int trackNo, int32_t position)
+MRPointer_SetDataSub(VALUE val, MDPointer *pt, MyDocument *doc, int trackNo, int32_t position)
 {
 	int kind, data, mode;
 	MDEventFieldData ed;
+	const MDEvent *ep = MDPointerCurrent(pt);
+	MDEvent *ep1;
 	kind = MDGetKind(ep);	
 	switch (kind) {
 		case kMDEventMetaText:
@@ -882,9 +887,9 @@ MRPointer_SetDataSub(VALUE val, MDEvent *ep, MyDocument *doc, int trackNo, int32
 			messageLength = (int)RSTRING_LEN(val);
 			if (doc != nil) {
 				[doc changeMessage: [NSData dataWithBytes: cp length: messageLength] atPosition: position inTrack: trackNo];
-			} else {
-				MDSetMessageLength(ep, messageLength);
-				MDSetMessage(ep, cp);
+			} else if ((ep1 = MDPointerCurrentMutable(pt)) != NULL) {
+				if (MDSetMessageLength(ep1, messageLength) == messageLength)
+					MDSetMessage(ep1, cp);
 			}
 			return;
 		}		
@@ -983,19 +988,19 @@ MRPointer_SetDataSub(VALUE val, MDEvent *ep, MyDocument *doc, int trackNo, int32
 	
 	if (doc != nil) {
 		[doc changeValue: ed.whole ofType: mode atPosition: position inTrack: trackNo];
-	} else {
+	} else if ((ep1 = MDPointerCurrentMutable(pt)) != NULL) {
 		switch (mode) {
 			case kMDEventFieldData:
-				MDSetData1(ep, ed.intValue);
+				MDSetData1(ep1, ed.intValue);
 				break;
 			case kMDEventFieldSMPTE:
-				*(MDGetSMPTERecordPtr(ep)) = ed.smpte;
+				*(MDGetSMPTERecordPtr(ep1)) = ed.smpte;
 				break;
 			case kMDEventFieldMetaData:
-				memmove(MDGetMetaDataPtr(ep), ed.ucValue, 4);
+				memmove(MDGetMetaDataPtr(ep1), ed.ucValue, 4);
 				break;
 			case kMDEventFieldTempo:
-				MDSetTempo(ep, ed.floatValue);
+				MDSetTempo(ep1, ed.floatValue);
 				break;
 		}
 	}
@@ -1018,10 +1023,9 @@ s_MRPointer_SetData(VALUE self, VALUE val)
 {
 	MRPointerInfo *ip = s_MRPointerInfoFromValue(self);
 	MDPointer *pt = ip->pointer;
-	MDEvent *ep = MDPointerCurrent(pt);
-	if (ep == NULL)
+	if (MDPointerCurrent(pt) == NULL)
 		s_MRPointer_OutOfBoundsError(pt);
-	MRPointer_SetDataSub(val, ep, ip->trackInfo.doc, ip->trackInfo.num, MDPointerGetPosition(pt));
+	MRPointer_SetDataSub(val, pt, ip->trackInfo.doc, ip->trackInfo.num, MDPointerGetPosition(pt));
 	return val;
 }
 
@@ -1037,7 +1041,7 @@ s_MRPointer_Duration(VALUE self)
 {
 	int kind, du;
 	MDPointer *pt = MDPointerFromMRPointerValue(self);
-	MDEvent *ep = MDPointerCurrent(pt);
+	const MDEvent *ep = MDPointerCurrent(pt);
 	if (ep == NULL)
 		s_MRPointer_OutOfBoundsError(pt);
 	kind = MDGetKind(ep);
@@ -1059,7 +1063,7 @@ s_MRPointer_SetDuration(VALUE self, VALUE val)
 	int kind, du;
 	MRPointerInfo *ip = s_MRPointerInfoFromValue(self);
 	MDPointer *pt = ip->pointer;
-	MDEvent *ep = MDPointerCurrent(pt);
+	const MDEvent *ep = MDPointerCurrent(pt);
 	if (ep == NULL)
 		s_MRPointer_OutOfBoundsError(pt);
 	kind = MDGetKind(ep);
@@ -1088,7 +1092,7 @@ s_MRPointer_Velocity(VALUE self)
 {
 	int kind, vel;
 	MDPointer *pt = MDPointerFromMRPointerValue(self);
-	MDEvent *ep = MDPointerCurrent(pt);
+	const MDEvent *ep = MDPointerCurrent(pt);
 	if (ep == NULL)
 		s_MRPointer_OutOfBoundsError(pt);
 	kind = MDGetKind(ep);
@@ -1111,7 +1115,7 @@ s_MRPointer_SetVelocity(VALUE self, VALUE val)
 	int kind, vel;
 	MRPointerInfo *ip = s_MRPointerInfoFromValue(self);
 	MDPointer *pt = ip->pointer;
-	MDEvent *ep = MDPointerCurrent(pt);
+	const MDEvent *ep = MDPointerCurrent(pt);
 	if (ep == NULL)
 		s_MRPointer_OutOfBoundsError(pt);
 	kind = MDGetKind(ep);
@@ -1126,7 +1130,7 @@ s_MRPointer_SetVelocity(VALUE self, VALUE val)
 		ed.ucValue[1] = MDGetNoteOffVelocity(ep);
 		[ip->trackInfo.doc changeValue: ed.whole ofType: kMDEventFieldVelocities atPosition: MDPointerGetPosition(pt) inTrack: ip->trackInfo.num];
 	} else {
-		MDSetNoteOnVelocity(ep, vel);
+		MDSetNoteOnVelocity(MDPointerCurrentMutable(pt), vel);
 	}
 	return val;
 }
@@ -1143,7 +1147,7 @@ s_MRPointer_ReleaseVelocity(VALUE self)
 {
 	int kind, vel;
 	MDPointer *pt = MDPointerFromMRPointerValue(self);
-	MDEvent *ep = MDPointerCurrent(pt);
+	const MDEvent *ep = MDPointerCurrent(pt);
 	if (ep == NULL)
 		s_MRPointer_OutOfBoundsError(pt);
 	kind = MDGetKind(ep);
@@ -1166,7 +1170,7 @@ s_MRPointer_SetReleaseVelocity(VALUE self, VALUE val)
 	int kind, vel;
 	MRPointerInfo *ip = s_MRPointerInfoFromValue(self);
 	MDPointer *pt = ip->pointer;
-	MDEvent *ep = MDPointerCurrent(pt);
+	const MDEvent *ep = MDPointerCurrent(pt);
 	if (ep == NULL)
 		s_MRPointer_OutOfBoundsError(pt);
 	kind = MDGetKind(ep);
@@ -1181,7 +1185,7 @@ s_MRPointer_SetReleaseVelocity(VALUE self, VALUE val)
 		ed.ucValue[1] = vel;
 		[ip->trackInfo.doc changeValue: ed.whole ofType: kMDEventFieldVelocities atPosition: MDPointerGetPosition(pt) inTrack: ip->trackInfo.num];
 	} else {
-		MDSetNoteOffVelocity(ep, vel);
+		MDSetNoteOffVelocity(MDPointerCurrentMutable(pt), vel);
 	}
 	return val;
 }
@@ -1197,7 +1201,7 @@ s_MRPointer_Tick(VALUE self)
 {
 	MDTickType tick;
 	MDPointer *pt = MDPointerFromMRPointerValue(self);
-	MDEvent *ep = MDPointerCurrent(pt);
+	const MDEvent *ep = MDPointerCurrent(pt);
 	if (ep == NULL)
 		s_MRPointer_OutOfBoundsError(pt);
 	tick = MDGetTick(ep);
@@ -1218,7 +1222,7 @@ s_MRPointer_SetTick(VALUE self, VALUE val)
 	MDTickType tick;
 	MRPointerInfo *ip = s_MRPointerInfoFromValue(self);
 	MDPointer *pt = ip->pointer;
-	MDEvent *ep = MDPointerCurrent(pt);
+	const MDEvent *ep = MDPointerCurrent(pt);
 	if (ep == NULL)
 		s_MRPointer_OutOfBoundsError(pt);
 	tick = (MDTickType)NUM2DBL(val);
@@ -112,38 +112,96 @@ MRSequenceUnregister(void *myDocument)
 
 #pragma mark ====== Ruby methods ======
 
+/*  Take the calibrator snapshot of the document. The snapshot is retained, so the caller
+    must release it before anything that may raise a Ruby exception.  */
+static MDCalibratorSnapshot *
+s_MRSequence_CopySnapshot(MyDocument *doc)
+{
+	MDCalibratorSnapshot *snap = [[doc myMIDISequence] copyCalibratorSnapshot];
+	if (snap == NULL)
+		rb_raise(rb_eStandardError, "Cannot get the tempo map");
+	return snap;
+}
+
 /*
  *  call-seq:
  *     sequence.tick_to_time(tick)
+ *     sequence.tick_to_time(array_of_ticks)
  *
  *  Convert tick to time by referring the conductor track. Time is expressed
- *  in seconds.
+ *  in seconds. If an array is given, an array of times is returned; this is
+ *  much faster than converting the values one by one, especially when the
+ *  ticks are sorted.
  */
 static VALUE
 s_MRSequence_TickToTime(VALUE self, VALUE tval)
 {
 	MyDocument *doc = MyDocumentFromMRSequenceValue(self);
-	MDCalibrator *calib = [[doc myMIDISequence] sharedCalibrator];
-	MDTickType tick = (MDTickType)floor(NUM2DBL(tval) + 0.5);
-	MDTimeType time = MDCalibratorTickToTime(calib, tick);
-	return rb_float_new((double)time / 1000000.0);
+	MDCalibratorSnapshot *snap;
+	if (TYPE(tval) == T_ARRAY) {
+		int i, n = (int)RARRAY_LEN(tval);
+		/*  The work area is a Ruby string, so that it is not leaked when NUM2DBL() or
+		    the allocation of the results raises an exception  */
+		VALUE bval = rb_str_new(NULL, (sizeof(MDTimeType) + sizeof(MDTickType)) * (n + 1));
+		MDTimeType *times = (MDTimeType *)RSTRING_PTR(bval);
+		MDTickType *ticks = (MDTickType *)(times + n + 1);
+		VALUE rval = rb_ary_new2(n);
+		for (i = 0; i < n; i++)
+			ticks[i] = (MDTickType)floor(NUM2DBL(rb_ary_entry(tval, i)) + 0.5);
+		snap = s_MRSequence_CopySnapshot(doc);
+		MDTempoMapTicksToTimes(MDCalibratorSnapshotGetTempoMap(snap), ticks, times, n);
+		MDCalibratorSnapshotRelease(snap);
+		for (i = 0; i < n; i++)
+			rb_ary_push(rval, rb_float_new((double)times[i] / 1000000.0));
+		rb_str_resize(bval, 0);
+		return rval;
+	} else {
+		MDTickType tick = (MDTickType)floor(NUM2DBL(tval) + 0.5);
+		MDTimeType time;
+		snap = s_MRSequence_CopySnapshot(doc);
+		time = MDCalibratorSnapshotTickToTime(snap, tick);
+		MDCalibratorSnapshotRelease(snap);
+		return rb_float_new((double)time / 1000000.0);
+	}
 }
 
 /*
  *  call-seq:
  *     sequence.time_to_tick(time)
+ *     sequence.time_to_tick(array_of_times)
  *
  *  Convert tick to time by referring the conductor track. Time is expressed
- *  in seconds.
+ *  in seconds. If an array is given, an array of ticks is returned.
  */
 static VALUE
 s_MRSequence_TimeToTick(VALUE self, VALUE tval)
 {
 	MyDocument *doc = MyDocumentFromMRSequenceValue(self);
-	MDCalibrator *calib = [[doc myMIDISequence] sharedCalibrator];
-	MDTimeType time = (MDTimeType)floor((NUM2DBL(tval) * (double)1000000.0) + (double)0.5);
-	MDTickType tick = MDCalibratorTimeToTick(calib, time);
-	return rb_float_new((double)tick);
+	MDCalibratorSnapshot *snap;
+	if (TYPE(tval) == T_ARRAY) {
+		int i, n = (int)RARRAY_LEN(tval);
+		/*  See s_MRSequence_TickToTime() for the work area  */
+		VALUE bval = rb_str_new(NULL, (sizeof(MDTimeType) + sizeof(MDTickType)) * (n + 1));
+		MDTimeType *times = (MDTimeType *)RSTRING_PTR(bval);
+		MDTickType *ticks = (MDTickType *)(times + n + 1);
+		VALUE rval = rb_ary_new2(n);
+		for (i = 0; i < n; i++)
+			times[i] = (MDTimeType)floor((NUM2DBL(rb_ary_entry(tval, i)) * (double)1000000.0) + (double)0.5);
+		snap = s_MRSequence_CopySnapshot(doc);
+		MDTempoMapTimesToTicks(MDCalibratorSnapshotGetTempoMap(snap), times, ticks, n);
+		MDCalibratorSnapshotRelease(snap);
+		for (i = 0; i < n; i++)
+			rb_ary_push(rval, rb_float_new((double)ticks[i]));
+		rb_str_resize(bval, 0);
+		return rval;
+	} else {
+		MDTimeType time = (MDTimeType)floor((NUM2DBL(tval) * (double)1000000.0) + (double)0.5);
+		MDTickType tick;
+		snap = s_MRSequence_CopySnapshot(doc);
+		tick = MDCalibratorSnapshotTimeToTick(snap, time);
+		MDCalibratorSnapshotRelease(snap);
+		return rb_float_new((double)tick);
+	}
 }
 
 /*
@@ -158,11 +216,13 @@ static VALUE
 s_MRSequence_TickToMeasure(VALUE self, VALUE tval)
 {
 	MyDocument *doc = MyDocumentFromMRSequenceValue(self);
-	MDCalibrator *calib = [[doc myMIDISequence] sharedCalibrator];
+	MDCalibratorSnapshot *snap;
 	MDTickType tick = (MDTickType)floor(NUM2DBL(tval) + 0.5);
 	int32_t bar, beat, subtick;
 	VALUE vals[3];
-	MDCalibratorTickToMeasure(calib, tick, &bar, &beat, &subtick);
+	snap = s_MRSequence_CopySnapshot(doc);
+	MDCalibratorSnapshotTickToMeasure(snap, tick, &bar, &beat, &subtick);
+	MDCalibratorSnapshotRelease(snap);
 	vals[0] = INT2NUM(bar);
 	vals[1] = INT2NUM(beat);
 	vals[2] = INT2NUM(subtick);
@@ -181,7 +241,7 @@ static VALUE
 s_MRSequence_MeasureToTick(int argc, VALUE *argv, VALUE self)
 {
 	MyDocument *doc = MyDocumentFromMRSequenceValue(self);
-	MDCalibrator *calib = [[doc myMIDISequence] sharedCalibrator];
+	MDCalibratorSnapshot *snap;
 	MDTickType tick;
 	VALUE val1, val2, val3;
 	int32_t bar, beat, subtick;
@@ -195,7 +255,9 @@ s_MRSequence_MeasureToTick(int argc, VALUE *argv, VALUE self)
 		beat = NUM2INT(val2);
 		subtick = NUM2INT(val3);
 	}
-	tick = MDCalibratorMeasureToTick(calib, bar, beat, subtick);
+	snap = s_MRSequence_CopySnapshot(doc);
+	tick = MDCalibratorSnapshotMeasureToTick(snap, bar, beat, subtick);
+	MDCalibratorSnapshotRelease(snap);
 	return rb_float_new((double)tick);
 }
 
@@ -488,104 +550,114 @@ MRSequence_Current(VALUE self)
 	return MRSequenceFromMyDocument([docs objectAtIndex: 0]);
 }
 
-/*  For DEBUG  */
-VALUE
-s_MRSequence_Merger(int argc, VALUE *argv, VALUE self)
+/*  For DEBUG: dump the events of the given tracks in the order of the sequence timeline
+    (the order in which MDPlayer sends them out)  */
+static VALUE
+s_MRSequence_DumpTimeline(int argc, VALUE *argv, VALUE self, NSString *path, int backward)
 {
-    int i;
+    int i, ntracks;
     MyDocument *doc = MyDocumentFromMRSequenceValue(self);
-    MyMIDISequence *seq = [doc myMIDISequence];
-    MDTrackMerger *merger = MDTrackMergerNew();
-    MDTrack *track;
+    MDSequence *sequence = [[doc myMIDISequence] mySequence];
+    const MDTimelineEntry *entries;
+    int32_t count;
     int numEvents = 0;
-    MDEvent **ebuf, *ep;
+    const MDEvent **ebuf;
     char buf[256];
     FILE *fp;
     int *ibuf;
+    char *flags;
+    MDPointer **pointers;
+
+    [doc lockMIDISequence];
+    ntracks = MDSequenceGetNumberOfTracks(sequence);
+    flags = (char *)calloc(1, ntracks + 1);
+    pointers = (MDPointer **)calloc(sizeof(MDPointer *), ntracks + 1);
+    if (flags == NULL || pointers == NULL || MDSequenceGetTimeline(sequence, &entries, &count) != kMDNoError) {
+        [doc unlockMIDISequence];
+        free(flags);
+        free(pointers);
+        fprintf(stderr, "out of memory\n");
+        return Qnil;
+    }
     for (i = 0; i < argc; i++) {
         int n = NUM2INT(argv[i]);
-        track = [seq getTrackAtIndex:n];
-        if (track != NULL) {
-            MDTrackMergerAddTrack(merger, track);
-            numEvents += MDTrackGetNumberOfEvents(track);
+        if (n >= 0 && n < ntracks && !flags[n]) {
+            pointers[n] = MDPointerNew(MDSequenceGetTrack(sequence, n));
+            if (pointers[n] == NULL)
+                continue;
+            flags[n] = 1;
+            numEvents += MDTrackGetNumberOfEvents(MDSequenceGetTrack(sequence, n));
         }
     }
-    ebuf = (MDEvent **)calloc(sizeof(MDEvent *), numEvents);
-    ibuf = (int *)calloc(sizeof(int), numEvents);
+    ebuf = (const MDEvent **)calloc(sizeof(MDEvent *), numEvents + 1);
+    ibuf = (int *)calloc(sizeof(int), numEvents + 1);
+    fp = NULL;
     if (ebuf == NULL || ibuf == NULL) {
         fprintf(stderr, "out of memory\n");
-        return Qnil;
+    } else if ((fp = fopen([[path stringByExpandingTildeInPath] UTF8String], "w")) == NULL) {
+        fprintf(stderr, "Cannot open %s\n", [path UTF8String]);
+    } else if (!backward) {
+        const MDTimelineEntry *e;
+        int32_t k;
+        for (i = 0, k = 0; k < count && i < numEvents; k++) {
+            e = &entries[k];
+            if (!flags[e->track])
+                continue;
+            if (MDPointerGetPosition(pointers[e->track]) == e->position - 1)
+                ebuf[i] = MDPointerForward(pointers[e->track]);
+            else {
+                MDPointerSetPosition(pointers[e->track], e->position);
+                ebuf[i] = MDPointerCurrent(pointers[e->track]);
+            }
+            ibuf[i++] = e->track;
+        }
+    } else {
+        const MDTimelineEntry *e;
+        int32_t k;
+        for (i = numEvents - 1, k = count - 1; k >= 0 && i >= 0; k--) {
+            e = &entries[k];
+            if (!flags[e->track])
+                continue;
+            if (MDPointerGetPosition(pointers[e->track]) == e->position + 1)
+                ebuf[i] = MDPointerBackward(pointers[e->track]);
+            else {
+                MDPointerSetPosition(pointers[e->track], e->position);
+                ebuf[i] = MDPointerCurrent(pointers[e->track]);
+            }
+            ibuf[i--] = e->track;
+        }
     }
-    ep = MDTrackMergerCurrent(merger, &track);
-    fp = fopen([[@"~/merger_test.txt" stringByExpandingTildeInPath] UTF8String], "w");
-    if (fp == NULL) {
-        fprintf(stderr, "Cannot open merger_test.txt\n");
-        return Qnil;
+    if (fp != NULL) {
+        for (i = 0; i < numEvents; i++) {
+            if (ebuf[i] == NULL)
+                continue;
+            MDEventToString(ebuf[i], buf, sizeof(buf));
+            fprintf(fp, "%d:%s\n", ibuf[i], buf);
+        }
+        fclose(fp);
     }
-    for (i = 0; i < numEvents && ep != NULL; i++) {
-        int trno = [seq lookUpTrack:track];
-        ebuf[i] = ep;
-        ibuf[i] = trno;
-        MDEventToString(ep, buf, sizeof(buf));
-        fprintf(fp, "%d:%s\n", trno, buf);
-        ep = MDTrackMergerForward(merger, &track);
+    [doc unlockMIDISequence];
+    for (i = 0; i < ntracks; i++) {
+        if (pointers[i] != NULL)
+            MDPointerRelease(pointers[i]);
     }
-    fclose(fp);
+    free(pointers);
+    free(flags);
     free(ebuf);
     free(ibuf);
-    return INT2NUM(numEvents);
+    return (fp != NULL ? INT2NUM(numEvents) : Qnil);
+}
+
+VALUE
+s_MRSequence_Merger(int argc, VALUE *argv, VALUE self)
+{
+    return s_MRSequence_DumpTimeline(argc, argv, self, @"~/merger_test.txt", 0);
 }
 
 VALUE
 s_MRSequence_BackMerger(int argc, VALUE *argv, VALUE self)
 {
-    int i;
-    MyDocument *doc = MyDocumentFromMRSequenceValue(self);
-    MyMIDISequence *seq = [doc myMIDISequence];
-    MDTrackMerger *merger = MDTrackMergerNew();
-    MDTrack *track;
-    int numEvents = 0;
-    MDEvent **ebuf, *ep;
-    char buf[256];
-    FILE *fp;
-    int *ibuf;
-    for (i = 0; i < argc; i++) {
-        int n = NUM2INT(argv[i]);
-        track = [seq getTrackAtIndex:n];
-        if (track != NULL) {
-            MDTrackMergerAddTrack(merger, track);
-            numEvents += MDTrackGetNumberOfEvents(track);
-        }
-    }
-    ebuf = (MDEvent **)calloc(sizeof(MDEvent *), numEvents);
-    ibuf = (int *)calloc(sizeof(int), numEvents);
-    if (ebuf == NULL || ibuf == NULL) {
-        fprintf(stderr, "out of memory\n");
-        return Qnil;
-    }
-    MDTrackMergerJumpToTick(merger, kMDMaxTick, NULL);
-    fp = fopen([[@"~/backmerger_test.txt" stringByExpandingTildeInPath] UTF8String], "w");
-    if (fp == NULL) {
-        fprintf(stderr, "Cannot open backmerger_test.txt\n");
-        return Qnil;
-    }
-    for (i = numEvents - 1; i >= 0; i--) {
-        int trno;
-        ep = MDTrackMergerBackward(merger, &track);
-        if (ep == NULL)
-            break;
-        trno = [seq lookUpTrack:track];
-        ebuf[i] = ep;
-        ibuf[i] = trno;
-    }
-    for (i = 0; i < numEvents; i++) {
-        MDEventToString(ebuf[i], buf, sizeof(buf));
-        fprintf(fp, "%d:%s\n", ibuf[i], buf);
-    }
-    fclose(fp);
-    free(ebuf);
-    free(ibuf);
-    return INT2NUM(numEvents);
+    return s_MRSequence_DumpTimeline(argc, argv, self, @"~/backmerger_test.txt", 1);
 }
 
 #pragma mark ====== Initialize class ======
@@ -774,7 +774,7 @@ s_MRTrack_Add(VALUE self, VALUE sval)
     MDSetTick(ep, tick);
     if (rb_obj_is_kind_of(argv[1], rb_cMRPointer)) {
         MDPointer *ptsrc = MDPointerFromMRPointerValue(argv[1]);
-        MDEvent *epsrc = MDPointerCurrent(ptsrc);
+        const MDEvent *epsrc = MDPointerCurrent(ptsrc);
         MDEventCopy(ep, epsrc, 1);
     } else {
         kind = MREventKindAndCodeFromEventSymbol(argv[1], &code, &is_generic);